@@ -0,0 +1,157 @@
+/*
+ * Microbenchmarks of the full request pipeline over the in-memory
+ * transport - no sockets and no kernel, so only the server's own work
+ * per packet is measured.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <vector>
+
+#include "memory_transport.h"
+#include "microbench.h"
+#include "key_store.h"
+#include "request_pipeline.h"
+#include "tsp_protocol.h"
+
+// valid requests from 'sources' different clients, with one junk packet of every 'junkEvery'
+static std::vector<Datagram> makeRequests(int count, int sources, int junkEvery)
+{
+  std::vector<Datagram> requests(count);
+  for (int i = 0; i < count; i++)
+  {
+    Datagram &d = requests[i];
+    memset(&d, 0, sizeof(d));
+    TimeRequest *request = (TimeRequest *)d.data;
+    memcpy(request->protocol, "TSP", 3);
+    request->protocolVersion = 1;
+    request->clientCookie = (uint64_t)i;
+    d.length = TimeRequestPacketSize;
+    if (junkEvery > 0 && i % junkEvery == junkEvery - 1)
+    {
+      d.data[0] = 'X';
+    }
+    d.peer.v4.sin_family = AF_INET;
+    d.peer.v4.sin_addr.s_addr = htonl(0x0a000000 | (uint32_t)(i % sources));
+    d.peer.v4.sin_port = htons((uint16_t)(10000 + i % 1000));
+  }
+  return requests;
+}
+
+// runs the pipeline over 'requests', the transport and the pipeline are set up outside the measurement
+static void benchPipeline(BenchState &state, int batchSize, const std::vector<Datagram> &requests)
+{
+  static WorkerStats stats;
+  MemoryTransport transport(requests);
+  RequestPipeline pipeline(transport, stats, NULL, NULL, NULL, batchSize);
+  state.resetTimer();
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    pipeline.processBatch();
+  }
+  state.itemsPerIteration = batchSize;
+}
+
+static void BM_PipelineBatch1(BenchState &state)
+{
+  static const std::vector<Datagram> requests = makeRequests(4096, 1000, 0);
+  benchPipeline(state, 1, requests);
+}
+TSSD_BENCHMARK(BM_PipelineBatch1);
+
+static void BM_PipelineBatch32(BenchState &state)
+{
+  static const std::vector<Datagram> requests = makeRequests(4096, 1000, 0);
+  benchPipeline(state, 32, requests);
+}
+TSSD_BENCHMARK(BM_PipelineBatch32);
+
+static void BM_PipelineBatch32WithJunk(BenchState &state)
+{
+  static const std::vector<Datagram> requests = makeRequests(4096, 1000, 10);
+  benchPipeline(state, 32, requests);
+}
+TSSD_BENCHMARK(BM_PipelineBatch32WithJunk);
+
+static const int BatchRequestCookies = 32;
+
+static std::vector<Datagram> makeBatchRequests()
+{
+  std::vector<Datagram> requests = makeRequests(4096, 1000, 0);
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    TimeBatchRequest *request = (TimeBatchRequest *)requests[i].data;
+    request->messageType = TspBatchRequest;
+    request->cookieCount = BatchRequestCookies;
+    request->flags = TspBatchEchoCookies;
+    for (int c = 0; c < BatchRequestCookies; c++)
+    {
+      request->clientCookies[c] = i * BatchRequestCookies + c;
+    }
+    requests[i].length = timeBatchRequestSize(BatchRequestCookies);
+  }
+  return requests;
+}
+
+// batch requests of 'cookies' cookies each, items are cookies
+static void BM_PipelineBatchRequest32Cookies(BenchState &state)
+{
+  static const std::vector<Datagram> requests = makeBatchRequests();
+  static WorkerStats stats;
+  MemoryTransport transport(requests);
+  RequestPipeline pipeline(transport, stats, NULL, NULL, NULL, 32);
+  pipeline.enableBatchRequests(BatchRequestCookies, 1e12, 1e12); // the limiter is measured, but never limits
+  state.resetTimer();
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    pipeline.processBatch();
+  }
+  state.itemsPerIteration = 32 * BatchRequestCookies;
+}
+TSSD_BENCHMARK(BM_PipelineBatchRequest32Cookies);
+
+static const uint16_t AuthKeyCount = 4;
+
+static KeyStore makeAuthKeys()
+{
+  KeyStore keys;
+  for (uint16_t k = 1; k <= AuthKeyCount; k++)
+  {
+    SipHashKey key = { 0x0706050403020100ULL * k, 0x0f0e0d0c0b0a0908ULL * k };
+    keys.add(k, key);
+  }
+  return keys;
+}
+
+static std::vector<Datagram> makeAuthRequests(const KeyStore &keys)
+{
+  std::vector<Datagram> requests = makeRequests(4096, 1000, 0);
+  for (size_t i = 0; i < requests.size(); i++)
+  {
+    TimeAuthRequest *request = (TimeAuthRequest *)requests[i].data;
+    request->messageType = TspAuthRequest;
+    request->keyId = (uint16_t)(1 + i % AuthKeyCount);
+    request->mac = sipHash24(*keys.find(request->keyId), requests[i].data, TimeAuthRequestMacLength);
+    requests[i].length = TimeAuthRequestPacketSize;
+  }
+  return requests;
+}
+
+// authenticated requests with 4 different keys, so the cost of verifying and signing shows
+static void BM_PipelineBatch32Authenticated(BenchState &state)
+{
+  static const KeyStore keys = makeAuthKeys();
+  static const std::vector<Datagram> requests = makeAuthRequests(keys);
+  static WorkerStats stats;
+  MemoryTransport transport(requests);
+  RequestPipeline pipeline(transport, stats, NULL, NULL, NULL, 32);
+  pipeline.enableAuthentication(&keys, true);
+  state.resetTimer();
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    pipeline.processBatch();
+  }
+  state.itemsPerIteration = 32;
+}
+TSSD_BENCHMARK(BM_PipelineBatch32Authenticated);
@@ -0,0 +1,148 @@
+/*
+ * Microbenchmarks of the per packet pieces of the request path
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "microbench.h"
+#include "tsp_protocol.h"
+
+static const int PacketCount = 1024; // power of 2
+
+// a mix of valid requests, short packets and junk, so branches are not trivially predicted
+struct PacketMix
+{
+  PacketMix()
+  {
+    srand(12321);
+    for (int i = 0; i < PacketCount; i++)
+    {
+      TimeRequest &request = *(TimeRequest *)buffers[i];
+      memset(buffers[i], 0, sizeof(buffers[i]));
+      memcpy(request.protocol, "TSP", 3);
+      request.protocolVersion = 1;
+      request.clientCookie = ((uint64_t)rand() << 32) | (uint64_t)rand();
+      lengths[i] = TimeRequestPacketSize;
+      int kind = rand() % 100;
+      if (kind < 5)
+      {
+        lengths[i] = rand() % TimeRequestPacketSize;
+      }
+      else if (kind < 10)
+      {
+        buffers[i][rand() % 3] = (char)('a' + rand() % 26);
+      }
+    }
+  }
+
+  char buffers[PacketCount][TimeRequestPacketSize];
+  int lengths[PacketCount];
+};
+
+static const PacketMix &packetMix()
+{
+  static PacketMix mix;
+  return mix;
+}
+
+static void BM_ValidateRequest(BenchState &state)
+{
+  const PacketMix &mix = packetMix();
+  uint64_t valid = 0;
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    int p = (int)(i & (PacketCount - 1));
+    valid += (mix.lengths[p] >= TimeRequestPacketSize && hasTspHeader(mix.buffers[p])) ? 1 : 0;
+  }
+  doNotOptimize(valid);
+}
+TSSD_BENCHMARK(BM_ValidateRequest);
+
+static void BM_CopyRequestToReply(BenchState &state)
+{
+  const PacketMix &mix = packetMix();
+  char reply[TimeReplyPacketSize];
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    memcpy(reply, mix.buffers[i & (PacketCount - 1)], TimeRequestPacketSize);
+    clobberMemory();
+  }
+  doNotOptimize(reply);
+}
+TSSD_BENCHMARK(BM_CopyRequestToReply);
+
+static void BM_ClockGettimeofday(BenchState &state)
+{
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    doNotOptimize(currentTimeMsSinceEpoch());
+  }
+}
+TSSD_BENCHMARK(BM_ClockGettimeofday);
+
+static void benchClock(BenchState &state, clockid_t clockId)
+{
+  struct timespec ts;
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    clock_gettime(clockId, &ts);
+    doNotOptimize(ts);
+  }
+}
+
+static void BM_ClockRealtime(BenchState &state)
+{
+  benchClock(state, CLOCK_REALTIME);
+}
+TSSD_BENCHMARK(BM_ClockRealtime);
+
+static void BM_ClockRealtimeCoarse(BenchState &state)
+{
+  benchClock(state, CLOCK_REALTIME_COARSE);
+}
+TSSD_BENCHMARK(BM_ClockRealtimeCoarse);
+
+static void BM_ClockMonotonic(BenchState &state)
+{
+  benchClock(state, CLOCK_MONOTONIC);
+}
+TSSD_BENCHMARK(BM_ClockMonotonic);
+
+// encoding only, with a fixed time
+static void BM_EncodeReply(BenchState &state)
+{
+  const PacketMix &mix = packetMix();
+  char reply[TimeReplyPacketSize];
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    encodeTimeReply(mix.buffers[i & (PacketCount - 1)], 1700000000000ULL + i, reply);
+    clobberMemory();
+  }
+  doNotOptimize(reply);
+}
+TSSD_BENCHMARK(BM_EncodeReply);
+
+// everything the loop does between recv and send: validate, read the clock and encode
+static void BM_ValidateAndReply(BenchState &state)
+{
+  const PacketMix &mix = packetMix();
+  char reply[TimeReplyPacketSize];
+  uint64_t replies = 0;
+  for (uint64_t i = 0; i < state.iterations; i++)
+  {
+    int p = (int)(i & (PacketCount - 1));
+    if (mix.lengths[p] < TimeRequestPacketSize || !hasTspHeader(mix.buffers[p]))
+    {
+      continue;
+    }
+    encodeTimeReply(mix.buffers[p], currentTimeMsSinceEpoch(), reply);
+    clobberMemory();
+    replies++;
+  }
+  doNotOptimize(replies);
+}
+TSSD_BENCHMARK(BM_ValidateAndReply);
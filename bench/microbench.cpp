@@ -0,0 +1,280 @@
+/*
+ * tssd-bench: runs the registered microbenchmarks and reports the time
+ * per iteration (and per packet), in the console or as JSON in the format
+ * of google-benchmark, so the results can be tracked across releases.
+ */
+
+#include "microbench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <regex>
+#include <sstream>
+#include <vector>
+
+#include <cxxopts/cxxopts.hpp>
+
+#include "self_profiler.h"
+
+struct Benchmark
+{
+  const char *name;
+  BenchFunction function;
+};
+
+struct BenchResult
+{
+  std::string name;
+  uint64_t iterations;
+  double realNs; // per iteration
+  double cpuNs; // per iteration
+  double itemsPerIteration;
+  double cyclesPerIteration; // 0 if the cycles counter is not available
+};
+
+static std::vector<Benchmark> &registry()
+{
+  static std::vector<Benchmark> benchmarks;
+  return benchmarks;
+}
+
+BenchRegistration::BenchRegistration(const char *name, BenchFunction function)
+{
+  Benchmark benchmark = { name, function };
+  registry().push_back(benchmark);
+}
+
+static uint64_t clockNs(clockid_t clockId)
+{
+  struct timespec ts;
+  clock_gettime(clockId, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void BenchState::resetTimer()
+{
+  SelfProfiler::Counts counts;
+  profiler->read(counts);
+  cyclesStart = counts.values[SelfProfiler::Cycles];
+  realStartNs = clockNs(CLOCK_MONOTONIC);
+  cpuStartNs = clockNs(CLOCK_THREAD_CPUTIME_ID);
+}
+
+// one run of 'state.iterations', measured from the call or from the benchmark's resetTimer()
+static void runOnce(const Benchmark &benchmark, BenchState &state, uint64_t &realNs, uint64_t &cpuNs, uint64_t &cycles)
+{
+  state.resetTimer();
+  benchmark.function(state);
+  cpuNs = clockNs(CLOCK_THREAD_CPUTIME_ID) - state.cpuStartNs;
+  realNs = clockNs(CLOCK_MONOTONIC) - state.realStartNs;
+  SelfProfiler::Counts counts;
+  state.profiler->read(counts);
+  cycles = counts.values[SelfProfiler::Cycles] - state.cyclesStart;
+}
+
+// runs with growing iteration counts until a run takes 'minTimeSec',
+// the result is the best of 'repetitions' runs of that length
+static BenchResult runBenchmark(const Benchmark &benchmark, double minTimeSec, int repetitions, const SelfProfiler &profiler)
+{
+  BenchState state;
+  state.iterations = 1;
+  state.itemsPerIteration = 1;
+  state.profiler = &profiler;
+  uint64_t realNs = 0;
+  uint64_t cpuNs = 0;
+  uint64_t cycles = 0;
+  while (true)
+  {
+    runOnce(benchmark, state, realNs, cpuNs, cycles);
+    if (realNs >= minTimeSec * 1e9 || state.iterations >= (1ULL << 40))
+    {
+      break;
+    }
+    // aim for 1.4x the min time, growing at most 10x per step
+    double factor = realNs > 0 ? (minTimeSec * 1e9 * 1.4) / realNs : 10.0;
+    factor = std::min(std::max(factor, 2.0), 10.0);
+    state.iterations = (uint64_t)(state.iterations * factor);
+  }
+
+  BenchResult result;
+  result.name = benchmark.name;
+  result.iterations = state.iterations;
+  result.realNs = (double)realNs / state.iterations;
+  result.cpuNs = (double)cpuNs / state.iterations;
+  result.cyclesPerIteration = (double)cycles / state.iterations;
+  for (int i = 1; i < repetitions; i++)
+  {
+    runOnce(benchmark, state, realNs, cpuNs, cycles);
+    double repRealNs = (double)realNs / state.iterations;
+    if (repRealNs < result.realNs)
+    {
+      result.realNs = repRealNs;
+      result.cpuNs = (double)cpuNs / state.iterations;
+      result.cyclesPerIteration = (double)cycles / state.iterations;
+    }
+  }
+  result.itemsPerIteration = (double)state.itemsPerIteration;
+  return result;
+}
+
+static std::string jsonEscape(const std::string &s)
+{
+  std::string out;
+  for (size_t i = 0; i < s.size(); i++)
+  {
+    if (s[i] == '"' || s[i] == '\\')
+    {
+      out += '\\';
+    }
+    out += s[i];
+  }
+  return out;
+}
+
+static std::string toJson(const std::vector<BenchResult> &results)
+{
+  char hostname[256] = "";
+  gethostname(hostname, sizeof(hostname) - 1);
+  char date[64];
+  time_t now = time(NULL);
+  struct tm tmLocal;
+  localtime_r(&now, &tmLocal);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", &tmLocal);
+
+  std::ostringstream out;
+  out << "{\n";
+  out << "  \"context\": {\n";
+  out << "    \"date\": \"" << date << "\",\n";
+  out << "    \"host_name\": \"" << jsonEscape(hostname) << "\",\n";
+  out << "    \"executable\": \"tssd-bench\",\n";
+  out << "    \"num_cpus\": " << sysconf(_SC_NPROCESSORS_ONLN) << "\n";
+  out << "  },\n";
+  out << "  \"benchmarks\": [\n";
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const BenchResult &r = results[i];
+    out << "    {\n";
+    out << "      \"name\": \"" << jsonEscape(r.name) << "\",\n";
+    out << "      \"iterations\": " << r.iterations << ",\n";
+    out << "      \"real_time\": " << r.realNs << ",\n";
+    out << "      \"cpu_time\": " << r.cpuNs << ",\n";
+    out << "      \"time_unit\": \"ns\",\n";
+    out << "      \"ns_per_packet\": " << r.realNs / r.itemsPerIteration << ",\n";
+    if (r.cyclesPerIteration > 0)
+    {
+      out << "      \"cycles_per_packet\": " << r.cyclesPerIteration / r.itemsPerIteration << ",\n";
+    }
+    out << "      \"items_per_second\": " << (r.realNs > 0 ? 1e9 * r.itemsPerIteration / r.realNs : 0.0) << "\n";
+    out << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ]\n";
+  out << "}\n";
+  return out.str();
+}
+
+static std::string toConsole(const std::vector<BenchResult> &results)
+{
+  std::ostringstream out;
+  char line[256];
+  snprintf(line, sizeof(line), "%-40s %14s %14s %14s %14s\n", "Benchmark", "Time [ns]", "CPU [ns]", "ns/packet", "Iterations");
+  out << line << std::string(100, '-') << "\n";
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    const BenchResult &r = results[i];
+    snprintf(line, sizeof(line), "%-40s %14.2f %14.2f %14.2f %14llu\n", r.name.c_str(), r.realNs, r.cpuNs,
+      r.realNs / r.itemsPerIteration, (unsigned long long)r.iterations);
+    out << line;
+  }
+  return out.str();
+}
+
+int main(int argc, char **argv)
+{
+  cxxopts::Options options(argv[0], "Microbenchmarks of the tssd request path");
+  options.add_options()
+    ("h, help", "print help")
+    ("filter", "run only benchmarks whose name matches this regex", cxxopts::value<std::string>()->default_value(".*"))
+    ("min_time", "min seconds per benchmark run", cxxopts::value<double>()->default_value("0.2"))
+    ("repetitions", "runs per benchmark, the best is reported", cxxopts::value<int>()->default_value("3"))
+    ("format", "output format: console or json", cxxopts::value<std::string>()->default_value("console"))
+    ("out", "also write the results as JSON to this file", cxxopts::value<std::string>()->default_value(""))
+    ("list", "list the benchmarks and exit", cxxopts::value<bool>())
+    ;
+
+  std::string filter, format, outPath;
+  double minTimeSec;
+  int repetitions;
+  bool list;
+  try
+  {
+    cxxopts::ParseResult parseResult = options.parse(argc, argv);
+    if (parseResult.count("help") > 0)
+    {
+      std::cout << options.help() << std::endl;
+      return EXIT_SUCCESS;
+    }
+    filter = parseResult["filter"].as<std::string>();
+    format = parseResult["format"].as<std::string>();
+    outPath = parseResult["out"].as<std::string>();
+    minTimeSec = parseResult["min_time"].as<double>();
+    repetitions = std::max(1, parseResult["repetitions"].as<int>());
+    list = parseResult["list"].as<bool>();
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  if (format != "console" && format != "json")
+  {
+    std::cerr << argv[0] << ": unknown format '" << format << "'" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // cycles are counted when the kernel allows it (see kernel.perf_event_paranoid)
+  SelfProfiler profiler;
+  if (!list)
+  {
+    profiler.open();
+  }
+
+  std::regex filterRegex(filter);
+  std::vector<BenchResult> results;
+  for (size_t i = 0; i < registry().size(); i++)
+  {
+    const Benchmark &benchmark = registry()[i];
+    if (!std::regex_search(benchmark.name, filterRegex))
+    {
+      continue;
+    }
+    if (list)
+    {
+      std::cout << benchmark.name << std::endl;
+      continue;
+    }
+    results.push_back(runBenchmark(benchmark, minTimeSec, repetitions, profiler));
+  }
+  if (list)
+  {
+    return EXIT_SUCCESS;
+  }
+
+  std::cout << (format == "json" ? toJson(results) : toConsole(results));
+  if (!outPath.empty())
+  {
+    std::ofstream out(outPath.c_str());
+    out << toJson(results);
+    if (!out)
+    {
+      std::cerr << argv[0] << ": cannot write '" << outPath << "'" << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+#ifndef TSSD_MICROBENCH_H
+#define TSSD_MICROBENCH_H
+
+#include <stdint.h>
+
+#include <string>
+
+/*
+ * Minimal self contained microbenchmark harness (in the spirit of
+ * google-benchmark). A benchmark is a function which runs its body
+ * 'state.iterations' times; the harness picks the number of iterations so
+ * a run takes at least the min time, and reports ns per iteration:
+ *
+ *   static void BM_Something(BenchState &state)
+ *   {
+ *     for (uint64_t i = 0; i < state.iterations; i++)
+ *     {
+ *       doNotOptimize(something());
+ *     }
+ *   }
+ *   TSSD_BENCHMARK(BM_Something);
+ *
+ * Batched variants set 'state.itemsPerIteration' (e.g. the batch size) so
+ * they are also reported per packet. A benchmark which sets up fixtures
+ * (a pipeline, its requests) calls 'state.resetTimer()' before its loop,
+ * so only the loop is measured.
+ */
+
+class SelfProfiler;
+
+struct BenchState
+{
+  uint64_t iterations;
+  uint64_t itemsPerIteration;
+
+  // restarts the measurement, what ran before isn't measured
+  void resetTimer();
+
+  // set by the harness
+  const SelfProfiler *profiler;
+  uint64_t realStartNs;
+  uint64_t cpuStartNs;
+  uint64_t cyclesStart;
+};
+
+typedef void (*BenchFunction)(BenchState &state);
+
+struct BenchRegistration
+{
+  BenchRegistration(const char *name, BenchFunction function);
+};
+
+#define TSSD_BENCHMARK(function) \
+  static BenchRegistration benchRegistration_##function(#function, function)
+
+// keeps the compiler from optimizing away a value or the computation of it
+template <typename T>
+inline void doNotOptimize(const T &value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// forces the compiler to assume memory was read and written
+inline void clobberMemory()
+{
+  asm volatile("" : : : "memory");
+}
+
+#endif // TSSD_MICROBENCH_H
@@ -0,0 +1,181 @@
+#include "beacon_listener.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "tsp_protocol.h"
+
+static uint64_t realtimeNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+BeaconListener::BeaconListener()
+  : fd_(-1), havePrevious_(false), previousSequence_(0), previousRxNs_(0)
+{
+}
+
+BeaconListener::~BeaconListener()
+{
+  close();
+}
+
+bool BeaconListener::open(const char *group, unsigned short port, const char *interfaceAddress)
+{
+  close();
+
+  struct in_addr groupAddress;
+  struct in_addr interface;
+  interface.s_addr = htonl(INADDR_ANY);
+  if (inet_pton(AF_INET, group, &groupAddress) != 1 ||
+    (interfaceAddress != NULL && inet_pton(AF_INET, interfaceAddress, &interface) != 1))
+  {
+    errno = EINVAL;
+    return false;
+  }
+
+  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0)
+  {
+    return false;
+  }
+  int optval = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)); // several listeners on one host
+  setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval));
+
+  struct sockaddr_in local;
+  memset(&local, 0, sizeof(local));
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = htonl(INADDR_ANY);
+  local.sin_port = htons(port);
+  if (bind(fd_, (struct sockaddr *)&local, sizeof(local)) < 0)
+  {
+    close();
+    return false;
+  }
+
+  if (IN_MULTICAST(ntohl(groupAddress.s_addr)))
+  {
+    struct ip_mreq membership;
+    membership.imr_multiaddr = groupAddress;
+    membership.imr_interface = interface;
+    if (setsockopt(fd_, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0)
+    {
+      int savedErrno = errno;
+      close();
+      errno = savedErrno;
+      return false;
+    }
+  }
+  havePrevious_ = false;
+  return true;
+}
+
+void BeaconListener::close()
+{
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+int BeaconListener::receive(int timeoutMs, BeaconSample &out)
+{
+  if (fd_ < 0)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  uint64_t deadlineNs = ((uint64_t)deadline.tv_sec) * 1000000000ULL + (uint64_t)deadline.tv_nsec +
+    (uint64_t)timeoutMs * 1000000ULL;
+  while (true)
+  {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t nowNs = ((uint64_t)now.tv_sec) * 1000000000ULL + (uint64_t)now.tv_nsec;
+    if (nowNs >= deadlineNs)
+    {
+      return 0;
+    }
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    int rc = ::poll(&pfd, 1, (int)((deadlineNs - nowNs + 999999) / 1000000));
+    if (rc < 0 && errno != EINTR)
+    {
+      return -1;
+    }
+    if (rc <= 0)
+    {
+      continue;
+    }
+
+    TimeBeacon beacon;
+    struct iovec iov;
+    iov.iov_base = &beacon;
+    iov.iov_len = sizeof(beacon);
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t length = recvmsg(fd_, &msg, MSG_DONTWAIT);
+    if (length < 0)
+    {
+      if (errno == EAGAIN || errno == EINTR)
+      {
+        continue;
+      }
+      return -1;
+    }
+    uint64_t rxNs = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+      {
+        struct timespec ts;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        rxNs = ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+      }
+    }
+    if (rxNs == 0)
+    {
+      rxNs = realtimeNs();
+    }
+    if (!isTimeBeacon((const char *)&beacon, (int)length))
+    {
+      continue;
+    }
+
+    out.sequence = beacon.sequence;
+    out.lost = havePrevious_ && beacon.sequence > previousSequence_ ? beacon.sequence - previousSequence_ - 1 : 0;
+    // the previous beacon's real TX time against the time it arrived here is the precise pair
+    out.precise = havePrevious_ && beacon.sequence == previousSequence_ + 1 && beacon.previousTxTimeNs != 0;
+    if (out.precise)
+    {
+      out.offsetNs = (double)beacon.previousTxTimeNs - (double)previousRxNs_;
+    }
+    else
+    {
+      out.offsetNs = (double)beacon.timeNs - (double)rxNs;
+    }
+    havePrevious_ = true;
+    previousSequence_ = beacon.sequence;
+    previousRxNs_ = rxNs;
+    return 1;
+  }
+}
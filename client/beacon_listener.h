@@ -0,0 +1,55 @@
+#ifndef TSSD_BEACON_LISTENER_H
+#define TSSD_BEACON_LISTENER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One beacon of the server. offset is server time minus local time, without
+ * the one way delay of the beacon (so the local clock is behind by the delay,
+ * which a client can learn from a unicast poll once in a while).
+ */
+struct BeaconSample
+{
+  uint64_t sequence;
+  double offsetNs;
+  bool precise; // offset from the kernel TX timestamp of the previous beacon, not from the build time of this one
+  uint64_t lost; // beacons missed since the previous one received
+};
+
+/*
+ * Passive client of the server's beacons (multicast or broadcast).
+ * It never sends anything, so any number of listeners costs the server
+ * nothing.
+ *
+ *   BeaconListener listener;
+ *   listener.open("239.255.43.21", 12323);
+ *   BeaconSample sample;
+ *   while (listener.receive(2000, sample) >= 0) ...
+ */
+class BeaconListener
+{
+public:
+  BeaconListener();
+  ~BeaconListener();
+
+  // 'group' is the multicast group to join, or a broadcast (or any) address.
+  // 'interfaceAddress' picks the interface to join on (NULL for the default).
+  // returns false (with errno set) on error
+  bool open(const char *group, unsigned short port, const char *interfaceAddress = NULL);
+  void close();
+
+  // waits up to timeoutMs for a beacon. returns 1 with the sample, 0 on timeout, -1 on a socket error
+  int receive(int timeoutMs, BeaconSample &out);
+
+private:
+  BeaconListener(const BeaconListener &);
+  BeaconListener &operator=(const BeaconListener &);
+
+  int fd_;
+  bool havePrevious_;
+  uint64_t previousSequence_;
+  uint64_t previousRxNs_; // local time the previous beacon arrived
+};
+
+#endif // TSSD_BEACON_LISTENER_H
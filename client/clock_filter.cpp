@@ -0,0 +1,146 @@
+#include "clock_filter.h"
+
+#include <math.h>
+#include <stddef.h>
+
+ClockFilter::ClockFilter(double resolutionNs, double maxDriftPpm)
+  : resolutionNs_(resolutionNs), maxDrift_(maxDriftPpm * 1e-6)
+{
+  reset();
+}
+
+void ClockFilter::reset()
+{
+  count_ = 0;
+  next_ = 0;
+  consecutiveSpikes_ = 0;
+  rejectedSpikes_ = 0;
+}
+
+bool ClockFilter::addBurst(const ClockSample *samples, int count, uint64_t nowNs)
+{
+  const ClockSample *best = NULL;
+  for (int i = 0; i < count; i++)
+  {
+    if (samples[i].delayNs >= 0.0 && (best == NULL || samples[i].delayNs < best->delayNs))
+    {
+      best = &samples[i];
+    }
+  }
+  if (best == NULL)
+  {
+    return false;
+  }
+
+  ClockEstimate current;
+  if (estimate(nowNs, current))
+  {
+    // the gate is never tighter than what the delays and the resolution explain
+    double gate = SpikeGate * current.jitterNs;
+    double floor = (best->delayNs + current.delayNs) / 2.0 + resolutionNs_;
+    if (gate < floor)
+    {
+      gate = floor;
+    }
+    if (fabs(best->offsetNs - current.offsetNs) > gate)
+    {
+      if (consecutiveSpikes_ < MaxConsecutiveSpikes)
+      {
+        consecutiveSpikes_++;
+        rejectedSpikes_++;
+        return false;
+      }
+      // persistent, so the clock stepped: the old samples describe another clock
+      count_ = 0;
+      next_ = 0;
+    }
+  }
+  consecutiveSpikes_ = 0;
+
+  window_[next_].sample = *best;
+  window_[next_].timeNs = nowNs;
+  next_ = (next_ + 1) % WindowSize;
+  if (count_ < WindowSize)
+  {
+    count_++;
+  }
+  return true;
+}
+
+int ClockFilter::select(uint64_t nowNs) const
+{
+  int best = -1;
+  double bestDelay = 0.0;
+  for (int i = 0; i < count_; i++)
+  {
+    // the offset of an old sample is off by up to the drift since it was taken,
+    // on both ends of the round trip
+    double ageNs = (double)(nowNs - window_[i].timeNs);
+    double delay = window_[i].sample.delayNs + 2.0 * maxDrift_ * ageNs;
+    if (best < 0 || delay < bestDelay)
+    {
+      best = i;
+      bestDelay = delay;
+    }
+  }
+  return best;
+}
+
+double ClockFilter::jitterAround(double offsetNs) const
+{
+  if (count_ < 2)
+  {
+    return 0.0;
+  }
+  double sumSquares = 0.0;
+  for (int i = 0; i < count_; i++)
+  {
+    double diff = window_[i].sample.offsetNs - offsetNs;
+    sumSquares += diff * diff;
+  }
+  return sqrt(sumSquares / (count_ - 1));
+}
+
+bool ClockFilter::estimate(uint64_t nowNs, ClockEstimate &out) const
+{
+  int best = select(nowNs);
+  if (best < 0)
+  {
+    return false;
+  }
+  const Entry &entry = window_[best];
+  out.offsetNs = entry.sample.offsetNs;
+  out.delayNs = entry.sample.delayNs;
+  out.ageNs = nowNs - entry.timeNs;
+  out.jitterNs = jitterAround(out.offsetNs);
+  // the true offset is within half the round trip of the estimate (the reply
+  // was stamped somewhere during it), plus the server's resolution and the drift since
+  out.uncertaintyNs = out.delayNs / 2.0 + resolutionNs_ / 2.0 + maxDrift_ * (double)out.ageNs;
+  return true;
+}
+
+PollInterval::PollInterval(double minPollSec, double maxPollSec)
+  : minPollSec_(minPollSec), maxPollSec_(maxPollSec), intervalSec_(minPollSec), counter_(0)
+{
+}
+
+void PollInterval::update(bool consistent)
+{
+  // like NTP: steady samples count up slowly, a jump counts down fast
+  counter_ += consistent ? 1 : -2;
+  if (counter_ >= Hysteresis)
+  {
+    counter_ = 0;
+    intervalSec_ = intervalSec_ * 2.0 > maxPollSec_ ? maxPollSec_ : intervalSec_ * 2.0;
+  }
+  else if (counter_ <= -Hysteresis)
+  {
+    counter_ = 0;
+    intervalSec_ = intervalSec_ / 2.0 < minPollSec_ ? minPollSec_ : intervalSec_ / 2.0;
+  }
+}
+
+void PollInterval::failed()
+{
+  update(false);
+}
@@ -0,0 +1,120 @@
+#ifndef TSSD_CLOCK_FILTER_H
+#define TSSD_CLOCK_FILTER_H
+
+#include <stdint.h>
+
+/*
+ * One request / reply exchange with the server.
+ * offset is server time minus local time, delay is the round trip time.
+ */
+struct ClockSample
+{
+  double offsetNs;
+  double delayNs;
+};
+
+struct ClockEstimate
+{
+  double offsetNs; // add to the local clock to get the server's time
+  double uncertaintyNs; // bound of the error of offsetNs
+  double delayNs; // round trip delay of the sample the estimate is based on
+  double jitterNs; // rms spread of the recent offsets around the estimate
+  uint64_t ageNs; // time since the sample the estimate is based on
+};
+
+/*
+ * Minimum delay clock filter, in the spirit of NTP's.
+ *
+ * Every poll is a burst of exchanges and only its minimum delay sample is
+ * kept (queueing only ever adds delay, so the fastest exchange is the
+ * least biased one). The last 'WindowSize' kept samples form a window,
+ * and the estimate is the one with the lowest delay, where older samples
+ * are penalized for the drift of the local clock since they were taken.
+ *
+ * A sample whose offset is further than 'SpikeGate' jitters from the
+ * current estimate is rejected as an outlier (popcorn spike), unless the
+ * previous samples were rejected as well - then the clock really stepped
+ * and the window restarts from it.
+ */
+class ClockFilter
+{
+public:
+  static const int WindowSize = 8;
+  static const int SpikeGate = 3;
+  static const int MaxConsecutiveSpikes = 2;
+
+  // resolutionNs is the resolution of the server's timestamps,
+  // maxDriftPpm is the assumed frequency error of the local clock
+  ClockFilter(double resolutionNs = 1e6, double maxDriftPpm = 50.0);
+
+  // adds the samples of one burst, nowNs is a monotonic time.
+  // returns false if the burst was empty or rejected as an outlier
+  bool addBurst(const ClockSample *samples, int count, uint64_t nowNs);
+
+  // returns false until the first sample was added
+  bool estimate(uint64_t nowNs, ClockEstimate &out) const;
+
+  // samples currently in the window
+  int size() const
+  {
+    return count_;
+  }
+
+  uint64_t rejectedSpikes() const
+  {
+    return rejectedSpikes_;
+  }
+
+  void reset();
+
+private:
+  struct Entry
+  {
+    ClockSample sample;
+    uint64_t timeNs;
+  };
+
+  // index in window_ of the best sample, -1 if empty
+  int select(uint64_t nowNs) const;
+  double jitterAround(double offsetNs) const;
+
+  double resolutionNs_;
+  double maxDrift_;
+  Entry window_[WindowSize];
+  int count_;
+  int next_;
+  int consecutiveSpikes_;
+  uint64_t rejectedSpikes_;
+};
+
+/*
+ * Adaptive poll interval. Polls back off (doubling up to maxPollSec) while
+ * the estimates stay consistent and the clock is quiet, and speed up
+ * (halving down to minPollSec) when the offset moves by more than the
+ * uncertainty, or polls fail. A hysteresis counter keeps a single noisy
+ * poll from changing the interval.
+ */
+class PollInterval
+{
+public:
+  static const int Hysteresis = 4;
+
+  PollInterval(double minPollSec = 16.0, double maxPollSec = 1024.0);
+
+  // 'consistent' when the new estimate is within the uncertainty of the previous one
+  void update(bool consistent);
+  void failed();
+
+  double seconds() const
+  {
+    return intervalSec_;
+  }
+
+private:
+  double minPollSec_;
+  double maxPollSec_;
+  double intervalSec_;
+  int counter_;
+};
+
+#endif // TSSD_CLOCK_FILTER_H
@@ -0,0 +1,118 @@
+#ifndef TSSD_SIPHASH_H
+#define TSSD_SIPHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SipHash-2-4: a keyed 64 bit hash, the MAC of authenticated TSP packets.
+ * A few dozen ns for a 16 or 24 byte packet, so it can run on every
+ * packet at full rate. The server hashes a batch at once (siphash_batch.h).
+ */
+
+struct SipHashKey
+{
+  uint64_t k0; // key bytes 0-7, little endian
+  uint64_t k1; // key bytes 8-15, little endian
+};
+
+const int SipHashKeySize = 16;
+
+inline uint64_t loadLittleEndian64(const char *p)
+{
+  const uint8_t *b = (const uint8_t *)p;
+  return (uint64_t)b[0] | ((uint64_t)b[1] << 8) | ((uint64_t)b[2] << 16) | ((uint64_t)b[3] << 24) |
+    ((uint64_t)b[4] << 32) | ((uint64_t)b[5] << 40) | ((uint64_t)b[6] << 48) | ((uint64_t)b[7] << 56);
+}
+
+inline SipHashKey sipHashKey(const uint8_t bytes[SipHashKeySize])
+{
+  SipHashKey key;
+  key.k0 = loadLittleEndian64((const char *)bytes);
+  key.k1 = loadLittleEndian64((const char *)bytes + 8);
+  return key;
+}
+
+// 32 hex digits (the 16 key bytes in order), false if 'hex' is not exactly that
+inline bool parseSipHashKey(const char *hex, SipHashKey &key)
+{
+  uint8_t bytes[SipHashKeySize];
+  for (int i = 0; i < SipHashKeySize * 2; i++)
+  {
+    char c = hex[i];
+    int digit;
+    if (c >= '0' && c <= '9')
+    {
+      digit = c - '0';
+    }
+    else if (c >= 'a' && c <= 'f')
+    {
+      digit = c - 'a' + 10;
+    }
+    else if (c >= 'A' && c <= 'F')
+    {
+      digit = c - 'A' + 10;
+    }
+    else
+    {
+      return false;
+    }
+    bytes[i / 2] = (uint8_t)(i % 2 == 0 ? digit << 4 : bytes[i / 2] | digit);
+  }
+  if (hex[SipHashKeySize * 2] != '\0')
+  {
+    return false;
+  }
+  key = sipHashKey(bytes);
+  return true;
+}
+
+inline uint64_t sipRotate(uint64_t value, int bits)
+{
+  return (value << bits) | (value >> (64 - bits));
+}
+
+#define TSSD_SIPROUND(v0, v1, v2, v3) \
+  do \
+  { \
+    v0 += v1; v1 = sipRotate(v1, 13); v1 ^= v0; v0 = sipRotate(v0, 32); \
+    v2 += v3; v3 = sipRotate(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = sipRotate(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = sipRotate(v1, 17); v1 ^= v2; v2 = sipRotate(v2, 32); \
+  } while (0)
+
+inline uint64_t sipHash24(const SipHashKey &key, const char *message, size_t length)
+{
+  uint64_t v0 = key.k0 ^ 0x736f6d6570736575ULL;
+  uint64_t v1 = key.k1 ^ 0x646f72616e646f6dULL;
+  uint64_t v2 = key.k0 ^ 0x6c7967656e657261ULL;
+  uint64_t v3 = key.k1 ^ 0x7465646279746573ULL;
+  size_t words = length / 8;
+  for (size_t i = 0; i < words; i++)
+  {
+    uint64_t m = loadLittleEndian64(message + i * 8);
+    v3 ^= m;
+    TSSD_SIPROUND(v0, v1, v2, v3);
+    TSSD_SIPROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  uint64_t last = (uint64_t)length << 56;
+  for (size_t i = 0; i < length % 8; i++)
+  {
+    last |= (uint64_t)(uint8_t)message[words * 8 + i] << (i * 8);
+  }
+  v3 ^= last;
+  TSSD_SIPROUND(v0, v1, v2, v3);
+  TSSD_SIPROUND(v0, v1, v2, v3);
+  v0 ^= last;
+  v2 ^= 0xff;
+  for (int i = 0; i < 4; i++)
+  {
+    TSSD_SIPROUND(v0, v1, v2, v3);
+  }
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef TSSD_SIPROUND
+
+#endif // TSSD_SIPHASH_H
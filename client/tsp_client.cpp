@@ -0,0 +1,229 @@
+#include "tsp_client.h"
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <random>
+
+#include "tsp_protocol.h"
+
+static uint64_t clockNs(clockid_t clockId)
+{
+  struct timespec ts;
+  clock_gettime(clockId, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+TspClient::TspClient(const Config &config)
+  : config_(config), fd_(-1), cookieBase_(0), sequence_(0),
+  filter_(1e6, config.maxDriftPpm), pollInterval_(config.minPollSec, config.maxPollSec),
+  requestsSent_(0), repliesReceived_(0), authFailures_(0)
+{
+  if (config_.burstSize < 1)
+  {
+    config_.burstSize = 1;
+  }
+  if (config_.burstSize > MaxBurstSize)
+  {
+    config_.burstSize = MaxBurstSize;
+  }
+}
+
+TspClient::~TspClient()
+{
+  close();
+}
+
+bool TspClient::open(const char *server, unsigned short port)
+{
+  close();
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+  char portString[8];
+  snprintf(portString, sizeof(portString), "%u", port);
+  struct addrinfo *addresses;
+  int rc = getaddrinfo(server, portString, &hints, &addresses);
+  if (rc != 0)
+  {
+    errno = rc == EAI_SYSTEM ? errno : EHOSTUNREACH;
+    return false;
+  }
+
+  for (struct addrinfo *address = addresses; address != NULL && fd_ < 0; address = address->ai_next)
+  {
+    fd_ = socket(address->ai_family, address->ai_socktype | SOCK_CLOEXEC, address->ai_protocol);
+    if (fd_ >= 0 && connect(fd_, address->ai_addr, address->ai_addrlen) < 0)
+    {
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+  freeaddrinfo(addresses);
+  if (fd_ < 0)
+  {
+    return false;
+  }
+
+  std::random_device random;
+  cookieBase_ = (((uint64_t)random()) << 32) ^ random();
+  cookieBase_ &= ~(uint64_t)0xffff; // the low bits are the sequence
+  filter_.reset();
+  return true;
+}
+
+void TspClient::close()
+{
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+int TspClient::poll()
+{
+  if (fd_ < 0)
+  {
+    errno = EBADF;
+    return -1;
+  }
+
+  // a TimeRequest is the first 16 bytes of a TimeAuthRequest
+  bool authenticated = config_.keyId != 0;
+  TimeAuthRequest request;
+  memset(&request, 0, sizeof(request));
+  memcpy(request.protocol, "TSP", 3);
+  request.protocolVersion = 1;
+  if (authenticated)
+  {
+    request.messageType = TspAuthRequest;
+    request.keyId = config_.keyId;
+  }
+  size_t requestSize = authenticated ? TimeAuthRequestPacketSize : TimeRequestPacketSize;
+
+  uint64_t cookies[MaxBurstSize];
+  uint64_t sentNs[MaxBurstSize];
+  ClockSample samples[MaxBurstSize];
+  int sent = 0;
+  int received = 0;
+  for (int i = 0; i < config_.burstSize; i++)
+  {
+    cookies[i] = 0;
+    samples[i].delayNs = -1.0; // no reply
+  }
+
+  uint64_t spacingNs = (uint64_t)(config_.burstSpacingMs * 1e6);
+  uint64_t nextSendNs = clockNs(CLOCK_MONOTONIC);
+  uint64_t deadlineNs = nextSendNs + spacingNs * (config_.burstSize - 1) + (uint64_t)(config_.timeoutMs * 1e6);
+  while (received < config_.burstSize)
+  {
+    uint64_t now = clockNs(CLOCK_MONOTONIC);
+    if (now >= deadlineNs)
+    {
+      break;
+    }
+    if (sent < config_.burstSize && now >= nextSendNs)
+    {
+      cookies[sent] = cookieBase_ | (sequence_++ & 0xffff);
+      request.clientCookie = cookies[sent];
+      if (authenticated)
+      {
+        request.mac = sipHash24(config_.key, (const char *)&request, TimeAuthRequestMacLength);
+      }
+      sentNs[sent] = clockNs(config_.clockId);
+      if (send(fd_, &request, requestSize, 0) < 0 && errno != ECONNREFUSED)
+      {
+        return -1;
+      }
+      requestsSent_++;
+      sent++;
+      nextSendNs += spacingNs;
+      continue;
+    }
+
+    uint64_t wakeNs = sent < config_.burstSize ? nextSendNs : deadlineNs;
+    struct pollfd pfd;
+    pfd.fd = fd_;
+    pfd.events = POLLIN;
+    int waitMs = (int)((wakeNs - now + 999999) / 1000000);
+    if (::poll(&pfd, 1, waitMs) <= 0)
+    {
+      continue;
+    }
+
+    // a TimeReply is the first 24 bytes of a TimeAuthReply
+    TimeAuthReply reply;
+    ssize_t length;
+    while ((length = recv(fd_, &reply, sizeof(reply), MSG_DONTWAIT)) >= 0)
+    {
+      uint64_t receivedNs = clockNs(config_.clockId);
+      if (length < (ssize_t)TimeReplyPacketSize || !hasTspHeader((const char *)&reply))
+      {
+        continue;
+      }
+      if (authenticated && (length != (ssize_t)TimeAuthReplyPacketSize || reply.messageType != TspAuthReply ||
+        reply.keyId != config_.keyId || reply.mac != sipHash24(config_.key, (const char *)&reply, TimeAuthReplyMacLength)))
+      {
+        authFailures_++;
+        continue;
+      }
+      for (int i = 0; i < sent; i++)
+      {
+        if (cookies[i] != 0 && cookies[i] == reply.clientCookie)
+        {
+          // the server truncates to ms, the middle of its ms is the best guess
+          double serverNs = (double)reply.timeSinceEphoc1970Ms * 1e6 + 500000.0;
+          samples[i].delayNs = (double)(receivedNs - sentNs[i]);
+          samples[i].offsetNs = serverNs - ((double)sentNs[i] + (double)receivedNs) / 2.0;
+          cookies[i] = 0;
+          received++;
+          repliesReceived_++;
+          break;
+        }
+      }
+    }
+  }
+
+  if (received == 0)
+  {
+    pollInterval_.failed();
+    return 0;
+  }
+
+  ClockEstimate previous;
+  bool hadEstimate = filter_.estimate(clockNs(CLOCK_MONOTONIC), previous);
+  bool accepted = filter_.addBurst(samples, config_.burstSize, clockNs(CLOCK_MONOTONIC));
+  ClockEstimate current;
+  filter_.estimate(clockNs(CLOCK_MONOTONIC), current);
+  if (hadEstimate)
+  {
+    pollInterval_.update(accepted && fabs(current.offsetNs - previous.offsetNs) <= previous.uncertaintyNs);
+  }
+  return received;
+}
+
+bool TspClient::estimate(ClockEstimate &out) const
+{
+  return filter_.estimate(clockNs(CLOCK_MONOTONIC), out);
+}
+
+uint64_t TspClient::now() const
+{
+  ClockEstimate current;
+  uint64_t local = clockNs(config_.clockId);
+  if (!estimate(current))
+  {
+    return local;
+  }
+  return (uint64_t)((double)local + current.offsetNs);
+}
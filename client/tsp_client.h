@@ -0,0 +1,103 @@
+#ifndef TSSD_TSP_CLIENT_H
+#define TSSD_TSP_CLIENT_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "clock_filter.h"
+#include "siphash.h"
+
+/*
+ * Client of the time sync protocol (TSP).
+ * Every poll sends a burst of requests, feeds the replies to a ClockFilter
+ * and adapts the poll interval. The client only estimates the offset of the
+ * local clock to the server's - it never changes the local clock.
+ *
+ *   TspClient client;
+ *   client.open("10.0.0.1", 12321);
+ *   while (true)
+ *   {
+ *     client.poll();
+ *     ... client.estimate(estimate) / client.now() ...
+ *     sleep(client.pollIntervalSec());
+ *   }
+ */
+class TspClient
+{
+public:
+  static const int MaxBurstSize = 16;
+
+  struct Config
+  {
+    Config() : burstSize(4), burstSpacingMs(2.0), timeoutMs(500.0), minPollSec(16.0), maxPollSec(1024.0), maxDriftPpm(50.0),
+      clockId(CLOCK_REALTIME), keyId(0)
+    {
+      key.k0 = 0;
+      key.k1 = 0;
+    }
+    int burstSize; // requests per poll, at most MaxBurstSize
+    double burstSpacingMs; // between the requests of a burst
+    double timeoutMs; // to wait for the replies after the last request
+    double minPollSec;
+    double maxPollSec;
+    double maxDriftPpm; // assumed frequency error of the local clock
+    clockid_t clockId; // the local clock the offset is measured against
+    uint16_t keyId; // authenticated requests with 'key' of this id on the server, 0 for unauthenticated requests
+    SipHashKey key;
+  };
+
+  explicit TspClient(const Config &config = Config());
+  ~TspClient();
+
+  // returns false (with errno set) if the server can't be resolved or the socket can't be opened
+  bool open(const char *server, unsigned short port);
+  void close();
+
+  // one burst, blocks for up to burstSize * burstSpacingMs + timeoutMs.
+  // returns the number of replies received, -1 on a socket error
+  int poll();
+
+  // returns false until a poll got a reply
+  bool estimate(ClockEstimate &out) const;
+
+  // the local clock corrected by the current estimate, in ns since the epoch
+  uint64_t now() const;
+
+  double pollIntervalSec() const
+  {
+    return pollInterval_.seconds();
+  }
+
+  uint64_t requestsSent() const
+  {
+    return requestsSent_;
+  }
+
+  uint64_t repliesReceived() const
+  {
+    return repliesReceived_;
+  }
+
+  // replies ignored since they are not signed, or their MAC is wrong
+  uint64_t authFailures() const
+  {
+    return authFailures_;
+  }
+
+private:
+  TspClient(const TspClient &);
+  TspClient &operator=(const TspClient &);
+
+  Config config_;
+  int fd_;
+  uint64_t cookieBase_; // random, so replies to other clients (or to old requests) are ignored
+  uint64_t sequence_;
+  ClockFilter filter_;
+  PollInterval pollInterval_;
+  uint64_t requestsSent_;
+  uint64_t repliesReceived_;
+  uint64_t authFailures_;
+};
+
+#endif // TSSD_TSP_CLIENT_H
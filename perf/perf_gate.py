@@ -0,0 +1,239 @@
+#!/usr/bin/env python3
+"""
+Performance regression gate for tssd.
+
+  perf_gate.py microbench --bench <tssd-bench> --baseline perf/baseline.json
+  perf_gate.py loopback --tssd <tssd> --loadgen <tssd-loadgen> --baseline perf/baseline.json
+
+Every run measures the current build and compares it to the baseline with the
+tolerances written in the baseline file. The exit status is 1 if any metric
+regressed. Add --update to write the measured values back to the baseline
+(after an intended change, or when moving the gate to another host).
+"""
+
+import argparse
+import ctypes
+import json
+import os
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def load_baseline(path):
+    with open(path) as f:
+        return json.load(f)
+
+
+def save_baseline(path, baseline):
+    with open(path, 'w') as f:
+        json.dump(baseline, f, indent=2, sort_keys=True)
+        f.write('\n')
+
+
+def check(name, measured, expected, tolerance_percent, higher_is_better, slack=0.0):
+    """returns True if 'measured' is within the tolerance of 'expected'.
+    'slack' is an absolute allowance for values too small for a relative tolerance"""
+    if higher_is_better:
+        limit = expected * (1.0 - tolerance_percent / 100.0)
+        ok = measured >= limit
+        relation = '>='
+    else:
+        limit = max(expected * (1.0 + tolerance_percent / 100.0), expected + slack)
+        ok = measured <= limit
+        relation = '<='
+    print('%-4s %-45s %12.2f (baseline %.2f, limit %s %.2f)' %
+          ('ok' if ok else 'FAIL', name, measured, expected, relation, limit))
+    return ok
+
+
+def run_microbench(args, baseline):
+    section = baseline['microbench']
+    tolerances = section['tolerance_percent']
+    with tempfile.NamedTemporaryFile(suffix='.json') as out:
+        subprocess.check_call([args.bench, '--format', 'json', '--out', out.name,
+                               '--min_time', str(section['min_time']),
+                               '--repetitions', str(section['repetitions'])],
+                              stdout=subprocess.DEVNULL)
+        results = json.load(open(out.name))['benchmarks']
+
+    ok = True
+    for result in results:
+        name = result['name']
+        expected = section['benchmarks'].get(name)
+        if args.update:
+            entry = {'ns_per_packet': round(result['ns_per_packet'], 2)}
+            if 'cycles_per_packet' in result:
+                entry['cycles_per_packet'] = round(result['cycles_per_packet'], 1)
+            section['benchmarks'][name] = entry
+            continue
+        if expected is None:
+            print('new  %s (not in baseline)' % name)
+            continue
+        ok &= check(name + ' ns/packet', result['ns_per_packet'],
+                    expected['ns_per_packet'], tolerances['ns_per_packet'], False,
+                    section['slack_ns_per_packet'])
+        # cycles are only counted where the kernel exposes the hardware counters
+        if 'cycles_per_packet' in result and 'cycles_per_packet' in expected:
+            ok &= check(name + ' cycles/packet', result['cycles_per_packet'],
+                        expected['cycles_per_packet'], tolerances['cycles_per_packet'], False)
+    return ok
+
+
+class ServerCounters:
+    """CPU time (from schedstat) and cycles (perf_event_open, when the kernel
+    exposes them) of every thread of a running process"""
+
+    PERF_EVENT_OPEN = {'x86_64': 298, 'aarch64': 241}
+
+    def __init__(self, pid):
+        self.pid = pid
+        self.cycle_fds = []
+        syscall_number = self.PERF_EVENT_OPEN.get(os.uname().machine)
+        if syscall_number is None:
+            return
+        libc = ctypes.CDLL(None, use_errno=True)
+        # struct perf_event_attr (PERF_ATTR_SIZE_VER0): PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,
+        # counting from the open, in the kernel too - a UDP server spends most of its cycles there
+        attr = struct.pack('IIQQQQQ', 0, 64, 0, 0, 0, 0, 0).ljust(64, b'\0')
+        for tid in self.threads():
+            fd = libc.syscall(syscall_number, attr, tid, -1, -1, 0)
+            if fd < 0:
+                self.close()
+                return
+            self.cycle_fds.append(fd)
+
+    def threads(self):
+        return [int(tid) for tid in os.listdir('/proc/%d/task' % self.pid)]
+
+    def cpu_ns(self):
+        total = 0
+        for tid in self.threads():
+            try:
+                with open('/proc/%d/task/%d/schedstat' % (self.pid, tid)) as f:
+                    total += int(f.read().split()[0])
+            except OSError:
+                pass  # the thread exited
+        return total
+
+    def cycles(self):
+        """None if the cycles are not counted"""
+        if not self.cycle_fds:
+            return None
+        return sum(struct.unpack('Q', os.read(fd, 8))[0] for fd in self.cycle_fds)
+
+    def close(self):
+        for fd in self.cycle_fds:
+            os.close(fd)
+        self.cycle_fds = []
+
+
+def run_loadgen(args, section, rate, cpus):
+    loadgen = subprocess.run([args.loadgen, '--json', '--port', str(section['port']),
+                              '--threads', str(section['threads']),
+                              '--clients', str(section['clients']),
+                              '--rate', str(rate),
+                              '--duration', str(section['duration'])],
+                             stdout=subprocess.PIPE, universal_newlines=True,
+                             preexec_fn=lambda: os.sched_setaffinity(0, cpus))
+    if loadgen.returncode not in (0, 2):
+        print('tssd-loadgen failed (status %d)' % loadgen.returncode)
+        return None
+    return json.loads(loadgen.stdout)
+
+
+def run_loopback(args, baseline):
+    section = baseline['loopback']
+    tolerances = section['tolerance_percent']
+    # the server on one cpu, tssd-loadgen on the others (on a single cpu host they share it,
+    # and the round trip times include the waits for the cpu)
+    cpus = sorted(os.sched_getaffinity(0))
+    server_cpus = {cpus[0]}
+    loadgen_cpus = set(cpus[1:]) or server_cpus
+    server = subprocess.Popen([args.tssd, '--dont_d', '--stats_interval', '0', '--port', str(section['port'])],
+                              preexec_fn=lambda: os.sched_setaffinity(0, server_cpus))
+    counters = None
+    try:
+        time.sleep(0.5)
+        if server.poll() is not None:
+            print('tssd exited during startup (status %d)' % server.returncode)
+            return False
+        # the capacity of the server: offered far more than it can serve, replies per second.
+        # the cpu time and cycles it takes per reply are measured at that load too
+        counters = ServerCounters(server.pid)
+        cpu_ns = counters.cpu_ns()
+        cycles = counters.cycles()
+        saturated = run_loadgen(args, section, section['saturation_rate'], loadgen_cpus)
+        if saturated is None:
+            return False
+        replies = max(saturated['received'], 1)
+        cpu_ns_per_packet = (counters.cpu_ns() - cpu_ns) / replies
+        if cycles is not None:
+            cycles_per_packet = (counters.cycles() - cycles) / replies
+        # the latency at a rate the server keeps up with, the median of the repetitions
+        latencies = []
+        for _ in range(section['repetitions']):
+            result = run_loadgen(args, section, section['rate'], loadgen_cpus)
+            if result is None:
+                return False
+            latencies.append(result)
+    finally:
+        if counters is not None:
+            counters.close()
+        server.send_signal(signal.SIGTERM)
+        server.wait()
+    rtt_p99_us = sorted(result['rtt_us']['p99'] for result in latencies)[len(latencies) // 2]
+    loss_percent = max(result['loss_percent'] for result in latencies)
+
+    if args.update:
+        section['expected'] = {'throughput': round(saturated['throughput'], 1),
+                               'rtt_p99_us': round(rtt_p99_us, 2),
+                               'cpu_ns_per_packet': round(cpu_ns_per_packet, 1)}
+        if cycles is not None:
+            section['expected']['cycles_per_packet'] = round(cycles_per_packet, 1)
+        return True
+
+    expected = section['expected']
+    ok = check('loopback saturation throughput [req/s]', saturated['throughput'],
+               expected['throughput'], tolerances['throughput'], True)
+    ok &= check('loopback server cpu [ns/packet]', cpu_ns_per_packet,
+                expected['cpu_ns_per_packet'], tolerances['cpu_ns_per_packet'], False)
+    # cycles are only counted where the kernel exposes the hardware counters
+    if cycles is not None and 'cycles_per_packet' in expected:
+        ok &= check('loopback server cycles/packet', cycles_per_packet,
+                    expected['cycles_per_packet'], tolerances['cycles_per_packet'], False)
+    ok &= check('loopback rtt p99 [us]', rtt_p99_us,
+                expected['rtt_p99_us'], tolerances['rtt_p99_us'], False, section['slack_rtt_us'])
+    ok &= check('loopback loss [%]', loss_percent,
+                section['max_loss_percent'], 0, False)
+    return ok
+
+
+def main():
+    parser = argparse.ArgumentParser(description='tssd performance regression gate')
+    parser.add_argument('suite', choices=['microbench', 'loopback'])
+    parser.add_argument('--baseline', required=True)
+    parser.add_argument('--bench', help='path to tssd-bench')
+    parser.add_argument('--tssd', help='path to tssd')
+    parser.add_argument('--loadgen', help='path to tssd-loadgen')
+    parser.add_argument('--update', action='store_true', help='write the measured values to the baseline')
+    args = parser.parse_args()
+
+    baseline = load_baseline(args.baseline)
+    if args.suite == 'microbench':
+        ok = run_microbench(args, baseline)
+    else:
+        ok = run_loopback(args, baseline)
+
+    if args.update:
+        save_baseline(args.baseline, baseline)
+        print('updated %s' % os.path.abspath(args.baseline))
+        return 0
+    return 0 if ok else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Training run of a TSSD_PGO=generate build: drives an instrumented tssd
+# with tssd-loadgen over loopback, with the traffic mix of production -
+# batched and single requests, several protocol versions and junk - and
+# leaves the profile in the profile directory for the TSSD_PGO=use build.
+#
+#   pgo_train.sh <tssd> <tssd-loadgen> <profile dir> [llvm-profdata]
+
+set -e
+
+TSSD="$1"
+LOADGEN="$2"
+PROFILE_DIR="$3"
+LLVM_PROFDATA="$4"
+PORT=12397
+
+if [ -z "$TSSD" ] || [ -z "$LOADGEN" ] || [ -z "$PROFILE_DIR" ]; then
+  echo "usage: $0 <tssd> <tssd-loadgen> <profile dir> [llvm-profdata]" >&2
+  exit 1
+fi
+
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# the options of the service, so the flight recorder and stats paths are trained too
+"$TSSD" --dont_d --port $PORT --stats_interval 1 --flight_recorder "$WORK_DIR/tssd.flight" &
+SERVER_PID=$!
+sleep 0.5
+
+# steady traffic from many clients, with junk and mixed protocol versions
+"$LOADGEN" --port $PORT --threads 2 --clients 100000 --rate 50000 --duration 4 \
+  --junk 5 --versions 1,1,1,2 || true
+# a reboot storm, for the large batches
+"$LOADGEN" --port $PORT --threads 2 --clients 10000 --rate 1000 --duration 3 \
+  --storm_at 1 --storm_clients 100000 --storm_window 0.5 --junk 1 || true
+# a few slow clients, so single request batches are represented
+"$LOADGEN" --port $PORT --threads 1 --clients 10 --sockets 1 --rate 200 --duration 2 --batch 1 || true
+
+# the profile is written when tssd exits
+kill -TERM $SERVER_PID
+wait $SERVER_PID || true
+
+# clang writes raw profiles which have to be merged
+if ls "$PROFILE_DIR"/*.profraw >/dev/null 2>&1; then
+  if [ -z "$LLVM_PROFDATA" ]; then
+    echo "llvm-profdata is needed to merge the clang profiles" >&2
+    exit 1
+  fi
+  "$LLVM_PROFDATA" merge -output="$PROFILE_DIR/tssd.profdata" "$PROFILE_DIR"/*.profraw
+fi
+
+echo "profile written to $PROFILE_DIR, reconfigure the same build directory with -DTSSD_PGO=use"
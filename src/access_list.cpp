@@ -0,0 +1,114 @@
+#include "access_list.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+bool AccessList::allow(const std::string &prefixes, std::string &error)
+{
+  return parse(prefixes, allowed_, error);
+}
+
+bool AccessList::deny(const std::string &prefixes, std::string &error)
+{
+  return parse(prefixes, denied_, error);
+}
+
+bool AccessList::parse(const std::string &prefixes, std::vector<Prefix> &out, std::string &error)
+{
+  size_t start = 0;
+  while (start < prefixes.size())
+  {
+    size_t end = prefixes.find(',', start);
+    if (end == std::string::npos)
+    {
+      end = prefixes.size();
+    }
+    std::string entry = prefixes.substr(start, end - start);
+    start = end + 1;
+    size_t first = entry.find_first_not_of(" \t");
+    if (first == std::string::npos)
+    {
+      continue;
+    }
+    entry = entry.substr(first, entry.find_last_not_of(" \t") - first + 1);
+
+    std::string address = entry;
+    int length = -1;
+    size_t slash = entry.find('/');
+    if (slash != std::string::npos)
+    {
+      address = entry.substr(0, slash);
+      char *lengthEnd;
+      length = (int)strtol(entry.c_str() + slash + 1, &lengthEnd, 10);
+      if (slash + 1 == entry.size() || *lengthEnd != '\0' || length < 0)
+      {
+        length = 1000;
+      }
+    }
+    Prefix prefix;
+    memset(prefix.address, 0, sizeof(prefix.address));
+    if (inet_pton(AF_INET, address.c_str(), prefix.address) == 1)
+    {
+      prefix.family = AF_INET;
+      prefix.length = length < 0 ? 32 : length;
+    }
+    else if (inet_pton(AF_INET6, address.c_str(), prefix.address) == 1)
+    {
+      prefix.family = AF_INET6;
+      prefix.length = length < 0 ? 128 : length;
+    }
+    else
+    {
+      error = "'" + entry + "' is not an address";
+      return false;
+    }
+    if (prefix.length > (prefix.family == AF_INET ? 32 : 128))
+    {
+      error = "'" + entry + "' has an invalid prefix length";
+      return false;
+    }
+    out.push_back(prefix);
+  }
+  return true;
+}
+
+int AccessList::sourceAddress(const SocketAddress &source, uint8_t *address)
+{
+  if (source.sa.sa_family != AF_INET6)
+  {
+    memcpy(address, &source.v4.sin_addr, 4);
+    return AF_INET;
+  }
+  if (IN6_IS_ADDR_V4MAPPED(&source.v6.sin6_addr))
+  {
+    memcpy(address, &source.v6.sin6_addr.s6_addr[12], 4);
+    return AF_INET;
+  }
+  memcpy(address, &source.v6.sin6_addr, 16);
+  return AF_INET6;
+}
+
+bool AccessList::matches(const std::vector<Prefix> &prefixes, int family, const uint8_t *address)
+{
+  for (size_t i = 0; i < prefixes.size(); i++)
+  {
+    const Prefix &prefix = prefixes[i];
+    if (prefix.family != family)
+    {
+      continue;
+    }
+    int fullBytes = prefix.length / 8;
+    int restBits = prefix.length % 8;
+    if (memcmp(prefix.address, address, fullBytes) != 0)
+    {
+      continue;
+    }
+    uint8_t mask = (uint8_t)(0xff << (8 - restBits));
+    if (restBits == 0 || ((prefix.address[fullBytes] ^ address[fullBytes]) & mask) == 0)
+    {
+      return true;
+    }
+  }
+  return false;
+}
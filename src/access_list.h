@@ -0,0 +1,56 @@
+#ifndef TSSD_ACCESS_LIST_H
+#define TSSD_ACCESS_LIST_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "transport.h"
+
+/*
+ * Which sources are served: address prefixes which are allowed (all
+ * sources if there are none) and prefixes which are denied, over both.
+ * Prefixes are given as a comma separated list, e.g.
+ *
+ *   10.0.0.0/8,192.168.1.7,2001:db8::/32
+ *
+ * A mapped IPv4 source of a dual stack socket matches the IPv4 prefixes.
+ */
+class AccessList
+{
+public:
+  // returns false (and sets 'error') if an entry is not an address or a prefix
+  bool allow(const std::string &prefixes, std::string &error);
+  bool deny(const std::string &prefixes, std::string &error);
+
+  // true if every source is served
+  bool empty() const
+  {
+    return allowed_.empty() && denied_.empty();
+  }
+
+  bool allows(const SocketAddress &source) const
+  {
+    uint8_t address[16];
+    int family = sourceAddress(source, address);
+    return (allowed_.empty() || matches(allowed_, family, address)) && !matches(denied_, family, address);
+  }
+
+private:
+  struct Prefix
+  {
+    int family;
+    int length; // bits
+    uint8_t address[16]; // an IPv4 address in the first 4
+  };
+
+  static bool parse(const std::string &prefixes, std::vector<Prefix> &out, std::string &error);
+  // the family of the source (AF_INET for a mapped IPv4 address) and its address bytes
+  static int sourceAddress(const SocketAddress &source, uint8_t *address);
+  static bool matches(const std::vector<Prefix> &prefixes, int family, const uint8_t *address);
+
+  std::vector<Prefix> allowed_;
+  std::vector<Prefix> denied_;
+};
+
+#endif // TSSD_ACCESS_LIST_H
@@ -0,0 +1,197 @@
+#include "async_logger.h"
+
+#include <stdio.h>
+#include <syslog.h>
+#include <arpa/inet.h>
+
+#include <chrono>
+
+static const unsigned int RingCapacityLog2 = 12; // 4096 records per worker
+static const int DrainIntervalMs = 20;
+static const int SummaryIntervalMs = 1000;
+
+static const char *categoryName(int category)
+{
+  switch (category)
+  {
+    case LogTooShort: return "too short";
+    case LogNotTsp: return "not TSP";
+    case LogBatchTooLarge: return "batch too large";
+    case LogBatchRateLimited: return "batch rate limited";
+    case LogNotNtpClient: return "not NTP client";
+    case LogAuthFailed: return "authentication failed";
+    case LogNotAuthenticated: return "not authenticated";
+    case LogAccessDenied: return "access denied";
+    default: return "unknown";
+  }
+}
+
+LogRing::LogRing(unsigned int capacityLog2, unsigned int ratePerSec, unsigned int sampleEvery)
+  : head_(0), tailCache_(0), tail_(0),
+    mask_((1ULL << capacityLog2) - 1), ratePerSec_(ratePerSec), sampleEvery_(sampleEvery),
+    records_(1ULL << capacityLog2)
+{
+  for (int i = 0; i < LogCategoryCount; i++)
+  {
+    suppressed_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+bool LogRing::pop(LogRecord &out)
+{
+  uint64_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail == head_.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  out = records_[tail & mask_];
+  tail_.store(tail + 1, std::memory_order_release);
+  return true;
+}
+
+AsyncLogger::AsyncLogger(unsigned int ratePerSec, unsigned int sampleEvery)
+  : ratePerSec_(ratePerSec), sampleEvery_(sampleEvery), stopRequested_(false)
+{
+  for (int i = 0; i < LogCategoryCount; i++)
+  {
+    reportedSuppressed_[i] = 0;
+  }
+}
+
+AsyncLogger::~AsyncLogger()
+{
+  stop();
+}
+
+LogRing *AsyncLogger::createRing()
+{
+  std::lock_guard<std::mutex> lock(ringsMutex_);
+  rings_.push_back(std::unique_ptr<LogRing>(new LogRing(RingCapacityLog2, ratePerSec_, sampleEvery_)));
+  return rings_.back().get();
+}
+
+void AsyncLogger::start()
+{
+  thread_ = std::thread(&AsyncLogger::run, this);
+}
+
+void AsyncLogger::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(stopMutex_);
+    stopRequested_ = true;
+  }
+  stopCond_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+}
+
+void AsyncLogger::run()
+{
+  std::chrono::steady_clock::time_point nextSummary = std::chrono::steady_clock::now() + std::chrono::milliseconds(SummaryIntervalMs);
+  std::unique_lock<std::mutex> lock(stopMutex_);
+  while (!stopRequested_)
+  {
+    stopCond_.wait_for(lock, std::chrono::milliseconds(DrainIntervalMs));
+    lock.unlock();
+    drain();
+    if (std::chrono::steady_clock::now() >= nextSummary)
+    {
+      writeSummary();
+      nextSummary += std::chrono::milliseconds(SummaryIntervalMs);
+    }
+    lock.lock();
+  }
+  lock.unlock();
+  drain();
+  writeSummary();
+}
+
+static void writeRecord(const LogRecord &record)
+{
+  // a.b.c.d:port or [v6 address]:port
+  char host[INET6_ADDRSTRLEN];
+  char addr[INET6_ADDRSTRLEN + 8];
+  if (record.source.sa.sa_family == AF_INET6)
+  {
+    inet_ntop(AF_INET6, &record.source.v6.sin6_addr, host, sizeof(host));
+    snprintf(addr, sizeof(addr), "[%s]:%u", host, ntohs(record.source.v6.sin6_port));
+  }
+  else
+  {
+    inet_ntop(AF_INET, &record.source.v4.sin_addr, host, sizeof(host));
+    snprintf(addr, sizeof(addr), "%s:%u", host, ntohs(record.source.v4.sin_port));
+  }
+  const char *sampled = record.sampled ? " (sampled)" : "";
+  switch (record.category)
+  {
+    case LogTooShort:
+      syslog(LOG_INFO, "dropped packet from %s: too short (%u bytes)%s",
+        addr, record.length, sampled);
+      break;
+    case LogNotTsp:
+      syslog(LOG_INFO, "dropped packet from %s: not a TSP packet (header 0x%06llx, %u bytes)%s",
+        addr, (unsigned long long)record.arg, record.length, sampled);
+      break;
+    case LogBatchTooLarge:
+      syslog(LOG_INFO, "dropped packet from %s: batch request with %llu cookies is too large%s",
+        addr, (unsigned long long)record.arg, sampled);
+      break;
+    case LogBatchRateLimited:
+      syslog(LOG_INFO, "dropped packet from %s: batch request with %llu cookies is over the batch rate limit%s",
+        addr, (unsigned long long)record.arg, sampled);
+      break;
+    case LogNotNtpClient:
+      syslog(LOG_INFO, "dropped packet from %s: not an NTP client request (first byte 0x%02llx, %u bytes)%s",
+        addr, (unsigned long long)record.arg, record.length, sampled);
+      break;
+    case LogAuthFailed:
+      syslog(LOG_INFO, "dropped packet from %s: authenticated request with an unknown key or a wrong MAC (key id %llu)%s",
+        addr, (unsigned long long)record.arg, sampled);
+      break;
+    case LogNotAuthenticated:
+      syslog(LOG_INFO, "dropped packet from %s: request is not authenticated (%u bytes)%s",
+        addr, record.length, sampled);
+      break;
+    case LogAccessDenied:
+      syslog(LOG_INFO, "dropped packet from %s: the source is not allowed (%u bytes)%s",
+        addr, record.length, sampled);
+      break;
+    default:
+      break;
+  }
+}
+
+void AsyncLogger::drain()
+{
+  std::lock_guard<std::mutex> lock(ringsMutex_);
+  LogRecord record;
+  for (size_t i = 0; i < rings_.size(); i++)
+  {
+    while (rings_[i]->pop(record))
+    {
+      writeRecord(record);
+    }
+  }
+}
+
+void AsyncLogger::writeSummary()
+{
+  std::lock_guard<std::mutex> lock(ringsMutex_);
+  for (int category = 0; category < LogCategoryCount; category++)
+  {
+    uint64_t suppressed = 0;
+    for (size_t i = 0; i < rings_.size(); i++)
+    {
+      suppressed += rings_[i]->suppressed((LogCategory)category);
+    }
+    if (suppressed != reportedSuppressed_[category])
+    {
+      syslog(LOG_INFO, "suppressed %llu '%s' log records",
+        (unsigned long long)(suppressed - reportedSuppressed_[category]), categoryName(category));
+      reportedSuppressed_[category] = suppressed;
+    }
+  }
+}
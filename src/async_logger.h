@@ -0,0 +1,176 @@
+#ifndef TSSD_ASYNC_LOGGER_H
+#define TSSD_ASYNC_LOGGER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "transport.h"
+
+enum LogCategory
+{
+  LogTooShort = 0, // datagram shorter than a TimeRequest
+  LogNotTsp, // datagram header is not 'TSP'
+  LogBatchTooLarge, // batch request with more cookies than allowed
+  LogBatchRateLimited, // batch request over the batch rate limit
+  LogNotNtpClient, // datagram on the NTP endpoint which is not an NTP client request
+  LogAuthFailed, // authenticated request with an unknown key or a wrong MAC
+  LogNotAuthenticated, // request which is not authenticated, while authentication is required
+  LogAccessDenied, // datagram from a source the access list doesn't allow
+  LogCategoryCount
+};
+
+/*
+ * Fixed size binary log record, written by a worker and formatted later
+ * by the logger thread.
+ */
+struct LogRecord
+{
+  uint64_t timeNs; // CLOCK_REALTIME of the event
+  uint64_t arg; // category specific value
+  uint32_t length; // length of the datagram
+  uint16_t category;
+  uint16_t sampled; // 1 if this record was logged as a sample of suppressed records
+  SocketAddress source;
+};
+
+/*
+ * Single producer single consumer ring of log records. Each worker owns
+ * one, so pushing a record is a few plain stores and a release store of
+ * the head - no syscall, no lock, no shared cache line with other workers.
+ *
+ * The worker also rate limits each category: up to 'ratePerSec' records
+ * per second are pushed, then only one of every 'sampleEvery' (0 means
+ * none), and the rest are only counted so the logger can write a summary.
+ */
+class LogRing
+{
+public:
+  LogRing(unsigned int capacityLog2, unsigned int ratePerSec, unsigned int sampleEvery);
+
+  // called by the owning worker only
+  void log(LogCategory category, uint64_t timeNs, const SocketAddress &source, uint32_t length, uint64_t arg)
+  {
+    CategoryLimit &limit = limits_[category];
+    uint16_t sampled = 0;
+    if (timeNs - limit.windowStartNs >= 1000000000ULL)
+    {
+      limit.windowStartNs = timeNs;
+      limit.inWindow = 0;
+    }
+    if (limit.inWindow < ratePerSec_)
+    {
+      limit.inWindow++;
+    }
+    else if (sampleEvery_ != 0 && ++limit.sinceSample >= sampleEvery_)
+    {
+      limit.sinceSample = 0;
+      sampled = 1;
+    }
+    else
+    {
+      suppressed_[category].store(suppressed_[category].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      return;
+    }
+
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tailCache_ > mask_)
+    {
+      tailCache_ = tail_.load(std::memory_order_acquire);
+      if (head - tailCache_ > mask_) // ring is full - the record is lost
+      {
+        suppressed_[category].store(suppressed_[category].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return;
+      }
+    }
+    LogRecord &record = records_[head & mask_];
+    record.timeNs = timeNs;
+    record.arg = arg;
+    record.length = length;
+    record.category = (uint16_t)category;
+    record.sampled = sampled;
+    record.source = source;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  // called by the owning worker only, e.g. on a reload
+  void setLimits(unsigned int ratePerSec, unsigned int sampleEvery)
+  {
+    ratePerSec_ = ratePerSec;
+    sampleEvery_ = sampleEvery;
+  }
+
+  // called by the logger thread only, returns false if the ring is empty
+  bool pop(LogRecord &out);
+
+  uint64_t suppressed(LogCategory category) const
+  {
+    return suppressed_[category].load(std::memory_order_relaxed);
+  }
+
+private:
+  struct CategoryLimit
+  {
+    CategoryLimit() : windowStartNs(0), inWindow(0), sinceSample(0) {}
+    uint64_t windowStartNs;
+    unsigned int inWindow;
+    unsigned int sinceSample;
+  };
+
+  // producer side
+  std::atomic<uint64_t> head_;
+  uint64_t tailCache_;
+  CategoryLimit limits_[LogCategoryCount];
+  std::atomic<uint64_t> suppressed_[LogCategoryCount];
+  char producerPad_[64];
+  // consumer side
+  std::atomic<uint64_t> tail_;
+  char consumerPad_[64];
+
+  const uint64_t mask_;
+  unsigned int ratePerSec_;
+  unsigned int sampleEvery_;
+  std::vector<LogRecord> records_;
+};
+
+/*
+ * Owns the rings of all the workers, and a background thread which drains
+ * them, formats the records and writes them to syslog. Once a second it
+ * also writes a summary line per category with records that were suppressed
+ * by the rate limit, so a flood of bad packets costs a handful of syscalls.
+ */
+class AsyncLogger
+{
+public:
+  AsyncLogger(unsigned int ratePerSec, unsigned int sampleEvery);
+  ~AsyncLogger();
+
+  // ring for a new worker, owned by the logger
+  LogRing *createRing();
+
+  void start();
+  void stop();
+
+private:
+  void run();
+  void drain();
+  void writeSummary();
+
+  const unsigned int ratePerSec_;
+  const unsigned int sampleEvery_;
+  std::mutex ringsMutex_;
+  std::vector<std::unique_ptr<LogRing> > rings_;
+  uint64_t reportedSuppressed_[LogCategoryCount];
+  std::mutex stopMutex_;
+  std::condition_variable stopCond_;
+  bool stopRequested_;
+  std::thread thread_;
+};
+
+#endif // TSSD_ASYNC_LOGGER_H
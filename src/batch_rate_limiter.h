@@ -0,0 +1,151 @@
+#ifndef TSSD_BATCH_RATE_LIMITER_H
+#define TSSD_BATCH_RATE_LIMITER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "transport.h"
+
+/*
+ * Token buckets which cap the cookies served in batch requests, per source
+ * address and in total, so batch replies can't be used to amplify traffic
+ * towards a spoofed source. Sources are kept in a fixed size table, so the
+ * memory is bounded no matter how many sources send. A new source evicts
+ * the one it collides with but takes its bucket over as it is - sending
+ * from colliding addresses doesn't give a fresh burst. An IPv6 source is
+ * its /64 - a host can pick any address in its prefix.
+ *
+ * Owned by a single worker, times are the requests' rx timestamps.
+ */
+class BatchRateLimiter
+{
+public:
+  static const int TableSize = 4096; // power of 2
+
+  BatchRateLimiter() : perSourceRate_(0), totalRate_(0), perSourceBurst_(0), totalBurst_(0), table_(TableSize)
+  {
+    total_.address = 0;
+    total_.tokens = 0;
+    total_.lastNs = 0;
+  }
+
+  // cookies per second, the bursts are one second worth of cookies (at least 'minBurst')
+  void configure(double perSourceRate, double totalRate, double minBurst)
+  {
+    setRates(perSourceRate, totalRate, minBurst);
+    total_.tokens = totalBurst_;
+    // the first refill of an empty bucket (lastNs 0) fills it
+    for (size_t i = 0; i < table_.size(); i++)
+    {
+      table_[i].address = 0;
+      table_[i].tokens = 0;
+      table_[i].lastNs = 0;
+    }
+  }
+
+  // like configure(), but the buckets are kept (a reload). tokens over a lower burst are cut at the next refill
+  void setRates(double perSourceRate, double totalRate, double minBurst)
+  {
+    perSourceRate_ = perSourceRate;
+    totalRate_ = totalRate;
+    perSourceBurst_ = perSourceRate > minBurst ? perSourceRate : minBurst;
+    totalBurst_ = totalRate > minBurst ? totalRate : minBurst;
+  }
+
+  // the bucket key of a source: its IPv4 address (also when mapped into IPv6), or its IPv6 /64
+  static uint64_t sourceKey(const SocketAddress &source)
+  {
+    if (source.sa.sa_family != AF_INET6)
+    {
+      return source.v4.sin_addr.s_addr;
+    }
+    const struct in6_addr &address = source.v6.sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&address))
+    {
+      uint32_t v4;
+      memcpy(&v4, &address.s6_addr[12], 4);
+      return v4;
+    }
+    uint64_t prefix;
+    memcpy(&prefix, &address.s6_addr[0], 8);
+    return prefix;
+  }
+
+  // 'address' is a sourceKey(). takes the tokens and returns true if allowed
+  bool allow(uint64_t address, uint64_t nowNs, int cookies)
+  {
+    refill(total_, totalRate_, totalBurst_, nowNs);
+    if (total_.tokens < cookies)
+    {
+      return false;
+    }
+    Bucket &bucket = table_[hash(address) & (TableSize - 1)];
+    bucket.address = address;
+    refill(bucket, perSourceRate_, perSourceBurst_, nowNs);
+    if (bucket.tokens < cookies)
+    {
+      return false;
+    }
+    bucket.tokens -= cookies;
+    total_.tokens -= cookies;
+    return true;
+  }
+
+  // the buckets, to hand them to another process (live upgrade). the rates are not part of it
+  std::string saveState() const
+  {
+    std::string state((const char *)&total_, sizeof(Bucket));
+    state.append((const char *)table_.data(), table_.size() * sizeof(Bucket));
+    return state;
+  }
+
+  // false (and nothing changes) if 'state' is not of saveState(). tokens over a lower burst are cut at the next refill
+  bool restoreState(const std::string &state)
+  {
+    if (state.size() != (TableSize + 1) * sizeof(Bucket))
+    {
+      return false;
+    }
+    memcpy(&total_, state.data(), sizeof(Bucket));
+    memcpy(table_.data(), state.data() + sizeof(Bucket), TableSize * sizeof(Bucket));
+    return true;
+  }
+
+  // the table slot of a source is hash(address) & (TableSize - 1)
+  static uint32_t hash(uint64_t address)
+  {
+    return (uint32_t)((address * 0x9e3779b97f4a7c15ULL) >> 32);
+  }
+
+private:
+  struct Bucket
+  {
+    uint64_t address;
+    double tokens;
+    uint64_t lastNs;
+  };
+
+  static void refill(Bucket &bucket, double rate, double burst, uint64_t nowNs)
+  {
+    if (nowNs > bucket.lastNs)
+    {
+      bucket.tokens += rate * (double)(nowNs - bucket.lastNs) / 1e9;
+      if (bucket.tokens > burst)
+      {
+        bucket.tokens = burst;
+      }
+    }
+    bucket.lastNs = nowNs;
+  }
+
+  double perSourceRate_;
+  double totalRate_;
+  double perSourceBurst_;
+  double totalBurst_;
+  Bucket total_;
+  std::vector<Bucket> table_;
+};
+
+#endif // TSSD_BATCH_RATE_LIMITER_H
@@ -0,0 +1,223 @@
+#include "beacon_sender.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include <chrono>
+
+#include "tsp_protocol.h"
+
+// how long to wait for the kernel to report the TX timestamp of a beacon
+static const int TxTimestampTimeoutMs = 10;
+
+static inline uint64_t realtimeNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+BeaconSender::BeaconSender()
+  : clock_(NULL), fd_(-1), intervalSec_(1.0), sequence_(0), previousTxTimeNs_(0), stopRequested_(false)
+{
+  memset(&destination_, 0, sizeof(destination_));
+}
+
+BeaconSender::~BeaconSender()
+{
+  stop();
+}
+
+void BeaconSender::setClock(const DisciplinedClock *clock)
+{
+  clock_ = clock;
+}
+
+bool BeaconSender::start(const std::string &group, unsigned short port, double intervalSec, int ttl,
+  const std::string &interfaceAddress)
+{
+  if (!openSocket(group, port, ttl, interfaceAddress))
+  {
+    return false;
+  }
+  intervalSec_ = intervalSec;
+  thread_ = std::thread(&BeaconSender::run, this);
+  syslog(LOG_INFO, "sending beacons to %s:%u every %.3f s", group.c_str(), port, intervalSec);
+  return true;
+}
+
+bool BeaconSender::openSocket(const std::string &group, unsigned short port, int ttl, const std::string &interfaceAddress)
+{
+  destination_.sin_family = AF_INET;
+  destination_.sin_port = htons(port);
+  if (inet_pton(AF_INET, group.c_str(), &destination_.sin_addr) != 1)
+  {
+    syslog(LOG_ERR, "beacon: '%s' is not an IPv4 address", group.c_str());
+    return false;
+  }
+
+  fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0)
+  {
+    syslog(LOG_ERR, "beacon: ERROR opening socket: '%m'");
+    return false;
+  }
+
+  int optval;
+  if (IN_MULTICAST(ntohl(destination_.sin_addr.s_addr)))
+  {
+    unsigned char multicastTtl = (unsigned char)ttl;
+    setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_TTL, &multicastTtl, sizeof(multicastTtl));
+    // listeners on this host (e.g. a relay's own clients) get the beacons too
+    unsigned char loop = 1;
+    setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (!interfaceAddress.empty())
+    {
+      struct in_addr interface;
+      if (inet_pton(AF_INET, interfaceAddress.c_str(), &interface) != 1 ||
+        setsockopt(fd_, IPPROTO_IP, IP_MULTICAST_IF, &interface, sizeof(interface)) < 0)
+      {
+        syslog(LOG_ERR, "beacon: can't send multicast from '%s': '%m'", interfaceAddress.c_str());
+        close(fd_);
+        fd_ = -1;
+        return false;
+      }
+    }
+  }
+  else
+  {
+    optval = 1;
+    setsockopt(fd_, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval));
+    optval = ttl;
+    setsockopt(fd_, IPPROTO_IP, IP_TTL, &optval, sizeof(optval));
+  }
+
+  // software TX timestamps, reported on the error queue without the packet itself
+  optval = SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_TSONLY;
+  if (setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPING, &optval, sizeof(optval)) < 0)
+  {
+    syslog(LOG_WARNING, "beacon: kernel TX timestamps are not available: '%m'");
+  }
+  return true;
+}
+
+void BeaconSender::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(stopMutex_);
+    stopRequested_ = true;
+  }
+  stopCond_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  if (fd_ >= 0)
+  {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+void BeaconSender::run()
+{
+  // absolute deadlines, so the interval doesn't drift by the time a beacon takes
+  std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+  std::chrono::nanoseconds interval((long long)(intervalSec_ * 1e9));
+  std::unique_lock<std::mutex> lock(stopMutex_);
+  while (!stopRequested_)
+  {
+    lock.unlock();
+    sendBeacon();
+    lock.lock();
+    next += interval;
+    stopCond_.wait_until(lock, next);
+  }
+}
+
+uint64_t BeaconSender::serverTimeNs() const
+{
+  return clock_ != NULL ? clock_->timeNsAt(DisciplinedClock::rawNs()) : realtimeNs();
+}
+
+void BeaconSender::sendBeacon()
+{
+  if (clock_ != NULL && !clock_->isSynchronized())
+  {
+    return; // a relay which has no time yet must not hand out its local time
+  }
+
+  TimeBeacon beacon;
+  memset(&beacon, 0, sizeof(beacon));
+  memcpy(beacon.protocol, "TSP", 3);
+  beacon.protocolVersion = 1;
+  beacon.messageType = TspBeacon;
+  beacon.sequence = sequence_;
+  beacon.previousTxTimeNs = previousTxTimeNs_;
+  beacon.timeNs = serverTimeNs();
+  beacon.timeSinceEphoc1970Ms = beacon.timeNs / 1000000;
+
+  if (sendto(fd_, &beacon, sizeof(beacon), 0, (const struct sockaddr *)&destination_, sizeof(destination_)) < 0)
+  {
+    syslog(LOG_WARNING, "beacon: ERROR in sendto: '%m'");
+    previousTxTimeNs_ = 0;
+    sequence_++;
+    return;
+  }
+  uint64_t fallbackNs = realtimeNs();
+  beaconsSent_.inc();
+  sequence_++;
+
+  uint64_t txRealtimeNs = readTxTimestamp();
+  if (txRealtimeNs != 0)
+  {
+    txTimestamps_.inc();
+  }
+  else
+  {
+    txRealtimeNs = fallbackNs; // sendto() returned, a bit after the packet left
+  }
+  // the kernel stamps with CLOCK_REALTIME, a relay serves its own clock
+  uint64_t nowRealtimeNs = realtimeNs();
+  uint64_t nowServerNs = serverTimeNs();
+  previousTxTimeNs_ = nowServerNs - (nowRealtimeNs - txRealtimeNs);
+}
+
+uint64_t BeaconSender::readTxTimestamp()
+{
+  uint64_t txNs = 0;
+  struct pollfd pfd;
+  pfd.fd = fd_;
+  pfd.events = 0; // POLLERR is always reported
+  while (txNs == 0 && poll(&pfd, 1, TxTimestampTimeoutMs) > 0)
+  {
+    char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + 64)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    // drain the error queue, the last timestamp is the one of this beacon
+    while (recvmsg(fd_, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0)
+    {
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+      {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+        {
+          struct scm_timestamping timestamps;
+          memcpy(&timestamps, CMSG_DATA(cmsg), sizeof(timestamps));
+          txNs = ((uint64_t)timestamps.ts[0].tv_sec) * 1000000000ULL + (uint64_t)timestamps.ts[0].tv_nsec;
+        }
+      }
+      msg.msg_controllen = sizeof(control);
+    }
+  }
+  return txNs;
+}
@@ -0,0 +1,68 @@
+#ifndef TSSD_BEACON_SENDER_H
+#define TSSD_BEACON_SENDER_H
+
+#include <stdint.h>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <netinet/in.h>
+
+#include "disciplined_clock.h"
+#include "worker_stats.h"
+
+/*
+ * Beacon mode: a background thread which sends a TimeBeacon every
+ * interval to a multicast or broadcast group, so the server load doesn't
+ * depend on the number of passive listeners. The kernel TX timestamp of
+ * every beacon (SO_TIMESTAMPING) is read back from the socket's error
+ * queue and sent in the next beacon.
+ */
+class BeaconSender
+{
+public:
+  BeaconSender();
+  ~BeaconSender();
+
+  // relay mode: beacons carry the relay's clock, and are only sent once it is synchronized
+  void setClock(const DisciplinedClock *clock);
+
+  // 'group' is a multicast group or a broadcast address. 'interfaceAddress' picks the interface
+  // multicast is sent from (empty for the routing default). returns false (and logs) on error
+  bool start(const std::string &group, unsigned short port, double intervalSec, int ttl,
+    const std::string &interfaceAddress);
+  void stop();
+
+  uint64_t beaconsSent() const
+  {
+    return beaconsSent_.load();
+  }
+
+  uint64_t txTimestamps() const
+  {
+    return txTimestamps_.load();
+  }
+
+private:
+  bool openSocket(const std::string &group, unsigned short port, int ttl, const std::string &interfaceAddress);
+  void run();
+  void sendBeacon();
+  // the kernel TX timestamp of the beacon just sent, as CLOCK_REALTIME ns, 0 if none arrived
+  uint64_t readTxTimestamp();
+  uint64_t serverTimeNs() const;
+
+  const DisciplinedClock *clock_;
+  int fd_;
+  struct sockaddr_in destination_;
+  double intervalSec_;
+  uint64_t sequence_;
+  uint64_t previousTxTimeNs_;
+  StatCounter beaconsSent_;
+  StatCounter txTimestamps_;
+  std::mutex stopMutex_;
+  std::condition_variable stopCond_;
+  bool stopRequested_;
+  std::thread thread_;
+};
+
+#endif // TSSD_BEACON_SENDER_H
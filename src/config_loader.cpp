@@ -0,0 +1,321 @@
+#include "config_loader.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "live_upgrade.h"
+
+static const int ReloadPollIntervalMs = 100;
+
+// the options a reload applies while serving, any other change needs a restart
+static const char *const ReloadableOptions[] = {
+  "batch_size", "batch_request_cookies", "batch_request_rate", "batch_request_rate_total", "key_file", "require_auth",
+  "allow", "deny", "log_level", "log_rate", "log_sample"
+};
+
+void addOptions(cxxopts::Options &options)
+{
+  options.add_options()
+    ("config", "path of a file of options, a 'name = value' line per option (the command line overrides it), reread on SIGHUP", cxxopts::value<std::string>()->default_value(""))
+    ("p, pidfile", "path referring to the systemd PID file of the service", cxxopts::value<std::string>()->default_value("/var/run/tssd.pid"))
+    ("dont_d", "don't run as deamon", cxxopts::value<bool>())
+    ("port", "UDP port to listen on", cxxopts::value<unsigned short>()->default_value("12321"))
+    ("ip", "address families to serve: ipv4, ipv6, dual (one IPv6 socket which also serves IPv4) or separate (an IPv4 and an IPv6 socket, each with its own worker)", cxxopts::value<std::string>()->default_value("ipv4"))
+    ("stats_interval", "interval in seconds between latency statistics reports to the log (0 to disable)", cxxopts::value<unsigned int>()->default_value("60"))
+    ("metrics_port", "TCP port to serve prometheus metrics on (0 to disable)", cxxopts::value<unsigned short>()->default_value("0"))
+    ("metrics_address", "local address to serve prometheus metrics on", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+    ("self_profile", "count cycles, instructions, cache misses and context switches of the worker, reported per packet with the statistics", cxxopts::value<bool>())
+    ("flight_recorder", "path of a file which records the most recent requests of worker 0 (path.N for worker N), dumped on SIGUSR1 (empty to disable)", cxxopts::value<std::string>()->default_value(""))
+    ("flight_recorder_size", "number of requests kept by the flight recorder", cxxopts::value<uint64_t>()->default_value("65536"))
+    ("log_rate", "max log records per second for each kind of dropped packet", cxxopts::value<unsigned int>()->default_value("10"))
+    ("log_sample", "once the log rate is exceeded, log one of every N dropped packets (0 to disable)", cxxopts::value<unsigned int>()->default_value("10000"))
+    ("log_level", "lowest priority logged: debug, info, notice, warning or err", cxxopts::value<std::string>()->default_value("info"))
+    ("allow", "comma separated addresses and prefixes (e.g. 10.0.0.0/8,2001:db8::/32) of the only sources served (empty for all)", cxxopts::value<std::string>()->default_value(""))
+    ("deny", "comma separated addresses and prefixes of sources which are not served", cxxopts::value<std::string>()->default_value(""))
+    ("capture", "path of a file to capture the datagrams arriving at worker 0 into (path.N for worker N), for tssd-replay (empty to disable)", cxxopts::value<std::string>()->default_value(""))
+    ("capture_size", "max size of each capture file in MB", cxxopts::value<uint64_t>()->default_value("1024"))
+    ("batch_size", "max datagrams received (and replied) per syscall", cxxopts::value<int>()->default_value("32"))
+    ("batch_request_cookies", "max cookies in a batch request (0 to answer batch requests as single requests)", cxxopts::value<int>()->default_value("32"))
+    ("batch_request_rate", "max cookies per second served in batch requests to one source address", cxxopts::value<double>()->default_value("1000"))
+    ("batch_request_rate_total", "max cookies per second served in batch requests to all sources", cxxopts::value<double>()->default_value("100000"))
+    ("relay", "relay mode: sync to this upstream tssd and serve from the synced clock (empty to serve the system clock)", cxxopts::value<std::string>()->default_value(""))
+    ("relay_port", "UDP port of the upstream tssd", cxxopts::value<unsigned short>()->default_value("12321"))
+    ("relay_burst", "requests per poll of the upstream", cxxopts::value<int>()->default_value("4"))
+    ("relay_min_poll", "shortest interval in seconds between polls of the upstream", cxxopts::value<double>()->default_value("1"))
+    ("relay_max_poll", "longest interval in seconds between polls of the upstream", cxxopts::value<double>()->default_value("16"))
+    ("relay_key_id", "authenticate to the upstream tssd with the key of this id in --key_file (0 for unauthenticated requests)", cxxopts::value<int>()->default_value("0"))
+    ("key_file", "file of the keys of authenticated requests, a key id and 32 hex digits per line (empty to disable authentication)", cxxopts::value<std::string>()->default_value(""))
+    ("require_auth", "drop TSP requests which are not authenticated (requires --key_file)", cxxopts::value<bool>())
+    ("ntp_port", "UDP port to answer NTPv4 client requests on, e.g. 123 (0 to disable)", cxxopts::value<unsigned short>()->default_value("0"))
+    ("ntp_stratum", "stratum the NTP replies report", cxxopts::value<int>()->default_value("2"))
+    ("ntp_refid", "reference ID the NTP replies report: an IPv4 address (of the upstream) or up to 4 characters", cxxopts::value<std::string>()->default_value("LOCL"))
+    ("stream_port", "TCP port to serve TSP over persistent TCP and WebSocket connections on (0 to disable)", cxxopts::value<unsigned short>()->default_value("0"))
+    ("stream_address", "local address to serve TCP and WebSocket connections on", cxxopts::value<std::string>()->default_value("0.0.0.0"))
+    ("stream_max_connections", "max open TCP and WebSocket connections", cxxopts::value<int>()->default_value("65536"))
+    ("beacon", "multicast group (or broadcast address) to send time beacons to (empty to disable)", cxxopts::value<std::string>()->default_value(""))
+    ("beacon_port", "UDP port to send the beacons to", cxxopts::value<unsigned short>()->default_value("12323"))
+    ("beacon_interval", "interval in seconds between beacons", cxxopts::value<double>()->default_value("1"))
+    ("beacon_ttl", "TTL of the beacons (multicast hops)", cxxopts::value<int>()->default_value("1"))
+    ("beacon_interface", "local address of the interface to send multicast beacons from (empty for the default route)", cxxopts::value<std::string>()->default_value(""))
+    ("upgrade_socket", "path of the control socket a new tssd takes the sockets and the state over on, for a live upgrade (empty to disable)", cxxopts::value<std::string>()->default_value(""))
+    ("realtime", "low jitter mode: lock the memory, run the workers SCHED_FIFO on CPUs of their own, and measure their wakeup latency at startup", cxxopts::value<bool>())
+    ("realtime_priority", "SCHED_FIFO priority of the workers in --realtime mode (1-99)", cxxopts::value<int>()->default_value("50"))
+    ("realtime_cpus", "CPUs the workers run on in --realtime mode, one worker per CPU in turn, e.g. 2-3 (empty for the isolated CPUs)", cxxopts::value<std::string>()->default_value(""))
+    ("upgrade", "take the sockets and the state over from the tssd running on --upgrade_socket, which exits once they are served", cxxopts::value<bool>())
+    ;
+  options.add_options()
+    ("h, help", "print help")
+    ;
+}
+
+bool readConfigFile(const std::string &path, std::vector<std::string> &arguments, std::string &error)
+{
+  FILE *file = fopen(path.c_str(), "re");
+  if (file == NULL)
+  {
+    error = "cannot open '" + path + "': " + strerror(errno);
+    return false;
+  }
+  char line[4096];
+  int lineNumber = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    lineNumber++;
+    std::string text(line);
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos || text[first] == '#')
+    {
+      continue;
+    }
+    text = text.substr(first, text.find_last_not_of(" \t\r\n") - first + 1);
+    size_t equals = text.find('=');
+    std::string name = text.substr(0, equals);
+    name = name.substr(0, name.find_last_not_of(" \t") + 1);
+    if (name.empty() || name.find_first_of(" \t") != std::string::npos)
+    {
+      fclose(file);
+      error = "'" + path + "' line " + std::to_string(lineNumber) + " is not 'name = value'";
+      return false;
+    }
+    if (equals == std::string::npos)
+    {
+      arguments.push_back("--" + name);
+      continue;
+    }
+    size_t valueStart = text.find_first_not_of(" \t", equals + 1);
+    arguments.push_back("--" + name + "=" + (valueStart == std::string::npos ? "" : text.substr(valueStart)));
+  }
+  fclose(file);
+  return true;
+}
+
+// the options of the config file, and then of the command line - which override the file.
+// throws on an invalid option
+static cxxopts::ParseResult *parseArguments(cxxopts::Options &options, const std::vector<std::string> &commandLine,
+  const std::vector<std::string> &configArguments)
+{
+  std::vector<std::string> arguments(1, commandLine[0]);
+  arguments.insert(arguments.end(), configArguments.begin(), configArguments.end());
+  arguments.insert(arguments.end(), commandLine.begin() + 1, commandLine.end());
+  std::vector<char *> argv;
+  for (size_t i = 0; i < arguments.size(); i++)
+  {
+    argv.push_back(&arguments[i][0]);
+  }
+  argv.push_back(NULL);
+  int argc = (int)arguments.size();
+  char **args = argv.data();
+  return new cxxopts::ParseResult(options.parse(argc, args));
+}
+
+std::unique_ptr<cxxopts::ParseResult> loadOptions(cxxopts::Options &options, const std::vector<std::string> &commandLine,
+  std::string &error)
+{
+  std::unique_ptr<cxxopts::ParseResult> parseResult;
+  try
+  {
+    parseResult.reset(parseArguments(options, commandLine, std::vector<std::string>()));
+    if (parseResult->count("help") > 0)
+    {
+      return parseResult;
+    }
+    std::string configPath = (*parseResult)["config"].as<std::string>();
+    if (!configPath.empty())
+    {
+      std::vector<std::string> configArguments;
+      if (!readConfigFile(configPath, configArguments, error))
+      {
+        return std::unique_ptr<cxxopts::ParseResult>();
+      }
+      parseResult.reset(parseArguments(options, commandLine, configArguments));
+    }
+  }
+  catch (const std::exception &e)
+  {
+    error = e.what();
+    return std::unique_ptr<cxxopts::ParseResult>();
+  }
+  return parseResult;
+}
+
+int logPriority(const std::string &level)
+{
+  static const char *const names[] = { "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug" };
+  for (int priority = LOG_EMERG; priority <= LOG_DEBUG; priority++)
+  {
+    if (level == names[priority])
+    {
+      return priority;
+    }
+  }
+  return -1;
+}
+
+ServingConfig *buildServingConfig(const cxxopts::ParseResult &parseResult)
+{
+  std::unique_ptr<ServingConfig> config(new ServingConfig());
+  config->batchSize = parseResult["batch_size"].as<int>();
+  config->maxBatchCookies = parseResult["batch_request_cookies"].as<int>();
+  config->batchRequestRate = parseResult["batch_request_rate"].as<double>();
+  config->batchRequestRateTotal = parseResult["batch_request_rate_total"].as<double>();
+  std::string keyFile = parseResult["key_file"].as<std::string>();
+  if (!keyFile.empty() && !config->keys.load(keyFile))
+  {
+    return NULL;
+  }
+  config->requireAuthentication = parseResult["require_auth"].as<bool>();
+  if (config->requireAuthentication && keyFile.empty())
+  {
+    syslog(LOG_ERR, "--require_auth requires --key_file");
+    return NULL;
+  }
+  std::string error;
+  if (!config->access.allow(parseResult["allow"].as<std::string>(), error) ||
+    !config->access.deny(parseResult["deny"].as<std::string>(), error))
+  {
+    syslog(LOG_ERR, "access list: %s", error.c_str());
+    return NULL;
+  }
+  config->logRate = parseResult["log_rate"].as<unsigned int>();
+  config->logSample = parseResult["log_sample"].as<unsigned int>();
+  return config.release();
+}
+
+std::map<std::string, std::string> restartOptions(const cxxopts::ParseResult &parseResult)
+{
+  std::map<std::string, std::string> options;
+  const std::vector<cxxopts::KeyValue> &arguments = parseResult.arguments();
+  for (size_t i = 0; i < arguments.size(); i++)
+  {
+    bool reloadable = false;
+    for (size_t j = 0; j < sizeof(ReloadableOptions) / sizeof(ReloadableOptions[0]); j++)
+    {
+      reloadable = reloadable || arguments[i].key() == ReloadableOptions[j];
+    }
+    if (!reloadable)
+    {
+      options[arguments[i].key()] = arguments[i].value();
+    }
+  }
+  return options;
+}
+
+std::string changedOptions(const std::map<std::string, std::string> &before, const std::map<std::string, std::string> &after)
+{
+  std::string changed;
+  std::map<std::string, std::string> names(before);
+  names.insert(after.begin(), after.end());
+  for (std::map<std::string, std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+  {
+    std::map<std::string, std::string>::const_iterator beforeValue = before.find(it->first);
+    std::map<std::string, std::string>::const_iterator afterValue = after.find(it->first);
+    if (beforeValue == before.end() || afterValue == after.end() || beforeValue->second != afterValue->second)
+    {
+      changed += (changed.empty() ? "--" : ", --") + it->first;
+    }
+  }
+  return changed;
+}
+
+ConfigReloader::ConfigReloader(cxxopts::Options &options, const std::vector<std::string> &commandLine,
+  const cxxopts::ParseResult &running, ConfigDomain &domain, bool canUpgrade)
+  : options_(options), commandLine_(commandLine), restartOptions_(restartOptions(running)), domain_(domain),
+    canUpgrade_(canUpgrade), requested_(NULL), stopRequested_(false)
+{
+}
+
+ConfigReloader::~ConfigReloader()
+{
+  stop();
+}
+
+ConfigReloader::Result ConfigReloader::reload()
+{
+  std::string error;
+  std::unique_ptr<cxxopts::ParseResult> parseResult = loadOptions(options_, commandLine_, error);
+  if (!parseResult)
+  {
+    syslog(LOG_ERR, "reload: %s, keeping the configuration", error.c_str());
+    return Kept;
+  }
+
+  int priority = logPriority((*parseResult)["log_level"].as<std::string>());
+  ServingConfig *config = priority < 0 ? NULL : buildServingConfig(*parseResult);
+  if (config == NULL)
+  {
+    syslog(LOG_ERR, "reload: invalid configuration (log level '%s'), keeping the configuration",
+      (*parseResult)["log_level"].as<std::string>().c_str());
+    return Kept;
+  }
+  setlogmask(LOG_UPTO(priority));
+  domain_.publish(config);
+  syslog(LOG_INFO, "reload: applied, serving with the new settings");
+
+  std::string changed = changedOptions(restartOptions_, restartOptions(*parseResult));
+  if (changed.empty())
+  {
+    return Applied;
+  }
+  if (!canUpgrade_)
+  {
+    syslog(LOG_WARNING, "reload: %s changed, which applies on a restart (or with --upgrade_socket, outside systemd)",
+      changed.c_str());
+    return RestartNeeded;
+  }
+  syslog(LOG_INFO, "reload: %s changed, upgrading to a new process", changed.c_str());
+  return spawnUpgrade(commandLine_) ? Upgrading : RestartNeeded;
+}
+
+void ConfigReloader::start(volatile sig_atomic_t *requested)
+{
+  requested_ = requested;
+  stopRequested_.store(false);
+  thread_ = std::thread(&ConfigReloader::run, this);
+}
+
+void ConfigReloader::stop()
+{
+  stopRequested_.store(true);
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+}
+
+void ConfigReloader::run()
+{
+  while (!stopRequested_.load())
+  {
+    if (*requested_)
+    {
+      *requested_ = 0;
+      syslog(LOG_INFO, "reload: got SIGHUP, rereading the configuration");
+      reload();
+      continue;
+    }
+    usleep(ReloadPollIntervalMs * 1000);
+  }
+}
@@ -0,0 +1,90 @@
+#ifndef TSSD_CONFIG_LOADER_H
+#define TSSD_CONFIG_LOADER_H
+
+#include <signal.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cxxopts/cxxopts.hpp>
+
+#include "serving_config.h"
+
+/*
+ * The options of tssd: the command line, over the options of a config
+ * file (--config) with a 'name = value' line per option. A reload (SIGHUP)
+ * reads them again, publishes the settings the workers serve with, and
+ * starts a live upgrade for options which can't change while serving.
+ */
+
+// the options of tssd (and --help)
+void addOptions(cxxopts::Options &options);
+
+// the options of a config file as command line arguments ("--name=value"), false (and sets 'error')
+// if it can't be read. a line is 'name = value', or 'name' for a flag. lines starting with '#' are comments
+bool readConfigFile(const std::string &path, std::vector<std::string> &arguments, std::string &error);
+
+// the options of the config file of --config (if any), and then of 'commandLine' (argv, with the
+// program name first), which override the file. a --help skips the file. NULL (and sets 'error')
+// if an option is invalid or the file can't be read
+std::unique_ptr<cxxopts::ParseResult> loadOptions(cxxopts::Options &options, const std::vector<std::string> &commandLine,
+  std::string &error);
+
+// the syslog priority of a --log_level, -1 if unknown
+int logPriority(const std::string &level);
+
+// the settings the workers read, NULL (and logs the reason) if they are not valid
+ServingConfig *buildServingConfig(const cxxopts::ParseResult &parseResult);
+
+// the options given (on the command line or in the config file) which a reload doesn't apply, by name
+std::map<std::string, std::string> restartOptions(const cxxopts::ParseResult &parseResult);
+
+// the options which are new, gone or have another value in 'after', e.g. "--port, --relay" (empty if none)
+std::string changedOptions(const std::map<std::string, std::string> &before, const std::map<std::string, std::string> &after);
+
+/*
+ * Reloads the configuration: rereads the options, publishes the settings
+ * of the workers, and for options which can't change while serving
+ * (endpoints, ports, relay...) starts a live upgrade to a new process of
+ * this binary, if it can. An invalid configuration keeps the running one.
+ */
+class ConfigReloader
+{
+public:
+  enum Result
+  {
+    Kept, // invalid, the running configuration is kept
+    Applied,
+    RestartNeeded, // applied, but options which need a restart changed
+    Upgrading // applied, and a new process takes over with the changed options
+  };
+
+  // 'running' is the configuration being served. with 'canUpgrade' (an upgrade socket, and not
+  // under systemd) a change of an option a reload doesn't apply starts a live upgrade
+  ConfigReloader(cxxopts::Options &options, const std::vector<std::string> &commandLine,
+    const cxxopts::ParseResult &running, ConfigDomain &domain, bool canUpgrade);
+  ~ConfigReloader();
+
+  Result reload();
+
+  // a thread which reloads whenever '*requested' is set (by a signal handler), and clears it
+  void start(volatile sig_atomic_t *requested);
+  void stop();
+
+private:
+  void run();
+
+  cxxopts::Options &options_;
+  std::vector<std::string> commandLine_;
+  std::map<std::string, std::string> restartOptions_; // of the running configuration
+  ConfigDomain &domain_;
+  bool canUpgrade_;
+  volatile sig_atomic_t *requested_;
+  std::atomic<bool> stopRequested_;
+  std::thread thread_;
+};
+
+#endif // TSSD_CONFIG_LOADER_H
@@ -0,0 +1,115 @@
+#include "disciplined_clock.h"
+
+#include <math.h>
+
+// the frequency is only estimated from samples at least this far apart,
+// and is never trusted beyond what a crystal can be off by
+static const double MinFrequencySpanNs = 4e9;
+static const double MaxFrequency = 500e-6;
+
+DisciplinedClock::DisciplinedClock()
+  : count_(0), next_(0), sequence_(0), offsetNs_(0.0), frequency_(0.0), referenceNs_(0),
+    uncertaintyNs_(0.0), synchronized_(false)
+{
+}
+
+void DisciplinedClock::reset()
+{
+  count_ = 0;
+  next_ = 0;
+}
+
+bool DisciplinedClock::saveModel(Model &out) const
+{
+  uint32_t sequence;
+  do
+  {
+    sequence = sequence_.load(std::memory_order_acquire);
+    out.offsetNs = offsetNs_.load(std::memory_order_relaxed);
+    out.frequency = frequency_.load(std::memory_order_relaxed);
+    out.referenceNs = referenceNs_.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((sequence & 1) != 0 || sequence != sequence_.load(std::memory_order_relaxed));
+  out.uncertaintyNs = uncertaintyNs_.load(std::memory_order_relaxed);
+  return isSynchronized();
+}
+
+void DisciplinedClock::restoreModel(const Model &model)
+{
+  // the model at its reference time is the first point, the frequency is fitted again from the next update
+  count_ = 1;
+  next_ = 1 % MaxPoints;
+  points_[0].sampleNs = model.referenceNs;
+  points_[0].offsetNs = model.offsetNs;
+  points_[0].uncertaintyNs = model.uncertaintyNs;
+  publish(model.offsetNs, model.frequency, model.referenceNs);
+  uncertaintyNs_.store(model.uncertaintyNs, std::memory_order_relaxed);
+  synchronized_.store(true, std::memory_order_relaxed);
+}
+
+void DisciplinedClock::update(uint64_t sampleNs, double offsetNs, double uncertaintyNs)
+{
+  // the clock filter reports the same best sample for several polls
+  int last = (next_ + MaxPoints - 1) % MaxPoints;
+  if (count_ > 0 && points_[last].sampleNs == sampleNs)
+  {
+    uncertaintyNs_.store(uncertaintyNs, std::memory_order_relaxed);
+    return;
+  }
+  points_[next_].sampleNs = sampleNs;
+  points_[next_].offsetNs = offsetNs;
+  points_[next_].uncertaintyNs = uncertaintyNs;
+  next_ = (next_ + 1) % MaxPoints;
+  if (count_ < MaxPoints)
+  {
+    count_++;
+  }
+
+  // least squares line through the points, weighted by 1 / uncertainty^2,
+  // around the newest sample so the numbers stay small
+  double sumW = 0.0, sumX = 0.0, sumY = 0.0, sumXX = 0.0, sumXY = 0.0;
+  double minX = 0.0;
+  for (int i = 0; i < count_; i++)
+  {
+    double x = (double)points_[i].sampleNs - (double)sampleNs;
+    double y = points_[i].offsetNs - offsetNs;
+    double u = points_[i].uncertaintyNs > 1.0 ? points_[i].uncertaintyNs : 1.0;
+    double w = 1.0 / (u * u);
+    sumW += w;
+    sumX += w * x;
+    sumY += w * y;
+    sumXX += w * x * x;
+    sumXY += w * x * y;
+    if (x < minX)
+    {
+      minX = x;
+    }
+  }
+  double frequency = 0.0;
+  double intercept = sumY / sumW;
+  double denominator = sumW * sumXX - sumX * sumX;
+  if (count_ >= 2 && -minX >= MinFrequencySpanNs && denominator > 0.0)
+  {
+    frequency = (sumW * sumXY - sumX * sumY) / denominator;
+    if (fabs(frequency) > MaxFrequency)
+    {
+      frequency = frequency > 0 ? MaxFrequency : -MaxFrequency;
+    }
+    intercept = (sumY - frequency * sumX) / sumW;
+  }
+
+  publish(offsetNs + intercept, frequency, sampleNs);
+  uncertaintyNs_.store(uncertaintyNs, std::memory_order_relaxed);
+  synchronized_.store(true, std::memory_order_relaxed);
+}
+
+void DisciplinedClock::publish(double offsetNs, double frequency, uint64_t referenceNs)
+{
+  uint32_t sequence = sequence_.load(std::memory_order_relaxed);
+  sequence_.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  offsetNs_.store(offsetNs, std::memory_order_relaxed);
+  frequency_.store(frequency, std::memory_order_relaxed);
+  referenceNs_.store(referenceNs, std::memory_order_relaxed);
+  sequence_.store(sequence + 2, std::memory_order_release);
+}
@@ -0,0 +1,114 @@
+#ifndef TSSD_DISCIPLINED_CLOCK_H
+#define TSSD_DISCIPLINED_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+
+/*
+ * The clock of a relay: CLOCK_MONOTONIC_RAW (the local oscillator, never
+ * stepped or slewed by anyone else) plus an offset and a frequency
+ * correction towards the upstream server:
+ *   time = raw + offsetNs + (raw - referenceNs) * frequency
+ *
+ * A single thread (the relay sync) updates the model, workers read it
+ * without locks through a sequence lock, so a reader never sees a torn
+ * model and never blocks the writer.
+ */
+class DisciplinedClock
+{
+public:
+  static const int MaxPoints = 16;
+
+  DisciplinedClock();
+
+  static uint64_t rawNs()
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+  }
+
+  bool isSynchronized() const
+  {
+    return synchronized_.load(std::memory_order_relaxed);
+  }
+
+  // upstream time in ns since the epoch, for a raw time. only valid once synchronized
+  uint64_t timeNsAt(uint64_t raw) const
+  {
+    uint32_t sequence;
+    double offsetNs, frequency;
+    uint64_t referenceNs;
+    do
+    {
+      sequence = sequence_.load(std::memory_order_acquire);
+      offsetNs = offsetNs_.load(std::memory_order_relaxed);
+      frequency = frequency_.load(std::memory_order_relaxed);
+      referenceNs = referenceNs_.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((sequence & 1) != 0 || sequence != sequence_.load(std::memory_order_relaxed));
+    return (uint64_t)((double)raw + offsetNs + ((double)raw - (double)referenceNs) * frequency);
+  }
+
+  uint64_t nowMsSinceEpoch() const
+  {
+    return timeNsAt(rawNs()) / 1000000;
+  }
+
+  // an offset (upstream minus raw) measured at raw time 'sampleNs', with its uncertainty.
+  // the model is a least squares line through the recent samples
+  void update(uint64_t sampleNs, double offsetNs, double uncertaintyNs);
+
+  // forget the samples (e.g. the upstream stepped its clock), keeps serving until the next update
+  void reset();
+
+  // the published model, to hand it to another process of the host (live upgrade) -
+  // CLOCK_MONOTONIC_RAW is the same for all of them
+  struct Model
+  {
+    double offsetNs;
+    double frequency;
+    uint64_t referenceNs;
+    double uncertaintyNs;
+  };
+
+  // false if the clock is not synchronized
+  bool saveModel(Model &out) const;
+  // the clock serves 'model' until the next update, which fits the line through it and the new sample
+  void restoreModel(const Model &model);
+
+  double frequencyPpm() const
+  {
+    return frequency_.load(std::memory_order_relaxed) * 1e6;
+  }
+
+  double uncertaintyNs() const
+  {
+    return uncertaintyNs_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct Point
+  {
+    uint64_t sampleNs;
+    double offsetNs;
+    double uncertaintyNs;
+  };
+
+  void publish(double offsetNs, double frequency, uint64_t referenceNs);
+
+  // writer only
+  Point points_[MaxPoints];
+  int count_;
+  int next_;
+
+  std::atomic<uint32_t> sequence_;
+  std::atomic<double> offsetNs_;
+  std::atomic<double> frequency_;
+  std::atomic<uint64_t> referenceNs_;
+  std::atomic<double> uncertaintyNs_;
+  std::atomic<bool> synchronized_;
+};
+
+#endif // TSSD_DISCIPLINED_CLOCK_H
@@ -0,0 +1,158 @@
+#include "flight_recorder.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+FlightRecorder::FlightRecorder()
+  : mappingSize_(0), header_(NULL), records_(NULL), mask_(0), frozen_(false), dumpWanted_(false),
+    dumpRequested_(false), stopRequested_(false)
+{
+}
+
+FlightRecorder::~FlightRecorder()
+{
+  close();
+}
+
+bool FlightRecorder::open(const std::string &path, uint32_t worker, uint64_t capacity)
+{
+  uint64_t roundedCapacity = 1;
+  while (roundedCapacity < capacity)
+  {
+    roundedCapacity <<= 1;
+  }
+
+  // a new file renamed over the path, so records of a previous run are not mixed with the new ones,
+  // and a tssd being upgraded (live) keeps writing to its own file rather than one truncated under it
+  std::string tempPath = path + ".XXXXXX";
+  int fd = mkostemp(&tempPath[0], O_CLOEXEC);
+  if (fd < 0)
+  {
+    syslog(LOG_ERR, "flight recorder: cannot create '%s': '%m'", tempPath.c_str());
+    return false;
+  }
+  size_t size = sizeof(FlightRecorderHeader) + roundedCapacity * sizeof(FlightRecord);
+  if (fchmod(fd, 0640) < 0 || ftruncate(fd, size) < 0)
+  {
+    syslog(LOG_ERR, "flight recorder: cannot resize '%s': '%m'", tempPath.c_str());
+    ::close(fd);
+    unlink(tempPath.c_str());
+    return false;
+  }
+  void *mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  ::close(fd);
+  if (mapping == MAP_FAILED || rename(tempPath.c_str(), path.c_str()) < 0)
+  {
+    syslog(LOG_ERR, "flight recorder: cannot map '%s': '%m'", path.c_str());
+    if (mapping != MAP_FAILED)
+    {
+      munmap(mapping, size);
+    }
+    unlink(tempPath.c_str());
+    return false;
+  }
+
+  path_ = path;
+  mappingSize_ = size;
+  header_ = (FlightRecorderHeader *)mapping;
+  records_ = (FlightRecord *)((char *)mapping + sizeof(FlightRecorderHeader));
+  mask_ = roundedCapacity - 1;
+  memcpy(header_->magic, FlightRecorderMagic, sizeof(header_->magic));
+  header_->recordSize = sizeof(FlightRecord);
+  header_->worker = worker;
+  header_->capacity = roundedCapacity;
+  header_->writeIndex = 0;
+
+  dumper_ = std::thread(&FlightRecorder::runDumper, this);
+  syslog(LOG_INFO, "flight recorder: recording last %llu requests to '%s'", (unsigned long long)roundedCapacity, path.c_str());
+  return true;
+}
+
+void FlightRecorder::freezeAndDump()
+{
+  if (header_ == NULL || frozen_.load(std::memory_order_relaxed))
+  {
+    return; // not recording, or a dump is already in progress
+  }
+  frozen_.store(true, std::memory_order_release);
+  {
+    std::lock_guard<std::mutex> lock(dumpMutex_);
+    dumpRequested_ = true;
+  }
+  dumpCond_.notify_one();
+}
+
+void FlightRecorder::runDumper()
+{
+  std::unique_lock<std::mutex> lock(dumpMutex_);
+  while (true)
+  {
+    dumpCond_.wait(lock, [this] { return dumpRequested_ || stopRequested_; });
+    if (stopRequested_)
+    {
+      return;
+    }
+    dumpRequested_ = false;
+    lock.unlock();
+    dump();
+    frozen_.store(false, std::memory_order_release);
+    lock.lock();
+  }
+}
+
+void FlightRecorder::dump()
+{
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".dump.%lld", (long long)time(NULL));
+  std::string dumpPath = path_ + suffix;
+
+  int fd = ::open(dumpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+  if (fd < 0)
+  {
+    syslog(LOG_ERR, "flight recorder: cannot create dump '%s': '%m'", dumpPath.c_str());
+    return;
+  }
+  const char *data = (const char *)header_;
+  size_t written = 0;
+  while (written < mappingSize_)
+  {
+    ssize_t n = write(fd, data + written, mappingSize_ - written);
+    if (n <= 0)
+    {
+      syslog(LOG_ERR, "flight recorder: cannot write dump '%s': '%m'", dumpPath.c_str());
+      break;
+    }
+    written += n;
+  }
+  ::close(fd);
+  if (written == mappingSize_)
+  {
+    uint64_t records = header_->writeIndex < header_->capacity ? header_->writeIndex : header_->capacity;
+    syslog(LOG_INFO, "flight recorder: dumped %llu records to '%s'", (unsigned long long)records, dumpPath.c_str());
+  }
+}
+
+void FlightRecorder::close()
+{
+  if (dumper_.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(dumpMutex_);
+      stopRequested_ = true;
+    }
+    dumpCond_.notify_one();
+    dumper_.join();
+  }
+  if (header_ != NULL)
+  {
+    munmap(header_, mappingSize_);
+    header_ = NULL;
+    records_ = NULL;
+  }
+}
@@ -0,0 +1,129 @@
+#ifndef TSSD_FLIGHT_RECORDER_H
+#define TSSD_FLIGHT_RECORDER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "transport.h"
+
+/*
+ * Binary format of a flight recorder file (also used by the dumps, and
+ * decoded by tssd-flight-decode): a FlightRecorderHeader followed by
+ * 'capacity' FlightRecords, used as a ring. Record i is at index
+ * (i % capacity), and 'writeIndex' is the number of records ever written.
+ */
+
+static const char FlightRecorderMagic[8] = { 'T', 'S', 'S', 'D', 'F', 'R', '1', '\0' };
+
+struct __attribute__((__packed__)) FlightRecorderHeader
+{
+  char magic[8];
+  uint32_t recordSize;
+  uint32_t worker;
+  uint64_t capacity; // number of records, power of 2
+  uint64_t writeIndex;
+  uint8_t reserved[32];
+};
+
+struct __attribute__((__packed__)) FlightRecord
+{
+  uint64_t rxTimeNs; // kernel RX timestamp, ns since epoch
+  uint64_t txTimeNs; // time sendto() returned, ns since epoch
+  uint64_t replyTimeMs; // time sent in the reply, ms since epoch
+  uint64_t clientCookie;
+  uint8_t sourceAddr[16]; // IPv4 address is in the first 4 bytes, an IPv6 one takes all 16
+  uint16_t sourcePort; // network byte order
+  uint16_t sourceFamily;
+  uint16_t requestLength;
+  uint8_t reserved[10];
+};
+
+/*
+ * Per worker ring of the most recent requests, in a memory mapped file so
+ * it also survives a crash. The worker writes each record with plain stores
+ * into the mapping. On demand (SIGUSR1) the worker freezes the ring between
+ * two packets, and a background thread copies it to a dump file and then
+ * lets the worker continue recording.
+ */
+class FlightRecorder
+{
+public:
+  FlightRecorder();
+  ~FlightRecorder();
+
+  // capacity is rounded up to a power of 2. returns false (and logs the reason) on failure
+  bool open(const std::string &path, uint32_t worker, uint64_t capacity);
+  bool isOpen() const
+  {
+    return header_ != NULL;
+  }
+
+  // called by the worker only
+  void record(uint64_t rxTimeNs, uint64_t txTimeNs, uint64_t replyTimeMs, uint64_t clientCookie,
+    const SocketAddress &source, uint16_t requestLength)
+  {
+    if (header_ == NULL || frozen_.load(std::memory_order_acquire))
+    {
+      return;
+    }
+    uint64_t index = header_->writeIndex;
+    FlightRecord &r = records_[index & mask_];
+    r.rxTimeNs = rxTimeNs;
+    r.txTimeNs = txTimeNs;
+    r.replyTimeMs = replyTimeMs;
+    r.clientCookie = clientCookie;
+    socketAddressBytes(source, r.sourceAddr);
+    r.sourcePort = socketAddressPort(source);
+    r.sourceFamily = source.sa.sa_family;
+    r.requestLength = requestLength;
+    header_->writeIndex = index + 1;
+  }
+
+  // called by the worker between packets: stops recording and dumps the
+  // ring in the background. recording continues once the dump is written
+  void freezeAndDump();
+
+  // any thread: the worker dumps the ring at the start of its next batch
+  void requestDump()
+  {
+    dumpWanted_.store(true);
+  }
+
+  // called by the worker between packets
+  void dumpIfRequested()
+  {
+    if (dumpWanted_.load(std::memory_order_relaxed) && dumpWanted_.exchange(false))
+    {
+      freezeAndDump();
+    }
+  }
+
+  void close();
+
+private:
+  void runDumper();
+  void dump();
+
+  std::string path_;
+  size_t mappingSize_;
+  FlightRecorderHeader *header_;
+  FlightRecord *records_;
+  uint64_t mask_;
+  std::atomic<bool> frozen_;
+  std::atomic<bool> dumpWanted_;
+
+  std::mutex dumpMutex_;
+  std::condition_variable dumpCond_;
+  bool dumpRequested_;
+  bool stopRequested_;
+  std::thread dumper_;
+};
+
+#endif // TSSD_FLIGHT_RECORDER_H
@@ -0,0 +1,86 @@
+#include "key_store.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+bool KeyStore::load(const std::string &path)
+{
+  FILE *file = fopen(path.c_str(), "re");
+  if (file == NULL)
+  {
+    syslog(LOG_ERR, "keys: cannot open '%s': '%m'", path.c_str());
+    return false;
+  }
+  struct stat st;
+  if (fstat(fileno(file), &st) == 0 && (st.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+  {
+    syslog(LOG_WARNING, "keys: '%s' is accessible by other users", path.c_str());
+  }
+
+  std::vector<Entry> keys;
+  char line[256];
+  int lineNumber = 0;
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    lineNumber++;
+    char *id = strtok(line, " \t\r\n");
+    if (id == NULL || id[0] == '#')
+    {
+      continue;
+    }
+    char *hex = strtok(NULL, " \t\r\n");
+    char *end;
+    long keyId = strtol(id, &end, 10);
+    Entry entry;
+    if (*end != '\0' || keyId < 1 || keyId > 65535 || hex == NULL || !parseSipHashKey(hex, entry.key) ||
+      strtok(NULL, " \t\r\n") != NULL)
+    {
+      syslog(LOG_ERR, "keys: '%s' line %d is not a key id and 32 hex digits", path.c_str(), lineNumber);
+      fclose(file);
+      return false;
+    }
+    entry.keyId = (uint16_t)keyId;
+    keys.push_back(entry);
+  }
+  fclose(file);
+
+  std::sort(keys.begin(), keys.end(), [](const Entry &a, const Entry &b) { return a.keyId < b.keyId; });
+  for (size_t i = 1; i < keys.size(); i++)
+  {
+    if (keys[i].keyId == keys[i - 1].keyId)
+    {
+      syslog(LOG_ERR, "keys: '%s' has key id %u twice", path.c_str(), keys[i].keyId);
+      return false;
+    }
+  }
+  keys_.swap(keys);
+  syslog(LOG_INFO, "keys: loaded %u keys from '%s'", (unsigned int)keys_.size(), path.c_str());
+  return true;
+}
+
+bool KeyStore::add(uint16_t keyId, const SipHashKey &key)
+{
+  std::vector<Entry>::iterator it = std::lower_bound(keys_.begin(), keys_.end(), keyId,
+    [](const Entry &entry, uint16_t id) { return entry.keyId < id; });
+  if (it != keys_.end() && it->keyId == keyId)
+  {
+    return false;
+  }
+  Entry entry;
+  entry.keyId = keyId;
+  entry.key = key;
+  keys_.insert(it, entry);
+  return true;
+}
+
+const SipHashKey *KeyStore::find(uint16_t keyId) const
+{
+  std::vector<Entry>::const_iterator it = std::lower_bound(keys_.begin(), keys_.end(), keyId,
+    [](const Entry &entry, uint16_t id) { return entry.keyId < id; });
+  return it != keys_.end() && it->keyId == keyId ? &it->key : NULL;
+}
@@ -0,0 +1,46 @@
+#ifndef TSSD_KEY_STORE_H
+#define TSSD_KEY_STORE_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "siphash.h"
+
+/*
+ * The keys of authenticated TSP, loaded from a key file with a key per
+ * line - its id (1 to 65535) and 32 hex digits:
+ *
+ *   # id key
+ *   1 8f1e3c0b6a2d4e5f708192a3b4c5d6e7
+ *
+ * Empty lines and lines starting with '#' are ignored.
+ */
+class KeyStore
+{
+public:
+  // returns false (and logs the reason) if the file can't be read or a line is malformed
+  bool load(const std::string &path);
+
+  // false if there is a key with this id already
+  bool add(uint16_t keyId, const SipHashKey &key);
+
+  // NULL if there is no key with this id
+  const SipHashKey *find(uint16_t keyId) const;
+
+  size_t size() const
+  {
+    return keys_.size();
+  }
+
+private:
+  struct Entry
+  {
+    uint16_t keyId;
+    SipHashKey key;
+  };
+
+  std::vector<Entry> keys_; // sorted by id
+};
+
+#endif // TSSD_KEY_STORE_H
@@ -0,0 +1,200 @@
+#ifndef TSSD_LATENCY_HISTOGRAM_H
+#define TSSD_LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+/*
+ * HDR style (log-linear) histogram of durations in nanoseconds.
+ * Every power of two range is split into 'SubBucketCount' linear buckets,
+ * so the relative error of a reported value is bounded (~3%) while the
+ * memory is fixed (~9KB) no matter how many values are recorded.
+ *
+ * A histogram has a single writer - the worker which owns it. Recording is
+ * a relaxed load + store of a counter (no locked instruction), and readers
+ * never block the writer: they take a snapshot and compute a window as the
+ * difference between two snapshots.
+ */
+
+class HistogramSnapshot;
+
+class LatencyHistogram
+{
+public:
+  static const int SubBucketBits = 5;
+  static const int SubBucketCount = 1 << SubBucketBits;
+  static const int MaxMagnitude = 40; // values up to 2^40 ns (~18 minutes), larger values are clamped
+  static const int BucketCount = (MaxMagnitude - SubBucketBits + 1) * SubBucketCount;
+
+  LatencyHistogram()
+  {
+    for (int i = 0; i < BucketCount; i++)
+    {
+      counts_[i].store(0, std::memory_order_relaxed);
+    }
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+  static int bucketIndex(uint64_t valueNs)
+  {
+    if (valueNs < (uint64_t)SubBucketCount)
+    {
+      return (int)valueNs;
+    }
+    if (valueNs >= ((uint64_t)1 << MaxMagnitude))
+    {
+      return BucketCount - 1;
+    }
+    int msb = 63 - __builtin_clzll(valueNs);
+    int shift = msb - SubBucketBits;
+    int subBucket = (int)(valueNs >> shift); // in range [SubBucketCount, 2 * SubBucketCount)
+    return (shift + 1) * SubBucketCount + (subBucket - SubBucketCount);
+  }
+
+  // largest value which is counted in the bucket
+  static uint64_t bucketHighestValue(int index)
+  {
+    if (index < SubBucketCount)
+    {
+      return (uint64_t)index;
+    }
+    int shift = index / SubBucketCount - 1;
+    uint64_t subBucket = (uint64_t)(index % SubBucketCount + SubBucketCount);
+    return ((subBucket + 1) << shift) - 1;
+  }
+
+  // must only be called from the owning worker
+  void record(uint64_t valueNs)
+  {
+    std::atomic<uint64_t> &counter = counts_[bucketIndex(valueNs)];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    sum_.store(sum_.load(std::memory_order_relaxed) + valueNs, std::memory_order_relaxed);
+    if (valueNs > max_.load(std::memory_order_relaxed))
+    {
+      max_.store(valueNs, std::memory_order_relaxed);
+    }
+  }
+
+  // can be called from any thread, while the owner keeps recording
+  void snapshot(HistogramSnapshot &out) const;
+
+private:
+  std::atomic<uint64_t> counts_[BucketCount];
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> max_;
+};
+
+/*
+ * Plain (non atomic) copy of a histogram, owned by a single reader.
+ * Used to merge the histograms of several workers and to compute windows.
+ */
+class HistogramSnapshot
+{
+public:
+  HistogramSnapshot()
+  {
+    clear();
+  }
+
+  void clear()
+  {
+    memset(counts, 0, sizeof(counts));
+    total = 0;
+    sum = 0;
+    max = 0;
+  }
+
+  void merge(const HistogramSnapshot &other)
+  {
+    for (int i = 0; i < LatencyHistogram::BucketCount; i++)
+    {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    if (other.max > max)
+    {
+      max = other.max;
+    }
+  }
+
+  // window between an older snapshot of the same histogram and this one.
+  // the exact max of a window is not tracked, so the highest value of the
+  // highest non empty bucket is used (never above the all time max)
+  void windowSince(const HistogramSnapshot &older, HistogramSnapshot &window) const
+  {
+    window.total = 0;
+    window.sum = sum - older.sum;
+    window.max = 0;
+    for (int i = 0; i < LatencyHistogram::BucketCount; i++)
+    {
+      window.counts[i] = counts[i] - older.counts[i];
+      window.total += window.counts[i];
+      if (window.counts[i] > 0)
+      {
+        window.max = LatencyHistogram::bucketHighestValue(i);
+      }
+    }
+    if (window.max > max)
+    {
+      window.max = max;
+    }
+  }
+
+  // percentile is in range [0, 100]
+  uint64_t valueAtPercentile(double percentile) const
+  {
+    if (total == 0)
+    {
+      return 0;
+    }
+    uint64_t rank = (uint64_t)((percentile / 100.0) * (double)total + 0.5);
+    if (rank < 1)
+    {
+      rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i < LatencyHistogram::BucketCount; i++)
+    {
+      seen += counts[i];
+      if (seen >= rank)
+      {
+        uint64_t value = LatencyHistogram::bucketHighestValue(i);
+        return value < max ? value : max;
+      }
+    }
+    return max;
+  }
+
+  // number of values which are not above 'valueNs' (up to the bucket resolution)
+  uint64_t countAtOrBelow(uint64_t valueNs) const
+  {
+    uint64_t count = 0;
+    for (int i = 0; i < LatencyHistogram::BucketCount && LatencyHistogram::bucketHighestValue(i) <= valueNs; i++)
+    {
+      count += counts[i];
+    }
+    return count;
+  }
+
+  uint64_t counts[LatencyHistogram::BucketCount];
+  uint64_t total;
+  uint64_t sum;
+  uint64_t max;
+};
+
+inline void LatencyHistogram::snapshot(HistogramSnapshot &out) const
+{
+  out.total = 0;
+  for (int i = 0; i < BucketCount; i++)
+  {
+    out.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    out.total += out.counts[i];
+  }
+  out.sum = sum_.load(std::memory_order_relaxed);
+  out.max = max_.load(std::memory_order_relaxed);
+}
+
+#endif // TSSD_LATENCY_HISTOGRAM_H
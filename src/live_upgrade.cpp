@@ -0,0 +1,498 @@
+#include "live_upgrade.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+static const char UpgradeMagic[8] = { 'T', 'S', 'S', 'D', 'U', 'P', 'G', '1' };
+static const char UpgradeAck = 'A';
+static const int StopPollIntervalMs = 50;
+static const int RequestTimeoutMs = 1000;
+static const int HandoverTimeoutMs = 5000; // the running tssd answers its current batches first
+static const int AckTimeoutMs = 10000; // the rest of the new tssd's startup
+static const uint32_t MaxStateSize = 64 * 1024 * 1024;
+
+// the header of the handover, sent with the sockets
+struct __attribute__((__packed__)) UpgradeHeader
+{
+    char magic[8];
+    uint32_t socketCount;
+    uint32_t stateCount;
+    uint8_t kinds[MaxUpgradeSockets];
+};
+
+// followed by the name and the value
+struct __attribute__((__packed__)) UpgradeStateHeader
+{
+    uint32_t nameLength;
+    uint32_t valueLength;
+};
+
+void UpgradeHandover::addSocket(uint8_t kind, int fd)
+{
+  fds.push_back(fd);
+  kinds.push_back(kind);
+}
+
+static unsigned short localPort(int fd)
+{
+  struct sockaddr_storage addr;
+  socklen_t addrLength = sizeof(addr);
+  if (getsockname(fd, (struct sockaddr *)&addr, &addrLength) < 0)
+  {
+    return 0;
+  }
+  if (addr.ss_family == AF_INET)
+  {
+    return ntohs(((const struct sockaddr_in *)&addr)->sin_port);
+  }
+  if (addr.ss_family == AF_INET6)
+  {
+    return ntohs(((const struct sockaddr_in6 *)&addr)->sin6_port);
+  }
+  return 0;
+}
+
+int UpgradeHandover::takeSocket(uint8_t kind, unsigned short port)
+{
+  for (size_t i = 0; i < fds.size(); i++)
+  {
+    if (kinds[i] == kind && (port == 0 || localPort(fds[i]) == port))
+    {
+      int fd = fds[i];
+      fds.erase(fds.begin() + i);
+      kinds.erase(kinds.begin() + i);
+      return fd;
+    }
+  }
+  return -1;
+}
+
+void UpgradeHandover::addState(const std::string &name, const std::string &value)
+{
+  state.push_back(std::make_pair(name, value));
+}
+
+const std::string *UpgradeHandover::findState(const std::string &name) const
+{
+  for (size_t i = 0; i < state.size(); i++)
+  {
+    if (state[i].first == name)
+    {
+      return &state[i].second;
+    }
+  }
+  return NULL;
+}
+
+static void setReceiveTimeout(int fd, int timeoutMs)
+{
+  struct timeval tv;
+  tv.tv_sec = timeoutMs / 1000;
+  tv.tv_usec = (timeoutMs % 1000) * 1000;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof(tv));
+}
+
+static bool sendAll(int fd, const void *data, size_t length)
+{
+  const char *bytes = (const char *)data;
+  while (length > 0)
+  {
+    ssize_t sent = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (sent <= 0)
+    {
+      return false;
+    }
+    bytes += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+// false on a timeout, an error, or if the peer closed the connection
+static bool receiveAll(int fd, void *data, size_t length)
+{
+  char *bytes = (char *)data;
+  while (length > 0)
+  {
+    ssize_t received = recv(fd, bytes, length, 0);
+    if (received < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (received <= 0)
+    {
+      return false;
+    }
+    bytes += received;
+    length -= received;
+  }
+  return true;
+}
+
+static bool controlAddress(const std::string &path, struct sockaddr_un &addr)
+{
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr.sun_path))
+  {
+    syslog(LOG_ERR, "upgrade: invalid control socket path '%s'", path.c_str());
+    return false;
+  }
+  memcpy(addr.sun_path, path.c_str(), path.size());
+  return true;
+}
+
+UpgradeListener::UpgradeListener()
+  : listenFd_(-1), connectionFd_(-1), requested_(false), stopRequested_(false)
+{
+}
+
+UpgradeListener::~UpgradeListener()
+{
+  stop();
+}
+
+bool UpgradeListener::start(const std::string &path, bool replace)
+{
+  struct sockaddr_un addr;
+  if (!controlAddress(path, addr))
+  {
+    return false;
+  }
+  // a socket file which nobody accepts on is left by a tssd which stopped
+  if (!replace)
+  {
+    int probeFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (probeFd >= 0 && connect(probeFd, (const struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+      close(probeFd);
+      syslog(LOG_ERR, "upgrade: a tssd is running on '%s', start with --upgrade to take it over", path.c_str());
+      return false;
+    }
+    if (probeFd >= 0)
+    {
+      close(probeFd);
+    }
+  }
+  unlink(path.c_str());
+
+  listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenFd_ < 0)
+  {
+    syslog(LOG_ERR, "upgrade: cannot create socket: '%m'");
+    return false;
+  }
+  if (bind(listenFd_, (const struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd_, 4) < 0)
+  {
+    syslog(LOG_ERR, "upgrade: cannot listen on '%s': '%m'", path.c_str());
+    close(listenFd_);
+    listenFd_ = -1;
+    return false;
+  }
+  // the daemon runs with a cleared umask
+  chmod(path.c_str(), 0600);
+
+  stopRequested_.store(false);
+  thread_ = std::thread(&UpgradeListener::run, this);
+  syslog(LOG_INFO, "upgrade: a new tssd can take over on '%s'", path.c_str());
+  return true;
+}
+
+// the path is not removed, it may already be of the tssd which took over
+void UpgradeListener::stop()
+{
+  stopRequested_.store(true);
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  if (listenFd_ >= 0)
+  {
+    close(listenFd_);
+    listenFd_ = -1;
+  }
+  if (connectionFd_ >= 0)
+  {
+    close(connectionFd_);
+    connectionFd_ = -1;
+  }
+}
+
+void UpgradeListener::run()
+{
+  while (!stopRequested_.load())
+  {
+    // one handover at a time, the next connection waits in the backlog
+    if (requested_.load())
+    {
+      poll(NULL, 0, StopPollIntervalMs);
+      continue;
+    }
+    struct pollfd pfd;
+    pfd.fd = listenFd_;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, StopPollIntervalMs) <= 0)
+    {
+      continue;
+    }
+    int fd = accept4(listenFd_, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      continue;
+    }
+    // only a tssd of our user (or root) may take the sockets
+    struct ucred credentials;
+    socklen_t credentialsLength = sizeof(credentials);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &credentialsLength) < 0 ||
+      (credentials.uid != 0 && credentials.uid != geteuid()))
+    {
+      syslog(LOG_WARNING, "upgrade: rejected a connection of uid %u", (unsigned int)credentials.uid);
+      close(fd);
+      continue;
+    }
+    char magic[sizeof(UpgradeMagic)];
+    setReceiveTimeout(fd, RequestTimeoutMs);
+    if (!receiveAll(fd, magic, sizeof(magic)))
+    {
+      close(fd); // a starting tssd checks whether one is running
+      continue;
+    }
+    if (memcmp(magic, UpgradeMagic, sizeof(magic)) != 0)
+    {
+      syslog(LOG_WARNING, "upgrade: rejected a connection which is not of a compatible tssd");
+      close(fd);
+      continue;
+    }
+    syslog(LOG_INFO, "upgrade: pid %d takes over, pausing", (int)credentials.pid);
+    connectionFd_ = fd;
+    requested_.store(true);
+  }
+}
+
+void UpgradeListener::finishRequest()
+{
+  close(connectionFd_);
+  connectionFd_ = -1;
+  requested_.store(false);
+}
+
+bool UpgradeListener::handOver(const UpgradeHandover &handover)
+{
+  if (handover.fds.size() > (size_t)MaxUpgradeSockets)
+  {
+    syslog(LOG_ERR, "upgrade: too many sockets to hand over");
+    finishRequest();
+    return false;
+  }
+  UpgradeHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, UpgradeMagic, sizeof(header.magic));
+  header.socketCount = (uint32_t)handover.fds.size();
+  header.stateCount = (uint32_t)handover.state.size();
+  memcpy(header.kinds, handover.kinds.data(), handover.kinds.size());
+
+  struct iovec iov;
+  iov.iov_base = &header;
+  iov.iov_len = sizeof(header);
+  char control[CMSG_SPACE(sizeof(int) * MaxUpgradeSockets)];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (!handover.fds.empty())
+  {
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * handover.fds.size());
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * handover.fds.size());
+    memcpy(CMSG_DATA(cmsg), handover.fds.data(), sizeof(int) * handover.fds.size());
+  }
+  bool sent = sendmsg(connectionFd_, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(header);
+  for (size_t i = 0; sent && i < handover.state.size(); i++)
+  {
+    UpgradeStateHeader stateHeader;
+    stateHeader.nameLength = (uint32_t)handover.state[i].first.size();
+    stateHeader.valueLength = (uint32_t)handover.state[i].second.size();
+    sent = sendAll(connectionFd_, &stateHeader, sizeof(stateHeader)) &&
+      sendAll(connectionFd_, handover.state[i].first.data(), stateHeader.nameLength) &&
+      sendAll(connectionFd_, handover.state[i].second.data(), stateHeader.valueLength);
+  }
+  if (!sent)
+  {
+    syslog(LOG_ERR, "upgrade: cannot send the handover: '%m'");
+    finishRequest();
+    return false;
+  }
+
+  char ack = 0;
+  setReceiveTimeout(connectionFd_, AckTimeoutMs);
+  if (!receiveAll(connectionFd_, &ack, sizeof(ack)) || ack != UpgradeAck)
+  {
+    syslog(LOG_ERR, "upgrade: the new tssd did not confirm the handover");
+    finishRequest();
+    return false;
+  }
+  syslog(LOG_INFO, "upgrade: handed %u sockets over", (unsigned int)handover.fds.size());
+  finishRequest();
+  return true;
+}
+
+UpgradeTakeover::UpgradeTakeover() : fd_(-1)
+{
+}
+
+// without a confirmation, the running tssd serves again
+UpgradeTakeover::~UpgradeTakeover()
+{
+  if (fd_ >= 0)
+  {
+    close(fd_);
+  }
+}
+
+bool UpgradeTakeover::receive(const std::string &path, UpgradeHandover &handover)
+{
+  struct sockaddr_un addr;
+  if (!controlAddress(path, addr))
+  {
+    return false;
+  }
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0 || connect(fd_, (const struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    syslog(LOG_ERR, "upgrade: no tssd to take over on '%s': '%m'", path.c_str());
+    return false;
+  }
+  setReceiveTimeout(fd_, HandoverTimeoutMs);
+  if (!sendAll(fd_, UpgradeMagic, sizeof(UpgradeMagic)))
+  {
+    syslog(LOG_ERR, "upgrade: cannot request the handover: '%m'");
+    return false;
+  }
+
+  UpgradeHeader header;
+  struct iovec iov;
+  iov.iov_base = &header;
+  iov.iov_len = sizeof(header);
+  char control[CMSG_SPACE(sizeof(int) * MaxUpgradeSockets)];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t received = recvmsg(fd_, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); received > 0 && cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+      int count = (int)((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+      handover.fds.resize(count);
+      memcpy(handover.fds.data(), CMSG_DATA(cmsg), sizeof(int) * count);
+    }
+  }
+  if (received != (ssize_t)sizeof(header) || memcmp(header.magic, UpgradeMagic, sizeof(header.magic)) != 0 ||
+    header.socketCount != handover.fds.size() || (msg.msg_flags & MSG_CTRUNC) != 0)
+  {
+    syslog(LOG_ERR, "upgrade: the running tssd did not hand its sockets over");
+    for (size_t i = 0; i < handover.fds.size(); i++)
+    {
+      close(handover.fds[i]);
+    }
+    handover.fds.clear();
+    return false;
+  }
+  handover.kinds.assign(header.kinds, header.kinds + header.socketCount);
+
+  for (uint32_t i = 0; i < header.stateCount; i++)
+  {
+    UpgradeStateHeader stateHeader;
+    if (!receiveAll(fd_, &stateHeader, sizeof(stateHeader)) || stateHeader.nameLength > MaxStateSize ||
+      stateHeader.valueLength > MaxStateSize)
+    {
+      syslog(LOG_ERR, "upgrade: cannot receive the state of the running tssd");
+      return false;
+    }
+    std::string name(stateHeader.nameLength, '\0');
+    std::string value(stateHeader.valueLength, '\0');
+    if (!receiveAll(fd_, &name[0], name.size()) || !receiveAll(fd_, &value[0], value.size()))
+    {
+      syslog(LOG_ERR, "upgrade: cannot receive the state of the running tssd");
+      return false;
+    }
+    handover.addState(name, value);
+  }
+  syslog(LOG_INFO, "upgrade: took %u sockets and %u states over", header.socketCount, header.stateCount);
+  return true;
+}
+
+void UpgradeTakeover::confirm()
+{
+  if (fd_ < 0)
+  {
+    return;
+  }
+  sendAll(fd_, &UpgradeAck, sizeof(UpgradeAck));
+  close(fd_);
+  fd_ = -1;
+}
+
+bool spawnUpgrade(const std::vector<std::string> &commandLine)
+{
+  std::vector<std::string> arguments;
+  for (size_t i = 0; i < commandLine.size(); i++)
+  {
+    if (commandLine[i] != "--upgrade")
+    {
+      arguments.push_back(commandLine[i]);
+    }
+  }
+  arguments.push_back("--upgrade");
+  std::vector<char *> argv;
+  for (size_t i = 0; i < arguments.size(); i++)
+  {
+    argv.push_back(&arguments[i][0]);
+  }
+  argv.push_back(NULL);
+  // by its path rather than /proc/self/exe, which would name the process 'exe'
+  char path[4096] = "/proc/self/exe";
+  ssize_t pathLength = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  if (pathLength > 0 && strstr(std::string(path, pathLength).c_str(), " (deleted)") == NULL)
+  {
+    path[pathLength] = '\0';
+  }
+  else
+  {
+    strcpy(path, "/proc/self/exe");
+  }
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    syslog(LOG_ERR, "upgrade: cannot fork: '%m'");
+    return false;
+  }
+  if (pid == 0)
+  {
+    execv(path, argv.data());
+    _exit(EXIT_FAILURE);
+  }
+  syslog(LOG_INFO, "upgrade: pid %d takes over with the changed options", (int)pid);
+  return true;
+}
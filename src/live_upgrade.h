@@ -0,0 +1,106 @@
+#ifndef TSSD_LIVE_UPGRADE_H
+#define TSSD_LIVE_UPGRADE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/*
+ * Live upgrade: a new tssd takes the sockets and the state of the running
+ * one over a Unix control socket, so the ports are never closed and no
+ * request is dropped.
+ *
+ * The new tssd (--upgrade) connects and asks for the handover. The running
+ * one stops its workers once their current batch is answered, and sends its
+ * sockets (SCM_RIGHTS) and the state of its components. Requests which
+ * arrive meanwhile wait in the socket queues. The new tssd serves the
+ * sockets and confirms, and only then the old one exits - if the new one
+ * fails before that, the old one serves again.
+ */
+
+enum UpgradeSocketKind
+{
+  UpgradeUdpSocket = 1, // a worker's socket, found by its port and family
+  UpgradeStreamSocket, // the listening socket of the stream endpoint
+  UpgradeMetricsSocket // the listening socket of the metrics endpoint
+};
+
+const int MaxUpgradeSockets = 16;
+
+struct UpgradeHandover
+{
+  std::vector<int> fds;
+  std::vector<uint8_t> kinds; // the UpgradeSocketKind of every fd
+  std::vector<std::pair<std::string, std::string> > state; // named state of the components
+
+  void addSocket(uint8_t kind, int fd);
+  // takes a socket of 'kind' bound to 'port' (any port if 0) out of the handover, -1 if there is none
+  int takeSocket(uint8_t kind, unsigned short port);
+  void addState(const std::string &name, const std::string &value);
+  // NULL if there is no state of 'name'
+  const std::string *findState(const std::string &name) const;
+};
+
+/*
+ * The running tssd's side: waits for a new tssd on the control socket.
+ * The main loop polls requested(), pauses the workers and calls handOver().
+ */
+class UpgradeListener
+{
+public:
+  UpgradeListener();
+  ~UpgradeListener();
+
+  // returns false (and logs the reason) if the control socket cannot be created, or if another
+  // tssd serves it. 'replace' takes the path over from the tssd being upgraded
+  bool start(const std::string &path, bool replace);
+  void stop();
+
+  // a new tssd waits for the handover
+  bool requested() const
+  {
+    return requested_.load();
+  }
+
+  // sends the sockets and the state, and waits until the new tssd serves them. returns
+  // false if the handover failed, and the caller should serve again
+  bool handOver(const UpgradeHandover &handover);
+
+private:
+  void run();
+  void finishRequest();
+
+  int listenFd_;
+  int connectionFd_;
+  std::atomic<bool> requested_;
+  std::atomic<bool> stopRequested_;
+  std::thread thread_;
+};
+
+/*
+ * The new tssd's side: receives the sockets and the state of the running
+ * tssd, and confirms once it serves them.
+ */
+class UpgradeTakeover
+{
+public:
+  UpgradeTakeover();
+  ~UpgradeTakeover();
+
+  // returns false (and logs the reason) if there is no tssd to take over, or the handover failed
+  bool receive(const std::string &path, UpgradeHandover &handover);
+  // the sockets are served, the previous tssd exits
+  void confirm();
+
+private:
+  int fd_;
+};
+
+// starts a new process of this binary with 'commandLine' (argv) and --upgrade, which takes the
+// sockets over from this one. false (and logs the reason) if it can't be started
+bool spawnUpgrade(const std::vector<std::string> &commandLine);
+
+#endif // TSSD_LIVE_UPGRADE_H
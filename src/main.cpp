@@ -1,11 +1,15 @@
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
+#include <sched.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <dirent.h>
+#include <sys/syscall.h>
 #include <sys/types.h> 
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -13,49 +17,58 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#include <cxxopts/cxxopts.hpp>
-
-struct __attribute__((__packed__)) TimeRequest
-{
-    char protocol[3]; // Protocol name (TSP)
-    uint8_t protocolVersion; // 1
-    char unused[4]; // 8 bytes padding, can have future use
-    uint64_t clientCookie; // 8 bytes which user can set to whatever value, and will be returned in reply
-};
-
-const int TimeRequestPacketSize = sizeof(TimeRequest);
-
-
-struct __attribute__((__packed__)) TimeReply
-{
-    char protocol[3]; // Protocol name (TSP)
-    uint8_t protocolVersion; // 1
-    char unused[4]; // 8 bytes padding, can have future use
-    uint64_t clientCookie; // the cookie which was sent in the request, copied to the reply for reference
-    uint64_t timeSinceEphoc1970Ms; // number of ms since ephoc time - 1 Jan 1970 GMT
-};
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
 
-const int TimeReplyPacketSize = sizeof(TimeReply);
+#include <cxxopts/cxxopts.hpp>
 
+#include "async_logger.h"
+#include "beacon_sender.h"
+#include "config_loader.h"
+#include "disciplined_clock.h"
+#include "flight_recorder.h"
+#include "key_store.h"
+#include "live_upgrade.h"
+#include "metrics_server.h"
+#include "realtime.h"
+#include "relay_sync.h"
+#include "request_pipeline.h"
+#include "self_profiler.h"
+#include "serving_config.h"
+#include "stream_server.h"
+#include "stats_reporter.h"
+#include "systemd.h"
+#include "traffic_capture.h"
+#include "udp_transport.h"
+#include "worker_stats.h"
 
 static volatile sig_atomic_t gotSigTerm = 0;
+static volatile sig_atomic_t gotSigUsr1 = 0;
+static volatile sig_atomic_t gotSigHup = 0;
+// the workers stop after their current batch, for a live upgrade
+static std::atomic<bool> pauseWorkers(false);
 
+static int realtimePriority = 0; // SCHED_FIFO priority of the workers, 0 unless --realtime
+static std::vector<int> realtimeCpus; // the workers run on these in turn, on any CPU if empty
+
+// only sets flags: syslog() (and most of libc) is not async signal safe, the threads which act on a flag log it
 void handleSignal(int sig)
 {
-  syslog(LOG_INFO, "Singal handler %d", sig);  
   if (sig == SIGTERM)
   {
     gotSigTerm = 1;  
     signal(SIGTERM, SIG_DFL);
   }
-}
-
-/*
- * error - wrapper for perror
- */
-void error(const char *msg) {
-  // perror(msg);
-  exit(1);
+  else if (sig == SIGUSR1) // dump the flight recorder
+  {
+    gotSigUsr1 = 1;
+  }
+  else if (sig == SIGHUP) // reload the configuration
+  {
+    gotSigHup = 1;
+  }
 }
 
 static void becomeBackgroundProccess()
@@ -114,8 +127,39 @@ static void changeWorkingDirectory()
 
 // they are not used in the daemon, and theredore should be cleaned
 // to prevent problems with later unmounts and resource leak.
+// the open files limit can be a million or more, so rather than close()
+// every possible fd: close_range() (Linux 5.9), or the fds in /proc/self/fd
 static void closeAllFileDescriptors()
 {
+#ifdef SYS_close_range
+  if (syscall(SYS_close_range, 0U, ~0U, 0U) == 0)
+  {
+    return;
+  }
+#endif
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir != NULL)
+  {
+    std::vector<int> fds;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+      if (entry->d_name[0] != '.')
+      {
+        fds.push_back(atoi(entry->d_name));
+      }
+    }
+    int ownFd = dirfd(dir);
+    closedir(dir);
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+      if (fds[i] != ownFd)
+      {
+        close(fds[i]);
+      }
+    }
+    return;
+  }
   int maxfd = sysconf(_SC_OPEN_MAX);
   if (maxfd < 0) // limit is indeterminate
   {
@@ -150,26 +194,35 @@ static void redirectStdFdsToDevNull()
   }
 }
 
-static void lockPidFile(const char *pidfile)
+static int pidFileFd = -1; // holds the lock while the daemon runs
+
+// 'waitMs' is how long to wait for a tssd which is upgraded (live) to release the lock
+static void lockPidFile(const char *pidfile, int waitMs)
 {
   char str[256];
-  int pidFd = open(pidfile, O_RDWR|O_CREAT, 0640);
+  int pidFd = open(pidfile, O_RDWR|O_CREAT|O_CLOEXEC, 0640);
   if (pidFd < 0) {
     syslog(LOG_ERR, "daemonize: cannot create lock file at '%s'", pidfile);
     exit(EXIT_FAILURE);
   }
-  if (lockf(pidFd, F_TLOCK, 0) < 0) {
-    /* Can't lock file */
-    syslog(LOG_ERR, "daemonize: cannot lock the lock file at '%s'", pidfile);
-    exit(EXIT_FAILURE);
+  for (int waitedMs = 0; lockf(pidFd, F_TLOCK, 0) < 0; waitedMs += 10) {
+    if (waitedMs >= waitMs) {
+      /* Can't lock file */
+      syslog(LOG_ERR, "daemonize: cannot lock the lock file at '%s'", pidfile);
+      exit(EXIT_FAILURE);
+    }
+    usleep(10000);
   }
   /* Get current PID */
   sprintf(str, "%d\n", getpid());
-  /* Write PID to lockfile */
+  /* Write PID to lockfile, over the PID of a previous tssd */
+  ftruncate(pidFd, 0);
   write(pidFd, str, strlen(str));  
+  pidFileFd = pidFd;
 }
 
-static void daemonize(const char *pidfile)
+// 'lockPid' is false for a live upgrade, the pid file is locked once the previous tssd exits
+static void daemonize(const char *pidfile, bool lockPid)
 {
 	becomeBackgroundProccess();
   becomeLeaderOfNewSession();
@@ -179,52 +232,183 @@ static void daemonize(const char *pidfile)
   changeWorkingDirectory();
   closeAllFileDescriptors();
   redirectStdFdsToDevNull();
-  lockPidFile(pidfile);
+  if (lockPid)
+  {
+    lockPidFile(pidfile, 0);
+  }
 }
 
-static cxxopts::ParseResult parseOptions(int argc, char **argv, cxxopts::Options &options)
+// an IPv4 address, or a name of up to 4 characters padded with zeros - in network byte order
+static uint32_t parseNtpReferenceId(const std::string &refid)
 {
-  const char *appName = argv[0];
+  struct in_addr address;
+  if (inet_pton(AF_INET, refid.c_str(), &address) == 1)
+  {
+    return address.s_addr;
+  }
+  char name[4] = {0, 0, 0, 0};
+  memcpy(name, refid.c_str(), refid.size() < 4 ? refid.size() : 4);
+  uint32_t referenceId;
+  memcpy(&referenceId, name, 4);
+  return referenceId;
+}
 
-  options.add_options()
-    ("h, help", "print help")
-    ;
+/*
+ * A socket the daemon serves, and the worker which serves it. Worker 0
+ * (the first TSP socket) runs on the main thread, the others on their own.
+ */
+struct Endpoint
+{
+  unsigned short port;
+  bool ntp;
+  int family;
+  bool v6Only;
+};
+
+static const int MaxEndpoints = 4; // TSP and NTP, each on an IPv4 and an IPv6 socket
 
-  try
+// the sockets of every protocol for the --ip mode, false if the mode is unknown
+static bool addEndpoints(std::vector<Endpoint> &endpoints, unsigned short port, bool ntp, const std::string &ipMode)
+{
+  Endpoint endpoint;
+  endpoint.port = port;
+  endpoint.ntp = ntp;
+  endpoint.v6Only = ipMode != "dual";
+  if (ipMode == "ipv4" || ipMode == "separate")
   {
-    cxxopts::ParseResult optsResult = options.parse(argc, argv);
+    endpoint.family = AF_INET;
+    endpoints.push_back(endpoint);
+  }
+  if (ipMode == "ipv6" || ipMode == "dual" || ipMode == "separate")
+  {
+    endpoint.family = AF_INET6;
+    endpoints.push_back(endpoint);
+  }
+  return ipMode == "ipv4" || ipMode == "ipv6" || ipMode == "dual" || ipMode == "separate";
+}
 
-    if(optsResult.count("help") > 0)
+// takes the socket systemd passed for the endpoint out of 'listenFds': one of its port and
+// family, else one of its port (systemd binds dual stack sockets by default). -1 if there is none.
+// the endpoint is updated to the family of the socket
+static int takeListenFd(std::vector<int> &listenFds, Endpoint &endpoint)
+{
+  for (int pass = 0; pass < 2; pass++)
+  {
+    for (size_t i = 0; i < listenFds.size(); i++)
     {
-      std::cout << options.help() << std::endl;
-      exit(EXIT_SUCCESS);
+      unsigned short port;
+      int family;
+      bool v6Only;
+      if (udpSocketEndpoint(listenFds[i], port, family, v6Only) && port == endpoint.port &&
+        (pass == 1 || (family == endpoint.family && (family == AF_INET || v6Only == endpoint.v6Only))))
+      {
+        int fd = listenFds[i];
+        listenFds.erase(listenFds.begin() + i);
+        endpoint.family = family;
+        endpoint.v6Only = v6Only;
+        return fd;
+      }
     }
+  }
+  return -1;
+}
 
-    return optsResult;
+// the file of a worker's flight recorder or capture: 'path' for worker 0, 'path.N' for worker N
+static std::string workerFilePath(const std::string &path, size_t worker)
+{
+  return worker == 0 ? path : path + "." + std::to_string(worker);
+}
+
+// the name of the rate limiter state of a TSP endpoint, in a live upgrade
+static std::string rateLimiterStateName(const Endpoint &endpoint)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "rate_limiter %u %s", endpoint.port, endpoint.family == AF_INET ? "ipv4" : "ipv6");
+  return name;
+}
+
+static uint64_t clockNs(clockid_t clockId)
+{
+  struct timespec ts;
+  clock_gettime(clockId, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// CLOCK_BOOTTIME when the process was started (exec, before the dynamic loader), 0 if unknown.
+// the kernel only keeps it in clock ticks
+static uint64_t processStartBootNs()
+{
+  FILE *file = fopen("/proc/self/stat", "re");
+  if (file == NULL)
+  {
+    return 0;
   }
-  catch(const cxxopts::OptionException &e)
+  char stat[1024];
+  size_t length = fread(stat, 1, sizeof(stat) - 1, file);
+  fclose(file);
+  stat[length] = '\0';
+  // the fields after the command name, which may contain anything but ends with the last ')'
+  const char *field = strrchr(stat, ')');
+  unsigned long long startTicks = 0;
+  if (field == NULL || sscanf(field + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+    &startTicks) != 1)
   {
-    std::cerr << appName << ": " << e.what() << std::endl;
-    std::cerr << "Try '" << appName << " --help' for more information." << std::endl;
-    exit(EXIT_FAILURE);
+    return 0;
   }
-  catch(const std::exception& e)
+  return (uint64_t)startTicks * (1000000000ULL / (uint64_t)sysconf(_SC_CLK_TCK));
+}
+
+static int workerCpu(size_t worker)
+{
+  return realtimeCpus.empty() ? -1 : realtimeCpus[worker % realtimeCpus.size()];
+}
+
+// 'profiler' (NULL if not --self_profile) counts this thread
+static void runWorker(RequestPipeline *pipeline, size_t worker, SelfProfiler *profiler)
+{
+  if (profiler != NULL)
   {
-    std::cerr << appName << ": " << e.what() << std::endl;
-    exit(EXIT_FAILURE);
+    profiler->open();
   }
+  if (realtimePriority > 0)
+  {
+    enterRealtime(realtimePriority, workerCpu(worker));
+  }
+  while (gotSigTerm == 0 && !pauseWorkers.load(std::memory_order_relaxed))
+  {
+    if (pipeline->processBatch() < 0)
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  pipeline->leaveConfig();
 }
 
 int main(int argc, char **argv) 
 {
   const char *appName = argv[0];
+  // the startup time is measured from the process start, the daemon is a forked child of it
+  uint64_t processStartNs = processStartBootNs();
+  uint64_t mainBootNs = clockNs(CLOCK_BOOTTIME);
 
   cxxopts::Options options(appName, "Time Sync Server Daemon: ntp like server, used to synchronize clients time fast and precisely");
-  options.add_options()
-    ("p, pidfile", "path referring to the systemd PID file of the service", cxxopts::value<std::string>()->default_value("/var/run/tssd.pid"))
-    ("dont_d", "don't run as deamon", cxxopts::value<bool>())
-    ;
-  cxxopts::ParseResult parseResult = parseOptions(argc, argv, options);
+  addOptions(options);
+  // cxxopts reorders argv, a reload parses the original again
+  std::vector<std::string> commandLine(argv, argv + argc);
+  std::string optionsError;
+  std::unique_ptr<cxxopts::ParseResult> parsedOptions = loadOptions(options, commandLine, optionsError);
+  if (!parsedOptions)
+  {
+    std::cerr << appName << ": " << optionsError << std::endl;
+    std::cerr << "Try '" << appName << " --help' for more information." << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (parsedOptions->count("help") > 0)
+  {
+    std::cout << options.help() << std::endl;
+    exit(EXIT_SUCCESS);
+  }
+  const cxxopts::ParseResult &parseResult = *parsedOptions;
 
   std::string pidfile;
   if(parseResult.count("pidfile") > 0)
@@ -233,19 +417,53 @@ int main(int argc, char **argv)
   }
 
   
-  int sockfd = -1;
-  int portno = 12321; /* port to listen on */
-  socklen_t clientlen; /* byte size of client's address */
-  struct sockaddr_in serveraddr; /* server's addr */
-  struct sockaddr_in clientaddr; /* client addr */
-  char requestBuffer[TimeRequestPacketSize];
-  char replyBuffer[TimeReplyPacketSize];
-  int optval; /* flag value for setsockopt */
-  int n; /* message byte size */
-
-  if(!parseResult["dont_d"].as<bool>())
+  unsigned short portno = parseResult["port"].as<unsigned short>(); /* port to listen on */
+  unsigned short ntpPort = parseResult["ntp_port"].as<unsigned short>();
+  std::string ipMode = parseResult["ip"].as<std::string>();
+  std::vector<Endpoint> endpoints;
+  if (!addEndpoints(endpoints, portno, false, ipMode) || (ntpPort != 0 && !addEndpoints(endpoints, ntpPort, true, ipMode)))
+  {
+    std::cerr << appName << ": unknown --ip mode '" << ipMode << "'" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  std::string upgradePath = parseResult["upgrade_socket"].as<std::string>();
+  bool upgrade = parseResult["upgrade"].as<bool>();
+  if (upgrade && upgradePath.empty())
   {
-    daemonize(pidfile.c_str());
+    std::cerr << appName << ": --upgrade requires --upgrade_socket" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (parseResult["realtime"].as<bool>())
+  {
+    realtimePriority = parseResult["realtime_priority"].as<int>();
+    if (realtimePriority < sched_get_priority_min(SCHED_FIFO) || realtimePriority > sched_get_priority_max(SCHED_FIFO))
+    {
+      std::cerr << appName << ": --realtime_priority must be in range 1-99" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::string cpuList = parseResult["realtime_cpus"].as<std::string>();
+    if (!parseCpuList(cpuList, realtimeCpus))
+    {
+      std::cerr << appName << ": --realtime_cpus '" << cpuList << "' is not a CPU list" << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    if (cpuList.empty())
+    {
+      realtimeCpus = isolatedCpus();
+    }
+  }
+  static WorkerStats workerStats[MaxEndpoints];
+  static WorkerStats streamWorkerStats;
+  unsigned short streamPort = parseResult["stream_port"].as<unsigned short>();
+
+  // under systemd (Type=notify, or socket activated) the service manager keeps track of the
+  // process, and forking would close the passed sockets and hide the readiness notification
+  std::vector<int> listenFds = systemdListenFds();
+  bool managedBySystemd = !listenFds.empty() || getenv("NOTIFY_SOCKET") != NULL;
+  bool daemonized = !parseResult["dont_d"].as<bool>() && !managedBySystemd;
+  if(daemonized)
+  {
+    daemonize(pidfile.c_str(), !upgrade);
   }
 
 	/* Open system log and write message to it */
@@ -253,97 +471,410 @@ int main(int argc, char **argv)
 	syslog(LOG_INFO, "Started time sync server daemon '%s'", appName);  
 
   signal(SIGTERM, handleSignal);
+  signal(SIGUSR1, handleSignal);
+  signal(SIGHUP, handleSignal);
 
-  /* 
-   * socket: create the parent socket 
-   */
-  sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-  if (sockfd < 0) 
-    error("ERROR opening socket");
-
-  /* setsockopt: Handy debugging trick that lets 
-   * us rerun the server immediately after we kill it; 
-   * otherwise we have to wait about 20 secs. 
-   * Eliminates "ERROR on binding: Address already in use" error. 
-   */
-  optval = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
-
-  /*
-  Set timeout on the socket. it is good for 2 reasons:
-  1. if we get a signal to terminate the service, this will give us a chance to 
-    observe the flag change and exit the loop
-  2. the code (which should react fast to time request) will be "hot" in cache,
-    thus, decreasing the response time
-  */
-  struct timeval tvForSockRecv;
-  tvForSockRecv.tv_sec = 0;
-  tvForSockRecv.tv_usec = 1000 * 50; /* value is microseconds, so timeout set to 50 ms */
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tvForSockRecv, sizeof(tvForSockRecv));
-
-  /*
-   * build the server's Internet address
-   */
-  bzero((char *) &serveraddr, sizeof(serveraddr));
-  serveraddr.sin_family = AF_INET;
-  serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
-  serveraddr.sin_port = htons((unsigned short)portno);
+  int logLevel = logPriority(parseResult["log_level"].as<std::string>());
+  if (logLevel < 0)
+  {
+    syslog(LOG_ERR, "unknown --log_level '%s'", parseResult["log_level"].as<std::string>().c_str());
+    exit(EXIT_FAILURE);
+  }
+  setlogmask(LOG_UPTO(logLevel));
 
-  /* 
-   * bind: associate the parent socket with a port 
-   */
-  if (bind(sockfd, (struct sockaddr *) &serveraddr, 
-	   sizeof(serveraddr)) < 0) 
-    error("ERROR on binding");
+  // low jitter mode, before a takeover so the self-test doesn't lengthen its pause. the memory is
+  // locked before the serving buffers are allocated, they are faulted in as they are
+  if (realtimePriority > 0)
+  {
+    std::vector<int> cpus;
+    for (size_t i = 0; i < endpoints.size() && i < realtimeCpus.size(); i++)
+    {
+      cpus.push_back(workerCpu(i));
+    }
+    if (cpus.empty())
+    {
+      syslog(LOG_WARNING, "realtime: there are no isolated CPUs (isolcpus=) and no --realtime_cpus, the workers are not pinned");
+    }
+    else if (cpus.size() < endpoints.size())
+    {
+      syslog(LOG_WARNING, "realtime: %u workers share %u CPUs", (unsigned int)endpoints.size(), (unsigned int)cpus.size());
+    }
+    checkRealtimeHost(cpus);
+    runWakeupSelfTest(cpus, realtimePriority);
+    lockMemory();
+  }
 
-  /* 
-   * main loop: wait for a datagram, check validite and response with the time
-   */
-  clientlen = sizeof(clientaddr);
-  while (gotSigTerm == 0) 
+  // live upgrade: the sockets and the state of the running tssd, which pauses until this one serves them
+  UpgradeListener upgradeListener;
+  UpgradeTakeover takeover;
+  UpgradeHandover handover;
+  uint64_t takeoverStartNs = clockNs(CLOCK_MONOTONIC);
+  if (upgrade)
+  {
+    if (!takeover.receive(upgradePath, handover))
+    {
+      exit(EXIT_FAILURE);
+    }
+    for (int fd = handover.takeSocket(UpgradeUdpSocket, 0); fd >= 0; fd = handover.takeSocket(UpgradeUdpSocket, 0))
+    {
+      listenFds.push_back(fd);
+    }
+  }
+  else if (!upgradePath.empty() && !upgradeListener.start(upgradePath, false))
+  {
+    exit(EXIT_FAILURE);
+  }
+
+  // every socket has its own worker, NTP on the same batched I/O and clock as TSP
+  UdpTransport transports[MaxEndpoints];
+  std::vector<const WorkerStats *> allWorkerStats;
+  for (size_t i = 0; i < endpoints.size(); i++)
+  {
+    int listenFd = takeListenFd(listenFds, endpoints[i]);
+    if (listenFd >= 0 ? !transports[i].adopt(listenFd) : !transports[i].open(endpoints[i].port, endpoints[i].family, endpoints[i].v6Only))
+    {
+      exit(EXIT_FAILURE);
+    }
+    allWorkerStats.push_back(&workerStats[i]);
+    syslog(LOG_INFO, "worker %u serves %s on port %u (%s)%s", (unsigned int)i, endpoints[i].ntp ? "NTP" : "TSP",
+      endpoints[i].port, endpoints[i].family == AF_INET ? "IPv4" : (endpoints[i].v6Only ? "IPv6" : "IPv6 and IPv4"),
+      listenFd < 0 ? "" : (upgrade ? ", taken over" : ", socket activated"));
+  }
+  for (size_t i = 0; i < listenFds.size(); i++)
+  {
+    syslog(LOG_WARNING, "inherited fd %d is not a socket of --port or --ntp_port, closing it", listenFds[i]);
+    close(listenFds[i]);
+  }
+  // the stream endpoint is one more worker, with its own epoll thread
+  if (streamPort != 0)
+  {
+    allWorkerStats.push_back(&streamWorkerStats);
+  }
+  StatsReporter statsReporter(allWorkerStats);
+  // a profiler per worker (the stream endpoint last), each opened on the thread of its worker
+  static SelfProfiler workerProfilers[MaxEndpoints + 1];
+  bool selfProfile = parseResult["self_profile"].as<bool>();
+  // this thread is worker 0. the workers open the same counters, so if it can't open any neither can they
+  if (selfProfile && !workerProfilers[0].open())
+  {
+    syslog(LOG_WARNING, "self profile: no counter can be opened, the workers are not profiled");
+    selfProfile = false;
+  }
+  if (selfProfile)
+  {
+    std::vector<const SelfProfiler *> profilers;
+    for (size_t i = 0; i < allWorkerStats.size(); i++)
+    {
+      profilers.push_back(&workerProfilers[i]);
+    }
+    statsReporter.setProfilers(profilers);
+  }
+  statsReporter.start(parseResult["stats_interval"].as<unsigned int>());
+
+  // the settings a reload changes, the workers read them from the current snapshot
+  ServingConfig *servingConfig = buildServingConfig(parseResult);
+  if (servingConfig == NULL)
+  {
+    exit(EXIT_FAILURE);
+  }
+  ConfigDomain configDomain(servingConfig);
+
+  // relay mode: the replies carry the time of the upstream server, kept by a background sync thread
+  DisciplinedClock relayClock;
+  TspClient::Config relayConfig;
+  relayConfig.burstSize = parseResult["relay_burst"].as<int>();
+  relayConfig.minPollSec = parseResult["relay_min_poll"].as<double>();
+  relayConfig.maxPollSec = parseResult["relay_max_poll"].as<double>();
+  relayConfig.clockId = CLOCK_MONOTONIC_RAW;
+  int relayKeyId = parseResult["relay_key_id"].as<int>();
+  if (relayKeyId != 0)
+  {
+    const SipHashKey *relayKey = relayKeyId > 0 && relayKeyId <= 65535 ? servingConfig->keys.find((uint16_t)relayKeyId) : NULL;
+    if (relayKey == NULL)
+    {
+      syslog(LOG_ERR, "--relay_key_id %d is not a key of --key_file", relayKeyId);
+      exit(EXIT_FAILURE);
+    }
+    relayConfig.keyId = (uint16_t)relayKeyId;
+    relayConfig.key = *relayKey;
+  }
+  RelaySync relaySync(relayClock, relayConfig);
+  std::string relayUpstream = parseResult["relay"].as<std::string>();
+  bool relayMode = !relayUpstream.empty();
+  const std::string *relayClockState = handover.findState("relay_clock");
+  if (relayMode && relayClockState != NULL && relayClockState->size() == sizeof(DisciplinedClock::Model))
+  {
+    DisciplinedClock::Model model;
+    memcpy(&model, relayClockState->data(), sizeof(model));
+    relayClock.restoreModel(model);
+  }
+  if (relayMode)
+  {
+    if (!relaySync.start(relayUpstream, parseResult["relay_port"].as<unsigned short>()))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  BeaconSender beaconSender;
+  beaconSender.setClock(relayMode ? &relayClock : NULL);
+  std::string beaconGroup = parseResult["beacon"].as<std::string>();
+  if (!beaconGroup.empty())
+  {
+    if (!beaconSender.start(beaconGroup, parseResult["beacon_port"].as<unsigned short>(),
+      parseResult["beacon_interval"].as<double>(), parseResult["beacon_ttl"].as<int>(),
+      parseResult["beacon_interface"].as<std::string>()))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  StreamServer streamServer(streamWorkerStats);
+  streamServer.setClock(relayMode ? &relayClock : NULL);
+  streamServer.followConfig(&configDomain);
+  if (selfProfile)
+  {
+    streamServer.setProfiler(&workerProfilers[endpoints.size()]); // after the UDP workers in allWorkerStats
+  }
+  if (streamPort != 0)
+  {
+    if (!streamServer.start(parseResult["stream_address"].as<std::string>(), streamPort,
+      parseResult["stream_max_connections"].as<int>(), handover.takeSocket(UpgradeStreamSocket, streamPort)))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  MetricsServer metricsServer(allWorkerStats);
+  metricsServer.setRelayClock(relayMode ? &relayClock : NULL);
+  metricsServer.setBeaconSender(beaconGroup.empty() ? NULL : &beaconSender);
+  metricsServer.setStreamServer(streamPort != 0 ? &streamServer : NULL);
+  unsigned short metricsPort = parseResult["metrics_port"].as<unsigned short>();
+  if (metricsPort != 0)
+  {
+    if (!metricsServer.start(parseResult["metrics_address"].as<std::string>(), metricsPort,
+      handover.takeSocket(UpgradeMetricsSocket, metricsPort)))
+    {
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t i = 0; i < handover.fds.size(); i++)
+  {
+    syslog(LOG_WARNING, "taken over fd %d is not served with the new options, closing it", handover.fds[i]);
+    close(handover.fds[i]);
+  }
+
+  // packets are logged through a per worker ring, syslog() is only called from the logger thread
+  AsyncLogger asyncLogger(parseResult["log_rate"].as<unsigned int>(), parseResult["log_sample"].as<unsigned int>());
+  LogRing *logRings[MaxEndpoints];
+  for (size_t i = 0; i < endpoints.size(); i++)
   {
-    n = recvfrom(sockfd, requestBuffer, TimeRequestPacketSize, 0, (struct sockaddr *) &clientaddr, &clientlen);
-    if (n < 0)
+    logRings[i] = asyncLogger.createRing();
+  }
+  asyncLogger.start();
+
+  // every worker records and captures its own requests, worker 0 to the path and worker N to path.N
+  static FlightRecorder flightRecorders[MaxEndpoints];
+  static TrafficCapture captures[MaxEndpoints];
+  std::string flightRecorderPath = parseResult["flight_recorder"].as<std::string>();
+  std::string capturePath = parseResult["capture"].as<std::string>();
+  for (size_t i = 0; i < endpoints.size(); i++)
+  {
+    if (!flightRecorderPath.empty() && !flightRecorders[i].open(workerFilePath(flightRecorderPath, i), (uint32_t)i,
+      parseResult["flight_recorder_size"].as<uint64_t>()))
+    {
+      exit(EXIT_FAILURE);
+    }
+    if (!capturePath.empty() && !captures[i].open(workerFilePath(capturePath, i), parseResult["capture_size"].as<uint64_t>() * 1024 * 1024))
     {
-      if(errno == EAGAIN || errno == EINTR) // timeout of the recv operation
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  std::vector<std::unique_ptr<RequestPipeline> > pipelines;
+  for (size_t i = 0; i < endpoints.size(); i++)
+  {
+    RequestPipeline *pipeline = new RequestPipeline(transports[i], workerStats[i], logRings[i],
+      flightRecorders[i].isOpen() ? &flightRecorders[i] : NULL, captures[i].isOpen() ? &captures[i] : NULL,
+      parseResult["batch_size"].as<int>());
+    pipelines.push_back(std::unique_ptr<RequestPipeline>(pipeline));
+    pipeline->setClock(relayMode ? &relayClock : NULL);
+    pipeline->followConfig(&configDomain);
+    if (endpoints[i].ntp)
+    {
+      pipeline->serveNtp((uint8_t)parseResult["ntp_stratum"].as<int>(), parseNtpReferenceId(parseResult["ntp_refid"].as<std::string>()));
+    }
+    else
+    {
+      const std::string *limiterState = handover.findState(rateLimiterStateName(endpoints[i]));
+      if (limiterState != NULL && !pipeline->restoreState(*limiterState))
       {
-        continue;
+        syslog(LOG_WARNING, "upgrade: the rate limiter state of worker %u is not compatible, starting empty", (unsigned int)i);
       }
-      else
+    }
+  }
+  RequestPipeline &pipeline = *pipelines[0];
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < pipelines.size(); i++)
+  {
+    workers.push_back(std::thread(runWorker, pipelines[i].get(), i, selfProfile ? &workerProfilers[i] : NULL));
+  }
+
+  // the failover time of a restart, the first processBatch() serves the packets queued meanwhile
+  uint64_t readyBootNs = clockNs(CLOCK_BOOTTIME);
+  if (processStartNs != 0 && processStartNs <= mainBootNs)
+  {
+    syslog(LOG_INFO, "ready %.1f ms after the process started (%.1f ms after main)", (readyBootNs - processStartNs) / 1e6,
+      (readyBootNs - mainBootNs) / 1e6);
+  }
+  else
+  {
+    syslog(LOG_INFO, "ready %.1f ms after main", (readyBootNs - mainBootNs) / 1e6);
+  }
+  if (upgrade)
+  {
+    takeover.confirm();
+    syslog(LOG_INFO, "upgrade: serving %.1f ms after the previous tssd paused",
+      (clockNs(CLOCK_MONOTONIC) - takeoverStartNs) / 1e6);
+    if (daemonized)
+    {
+      lockPidFile(pidfile.c_str(), 5000);
+    }
+    upgradeListener.start(upgradePath, true);
+  }
+  ConfigReloader reloader(options, commandLine, parseResult, configDomain, !upgradePath.empty() && !managedBySystemd);
+  reloader.start(&gotSigHup);
+  if (realtimePriority > 0)
+  {
+    // the main thread is worker 0, and every thread it starts from now on enters realtime itself
+    enterRealtime(realtimePriority, workerCpu(0));
+    syslog(LOG_INFO, "realtime: workers run SCHED_FIFO %d on %s, %.1f MB of memory locked", realtimePriority,
+      realtimeCpus.empty() ? "any CPU" : ("CPUs " + formatCpuList(realtimeCpus)).c_str(), lockedMemoryBytes() / 1048576.0);
+  }
+  systemdNotify("READY=1");
+  // keep-alives twice per watchdog interval, from the main worker's loop - a stuck worker stops them
+  uint64_t watchdogIntervalNs = systemdWatchdogUsec() * 1000 / 2;
+  uint64_t nextWatchdogNs = 0;
+
+  /* 
+   * main loop: wait for datagrams, check validite and response with the time
+   */
+  bool handedOver = false;
+  while (gotSigTerm == 0 && !handedOver) 
+  {
+    if (gotSigUsr1)
+    {
+      gotSigUsr1 = 0;
+      syslog(LOG_INFO, "got SIGUSR1, dumping the flight recorders");
+      for (size_t i = 0; i < endpoints.size(); i++)
       {
-        syslog(LOG_ERR, "recv from socket failed because: '%m'");
-        exit(EXIT_FAILURE);
+        flightRecorders[i].requestDump();
       }
     }
 
-    if(n < TimeRequestPacketSize)
+    if (pipeline.processBatch() < 0)
     {
-      // packet is too short - just ignore it (todo: write to log)
-      continue;
+      exit(EXIT_FAILURE);
     }
 
-    // check header of packet - to make sure it is a TSP (time sync protocol) packet
-    if(*(requestBuffer + 0) != 'T' ||
-        *(requestBuffer + 1) != 'S' ||
-        *(requestBuffer + 2) != 'P')
+    if (watchdogIntervalNs != 0)
     {
-      // not an TSP message (todo: write to log)
-      continue;
+      uint64_t nowNs = clockNs(CLOCK_MONOTONIC);
+      if (nowNs >= nextWatchdogNs)
+      {
+        systemdNotify("WATCHDOG=1");
+        nextWatchdogNs = nowNs + watchdogIntervalNs;
+      }
     }
 
-    struct timeval tvCurrTime;
-    gettimeofday(&tvCurrTime, NULL);
-    // convert sec to ms and usec to ms
-    uint64_t currTimeMsSinceEpoch = ((uint64_t)(tvCurrTime.tv_sec)) * 1000 + ((uint64_t)(tvCurrTime.tv_usec)) / 1000;
+    if (upgradeListener.requested())
+    {
+      // the workers answer their current batch and stop, what arrives meanwhile waits in the socket queues
+      pauseWorkers.store(true);
+      for (size_t i = 0; i < workers.size(); i++)
+      {
+        workers[i].join();
+      }
+      workers.clear();
+      // the listening sockets stay open here too, but only the new tssd accepts on them
+      streamServer.pauseAccepting();
+      metricsServer.pauseAccepting();
+
+      UpgradeHandover outgoing;
+      for (size_t i = 0; i < endpoints.size(); i++)
+      {
+        outgoing.addSocket(UpgradeUdpSocket, transports[i].fd());
+        if (!endpoints[i].ntp)
+        {
+          outgoing.addState(rateLimiterStateName(endpoints[i]), pipelines[i]->saveState());
+        }
+      }
+      if (streamServer.listenFd() >= 0)
+      {
+        outgoing.addSocket(UpgradeStreamSocket, streamServer.listenFd());
+      }
+      if (metricsServer.listenFd() >= 0)
+      {
+        outgoing.addSocket(UpgradeMetricsSocket, metricsServer.listenFd());
+      }
+      DisciplinedClock::Model model;
+      if (relayMode && relayClock.saveModel(model))
+      {
+        outgoing.addState("relay_clock", std::string((const char *)&model, sizeof(model)));
+      }
+      pipeline.leaveConfig(); // a reload doesn't wait for the handover
+      handedOver = upgradeListener.handOver(outgoing);
 
-    memcpy(replyBuffer, requestBuffer, TimeRequestPacketSize);
-    ((TimeReply *)replyBuffer)->timeSinceEphoc1970Ms = currTimeMsSinceEpoch;
-    n = sendto(sockfd, replyBuffer, TimeReplyPacketSize, MSG_CONFIRM, (struct sockaddr *) &clientaddr, clientlen);
-    if (n < 0) 
-      error("ERROR in sendto");
+      if (handedOver)
+      {
+        // the new tssd takes the pid file
+        if (pidFileFd >= 0)
+        {
+          close(pidFileFd);
+          pidFileFd = -1;
+        }
+      }
+      else
+      {
+        syslog(LOG_WARNING, "upgrade: serving again");
+        streamServer.resumeAccepting();
+        metricsServer.resumeAccepting();
+        pauseWorkers.store(false);
+        for (size_t i = 1; i < pipelines.size(); i++)
+        {
+          workers.push_back(std::thread(runWorker, pipelines[i].get(), i, selfProfile ? &workerProfilers[i] : NULL));
+        }
+      }
+    }
   }
+  if (gotSigTerm != 0)
+  {
+    syslog(LOG_INFO, "got SIGTERM, stopping");
+  }
+  systemdNotify("STOPPING=1");
 
-  close(sockfd);
+  pipeline.leaveConfig();
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    workers[i].join();
+  }
+  reloader.stop();
+  for (size_t i = 0; i < endpoints.size(); i++)
+  {
+    captures[i].close();
+    flightRecorders[i].close();
+  }
+  asyncLogger.stop();
+  upgradeListener.stop();
+  metricsServer.stop();
+  streamServer.stop();
+  beaconSender.stop();
+  relaySync.stop();
+  statsReporter.stop();
+  for (size_t i = 0; i < endpoints.size(); i++)
+  {
+    transports[i].close();
+  }
 	syslog(LOG_INFO, "Stopped time sync server daemon '%s'", appName);
 
   return EXIT_SUCCESS;
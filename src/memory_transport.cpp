@@ -0,0 +1,55 @@
+#include "memory_transport.h"
+
+#include <string.h>
+#include <time.h>
+
+MemoryTransport::MemoryTransport(const std::vector<Datagram> &requests, size_t captureLimit)
+  : requests_(requests), next_(0), rounds_(0), round_(0), captureLimit_(captureLimit),
+    received_(0), sent_(0)
+{
+  captured_.reserve(captureLimit_);
+}
+
+int MemoryTransport::receive(Datagram *datagrams, int maxCount)
+{
+  if (requests_.empty() || (rounds_ != 0 && round_ >= rounds_))
+  {
+    return -1;
+  }
+
+  // all the datagrams of a batch "arrive" at the same time, like a burst on a socket
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  uint64_t rxTimeNs = ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+
+  int n = 0;
+  while (n < maxCount)
+  {
+    const Datagram &request = requests_[next_];
+    memcpy(datagrams[n].data, request.data, request.length);
+    datagrams[n].length = request.length;
+    datagrams[n].peer = request.peer;
+    datagrams[n].rxTimeNs = rxTimeNs;
+    n++;
+    if (++next_ == requests_.size())
+    {
+      next_ = 0;
+      if (rounds_ != 0 && ++round_ >= rounds_)
+      {
+        break;
+      }
+    }
+  }
+  received_ += n;
+  return n;
+}
+
+int MemoryTransport::send(const Datagram *datagrams, int count)
+{
+  for (int i = 0; i < count && captured_.size() < captureLimit_; i++)
+  {
+    captured_.push_back(datagrams[i]);
+  }
+  sent_ += count;
+  return count;
+}
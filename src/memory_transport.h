@@ -0,0 +1,56 @@
+#ifndef TSSD_MEMORY_TRANSPORT_H
+#define TSSD_MEMORY_TRANSPORT_H
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "transport.h"
+
+/*
+ * Transport without sockets, for deterministic benchmarks of the request
+ * pipeline: receive() feeds a prepared list of requests (over and over),
+ * and send() captures the replies - the first 'captureLimit' are kept,
+ * the rest are only counted.
+ */
+class MemoryTransport : public Transport
+{
+public:
+  explicit MemoryTransport(const std::vector<Datagram> &requests, size_t captureLimit = 0);
+
+  // requests are fed this many times (0 means forever), then receive() returns -1
+  void setRounds(uint64_t rounds)
+  {
+    rounds_ = rounds;
+  }
+
+  virtual int receive(Datagram *datagrams, int maxCount);
+  virtual int send(const Datagram *datagrams, int count);
+
+  const std::vector<Datagram> &captured() const
+  {
+    return captured_;
+  }
+
+  uint64_t received() const
+  {
+    return received_;
+  }
+
+  uint64_t sent() const
+  {
+    return sent_;
+  }
+
+private:
+  std::vector<Datagram> requests_;
+  size_t next_;
+  uint64_t rounds_;
+  uint64_t round_;
+  size_t captureLimit_;
+  std::vector<Datagram> captured_;
+  uint64_t received_;
+  uint64_t sent_;
+};
+
+#endif // TSSD_MEMORY_TRANSPORT_H
@@ -0,0 +1,440 @@
+#include "metrics_server.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timex.h>
+
+#include <sstream>
+
+#include "transport.h"
+
+static const int MaxRequestSize = 4096;
+static const int ConnectionDeadlineMs = 2000; // for the whole request and response, however slowly the client trickles
+static const int StopPollIntervalMs = 200;
+
+// histogram bucket bounds exported to prometheus, in seconds
+static const double LatencyBucketBoundsSec[] = {
+  0.000005, 0.00001, 0.000025, 0.00005, 0.0001, 0.00025, 0.0005,
+  0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1
+};
+
+MetricsServer::MetricsServer(const std::vector<const WorkerStats *> &workers)
+  : workers_(workers), relayClock_(NULL), beaconSender_(NULL), streamServer_(NULL), listenFd_(-1), acceptPaused_(false),
+    stopRequested_(false)
+{
+}
+
+void MetricsServer::setRelayClock(const DisciplinedClock *clock)
+{
+  relayClock_ = clock;
+}
+
+void MetricsServer::setBeaconSender(const BeaconSender *beaconSender)
+{
+  beaconSender_ = beaconSender;
+}
+
+void MetricsServer::setStreamServer(const StreamServer *streamServer)
+{
+  streamServer_ = streamServer;
+}
+
+MetricsServer::~MetricsServer()
+{
+  stop();
+}
+
+bool MetricsServer::start(const std::string &address, unsigned short port, int listenFd)
+{
+  if (listenFd >= 0)
+  {
+    listenFd_ = listenFd;
+    thread_ = std::thread(&MetricsServer::run, this);
+    syslog(LOG_INFO, "metrics: serving /metrics on the socket of the previous tssd (%s:%u)", address.c_str(), port);
+    return true;
+  }
+
+  // an IPv4 or an IPv6 address
+  SocketAddress addr;
+  socklen_t addrLength;
+  bzero((char *) &addr, sizeof(addr));
+  if (inet_pton(AF_INET, address.c_str(), &addr.v4.sin_addr) == 1)
+  {
+    addr.v4.sin_family = AF_INET;
+    addr.v4.sin_port = htons(port);
+    addrLength = sizeof(addr.v4);
+  }
+  else if (inet_pton(AF_INET6, address.c_str(), &addr.v6.sin6_addr) == 1)
+  {
+    addr.v6.sin6_family = AF_INET6;
+    addr.v6.sin6_port = htons(port);
+    addrLength = sizeof(addr.v6);
+  }
+  else
+  {
+    syslog(LOG_ERR, "metrics: invalid address '%s'", address.c_str());
+    return false;
+  }
+
+  // non blocking, another process may accept the connection poll() reported (live upgrade)
+  listenFd_ = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenFd_ < 0)
+  {
+    syslog(LOG_ERR, "metrics: cannot create socket: '%m'");
+    return false;
+  }
+  int optval = 1;
+  setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+  if (bind(listenFd_, &addr.sa, addrLength) < 0 || listen(listenFd_, 16) < 0)
+  {
+    syslog(LOG_ERR, "metrics: cannot listen on %s:%u: '%m'", address.c_str(), port);
+    close(listenFd_);
+    listenFd_ = -1;
+    return false;
+  }
+
+  thread_ = std::thread(&MetricsServer::run, this);
+  syslog(LOG_INFO, "metrics: serving /metrics on %s:%u", address.c_str(), port);
+  return true;
+}
+
+void MetricsServer::stop()
+{
+  stopRequested_.store(true);
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  if (listenFd_ >= 0)
+  {
+    close(listenFd_);
+    listenFd_ = -1;
+  }
+}
+
+void MetricsServer::pauseAccepting()
+{
+  std::lock_guard<std::mutex> lock(acceptMutex_);
+  acceptPaused_.store(true);
+}
+
+void MetricsServer::resumeAccepting()
+{
+  std::lock_guard<std::mutex> lock(acceptMutex_);
+  acceptPaused_.store(false);
+}
+
+// scraping is never urgent - let the scheduler run it only when nothing else wants the cpu
+static void lowerThreadPriority()
+{
+  struct sched_param param;
+  bzero(&param, sizeof(param));
+  if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &param) != 0)
+  {
+    setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+  }
+}
+
+void MetricsServer::run()
+{
+  lowerThreadPriority();
+
+  struct pollfd pfd;
+  pfd.events = POLLIN;
+  while (!stopRequested_.load())
+  {
+    pfd.fd = acceptPaused_.load() ? -1 : listenFd_; // poll() skips a negative fd, and only waits
+    int ready = poll(&pfd, 1, StopPollIntervalMs);
+    if (ready <= 0)
+    {
+      continue;
+    }
+    int connFd;
+    {
+      std::lock_guard<std::mutex> lock(acceptMutex_);
+      connFd = acceptPaused_.load() ? -1 : accept4(listenFd_, NULL, NULL, SOCK_CLOEXEC);
+    }
+    if (connFd < 0)
+    {
+      continue;
+    }
+    serveConnection(connFd);
+    close(connFd);
+  }
+}
+
+static uint64_t monotonicMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000ULL + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// false if 'fd' isn't ready for 'events' before 'deadlineMs' (monotonic)
+static bool waitReady(int fd, short events, uint64_t deadlineMs)
+{
+  struct pollfd pfd;
+  pfd.fd = fd;
+  pfd.events = events;
+  for (;;)
+  {
+    uint64_t now = monotonicMs();
+    if (now >= deadlineMs)
+    {
+      return false;
+    }
+    int ready = poll(&pfd, 1, (int)(deadlineMs - now));
+    if (ready > 0)
+    {
+      return true;
+    }
+    if (ready < 0 && errno != EINTR)
+    {
+      return false;
+    }
+  }
+}
+
+static bool sendAll(int fd, const std::string &data, uint64_t deadlineMs)
+{
+  size_t sent = 0;
+  while (sent < data.size())
+  {
+    if (!waitReady(fd, POLLOUT, deadlineMs))
+    {
+      return false;
+    }
+    ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+void MetricsServer::serveConnection(int connFd)
+{
+  // the connection is closed once the deadline passes, wherever it is
+  uint64_t deadlineMs = monotonicMs() + ConnectionDeadlineMs;
+
+  // read until the end of the request headers, the body (if any) is ignored
+  char request[MaxRequestSize + 1];
+  int received = 0;
+  while (received < MaxRequestSize)
+  {
+    if (!waitReady(connFd, POLLIN, deadlineMs))
+    {
+      return;
+    }
+    ssize_t n = recv(connFd, request + received, MaxRequestSize - received, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return;
+    }
+    received += n;
+    request[received] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+    {
+      break;
+    }
+  }
+  request[received] = '\0';
+
+  if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET /metrics?", 13) != 0)
+  {
+    sendAll(connFd, "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", deadlineMs);
+    return;
+  }
+
+  std::string body = renderMetrics();
+  std::ostringstream response;
+  response << "HTTP/1.0 200 OK\r\n"
+    << "Content-Type: text/plain; version=0.0.4\r\n"
+    << "Content-Length: " << body.size() << "\r\n"
+    << "Connection: close\r\n\r\n"
+    << body;
+  sendAll(connFd, response.str(), deadlineMs);
+}
+
+static void writeCounter(std::ostringstream &out, const char *name, const char *help,
+  const std::vector<const WorkerStats *> &workers, const StatCounter WorkerStats::*counter)
+{
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " counter\n";
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    out << name << "{worker=\"" << i << "\"} " << (workers[i]->*counter).load() << "\n";
+  }
+}
+
+static void writeHistogram(std::ostringstream &out, const char *name, const char *help,
+  const std::vector<const WorkerStats *> &workers, const LatencyHistogram WorkerStats::*histogram)
+{
+  HistogramSnapshot merged;
+  HistogramSnapshot workerSnapshot;
+  for (size_t i = 0; i < workers.size(); i++)
+  {
+    (workers[i]->*histogram).snapshot(workerSnapshot);
+    merged.merge(workerSnapshot);
+  }
+
+  out << "# HELP " << name << " " << help << "\n";
+  out << "# TYPE " << name << " histogram\n";
+  for (size_t i = 0; i < sizeof(LatencyBucketBoundsSec) / sizeof(LatencyBucketBoundsSec[0]); i++)
+  {
+    uint64_t boundNs = (uint64_t)(LatencyBucketBoundsSec[i] * 1e9 + 0.5);
+    out << name << "_bucket{le=\"" << LatencyBucketBoundsSec[i] << "\"} " << merged.countAtOrBelow(boundNs) << "\n";
+  }
+  out << name << "_bucket{le=\"+Inf\"} " << merged.total << "\n";
+  out << name << "_sum " << merged.sum / 1e9 << "\n";
+  out << name << "_count " << merged.total << "\n";
+}
+
+static std::string currentClockSource()
+{
+  std::string source = "unknown";
+  FILE *f = fopen("/sys/devices/system/clocksource/clocksource0/current_clocksource", "re");
+  if (f != NULL)
+  {
+    char buf[64];
+    if (fgets(buf, sizeof(buf), f) != NULL)
+    {
+      buf[strcspn(buf, "\n")] = '\0';
+      source = buf;
+    }
+    fclose(f);
+  }
+  return source;
+}
+
+static void writeClockState(std::ostringstream &out)
+{
+  out << "# HELP tssd_clock_source_info Kernel clock source used for timestamps\n";
+  out << "# TYPE tssd_clock_source_info gauge\n";
+  out << "tssd_clock_source_info{source=\"" << currentClockSource() << "\"} 1\n";
+
+  struct timex tx;
+  bzero(&tx, sizeof(tx));
+  int state = adjtimex(&tx);
+  if (state < 0)
+  {
+    return;
+  }
+  out << "# HELP tssd_clock_synchronized Whether the kernel considers the system clock synchronized\n";
+  out << "# TYPE tssd_clock_synchronized gauge\n";
+  out << "tssd_clock_synchronized " << ((state != TIME_ERROR && (tx.status & STA_UNSYNC) == 0) ? 1 : 0) << "\n";
+  out << "# HELP tssd_clock_estimated_error_seconds Estimated error of the system clock\n";
+  out << "# TYPE tssd_clock_estimated_error_seconds gauge\n";
+  out << "tssd_clock_estimated_error_seconds " << tx.esterror / 1e6 << "\n";
+  out << "# HELP tssd_clock_max_error_seconds Maximum error of the system clock\n";
+  out << "# TYPE tssd_clock_max_error_seconds gauge\n";
+  out << "tssd_clock_max_error_seconds " << tx.maxerror / 1e6 << "\n";
+}
+
+std::string MetricsServer::renderMetrics() const
+{
+  std::ostringstream out;
+
+  writeCounter(out, "tssd_requests_total", "Datagrams received", workers_, &WorkerStats::requests);
+  writeCounter(out, "tssd_replies_total", "Replies sent", workers_, &WorkerStats::replies);
+  writeCounter(out, "tssd_send_failed_total", "Replies the kernel didn't send, e.g. since there is no route to the client", workers_, &WorkerStats::sendFailed);
+
+  out << "# HELP tssd_dropped_requests_total Datagrams dropped since they are not valid requests\n";
+  out << "# TYPE tssd_dropped_requests_total counter\n";
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"too_short\"} " << workers_[i]->tooShort.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"not_tsp\"} " << workers_[i]->notTsp.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"not_ntp_client\"} " << workers_[i]->notNtpClient.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"not_synchronized\"} " << workers_[i]->notSynchronized.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"auth_failed\"} " << workers_[i]->authFailed.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"not_authenticated\"} " << workers_[i]->notAuthenticated.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"access_denied\"} " << workers_[i]->accessDenied.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"batch_too_large\"} " << workers_[i]->batchTooLarge.load() << "\n";
+    out << "tssd_dropped_requests_total{worker=\"" << i << "\",reason=\"batch_rate_limited\"} " << workers_[i]->batchRateLimited.load() << "\n";
+  }
+
+  writeCounter(out, "tssd_batch_requests_total", "Batch requests served", workers_, &WorkerStats::batchRequests);
+  writeCounter(out, "tssd_batch_cookies_total", "Cookies served in batch requests", workers_, &WorkerStats::batchCookies);
+  writeCounter(out, "tssd_auth_requests_total", "Authenticated requests served", workers_, &WorkerStats::authRequests);
+
+  out << "# HELP tssd_socket_queue_drops_total Datagrams dropped by the kernel since the socket receive queue was full\n";
+  out << "# TYPE tssd_socket_queue_drops_total counter\n";
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    out << "tssd_socket_queue_drops_total{worker=\"" << i << "\"} " << workers_[i]->socketQueueDrops.load(std::memory_order_relaxed) << "\n";
+  }
+
+  out << "# HELP tssd_worker_cpu CPU the worker was last seen running on\n";
+  out << "# TYPE tssd_worker_cpu gauge\n";
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    out << "tssd_worker_cpu{worker=\"" << i << "\"} " << workers_[i]->cpu.load(std::memory_order_relaxed) << "\n";
+  }
+
+  writeHistogram(out, "tssd_service_time_seconds", "Time from kernel receive timestamp until the reply was sent", workers_, &WorkerStats::serviceTime);
+  writeHistogram(out, "tssd_reply_build_time_seconds", "Time spent building the reply", workers_, &WorkerStats::buildTime);
+
+  writeClockState(out);
+
+  if (relayClock_ != NULL)
+  {
+    out << "# HELP tssd_relay_synchronized Whether the relay's clock is synchronized to the upstream server\n";
+    out << "# TYPE tssd_relay_synchronized gauge\n";
+    out << "tssd_relay_synchronized " << (relayClock_->isSynchronized() ? 1 : 0) << "\n";
+    out << "# HELP tssd_relay_uncertainty_seconds Error bound of the last upstream sample of the relay\n";
+    out << "# TYPE tssd_relay_uncertainty_seconds gauge\n";
+    out << "tssd_relay_uncertainty_seconds " << relayClock_->uncertaintyNs() / 1e9 << "\n";
+    out << "# HELP tssd_relay_frequency_ppm Frequency correction of the relay's clock\n";
+    out << "# TYPE tssd_relay_frequency_ppm gauge\n";
+    out << "tssd_relay_frequency_ppm " << relayClock_->frequencyPpm() << "\n";
+  }
+
+  if (beaconSender_ != NULL)
+  {
+    out << "# HELP tssd_beacons_sent_total Beacons sent to the beacon group\n";
+    out << "# TYPE tssd_beacons_sent_total counter\n";
+    out << "tssd_beacons_sent_total " << beaconSender_->beaconsSent() << "\n";
+    out << "# HELP tssd_beacon_tx_timestamps_total Beacons the kernel reported a TX timestamp for\n";
+    out << "# TYPE tssd_beacon_tx_timestamps_total counter\n";
+    out << "tssd_beacon_tx_timestamps_total " << beaconSender_->txTimestamps() << "\n";
+  }
+
+  if (streamServer_ != NULL)
+  {
+    out << "# HELP tssd_stream_connections Open TCP and WebSocket connections\n";
+    out << "# TYPE tssd_stream_connections gauge\n";
+    out << "tssd_stream_connections " << streamServer_->connections() << "\n";
+    out << "# HELP tssd_stream_connections_rejected_total Connections closed right away since --stream_max_connections were open\n";
+    out << "# TYPE tssd_stream_connections_rejected_total counter\n";
+    out << "tssd_stream_connections_rejected_total " << streamServer_->connectionsRejected() << "\n";
+    out << "# HELP tssd_stream_slow_readers_dropped_total Connections closed since the client didn't read its replies\n";
+    out << "# TYPE tssd_stream_slow_readers_dropped_total counter\n";
+    out << "tssd_stream_slow_readers_dropped_total " << streamServer_->slowReadersDropped() << "\n";
+  }
+
+  return out.str();
+}
@@ -0,0 +1,67 @@
+#ifndef TSSD_METRICS_SERVER_H
+#define TSSD_METRICS_SERVER_H
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "beacon_sender.h"
+#include "disciplined_clock.h"
+#include "stream_server.h"
+#include "worker_stats.h"
+
+/*
+ * Serves the statistics of the workers in Prometheus text format on
+ * 'GET /metrics', from a dedicated thread with the lowest scheduling
+ * priority. The workers are never locked - their counters are read with
+ * relaxed loads - so a slow or hostile scraper can only stall this thread,
+ * never the UDP replies. Connections are served one at a time, each within
+ * a short deadline.
+ */
+class MetricsServer
+{
+public:
+  explicit MetricsServer(const std::vector<const WorkerStats *> &workers);
+  ~MetricsServer();
+
+  // returns false (and logs the reason) if the listening socket cannot be created.
+  // 'listenFd' is a listening socket to serve instead of creating one (live upgrade)
+  bool start(const std::string &address, unsigned short port, int listenFd = -1);
+  void stop();
+
+  // no connection is accepted once it returns - while another process takes the listening
+  // socket over (live upgrade). resumeAccepting() if it doesn't
+  void pauseAccepting();
+  void resumeAccepting();
+
+  int listenFd() const
+  {
+    return listenFd_;
+  }
+
+  // relay mode: also export the state of the relay's clock
+  void setRelayClock(const DisciplinedClock *clock);
+  // beacon mode: also export the beacon counters
+  void setBeaconSender(const BeaconSender *beaconSender);
+  // stream endpoint: also export its connection counts
+  void setStreamServer(const StreamServer *streamServer);
+
+private:
+  void run();
+  void serveConnection(int connFd);
+  std::string renderMetrics() const;
+
+  std::vector<const WorkerStats *> workers_;
+  const DisciplinedClock *relayClock_;
+  const BeaconSender *beaconSender_;
+  const StreamServer *streamServer_;
+  int listenFd_;
+  std::mutex acceptMutex_; // held while accepting, so a pause waits for an accept in progress
+  std::atomic<bool> acceptPaused_;
+  std::atomic<bool> stopRequested_;
+  std::thread thread_;
+};
+
+#endif // TSSD_METRICS_SERVER_H
@@ -0,0 +1,131 @@
+#ifndef TSSD_NTP_PROTOCOL_H
+#define TSSD_NTP_PROTOCOL_H
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+/*
+ * Wire format of NTPv4 (RFC 5905) packets, as far as a server answering
+ * client mode requests needs it. All the fields are in network byte order.
+ */
+
+struct __attribute__((__packed__)) NtpPacket
+{
+    uint8_t liVnMode; // leap indicator (2 bits), version (3 bits), mode (3 bits)
+    uint8_t stratum;
+    int8_t poll; // log2 seconds
+    int8_t precision; // log2 seconds
+    uint32_t rootDelay; // NTP short format, 16.16 seconds
+    uint32_t rootDispersion; // NTP short format, 16.16 seconds
+    uint32_t referenceId;
+    uint64_t referenceTimestamp; // NTP timestamp format, 32.32 seconds since 1900
+    uint64_t originTimestamp;
+    uint64_t receiveTimestamp;
+    uint64_t transmitTimestamp;
+};
+
+const int NtpPacketSize = sizeof(NtpPacket);
+
+enum NtpMode
+{
+  NtpModeClient = 3,
+  NtpModeServer = 4
+};
+
+const uint8_t NtpLeapNone = 0;
+const uint8_t NtpLeapUnsynchronized = 3;
+const uint8_t NtpStratumUnsynchronized = 16; // RFC 5905, what an unsynchronized server reports
+
+// seconds from the NTP era (1900) to the unix epoch (1970)
+const uint64_t NtpEpochOffsetSec = 2208988800ULL;
+
+inline uint8_t ntpMode(uint8_t liVnMode)
+{
+  return liVnMode & 0x7;
+}
+
+inline uint8_t ntpVersion(uint8_t liVnMode)
+{
+  return (liVnMode >> 3) & 0x7;
+}
+
+inline uint8_t ntpLeap(uint8_t liVnMode)
+{
+  return liVnMode >> 6;
+}
+
+// a client mode request of a version we answer, NTPv1 has no modes
+inline bool isNtpClientRequest(const char *buffer, int length)
+{
+  if (length < NtpPacketSize)
+  {
+    return false;
+  }
+  uint8_t liVnMode = ((const NtpPacket *)buffer)->liVnMode;
+  uint8_t version = ntpVersion(liVnMode);
+  return ntpMode(liVnMode) == NtpModeClient && version >= 2 && version <= 4;
+}
+
+inline uint64_t hostToNetwork64(uint64_t value)
+{
+  return ((uint64_t)htonl((uint32_t)value) << 32) | htonl((uint32_t)(value >> 32));
+}
+
+// ns since the unix epoch to the NTP timestamp format, in network byte order
+inline uint64_t ntpTimestamp(uint64_t timeNs)
+{
+  uint64_t seconds = timeNs / 1000000000ULL + NtpEpochOffsetSec;
+  uint64_t fraction = ((timeNs % 1000000000ULL) << 32) / 1000000000ULL;
+  return hostToNetwork64((seconds << 32) | fraction);
+}
+
+// seconds to the NTP short format, in network byte order
+inline uint32_t ntpShort(double seconds)
+{
+  if (seconds < 0.0)
+  {
+    seconds = 0.0;
+  }
+  if (seconds >= 65535.0)
+  {
+    return htonl(0xffffffff);
+  }
+  return htonl((uint32_t)(seconds * 65536.0));
+}
+
+/*
+ * What a server tells about itself in every reply. The timestamps are
+ * filled per reply.
+ */
+struct NtpServerInfo
+{
+  uint8_t leap; // NtpLeapNone or NtpLeapUnsynchronized
+  uint8_t stratum;
+  int8_t precision;
+  uint32_t referenceId; // network byte order
+  uint64_t referenceTimeNs; // when the clock was last set, ns since the epoch
+  double rootDelaySec;
+  double rootDispersionSec;
+};
+
+// the reply echoes the version and poll of the request, and its transmit timestamp as the origin.
+// while unsynchronized the server reports stratum 16, whatever its stratum is
+inline void encodeNtpReply(const char *requestBuffer, const NtpServerInfo &info, uint64_t receiveNs, uint64_t transmitNs,
+  char *replyBuffer)
+{
+  const NtpPacket *request = (const NtpPacket *)requestBuffer;
+  NtpPacket *reply = (NtpPacket *)replyBuffer;
+  reply->liVnMode = (uint8_t)((info.leap << 6) | (ntpVersion(request->liVnMode) << 3) | NtpModeServer);
+  reply->stratum = info.leap == NtpLeapUnsynchronized ? NtpStratumUnsynchronized : info.stratum;
+  reply->poll = request->poll;
+  reply->precision = info.precision;
+  reply->rootDelay = ntpShort(info.rootDelaySec);
+  reply->rootDispersion = ntpShort(info.rootDispersionSec);
+  reply->referenceId = info.referenceId;
+  reply->referenceTimestamp = ntpTimestamp(info.referenceTimeNs);
+  reply->originTimestamp = request->transmitTimestamp;
+  reply->receiveTimestamp = ntpTimestamp(receiveNs);
+  reply->transmitTimestamp = ntpTimestamp(transmitNs);
+}
+
+#endif // TSSD_NTP_PROTOCOL_H
@@ -0,0 +1,33 @@
+#ifndef TSSD_PROBES_H
+#define TSSD_PROBES_H
+
+/*
+ * USDT (user level statically defined tracing) probes of the request path,
+ * for tracing a running server with perf, bpftrace or systemtap, e.g.:
+ *   bpftrace -e 'usdt:/usr/bin/tssd:tssd:reply_sent { @[arg1 / 1000] = count(); }'
+ * A disabled probe is a single nop. Without <sys/sdt.h> the probes compile to nothing.
+ */
+
+#ifdef TSSD_HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+// datagram received: length, kernel RX timestamp (ns since epoch)
+#define TSSD_PROBE_REQUEST_RECEIVED(length, rxTimeNs) DTRACE_PROBE2(tssd, request_received, length, rxTimeNs)
+// datagram dropped by validation: reason (LogCategory), length
+#define TSSD_PROBE_REQUEST_REJECTED(reason, length) DTRACE_PROBE2(tssd, request_rejected, reason, length)
+// reply timestamp taken: client cookie, timestamp (ms since epoch)
+#define TSSD_PROBE_TIMESTAMP(cookie, timeMs) DTRACE_PROBE2(tssd, timestamp, cookie, timeMs)
+// reply sent: client cookie, service time (ns since the kernel RX timestamp)
+#define TSSD_PROBE_REPLY_SENT(cookie, serviceTimeNs) DTRACE_PROBE2(tssd, reply_sent, cookie, serviceTimeNs)
+
+#else
+
+#define TSSD_PROBE_REQUEST_RECEIVED(length, rxTimeNs) do {} while (0)
+#define TSSD_PROBE_REQUEST_REJECTED(reason, length) do {} while (0)
+#define TSSD_PROBE_TIMESTAMP(cookie, timeMs) do {} while (0)
+#define TSSD_PROBE_REPLY_SENT(cookie, serviceTimeNs) do {} while (0)
+
+#endif
+
+#endif // TSSD_PROBES_H
@@ -0,0 +1,423 @@
+#include "realtime.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <algorithm>
+#include <thread>
+
+static const int SelfTestWakeups = 1000;
+static const long SelfTestIntervalNs = 200000;
+static const uint64_t WakeupWarnNs = 50000; // a worker CPU which wakes up later than this is reported as a warning
+static const size_t StackPrefaultBytes = 256 * 1024;
+static const size_t LockedThreadStackBytes = 1024 * 1024; // instead of 8MB (RLIMIT_STACK), every byte of a stack is locked
+static const int MaxIrqExamples = 8;
+
+bool parseCpuList(const std::string &list, std::vector<int> &cpus)
+{
+  cpus.clear();
+  size_t start = 0;
+  while (start < list.size())
+  {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+    {
+      end = list.size();
+    }
+    std::string entry = list.substr(start, end - start);
+    start = end + 1;
+    size_t first = entry.find_first_not_of(" \t\n");
+    if (first == std::string::npos)
+    {
+      continue;
+    }
+    entry = entry.substr(first, entry.find_last_not_of(" \t\n") - first + 1);
+
+    char *rangeEnd;
+    long low = strtol(entry.c_str(), &rangeEnd, 10);
+    long high = low;
+    if (*rangeEnd == '-')
+    {
+      high = strtol(rangeEnd + 1, &rangeEnd, 10);
+    }
+    if (rangeEnd == entry.c_str() || *rangeEnd != '\0' || !isdigit((unsigned char)entry[entry.size() - 1]) || low < 0 ||
+      high < low || high >= CPU_SETSIZE)
+    {
+      return false;
+    }
+    for (long cpu = low; cpu <= high; cpu++)
+    {
+      cpus.push_back((int)cpu);
+    }
+  }
+  return true;
+}
+
+std::string formatCpuList(const std::vector<int> &cpus)
+{
+  std::string list;
+  size_t i = 0;
+  while (i < cpus.size())
+  {
+    size_t last = i;
+    while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1)
+    {
+      last++;
+    }
+    char entry[32];
+    if (last == i)
+    {
+      snprintf(entry, sizeof(entry), "%d", cpus[i]);
+    }
+    else
+    {
+      snprintf(entry, sizeof(entry), "%d-%d", cpus[i], cpus[last]);
+    }
+    list += (list.empty() ? "" : ",") + std::string(entry);
+    i = last + 1;
+  }
+  return list;
+}
+
+// the first line of a file, false if it can't be read
+static bool readFirstLine(const std::string &path, std::string &line)
+{
+  FILE *file = fopen(path.c_str(), "re");
+  if (file == NULL)
+  {
+    return false;
+  }
+  char buffer[4096];
+  bool read = fgets(buffer, sizeof(buffer), file) != NULL;
+  fclose(file);
+  line = read ? buffer : "";
+  return true;
+}
+
+// the CPUs of a sysfs cpu list file, empty if there is none
+static std::vector<int> readCpuList(const std::string &path)
+{
+  std::string line;
+  std::vector<int> cpus;
+  if (!readFirstLine(path, line) || !parseCpuList(line, cpus))
+  {
+    cpus.clear();
+  }
+  return cpus;
+}
+
+// the CPUs of a hex cpu mask like "00000000,0000000f"
+static std::vector<int> parseCpuMask(const std::string &mask)
+{
+  std::vector<int> cpus;
+  int bit = 0;
+  for (size_t i = mask.size(); i-- > 0;)
+  {
+    if (!isxdigit((unsigned char)mask[i]))
+    {
+      continue;
+    }
+    int digit = isdigit((unsigned char)mask[i]) ? mask[i] - '0' : tolower((unsigned char)mask[i]) - 'a' + 10;
+    for (int j = 0; j < 4; j++, bit++)
+    {
+      if ((digit & (1 << j)) != 0)
+      {
+        cpus.push_back(bit);
+      }
+    }
+  }
+  return cpus;
+}
+
+// the CPUs of 'cpus' which are not in 'set'
+static std::vector<int> missingFrom(const std::vector<int> &cpus, const std::vector<int> &set)
+{
+  std::vector<int> missing;
+  for (size_t i = 0; i < cpus.size(); i++)
+  {
+    if (std::find(set.begin(), set.end(), cpus[i]) == set.end())
+    {
+      missing.push_back(cpus[i]);
+    }
+  }
+  return missing;
+}
+
+std::vector<int> isolatedCpus()
+{
+  return readCpuList("/sys/devices/system/cpu/isolated");
+}
+
+// IRQs which are routed to 'cpus' (the effective affinity where the kernel reports it)
+static void checkIrqs(const std::vector<int> &cpus)
+{
+  DIR *dir = opendir("/proc/irq");
+  if (dir == NULL)
+  {
+    return;
+  }
+  int count = 0;
+  std::string examples;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL)
+  {
+    if (!isdigit((unsigned char)entry->d_name[0]))
+    {
+      continue;
+    }
+    std::string irq = std::string("/proc/irq/") + entry->d_name;
+    std::vector<int> irqCpus = readCpuList(irq + "/effective_affinity_list");
+    if (irqCpus.empty())
+    {
+      irqCpus = readCpuList(irq + "/smp_affinity_list");
+    }
+    if (!irqCpus.empty() && missingFrom(cpus, irqCpus).size() < cpus.size())
+    {
+      if (++count <= MaxIrqExamples)
+      {
+        examples += (examples.empty() ? "" : ",") + std::string(entry->d_name);
+      }
+    }
+  }
+  closedir(dir);
+  if (count > 0)
+  {
+    syslog(LOG_WARNING, "realtime: %d IRQs can run on the worker CPUs (%s%s), move them with /proc/irq/<irq>/smp_affinity_list",
+      count, examples.c_str(), count > MaxIrqExamples ? ",..." : "");
+  }
+
+  std::string mask;
+  if (readFirstLine("/proc/irq/default_smp_affinity", mask) && missingFrom(cpus, parseCpuMask(mask)).size() < cpus.size())
+  {
+    syslog(LOG_WARNING, "realtime: new IRQs can run on the worker CPUs (/proc/irq/default_smp_affinity is %s)",
+      mask.substr(0, mask.find('\n')).c_str());
+  }
+}
+
+static bool irqbalanceRuns()
+{
+  DIR *dir = opendir("/proc");
+  if (dir == NULL)
+  {
+    return false;
+  }
+  bool found = false;
+  struct dirent *entry;
+  while (!found && (entry = readdir(dir)) != NULL)
+  {
+    std::string comm;
+    found = isdigit((unsigned char)entry->d_name[0]) && readFirstLine(std::string("/proc/") + entry->d_name + "/comm", comm) &&
+      comm == "irqbalance\n";
+  }
+  closedir(dir);
+  return found;
+}
+
+void checkRealtimeHost(const std::vector<int> &cpus)
+{
+  if (cpus.empty())
+  {
+    return;
+  }
+  std::vector<int> notIsolated = missingFrom(cpus, isolatedCpus());
+  if (!notIsolated.empty())
+  {
+    syslog(LOG_WARNING, "realtime: CPUs %s are not isolated (isolcpus=), other tasks and kernel threads share them with the workers",
+      formatCpuList(notIsolated).c_str());
+  }
+  std::vector<int> ticking = missingFrom(cpus, readCpuList("/sys/devices/system/cpu/nohz_full"));
+  if (!ticking.empty())
+  {
+    syslog(LOG_WARNING, "realtime: CPUs %s are not nohz_full, the scheduler tick interrupts the workers", formatCpuList(ticking).c_str());
+  }
+  checkIrqs(cpus);
+  if (irqbalanceRuns())
+  {
+    syslog(LOG_WARNING, "realtime: irqbalance runs and may move IRQs to the worker CPUs (IRQBALANCE_BANNED_CPULIST keeps them off)");
+  }
+}
+
+static void prefaultStack()
+{
+  volatile char stack[StackPrefaultBytes];
+  for (size_t i = 0; i < sizeof(stack); i += 4096)
+  {
+    stack[i] = 0;
+  }
+}
+
+// enterRealtime() without logging, 'error' has the reasons of what failed
+static bool applyRealtime(int priority, int cpu, std::string &error)
+{
+  // the least slack (0 restores the default of 50us); SCHED_FIFO threads have none, this
+  // keeps it off if the scheduling class can't be changed
+  prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+
+  if (cpu >= 0)
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (result != 0)
+    {
+      char reason[64];
+      snprintf(reason, sizeof(reason), "cannot run on CPU %d (%s)", cpu, strerror(result));
+      error += reason;
+    }
+  }
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  int result = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+  if (result != 0)
+  {
+    error += (error.empty() ? "" : ", ") + std::string("cannot use SCHED_FIFO (") + strerror(result) + ")";
+  }
+
+  prefaultStack();
+  return error.empty();
+}
+
+bool enterRealtime(int priority, int cpu)
+{
+  std::string error;
+  if (!applyRealtime(priority, cpu, error))
+  {
+    syslog(LOG_WARNING, "realtime: worker thread %ld: %s", (long)syscall(SYS_gettid), error.c_str());
+    return false;
+  }
+  return true;
+}
+
+struct WakeupResult
+{
+  int cpu;
+  std::string error;
+  std::vector<uint64_t> latenciesNs;
+};
+
+static void measureWakeups(int priority, WakeupResult *result)
+{
+  applyRealtime(priority, result->cpu, result->error);
+  result->latenciesNs.reserve(SelfTestWakeups);
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  for (int i = 0; i < SelfTestWakeups; i++)
+  {
+    next.tv_nsec += SelfTestIntervalNs;
+    if (next.tv_nsec >= 1000000000L)
+    {
+      next.tv_nsec -= 1000000000L;
+      next.tv_sec++;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+    {
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t lateNs = (int64_t)(now.tv_sec - next.tv_sec) * 1000000000LL + (now.tv_nsec - next.tv_nsec);
+    result->latenciesNs.push_back(lateNs < 0 ? 0 : (uint64_t)lateNs);
+  }
+}
+
+static double percentileUs(const std::vector<uint64_t> &sortedNs, double percentile)
+{
+  size_t rank = (size_t)(percentile / 100.0 * sortedNs.size() + 0.5);
+  return sortedNs[rank == 0 ? 0 : std::min(rank, sortedNs.size()) - 1] / 1000.0;
+}
+
+void runWakeupSelfTest(const std::vector<int> &cpus, int priority)
+{
+  // all CPUs at once, as the workers will run
+  std::vector<WakeupResult> results(cpus.empty() ? 1 : cpus.size());
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    results[i].cpu = cpus.empty() ? -1 : cpus[i];
+    threads.push_back(std::thread(measureWakeups, priority, &results[i]));
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i].join();
+  }
+
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    WakeupResult &result = results[i];
+    std::sort(result.latenciesNs.begin(), result.latenciesNs.end());
+    char cpu[32];
+    snprintf(cpu, sizeof(cpu), result.cpu < 0 ? "any CPU" : "CPU %d", result.cpu);
+    uint64_t maxNs = result.latenciesNs.back();
+    syslog(maxNs > WakeupWarnNs || !result.error.empty() ? LOG_WARNING : LOG_INFO,
+      "realtime: wakeup latency on %s p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us (%d timers)%s%s", cpu,
+      percentileUs(result.latenciesNs, 50), percentileUs(result.latenciesNs, 99), percentileUs(result.latenciesNs, 99.9),
+      maxNs / 1000.0, SelfTestWakeups, result.error.empty() ? "" : ", ", result.error.c_str());
+  }
+}
+
+bool lockMemory()
+{
+  // root isn't limited, other users need a memlock limit above what the process maps
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_MEMLOCK, &limit);
+  }
+  if (geteuid() != 0 && getrlimit(RLIMIT_MEMLOCK, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+  {
+    // with MCL_FUTURE any allocation (a thread stack) beyond the limit would fail
+    syslog(LOG_WARNING, "realtime: not locking the memory, the memlock limit is %llu KB (LimitMEMLOCK=infinity)",
+      (unsigned long long)limit.rlim_cur / 1024);
+    return false;
+  }
+  if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+  {
+    syslog(LOG_WARNING, "realtime: cannot lock the memory: %s", strerror(errno));
+    return false;
+  }
+  pthread_attr_t attr;
+  if (pthread_getattr_default_np(&attr) == 0)
+  {
+    pthread_attr_setstacksize(&attr, LockedThreadStackBytes);
+    pthread_setattr_default_np(&attr);
+    pthread_attr_destroy(&attr);
+  }
+  // freed memory stays in the process (and locked) instead of being returned and faulted in again
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+  return true;
+}
+
+uint64_t lockedMemoryBytes()
+{
+  // VmLck of /proc/self/status counts reserved address space (malloc arenas) as well
+  FILE *file = fopen("/proc/self/smaps_rollup", "re");
+  if (file == NULL)
+  {
+    return 0;
+  }
+  char line[256];
+  unsigned long long lockedKb = 0;
+  while (fgets(line, sizeof(line), file) != NULL && sscanf(line, "Locked: %llu kB", &lockedKb) != 1)
+  {
+  }
+  fclose(file);
+  return (uint64_t)lockedKb * 1024;
+}
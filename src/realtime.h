@@ -0,0 +1,46 @@
+#ifndef TSSD_REALTIME_H
+#define TSSD_REALTIME_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/*
+ * The low jitter mode (--realtime). The time in a reply is only as good as
+ * the delay between reading the clock and sending is short and steady, and
+ * a page fault or a preempted worker adds tens of microseconds to it. In
+ * this mode the memory of the process is locked, and the workers run
+ * SCHED_FIFO on CPUs of their own, without timer slack. What the host still
+ * does on those CPUs (the scheduler tick, IRQs) is checked and logged, and
+ * the wakeup latency of every worker CPU is measured at startup.
+ */
+
+// the CPUs of a list like "2-5,8" (an empty list has none), false if it is malformed
+bool parseCpuList(const std::string &list, std::vector<int> &cpus);
+std::string formatCpuList(const std::vector<int> &cpus);
+
+// the CPUs isolated from the scheduler (isolcpus=), empty if there are none
+std::vector<int> isolatedCpus();
+
+// logs a warning for every host setting which disturbs 'cpus': not isolated, not nohz_full,
+// IRQs routed to them, irqbalance
+void checkRealtimeHost(const std::vector<int> &cpus);
+
+// measures how late a SCHED_FIFO thread of 'priority' wakes up from a timer on each of 'cpus'
+// (on any CPU if empty), and logs the percentiles. takes about 200ms
+void runWakeupSelfTest(const std::vector<int> &cpus, int priority);
+
+// locks the memory of the process, current and future, so no buffer is faulted in (or paged
+// out) while serving - new allocations are faulted in when they are made. false (and logs the
+// reason) if it is not permitted
+bool lockMemory();
+
+// bytes of locked memory of the process which are resident
+uint64_t lockedMemoryBytes();
+
+// makes the calling thread a worker of the low jitter mode: SCHED_FIFO at 'priority', on 'cpu'
+// (any if -1), without timer slack, and with its stack faulted in. false (and logs the reason)
+// if a part of it failed, the rest still applies
+bool enterRealtime(int priority, int cpu);
+
+#endif // TSSD_REALTIME_H
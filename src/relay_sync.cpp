@@ -0,0 +1,108 @@
+#include "relay_sync.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <syslog.h>
+
+#include <chrono>
+
+RelaySync::RelaySync(DisciplinedClock &clock, const TspClient::Config &config)
+  : clock_(clock), client_(config), maxDrift_(config.maxDriftPpm * 1e-6), upstreamReachable_(true), stopRequested_(false)
+{
+}
+
+RelaySync::~RelaySync()
+{
+  stop();
+}
+
+bool RelaySync::start(const std::string &server, unsigned short port)
+{
+  if (!client_.open(server.c_str(), port))
+  {
+    syslog(LOG_ERR, "relay: can't open upstream %s:%u: %m", server.c_str(), port);
+    return false;
+  }
+  char description[300];
+  snprintf(description, sizeof(description), "%s:%u", server.c_str(), port);
+  server_ = description;
+  thread_ = std::thread(&RelaySync::run, this);
+  return true;
+}
+
+void RelaySync::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(stopMutex_);
+    stopRequested_ = true;
+  }
+  stopCond_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  client_.close();
+}
+
+void RelaySync::run()
+{
+  std::unique_lock<std::mutex> lock(stopMutex_);
+  while (!stopRequested_)
+  {
+    lock.unlock();
+    pollOnce();
+    lock.lock();
+    stopCond_.wait_for(lock, std::chrono::milliseconds((long long)(client_.pollIntervalSec() * 1000)));
+  }
+}
+
+void RelaySync::pollOnce()
+{
+  int replies = client_.poll();
+  if (replies <= 0)
+  {
+    if (upstreamReachable_)
+    {
+      syslog(LOG_WARNING, "relay: no reply from upstream %s, serving from the local clock model", server_.c_str());
+      upstreamReachable_ = false;
+    }
+    return;
+  }
+  if (!upstreamReachable_)
+  {
+    syslog(LOG_INFO, "relay: upstream %s replies again", server_.c_str());
+    upstreamReachable_ = true;
+  }
+
+  ClockEstimate estimate;
+  if (!client_.estimate(estimate))
+  {
+    return;
+  }
+  uint64_t sampleNs = DisciplinedClock::rawNs() - estimate.ageNs;
+  // the error bound of the sample when it was taken, the model accounts for the drift since
+  double sampleUncertaintyNs = estimate.uncertaintyNs - estimate.ageNs * maxDrift_;
+  if (sampleUncertaintyNs < estimate.delayNs / 2.0)
+  {
+    sampleUncertaintyNs = estimate.delayNs / 2.0;
+  }
+
+  bool wasSynchronized = clock_.isSynchronized();
+  if (wasSynchronized)
+  {
+    // an offset far from the model means the upstream clock stepped, the old samples are of no use
+    double predictedNs = (double)clock_.timeNsAt(sampleNs) - (double)sampleNs;
+    if (fabs(estimate.offsetNs - predictedNs) > 3.0 * (sampleUncertaintyNs + clock_.uncertaintyNs()))
+    {
+      syslog(LOG_WARNING, "relay: upstream %s stepped by %.3f ms, restarting the clock model",
+        server_.c_str(), (estimate.offsetNs - predictedNs) / 1e6);
+      clock_.reset();
+    }
+  }
+  clock_.update(sampleNs, estimate.offsetNs, sampleUncertaintyNs);
+  if (!wasSynchronized)
+  {
+    syslog(LOG_INFO, "relay: synchronized to %s, uncertainty %.3f ms, delay %.3f ms",
+      server_.c_str(), sampleUncertaintyNs / 1e6, estimate.delayNs / 1e6);
+  }
+}
@@ -0,0 +1,44 @@
+#ifndef TSSD_RELAY_SYNC_H
+#define TSSD_RELAY_SYNC_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "disciplined_clock.h"
+#include "tsp_client.h"
+
+/*
+ * Relay mode: a background thread which syncs to an upstream tssd with
+ * the client library (bursts, clock filter, adaptive poll) and disciplines
+ * the relay's clock, which the workers then answer local requests from.
+ * The upstream sees a few packets per poll, no matter how many clients
+ * the relay serves.
+ */
+class RelaySync
+{
+public:
+  RelaySync(DisciplinedClock &clock, const TspClient::Config &config);
+  ~RelaySync();
+
+  // resolves the upstream and starts the thread, returns false (and logs) on error
+  bool start(const std::string &server, unsigned short port);
+  void stop();
+
+private:
+  void run();
+  void pollOnce();
+
+  DisciplinedClock &clock_;
+  TspClient client_;
+  double maxDrift_;
+  std::string server_;
+  bool upstreamReachable_;
+  std::mutex stopMutex_;
+  std::condition_variable stopCond_;
+  bool stopRequested_;
+  std::thread thread_;
+};
+
+#endif // TSSD_RELAY_SYNC_H
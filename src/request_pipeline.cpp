@@ -0,0 +1,452 @@
+#include "request_pipeline.h"
+
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timex.h>
+
+#include "probes.h"
+#include "siphash_batch.h"
+#include "tsp_protocol.h"
+
+static inline uint64_t nowNs(clockid_t clockId)
+{
+  struct timespec ts;
+  clock_gettime(clockId, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+RequestPipeline::RequestPipeline(Transport &transport, WorkerStats &stats, LogRing *logRing,
+  FlightRecorder *flightRecorder, TrafficCapture *capture, int batchSize)
+  : transport_(transport), stats_(stats), logRing_(logRing), flightRecorder_(flightRecorder), capture_(capture),
+    batchSize_(batchSize < 1 ? 1 : (batchSize > MaxBatchSize ? MaxBatchSize : batchSize)), maxBatchCookies_(0), clock_(NULL),
+    servesNtp_(false), ntpInfoRefreshedNs_(0), keys_(NULL), requireAuthentication_(false), access_(NULL),
+    configDomain_(NULL), configReader_(-1), configVersion_(0)
+{
+  stats_.cpu.store(sched_getcpu(), std::memory_order_relaxed);
+}
+
+void RequestPipeline::setClock(const DisciplinedClock *clock)
+{
+  clock_ = clock;
+}
+
+void RequestPipeline::serveNtp(uint8_t stratum, uint32_t referenceId)
+{
+  servesNtp_ = true;
+  ntpInfo_.leap = NtpLeapUnsynchronized;
+  ntpInfo_.stratum = stratum;
+  ntpInfo_.precision = NtpPrecision;
+  ntpInfo_.referenceId = referenceId;
+  ntpInfo_.referenceTimeNs = 0;
+  ntpInfo_.rootDelaySec = 0.0;
+  ntpInfo_.rootDispersionSec = 0.0;
+  ntpInfoRefreshedNs_ = 0;
+}
+
+void RequestPipeline::enableAuthentication(const KeyStore *keys, bool requireAuthentication)
+{
+  keys_ = keys;
+  requireAuthentication_ = keys != NULL && requireAuthentication;
+}
+
+void RequestPipeline::followConfig(ConfigDomain *domain)
+{
+  configReader_ = domain->registerReader();
+  configDomain_ = configReader_ >= 0 ? domain : NULL;
+}
+
+void RequestPipeline::leaveConfig()
+{
+  if (configDomain_ != NULL)
+  {
+    configDomain_->leave(configReader_);
+  }
+}
+
+// the pointers into the snapshot stay valid until the next read() - the start of the next batch
+void RequestPipeline::applyConfig(const ServingConfig &config)
+{
+  batchSize_ = config.batchSize < 1 ? 1 : (config.batchSize > MaxBatchSize ? MaxBatchSize : config.batchSize);
+  if (!servesNtp_)
+  {
+    maxBatchCookies_ = config.maxBatchCookies < 0 ? 0 : (config.maxBatchCookies > MaxBatchCookies ? MaxBatchCookies : config.maxBatchCookies);
+    batchRateLimiter_.setRates(config.batchRequestRate, config.batchRequestRateTotal, maxBatchCookies_);
+    keys_ = config.keys.size() > 0 ? &config.keys : NULL;
+    requireAuthentication_ = keys_ != NULL && config.requireAuthentication;
+  }
+  access_ = config.access.empty() ? NULL : &config.access;
+  if (logRing_ != NULL)
+  {
+    logRing_->setLimits(config.logRate, config.logSample);
+  }
+  configVersion_ = config.version;
+}
+
+std::string RequestPipeline::saveState() const
+{
+  return batchRateLimiter_.saveState();
+}
+
+bool RequestPipeline::restoreState(const std::string &state)
+{
+  return batchRateLimiter_.restoreState(state);
+}
+
+void RequestPipeline::enableBatchRequests(int maxCookies, double perSourceRate, double totalRate)
+{
+  maxBatchCookies_ = maxCookies < 0 ? 0 : (maxCookies > MaxBatchCookies ? MaxBatchCookies : maxCookies);
+  // a single request of the largest size always fits in the buckets
+  batchRateLimiter_.configure(perSourceRate, totalRate, maxBatchCookies_);
+}
+
+int RequestPipeline::processBatch()
+{
+  if (configDomain_ != NULL)
+  {
+    const ServingConfig *config = configDomain_->read(configReader_);
+    if (config->version != configVersion_)
+    {
+      applyConfig(*config);
+    }
+  }
+  if (flightRecorder_ != NULL)
+  {
+    flightRecorder_->dumpIfRequested();
+  }
+  int received = transport_.receive(requests_, batchSize_);
+  if (received <= 0)
+  {
+    if (received == 0) // idle - a good time to refresh the cpu we run on
+    {
+      stats_.cpu.store(sched_getcpu(), std::memory_order_relaxed);
+    }
+    return received;
+  }
+  stats_.socketQueueDrops.store(transport_.socketQueueDrops(), std::memory_order_relaxed);
+  if (keys_ != NULL)
+  {
+    verifyRequests(received);
+  }
+
+  int replyCount = 0;
+  for (int i = 0; i < received; i++)
+  {
+    const Datagram &request = requests_[i];
+    stats_.requests.inc();
+    TSSD_PROBE_REQUEST_RECEIVED(request.length, request.rxTimeNs);
+    if (capture_ != NULL)
+    {
+      capture_->capture(request);
+    }
+
+    if (access_ != NULL && !access_->allows(request.peer))
+    {
+      stats_.accessDenied.inc();
+      TSSD_PROBE_REQUEST_REJECTED(LogAccessDenied, request.length);
+      if (logRing_ != NULL)
+      {
+        logRing_->log(LogAccessDenied, request.rxTimeNs, request.peer, request.length, 0);
+      }
+      continue;
+    }
+
+    if (servesNtp_)
+    {
+      if (buildNtpReply(request, replies_[replyCount], replyInfo_[replyCount]))
+      {
+        replyKeys_[replyCount] = NULL;
+        replyCount++;
+      }
+      continue;
+    }
+
+    if (request.length < TimeRequestPacketSize)
+    {
+      stats_.tooShort.inc();
+      // packet is too short - just ignore it
+      TSSD_PROBE_REQUEST_REJECTED(LogTooShort, request.length);
+      if (logRing_ != NULL)
+      {
+        logRing_->log(LogTooShort, request.rxTimeNs, request.peer, request.length, 0);
+      }
+      continue;
+    }
+
+    if (!hasTspHeader(request.data))
+    {
+      stats_.notTsp.inc();
+      // not an TSP message
+      TSSD_PROBE_REQUEST_REJECTED(LogNotTsp, request.length);
+      if (logRing_ != NULL)
+      {
+        uint64_t header = ((uint64_t)(uint8_t)request.data[0] << 16) | ((uint64_t)(uint8_t)request.data[1] << 8) | (uint8_t)request.data[2];
+        logRing_->log(LogNotTsp, request.rxTimeNs, request.peer, request.length, header);
+      }
+      continue;
+    }
+
+    if (clock_ != NULL && !clock_->isSynchronized())
+    {
+      // a relay which has no time yet must not hand out its local time
+      stats_.notSynchronized.inc();
+      continue;
+    }
+
+    bool authenticated = keys_ != NULL && isTimeAuthRequest(request.data, request.length);
+    if (authenticated && requestKeys_[i] == NULL)
+    {
+      stats_.authFailed.inc();
+      TSSD_PROBE_REQUEST_REJECTED(LogAuthFailed, request.length);
+      if (logRing_ != NULL)
+      {
+        logRing_->log(LogAuthFailed, request.rxTimeNs, request.peer, request.length, ((const TimeAuthRequest *)request.data)->keyId);
+      }
+      continue;
+    }
+    if (!authenticated && requireAuthentication_)
+    {
+      stats_.notAuthenticated.inc();
+      TSSD_PROBE_REQUEST_REJECTED(LogNotAuthenticated, request.length);
+      if (logRing_ != NULL)
+      {
+        logRing_->log(LogNotAuthenticated, request.rxTimeNs, request.peer, request.length, 0);
+      }
+      continue;
+    }
+
+    int cookieCount = maxBatchCookies_ > 0 ? batchRequestCookieCount(request.data, request.length) : 0;
+    if (cookieCount > maxBatchCookies_)
+    {
+      stats_.batchTooLarge.inc();
+      TSSD_PROBE_REQUEST_REJECTED(LogBatchTooLarge, request.length);
+      if (logRing_ != NULL)
+      {
+        logRing_->log(LogBatchTooLarge, request.rxTimeNs, request.peer, request.length, cookieCount);
+      }
+      continue;
+    }
+    if (cookieCount > 0 && !batchRateLimiter_.allow(BatchRateLimiter::sourceKey(request.peer), request.rxTimeNs, cookieCount))
+    {
+      stats_.batchRateLimited.inc();
+      TSSD_PROBE_REQUEST_REJECTED(LogBatchRateLimited, request.length);
+      if (logRing_ != NULL)
+      {
+        logRing_->log(LogBatchRateLimited, request.rxTimeNs, request.peer, request.length, cookieCount);
+      }
+      continue;
+    }
+
+    uint64_t buildStartNs = nowNs(CLOCK_MONOTONIC);
+    Datagram &reply = replies_[replyCount];
+    uint64_t currTimeMsSinceEpoch = clock_ != NULL ? clock_->nowMsSinceEpoch() : currentTimeMsSinceEpoch();
+    if (authenticated)
+    {
+      // signed with the other replies of the batch, once they are all built
+      encodeTimeAuthReply(request.data, currTimeMsSinceEpoch, reply.data);
+      reply.length = TimeAuthReplyPacketSize;
+      stats_.authRequests.inc();
+    }
+    else if (cookieCount > 0)
+    {
+      // one clock read and one datagram for all the cookies
+      reply.length = encodeTimeBatchReply(request.data, cookieCount, currTimeMsSinceEpoch, reply.data);
+      stats_.batchRequests.inc();
+      stats_.batchCookies.add(cookieCount);
+    }
+    else
+    {
+      encodeTimeReply(request.data, currTimeMsSinceEpoch, reply.data);
+      reply.length = TimeReplyPacketSize;
+    }
+    reply.peer = request.peer;
+    reply.rxTimeNs = request.rxTimeNs;
+    replyKeys_[replyCount] = authenticated ? requestKeys_[i] : NULL;
+    replyInfo_[replyCount].cookie = ((const TimeReply *)reply.data)->clientCookie;
+    replyInfo_[replyCount].timeMsSinceEpoch = currTimeMsSinceEpoch;
+    TSSD_PROBE_TIMESTAMP(replyInfo_[replyCount].cookie, currTimeMsSinceEpoch);
+    replyInfo_[replyCount].buildTimeNs = nowNs(CLOCK_MONOTONIC) - buildStartNs;
+    replyInfo_[replyCount].requestLength = (uint16_t)request.length;
+    replyCount++;
+  }
+
+  if (replyCount == 0)
+  {
+    return received;
+  }
+  if (keys_ != NULL)
+  {
+    signReplies(replyCount);
+  }
+  int sent = transport_.send(replies_, replyCount);
+  if (sent < 0)
+  {
+    return -1;
+  }
+  stats_.replies.add(sent);
+  stats_.sendFailed.add(replyCount - sent);
+
+  uint64_t sentNs = nowNs(CLOCK_REALTIME);
+  for (int i = 0; i < replyCount; i++)
+  {
+    const Datagram &reply = replies_[i];
+    uint64_t serviceTimeNs = sentNs > reply.rxTimeNs ? sentNs - reply.rxTimeNs : 0;
+    stats_.buildTime.record(replyInfo_[i].buildTimeNs);
+    stats_.serviceTime.record(serviceTimeNs);
+    TSSD_PROBE_REPLY_SENT(replyInfo_[i].cookie, serviceTimeNs);
+    if (flightRecorder_ != NULL)
+    {
+      flightRecorder_->record(reply.rxTimeNs, sentNs, replyInfo_[i].timeMsSinceEpoch, replyInfo_[i].cookie,
+        reply.peer, replyInfo_[i].requestLength);
+    }
+  }
+  return received;
+}
+
+bool RequestPipeline::buildNtpReply(const Datagram &request, Datagram &reply, ReplyInfo &info)
+{
+  if (request.length < NtpPacketSize)
+  {
+    stats_.tooShort.inc();
+    TSSD_PROBE_REQUEST_REJECTED(LogTooShort, request.length);
+    if (logRing_ != NULL)
+    {
+      logRing_->log(LogTooShort, request.rxTimeNs, request.peer, request.length, 0);
+    }
+    return false;
+  }
+
+  if (!isNtpClientRequest(request.data, request.length))
+  {
+    // server, broadcast and control packets are not ours to answer
+    stats_.notNtpClient.inc();
+    TSSD_PROBE_REQUEST_REJECTED(LogNotNtpClient, request.length);
+    if (logRing_ != NULL)
+    {
+      logRing_->log(LogNotNtpClient, request.rxTimeNs, request.peer, request.length, (uint8_t)request.data[0]);
+    }
+    return false;
+  }
+
+  if (clock_ != NULL && !clock_->isSynchronized())
+  {
+    stats_.notSynchronized.inc();
+    return false;
+  }
+
+  uint64_t buildStartNs = nowNs(CLOCK_MONOTONIC);
+  uint64_t transmitNs;
+  uint64_t receiveNs;
+  if (clock_ != NULL)
+  {
+    // the kernel stamps with CLOCK_REALTIME, a relay serves its own clock
+    uint64_t realtimeNs = nowNs(CLOCK_REALTIME);
+    transmitNs = clock_->timeNsAt(DisciplinedClock::rawNs());
+    receiveNs = transmitNs - (realtimeNs > request.rxTimeNs ? realtimeNs - request.rxTimeNs : 0);
+  }
+  else
+  {
+    transmitNs = nowNs(CLOCK_REALTIME);
+    receiveNs = request.rxTimeNs < transmitNs ? request.rxTimeNs : transmitNs;
+  }
+  if (transmitNs - ntpInfoRefreshedNs_ >= 1000000000ULL)
+  {
+    refreshNtpInfo(transmitNs);
+  }
+  encodeNtpReply(request.data, ntpInfo_, receiveNs, transmitNs, reply.data);
+  reply.length = NtpPacketSize;
+  reply.peer = request.peer;
+  reply.rxTimeNs = request.rxTimeNs;
+  info.cookie = ((const NtpPacket *)request.data)->transmitTimestamp;
+  info.timeMsSinceEpoch = transmitNs / 1000000;
+  TSSD_PROBE_TIMESTAMP(info.cookie, info.timeMsSinceEpoch);
+  info.buildTimeNs = nowNs(CLOCK_MONOTONIC) - buildStartNs;
+  info.requestLength = (uint16_t)request.length;
+  return true;
+}
+
+void RequestPipeline::refreshNtpInfo(uint64_t nowNs)
+{
+  ntpInfoRefreshedNs_ = nowNs;
+  if (clock_ != NULL)
+  {
+    ntpInfo_.leap = NtpLeapNone; // only served once synchronized
+    ntpInfo_.rootDispersionSec = clock_->uncertaintyNs() / 1e9;
+    ntpInfo_.referenceTimeNs = nowNs;
+    return;
+  }
+  // the system clock is disciplined by someone else, the kernel knows how well
+  struct timex tx;
+  memset(&tx, 0, sizeof(tx));
+  int state = adjtimex(&tx);
+  bool synchronized = state >= 0 && state != TIME_ERROR && (tx.status & STA_UNSYNC) == 0;
+  ntpInfo_.leap = synchronized ? NtpLeapNone : NtpLeapUnsynchronized;
+  ntpInfo_.rootDispersionSec = state >= 0 ? tx.esterror / 1e6 : 0.0;
+  ntpInfo_.referenceTimeNs = nowNs;
+}
+
+void RequestPipeline::verifyRequests(int received)
+{
+  const SipHashKey *keys[MaxBatchSize];
+  const char *messages[MaxBatchSize];
+  uint64_t macs[MaxBatchSize];
+  int indexes[MaxBatchSize];
+  int count = 0;
+  for (int i = 0; i < received; i++)
+  {
+    const Datagram &request = requests_[i];
+    requestKeys_[i] = NULL;
+    if (!isTimeAuthRequest(request.data, request.length))
+    {
+      continue;
+    }
+    const SipHashKey *key = keys_->find(((const TimeAuthRequest *)request.data)->keyId);
+    if (key != NULL)
+    {
+      keys[count] = key;
+      messages[count] = request.data;
+      indexes[count] = i;
+      count++;
+    }
+  }
+  if (count == 0)
+  {
+    return;
+  }
+  sipHash24Batch(keys, messages, TimeAuthRequestMacLength, macs, count);
+  for (int j = 0; j < count; j++)
+  {
+    if (macs[j] == ((const TimeAuthRequest *)requests_[indexes[j]].data)->mac)
+    {
+      requestKeys_[indexes[j]] = keys[j];
+    }
+  }
+}
+
+void RequestPipeline::signReplies(int replyCount)
+{
+  const SipHashKey *keys[MaxBatchSize];
+  const char *messages[MaxBatchSize];
+  uint64_t macs[MaxBatchSize];
+  int indexes[MaxBatchSize];
+  int count = 0;
+  for (int i = 0; i < replyCount; i++)
+  {
+    if (replyKeys_[i] != NULL)
+    {
+      keys[count] = replyKeys_[i];
+      messages[count] = replies_[i].data;
+      indexes[count] = i;
+      count++;
+    }
+  }
+  if (count == 0)
+  {
+    return;
+  }
+  sipHash24Batch(keys, messages, TimeAuthReplyMacLength, macs, count);
+  for (int j = 0; j < count; j++)
+  {
+    ((TimeAuthReply *)replies_[indexes[j]].data)->mac = macs[j];
+  }
+}
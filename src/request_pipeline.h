@@ -0,0 +1,110 @@
+#ifndef TSSD_REQUEST_PIPELINE_H
+#define TSSD_REQUEST_PIPELINE_H
+
+#include "access_list.h"
+#include "async_logger.h"
+#include "batch_rate_limiter.h"
+#include "disciplined_clock.h"
+#include "flight_recorder.h"
+#include "key_store.h"
+#include "ntp_protocol.h"
+#include "serving_config.h"
+#include "traffic_capture.h"
+#include "transport.h"
+#include "worker_stats.h"
+
+/*
+ * The work of a worker: receive a batch of datagrams from the transport,
+ * validate them (and verify their MACs), build a reply for every TSP (or NTP) request, send the replies and
+ * account for everything in the worker's statistics, log, flight recorder
+ * and traffic capture.
+ * Knows nothing about sockets, so it can run on any transport.
+ */
+class RequestPipeline
+{
+public:
+  // 'logRing', 'flightRecorder' and 'capture' may be NULL
+  RequestPipeline(Transport &transport, WorkerStats &stats, LogRing *logRing, FlightRecorder *flightRecorder,
+    TrafficCapture *capture, int batchSize = MaxBatchSize);
+
+  // one round of receive, reply and send. returns the number of
+  // datagrams received (0 on timeout), or -1 on a fatal transport error
+  int processBatch();
+
+  // serve batch requests of up to 'maxCookies' cookies (at most MaxBatchCookies), at
+  // most 'perSourceRate' cookies per second per source and 'totalRate' in total.
+  // until enabled, batch requests are served as TimeRequests (the first cookie)
+  void enableBatchRequests(int maxCookies, double perSourceRate, double totalRate);
+
+  // relay mode: replies carry the time of 'clock' instead of the system clock,
+  // and requests are dropped until it is synchronized
+  void setClock(const DisciplinedClock *clock);
+
+  // answer NTP client requests instead of TSP requests, as a server of 'stratum'.
+  // 'referenceId' is in network byte order
+  void serveNtp(uint8_t stratum, uint32_t referenceId);
+
+  // answer authenticated requests whose MAC verifies with a key of 'keys' (which must
+  // outlive the pipeline) with signed replies. with 'requireAuthentication' requests
+  // which are not authenticated are dropped
+  void enableAuthentication(const KeyStore *keys, bool requireAuthentication);
+
+  // take the batch size, the batch request limits, authentication (of a TSP pipeline), the
+  // access list and the log limits from the snapshots of 'domain', read at the start of every
+  // batch - a reload applies at the next batch. overrides enableBatchRequests() and enableAuthentication()
+  void followConfig(ConfigDomain *domain);
+  // the worker stops calling processBatch() (it pauses or exits), so a reload doesn't wait for it
+  void leaveConfig();
+
+  // the state a restart would lose (the batch rate limits), to hand it to another process
+  // (live upgrade). only while no batch is processed
+  std::string saveState() const;
+  // false if 'state' is not of saveState()
+  bool restoreState(const std::string &state);
+
+private:
+  struct ReplyInfo
+  {
+    uint64_t buildTimeNs;
+    uint64_t cookie; // the client's cookie, or the transmit timestamp of an NTP request
+    uint64_t timeMsSinceEpoch;
+    uint16_t requestLength;
+  };
+
+  static const int8_t NtpPrecision = -20; // about a us, what a clock read and a copy take
+
+  // validate an NTP request and build its reply, false if the request is dropped
+  bool buildNtpReply(const Datagram &request, Datagram &reply, ReplyInfo &info);
+  // sync state of the served clock, refreshed once a second
+  void refreshNtpInfo(uint64_t nowNs);
+  // the MACs of a batch are computed together, so the hashes of different packets overlap
+  void verifyRequests(int received);
+  void signReplies(int replyCount);
+  void applyConfig(const ServingConfig &config);
+
+  Transport &transport_;
+  WorkerStats &stats_;
+  LogRing *logRing_;
+  FlightRecorder *flightRecorder_;
+  TrafficCapture *capture_;
+  int batchSize_;
+  int maxBatchCookies_; // 0 when batch requests are disabled
+  BatchRateLimiter batchRateLimiter_;
+  const DisciplinedClock *clock_; // NULL for the system clock
+  bool servesNtp_;
+  NtpServerInfo ntpInfo_;
+  uint64_t ntpInfoRefreshedNs_;
+  const KeyStore *keys_; // NULL when authentication is disabled
+  bool requireAuthentication_;
+  const AccessList *access_; // NULL when every source is served
+  ConfigDomain *configDomain_; // NULL when the settings are fixed
+  int configReader_;
+  uint64_t configVersion_; // of the applied snapshot
+  Datagram requests_[MaxBatchSize];
+  Datagram replies_[MaxBatchSize];
+  ReplyInfo replyInfo_[MaxBatchSize];
+  const SipHashKey *requestKeys_[MaxBatchSize]; // key of an authenticated request whose MAC is valid, else NULL
+  const SipHashKey *replyKeys_[MaxBatchSize]; // key to sign a reply with, NULL for an unsigned reply
+};
+
+#endif // TSSD_REQUEST_PIPELINE_H
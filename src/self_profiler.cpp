@@ -0,0 +1,149 @@
+#include "self_profiler.h"
+
+#include <errno.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include <atomic>
+
+static int perfEventOpen(struct perf_event_attr *attr)
+{
+  // pid 0 and cpu -1: the calling thread, on any cpu
+  return (int)syscall(SYS_perf_event_open, attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static int openCounter(uint32_t type, uint64_t config)
+{
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_hv = 1;
+
+  int fd = perfEventOpen(&attr);
+  if (fd < 0 && (errno == EACCES || errno == EPERM))
+  {
+    // not allowed to count in the kernel - count the user space part of the request path only
+    attr.exclude_kernel = 1;
+    fd = perfEventOpen(&attr);
+  }
+  return fd;
+}
+
+SelfProfiler::SelfProfiler()
+  : open_(false)
+{
+  for (int i = 0; i < CounterCount; i++)
+  {
+    fds_[i] = -1;
+    base_.values[i] = 0;
+  }
+}
+
+SelfProfiler::~SelfProfiler()
+{
+  closeCounters();
+}
+
+void SelfProfiler::closeCounters()
+{
+  for (int i = 0; i < CounterCount; i++)
+  {
+    if (fds_[i] >= 0)
+    {
+      close(fds_[i]);
+      fds_[i] = -1;
+    }
+  }
+}
+
+bool SelfProfiler::open()
+{
+  static const uint32_t types[CounterCount] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_SOFTWARE
+  };
+  static const uint64_t configs[CounterCount] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_SW_CONTEXT_SWITCHES
+  };
+
+  static std::atomic<bool> warned[CounterCount];
+  std::lock_guard<std::mutex> lock(mutex_);
+  // the previous thread has exited, its counts are final
+  Counts previous;
+  readOpen(previous);
+  for (int i = 0; i < CounterCount; i++)
+  {
+    base_.values[i] += previous.values[i];
+  }
+  closeCounters();
+
+  bool anyOpen = false;
+  for (int i = 0; i < CounterCount; i++)
+  {
+    fds_[i] = openCounter(types[i], configs[i]);
+    if (fds_[i] < 0)
+    {
+      if (!warned[i].exchange(true)) // every worker opens the same counters, once is enough
+      {
+        syslog(LOG_WARNING, "self profile: cannot count %s: '%m'", counterName((Counter)i));
+      }
+    }
+    else
+    {
+      anyOpen = true;
+    }
+  }
+  open_ = anyOpen;
+  return anyOpen;
+}
+
+bool SelfProfiler::isOpen() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return open_;
+}
+
+void SelfProfiler::read(Counts &out) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  readOpen(out);
+  for (int i = 0; i < CounterCount; i++)
+  {
+    out.values[i] += base_.values[i];
+  }
+}
+
+void SelfProfiler::readOpen(Counts &out) const
+{
+  for (int i = 0; i < CounterCount; i++)
+  {
+    out.values[i] = 0;
+    if (fds_[i] < 0)
+    {
+      continue;
+    }
+    uint64_t data[3]; // value, time enabled, time running
+    if (::read(fds_[i], data, sizeof(data)) != (ssize_t)sizeof(data) || data[2] == 0)
+    {
+      continue;
+    }
+    out.values[i] = data[2] < data[1] ? (uint64_t)((double)data[0] * data[1] / data[2]) : data[0];
+  }
+}
+
+const char *SelfProfiler::counterName(Counter counter)
+{
+  switch (counter)
+  {
+    case Cycles: return "cycles";
+    case Instructions: return "instructions";
+    case CacheMisses: return "cache_misses";
+    case ContextSwitches: return "context_switches";
+    default: return "unknown";
+  }
+}
@@ -0,0 +1,55 @@
+#ifndef TSSD_SELF_PROFILER_H
+#define TSSD_SELF_PROFILER_H
+
+#include <stdint.h>
+#include <mutex>
+
+/*
+ * Hardware and software performance counters (perf_event_open) of a
+ * single worker thread. The counters are opened on the worker thread, and
+ * can then be read from any thread without disturbing the worker. A worker
+ * which is started again (after a failed live upgrade) opens them again, and
+ * the counts go on from the ones of its previous thread.
+ */
+class SelfProfiler
+{
+public:
+  enum Counter
+  {
+    Cycles = 0,
+    Instructions,
+    CacheMisses,
+    ContextSwitches,
+    CounterCount
+  };
+
+  struct Counts
+  {
+    uint64_t values[CounterCount];
+  };
+
+  SelfProfiler();
+  ~SelfProfiler();
+
+  // must be called on the thread to profile. returns false if no counter
+  // could be opened (e.g. restricted by kernel.perf_event_paranoid)
+  bool open();
+  // true if the last open() opened a counter
+  bool isOpen() const;
+
+  // values are scaled when the kernel multiplexed the counters
+  void read(Counts &out) const;
+
+  static const char *counterName(Counter counter);
+
+private:
+  void readOpen(Counts &out) const;
+  void closeCounters();
+
+  mutable std::mutex mutex_; // open() of a restarted worker against read() of the reporter
+  int fds_[CounterCount];
+  bool open_;
+  Counts base_; // counts of the threads the counters were open on before
+};
+
+#endif // TSSD_SELF_PROFILER_H
@@ -0,0 +1,46 @@
+#include "serving_config.h"
+
+#include <time.h>
+
+#include <algorithm>
+
+ConfigDomain::ConfigDomain(ServingConfig *initial)
+  : current_(initial), epoch_(1), readerCount_(0), version_(1)
+{
+  initial->version = version_;
+  for (int i = 0; i < MaxReaders; i++)
+  {
+    readers_[i].epoch.store(Offline);
+  }
+}
+
+ConfigDomain::~ConfigDomain()
+{
+  delete current_.load();
+}
+
+int ConfigDomain::registerReader()
+{
+  // the count may pass MaxReaders when registrations fail, publish() only looks at the slots
+  int reader = readerCount_.fetch_add(1);
+  return reader < MaxReaders ? reader : -1;
+}
+
+void ConfigDomain::publish(ServingConfig *config)
+{
+  std::lock_guard<std::mutex> lock(publishMutex_);
+  config->version = ++version_;
+  ServingConfig *old = current_.exchange(config);
+  // a reader which saw this epoch (or a later one) read the new snapshot
+  uint64_t epoch = epoch_.fetch_add(1) + 1;
+  int readerCount = std::min(readerCount_.load(), (int)MaxReaders);
+  for (int i = 0; i < readerCount; i++)
+  {
+    while (readers_[i].epoch.load() < epoch)
+    {
+      struct timespec pause = { 0, 1000000 };
+      nanosleep(&pause, NULL);
+    }
+  }
+  delete old;
+}
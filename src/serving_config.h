@@ -0,0 +1,99 @@
+#ifndef TSSD_SERVING_CONFIG_H
+#define TSSD_SERVING_CONFIG_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+#include "access_list.h"
+#include "key_store.h"
+#include "transport.h"
+
+/*
+ * The settings a reload (SIGHUP) changes while the workers serve. A
+ * snapshot is never changed once it is published - a reload builds a new
+ * one.
+ */
+struct ServingConfig
+{
+  ServingConfig()
+    : version(0), batchSize(MaxBatchSize), maxBatchCookies(0), batchRequestRate(0.0), batchRequestRateTotal(0.0),
+      requireAuthentication(false), logRate(10), logSample(10000)
+  {
+  }
+
+  uint64_t version; // set by ConfigDomain::publish()
+  int batchSize; // max datagrams per syscall
+  int maxBatchCookies; // 0 when batch requests are disabled
+  double batchRequestRate; // cookies per second per source
+  double batchRequestRateTotal; // cookies per second
+  KeyStore keys; // empty when authentication is disabled
+  bool requireAuthentication;
+  AccessList access;
+  unsigned int logRate; // log records per second of each kind of dropped packet
+  unsigned int logSample; // then one of every N (0 for none)
+};
+
+/*
+ * Hands ServingConfig snapshots to the workers, RCU style with quiescent
+ * state based reclamation. A worker reads the current snapshot at the
+ * start of every batch - two atomic loads and a store to its own cache
+ * line, no lock - and may use it until the start of its next batch.
+ * publish() swaps the snapshot, waits until every reader has started a
+ * new batch (or went offline), and only then frees the old one. A worker
+ * is between batches every 50ms at most (the receive timeout), so that is
+ * about how long a reload waits.
+ */
+class ConfigDomain
+{
+public:
+  static const int MaxReaders = 16;
+
+  // takes ownership of 'initial'
+  explicit ConfigDomain(ServingConfig *initial);
+  ~ConfigDomain();
+
+  // a reader slot for a worker, starts offline. -1 if all are taken. thread safe
+  int registerReader();
+
+  // called by the reader at the start of a batch: the previous snapshot is not used anymore
+  const ServingConfig *read(int reader)
+  {
+    uint64_t epoch = epoch_.load();
+    readers_[reader].epoch.store(epoch);
+    return current_.load();
+  }
+
+  // the reader stops reading (its worker pauses or exits), publish() doesn't wait for it
+  void leave(int reader)
+  {
+    readers_[reader].epoch.store(Offline);
+  }
+
+  // the snapshot readers start their next batch with, it must not be changed after this.
+  // takes ownership of 'config', and frees the one it replaces once no reader uses it
+  void publish(ServingConfig *config);
+
+  // the current snapshot, for the thread which publishes
+  const ServingConfig *current() const
+  {
+    return current_.load();
+  }
+
+private:
+  static const uint64_t Offline = ~0ULL;
+
+  struct alignas(64) ReaderSlot
+  {
+    std::atomic<uint64_t> epoch; // the epoch the reader saw at the start of its batch, or Offline
+  };
+
+  std::atomic<ServingConfig *> current_;
+  std::atomic<uint64_t> epoch_;
+  std::atomic<int> readerCount_;
+  uint64_t version_;
+  std::mutex publishMutex_; // publishers only
+  ReaderSlot readers_[MaxReaders];
+};
+
+#endif // TSSD_SERVING_CONFIG_H
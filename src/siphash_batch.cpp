@@ -0,0 +1,95 @@
+#include "siphash_batch.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TSSD_SIPHASH_AVX2
+#endif
+
+#ifdef TSSD_SIPHASH_AVX2
+
+// four 64 bit lanes, the 256 bit registers of AVX2
+typedef uint64_t SipHashVector __attribute__((vector_size(32)));
+
+#define TSSD_SIPROTATE(v, bits) (((v) << (bits)) | ((v) >> (64 - (bits))))
+#define TSSD_SIPROUND4(v0, v1, v2, v3) \
+  do \
+  { \
+    v0 += v1; v1 = TSSD_SIPROTATE(v1, 13); v1 ^= v0; v0 = TSSD_SIPROTATE(v0, 32); \
+    v2 += v3; v3 = TSSD_SIPROTATE(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = TSSD_SIPROTATE(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = TSSD_SIPROTATE(v1, 17); v1 ^= v2; v2 = TSSD_SIPROTATE(v2, 32); \
+  } while (0)
+
+// the messages are hashed 4 at a time, the rest one at a time
+__attribute__((target("avx2")))
+static void sipHash24BatchAvx2(const SipHashKey *const *keys, const char *const *messages, size_t length, uint64_t *hashes,
+  int count)
+{
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    const SipHashKey *const *k = keys + i;
+    const char *const *m = messages + i;
+    SipHashVector k0 = { k[0]->k0, k[1]->k0, k[2]->k0, k[3]->k0 };
+    SipHashVector k1 = { k[0]->k1, k[1]->k1, k[2]->k1, k[3]->k1 };
+    SipHashVector v0 = k0 ^ 0x736f6d6570736575ULL;
+    SipHashVector v1 = k1 ^ 0x646f72616e646f6dULL;
+    SipHashVector v2 = k0 ^ 0x6c7967656e657261ULL;
+    SipHashVector v3 = k1 ^ 0x7465646279746573ULL;
+    for (size_t word = 0; word < length / 8; word++)
+    {
+      SipHashVector w = { loadLittleEndian64(m[0] + word * 8), loadLittleEndian64(m[1] + word * 8),
+        loadLittleEndian64(m[2] + word * 8), loadLittleEndian64(m[3] + word * 8) };
+      v3 ^= w;
+      TSSD_SIPROUND4(v0, v1, v2, v3);
+      TSSD_SIPROUND4(v0, v1, v2, v3);
+      v0 ^= w;
+    }
+    // the last block of a length which is a multiple of 8 is only the length
+    uint64_t last = (uint64_t)length << 56;
+    v3 ^= last;
+    TSSD_SIPROUND4(v0, v1, v2, v3);
+    TSSD_SIPROUND4(v0, v1, v2, v3);
+    v0 ^= last;
+    v2 ^= 0xff;
+    TSSD_SIPROUND4(v0, v1, v2, v3);
+    TSSD_SIPROUND4(v0, v1, v2, v3);
+    TSSD_SIPROUND4(v0, v1, v2, v3);
+    TSSD_SIPROUND4(v0, v1, v2, v3);
+    SipHashVector h = v0 ^ v1 ^ v2 ^ v3;
+    hashes[i] = h[0];
+    hashes[i + 1] = h[1];
+    hashes[i + 2] = h[2];
+    hashes[i + 3] = h[3];
+  }
+  for (; i < count; i++)
+  {
+    hashes[i] = sipHash24(*keys[i], messages[i], length);
+  }
+}
+
+static bool cpuHasAvx2()
+{
+  __builtin_cpu_init(); // may run before the constructor which detects the cpu features
+  return __builtin_cpu_supports("avx2");
+}
+
+static const bool HasAvx2 = cpuHasAvx2();
+
+#endif // TSSD_SIPHASH_AVX2
+
+void sipHash24Batch(const SipHashKey *const *keys, const char *const *messages, size_t length, uint64_t *hashes,
+  int count)
+{
+#ifdef TSSD_SIPHASH_AVX2
+  if (HasAvx2)
+  {
+    sipHash24BatchAvx2(keys, messages, length, hashes, count);
+    return;
+  }
+#endif
+  // without 64 bit vector rotates, one message after the other is as fast - the out of order core overlaps them
+  for (int i = 0; i < count; i++)
+  {
+    hashes[i] = sipHash24(*keys[i], messages[i], length);
+  }
+}
@@ -0,0 +1,18 @@
+#ifndef TSSD_SIPHASH_BATCH_H
+#define TSSD_SIPHASH_BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "siphash.h"
+
+/*
+ * The SipHash-2-4 hashes of 'count' messages of the same 'length' (a
+ * multiple of 8), each with its own key - the MACs of a batch of packets.
+ * On CPUs with AVX2 four messages are hashed at once in the lanes of a
+ * vector, elsewhere one after the other.
+ */
+void sipHash24Batch(const SipHashKey *const *keys, const char *const *messages, size_t length, uint64_t *hashes,
+  int count);
+
+#endif // TSSD_SIPHASH_BATCH_H
@@ -0,0 +1,135 @@
+#include "stats_reporter.h"
+
+#include <syslog.h>
+
+#include <chrono>
+
+StatsReporter::StatsReporter(const std::vector<const WorkerStats *> &workers)
+  : workers_(workers), intervalSec_(0), stopRequested_(false)
+{
+}
+
+StatsReporter::~StatsReporter()
+{
+  stop();
+}
+
+void StatsReporter::setProfilers(const std::vector<const SelfProfiler *> &profilers)
+{
+  profilers_ = profilers;
+}
+
+void StatsReporter::start(unsigned int intervalSec)
+{
+  intervalSec_ = intervalSec;
+  takeSnapshots(previous_);
+  if (intervalSec_ > 0)
+  {
+    thread_ = std::thread(&StatsReporter::run, this);
+  }
+}
+
+void StatsReporter::stop()
+{
+  {
+    std::lock_guard<std::mutex> lock(stopMutex_);
+    stopRequested_ = true;
+  }
+  stopCond_.notify_all();
+  if (thread_.joinable())
+  {
+    thread_.join();
+    reportWindow(); // the last (partial) window
+  }
+}
+
+void StatsReporter::run()
+{
+  std::unique_lock<std::mutex> lock(stopMutex_);
+  while (!stopRequested_)
+  {
+    if (stopCond_.wait_for(lock, std::chrono::seconds(intervalSec_)) == std::cv_status::timeout)
+    {
+      lock.unlock();
+      reportWindow();
+      lock.lock();
+    }
+  }
+}
+
+void StatsReporter::takeSnapshots(Snapshots &out) const
+{
+  HistogramSnapshot workerSnapshot;
+  out.serviceTime.clear();
+  out.buildTime.clear();
+  out.requests = 0;
+  out.workerRequests.resize(workers_.size());
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    workers_[i]->serviceTime.snapshot(workerSnapshot);
+    out.serviceTime.merge(workerSnapshot);
+    workers_[i]->buildTime.snapshot(workerSnapshot);
+    out.buildTime.merge(workerSnapshot);
+    out.workerRequests[i] = workers_[i]->requests.load();
+    out.requests += out.workerRequests[i];
+  }
+
+  out.profiles.resize(profilers_.size());
+  out.profiled.assign(profilers_.size(), false);
+  for (size_t i = 0; i < profilers_.size(); i++)
+  {
+    // the workers open their profilers on their own threads, maybe after this
+    if (profilers_[i] != NULL && profilers_[i]->isOpen())
+    {
+      profilers_[i]->read(out.profiles[i]);
+      out.profiled[i] = true;
+    }
+  }
+}
+
+static void logPercentiles(const char *name, const HistogramSnapshot &window)
+{
+  syslog(LOG_INFO, "stats: %s [us] n=%llu p50=%.1f p99=%.1f p99.9=%.1f max=%.1f",
+    name,
+    (unsigned long long)window.total,
+    window.valueAtPercentile(50.0) / 1000.0,
+    window.valueAtPercentile(99.0) / 1000.0,
+    window.valueAtPercentile(99.9) / 1000.0,
+    window.max / 1000.0);
+}
+
+// per packet averages of the performance counters of a worker in the window, over the packets of that worker
+static void logProfile(size_t worker, uint64_t packets, const SelfProfiler::Counts &current, const SelfProfiler::Counts &previous)
+{
+  double perPacket[SelfProfiler::CounterCount];
+  for (int c = 0; c < SelfProfiler::CounterCount; c++)
+  {
+    perPacket[c] = packets > 0 ? (double)(current.values[c] - previous.values[c]) / packets : 0.0;
+  }
+  syslog(LOG_INFO, "stats: self profile of worker %u per packet n=%llu cycles=%.0f instructions=%.0f ipc=%.2f cache_misses=%.2f context_switches=%.3f",
+    (unsigned int)worker, (unsigned long long)packets,
+    perPacket[SelfProfiler::Cycles],
+    perPacket[SelfProfiler::Instructions],
+    perPacket[SelfProfiler::Cycles] > 0 ? perPacket[SelfProfiler::Instructions] / perPacket[SelfProfiler::Cycles] : 0.0,
+    perPacket[SelfProfiler::CacheMisses],
+    perPacket[SelfProfiler::ContextSwitches]);
+}
+
+void StatsReporter::reportWindow()
+{
+  std::lock_guard<std::mutex> lock(reportMutex_);
+  takeSnapshots(current_);
+  current_.serviceTime.windowSince(previous_.serviceTime, window_.serviceTime);
+  current_.buildTime.windowSince(previous_.buildTime, window_.buildTime);
+  logPercentiles("service time", window_.serviceTime);
+  logPercentiles("reply build time", window_.buildTime);
+  for (size_t i = 0; i < profilers_.size() && i < workers_.size(); i++)
+  {
+    if (current_.profiled[i] && previous_.profiled[i] &&
+      current_.workerRequests[i] != previous_.workerRequests[i])
+    {
+      logProfile(i, current_.workerRequests[i] - previous_.workerRequests[i], current_.profiles[i], previous_.profiles[i]);
+    }
+  }
+  previous_ = current_;
+}
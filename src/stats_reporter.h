@@ -0,0 +1,65 @@
+#ifndef TSSD_STATS_REPORTER_H
+#define TSSD_STATS_REPORTER_H
+
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "self_profiler.h"
+#include "worker_stats.h"
+
+/*
+ * Background thread which periodically merges the statistics of all the
+ * workers and writes the latency percentiles of the last window to syslog.
+ * Workers are never stopped or locked - each window is the difference
+ * between the current snapshot and the one taken at the end of the
+ * previous window.
+ */
+class StatsReporter
+{
+public:
+  explicit StatsReporter(const std::vector<const WorkerStats *> &workers);
+  ~StatsReporter();
+
+  // performance counters of the workers (same order as the workers, NULL for
+  // a worker which isn't profiled), so every report also includes the per
+  // packet averages of each worker whose profiler opened a counter
+  void setProfilers(const std::vector<const SelfProfiler *> &profilers);
+
+  // intervalSec of 0 means no periodic reports
+  void start(unsigned int intervalSec);
+  // stops the periodic reports, after reporting the last window
+  void stop();
+
+  // report the window since the previous report and start a new window
+  void reportWindow();
+
+private:
+  struct Snapshots
+  {
+    HistogramSnapshot serviceTime;
+    HistogramSnapshot buildTime;
+    uint64_t requests;
+    std::vector<uint64_t> workerRequests;
+    std::vector<SelfProfiler::Counts> profiles; // of the workers in profilers_
+    std::vector<bool> profiled; // whether the profiler of the worker had a counter open
+  };
+
+  void run();
+  void takeSnapshots(Snapshots &out) const;
+
+  std::vector<const WorkerStats *> workers_;
+  std::vector<const SelfProfiler *> profilers_;
+  unsigned int intervalSec_;
+  Snapshots previous_;
+  Snapshots current_;
+  Snapshots window_;
+  std::mutex reportMutex_; // serializes reports of the thread and of the owner
+  std::mutex stopMutex_;
+  std::condition_variable stopCond_;
+  bool stopRequested_;
+  std::thread thread_;
+};
+
+#endif // TSSD_STATS_REPORTER_H
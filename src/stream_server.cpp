@@ -0,0 +1,545 @@
+#include "stream_server.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "transport.h"
+#include "tsp_protocol.h"
+
+static const int StopPollIntervalMs = 50;
+static const int MaxEvents = 256;
+static const int ReadSize = 4096;
+static const int MaxHandshakeSize = 4096;
+// a read yields at most one reply per 16 byte request, each at most 26 bytes (in a WebSocket frame)
+static const int MaxRepliesPerRead = (ReadSize + MaxWebSocketFrame) / TimeRequestPacketSize + 1;
+
+static inline uint64_t nowNs(clockid_t clockId)
+{
+  struct timespec ts;
+  clock_gettime(clockId, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+StreamServer::StreamServer(WorkerStats &stats)
+  : stats_(stats), clock_(NULL), configDomain_(NULL), configReader_(-1), profiler_(NULL), listenFd_(-1), epollFd_(-1), maxConnections_(0), connectionCount_(0),
+    acceptPaused_(false), stopRequested_(false)
+{
+}
+
+StreamServer::~StreamServer()
+{
+  stop();
+}
+
+void StreamServer::setClock(const DisciplinedClock *clock)
+{
+  clock_ = clock;
+}
+
+void StreamServer::followConfig(ConfigDomain *domain)
+{
+  configReader_ = domain->registerReader();
+  configDomain_ = configReader_ >= 0 ? domain : NULL;
+}
+
+void StreamServer::setProfiler(SelfProfiler *profiler)
+{
+  profiler_ = profiler;
+}
+
+// every connection is a file descriptor, make sure the limit allows them
+static void raiseFileLimit(int maxConnections)
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+  {
+    return;
+  }
+  rlim_t wanted = (rlim_t)maxConnections + 256;
+  if (limit.rlim_cur >= wanted)
+  {
+    return;
+  }
+  limit.rlim_cur = limit.rlim_max < wanted ? limit.rlim_max : wanted;
+  setrlimit(RLIMIT_NOFILE, &limit);
+  if (limit.rlim_cur < wanted)
+  {
+    syslog(LOG_WARNING, "stream: the open files limit (%llu) is lower than --stream_max_connections",
+      (unsigned long long)limit.rlim_cur);
+  }
+}
+
+bool StreamServer::start(const std::string &address, unsigned short port, int maxConnections, int listenFd)
+{
+  if (listenFd >= 0)
+  {
+    listenFd_ = listenFd;
+    return startServing(address, port, maxConnections);
+  }
+
+  // an IPv4 or an IPv6 address
+  SocketAddress addr;
+  socklen_t addrLength;
+  memset(&addr, 0, sizeof(addr));
+  if (inet_pton(AF_INET, address.c_str(), &addr.v4.sin_addr) == 1)
+  {
+    addr.v4.sin_family = AF_INET;
+    addr.v4.sin_port = htons(port);
+    addrLength = sizeof(addr.v4);
+  }
+  else if (inet_pton(AF_INET6, address.c_str(), &addr.v6.sin6_addr) == 1)
+  {
+    addr.v6.sin6_family = AF_INET6;
+    addr.v6.sin6_port = htons(port);
+    addrLength = sizeof(addr.v6);
+  }
+  else
+  {
+    syslog(LOG_ERR, "stream: invalid address '%s'", address.c_str());
+    return false;
+  }
+
+  listenFd_ = socket(addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenFd_ < 0)
+  {
+    syslog(LOG_ERR, "stream: cannot create socket: '%m'");
+    return false;
+  }
+  int optval = 1;
+  setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval, sizeof(int));
+  if (bind(listenFd_, &addr.sa, addrLength) < 0 || listen(listenFd_, 1024) < 0)
+  {
+    syslog(LOG_ERR, "stream: cannot listen on %s:%u: '%m'", address.c_str(), port);
+    close(listenFd_);
+    listenFd_ = -1;
+    return false;
+  }
+  return startServing(address, port, maxConnections);
+}
+
+bool StreamServer::startServing(const std::string &address, unsigned short port, int maxConnections)
+{
+  epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.fd = listenFd_;
+  if (epollFd_ < 0 || epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event) < 0)
+  {
+    syslog(LOG_ERR, "stream: cannot create epoll: '%m'");
+    stop();
+    return false;
+  }
+
+  maxConnections_ = maxConnections;
+  raiseFileLimit(maxConnections);
+  thread_ = std::thread(&StreamServer::run, this);
+  syslog(LOG_INFO, "stream: serving TSP over TCP and WebSocket on %s:%u", address.c_str(), port);
+  return true;
+}
+
+void StreamServer::stop()
+{
+  stopRequested_.store(true);
+  if (thread_.joinable())
+  {
+    thread_.join();
+  }
+  for (size_t fd = 0; fd < connections_.size(); fd++)
+  {
+    if (connections_[fd].state != Closed)
+    {
+      closeConnection((int)fd);
+    }
+  }
+  if (epollFd_ >= 0)
+  {
+    close(epollFd_);
+    epollFd_ = -1;
+  }
+  if (listenFd_ >= 0)
+  {
+    close(listenFd_);
+    listenFd_ = -1;
+  }
+}
+
+void StreamServer::pauseAccepting()
+{
+  std::lock_guard<std::mutex> lock(acceptMutex_);
+  if (!acceptPaused_ && epollFd_ >= 0)
+  {
+    // else the pending connections would wake the thread up again and again
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, listenFd_, NULL);
+  }
+  acceptPaused_ = true;
+}
+
+void StreamServer::resumeAccepting()
+{
+  std::lock_guard<std::mutex> lock(acceptMutex_);
+  if (acceptPaused_ && epollFd_ >= 0)
+  {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = listenFd_;
+    epoll_ctl(epollFd_, EPOLL_CTL_ADD, listenFd_, &event);
+  }
+  acceptPaused_ = false;
+}
+
+void StreamServer::run()
+{
+  if (profiler_ != NULL)
+  {
+    profiler_->open();
+  }
+  struct epoll_event events[MaxEvents];
+  while (!stopRequested_.load())
+  {
+    const ServingConfig *config = configDomain_ != NULL ? configDomain_->read(configReader_) : NULL;
+    const AccessList *access = config != NULL && !config->access.empty() ? &config->access : NULL;
+    int ready = epoll_wait(epollFd_, events, MaxEvents, StopPollIntervalMs);
+    if (ready == 0) // idle - a good time to refresh the cpu we run on
+    {
+      stats_.cpu.store(sched_getcpu(), std::memory_order_relaxed);
+    }
+    for (int i = 0; i < ready; i++)
+    {
+      int fd = events[i].data.fd;
+      if (fd == listenFd_)
+      {
+        acceptConnections(access);
+      }
+      else if ((size_t)fd < connections_.size() && connections_[fd].state != Closed)
+      {
+        serveConnection(fd, config != NULL && config->requireAuthentication);
+      }
+    }
+  }
+  if (configDomain_ != NULL)
+  {
+    configDomain_->leave(configReader_);
+  }
+}
+
+void StreamServer::acceptConnections(const AccessList *access)
+{
+  std::lock_guard<std::mutex> lock(acceptMutex_);
+  while (!acceptPaused_)
+  {
+    SocketAddress peer;
+    socklen_t peerLength = sizeof(peer);
+    int fd = accept4(listenFd_, &peer.sa, &peerLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      return; // EAGAIN, or out of file descriptors - the next connection gets another try
+    }
+    if (access != NULL && !access->allows(peer))
+    {
+      stats_.accessDenied.inc();
+      close(fd);
+      continue;
+    }
+    if ((int)connectionCount_.load(std::memory_order_relaxed) >= maxConnections_)
+    {
+      connectionsRejected_.inc();
+      close(fd);
+      continue;
+    }
+
+    int optval = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&optval, sizeof(int));
+    // the kernel RX timestamp of the data of every read, for the service time
+    setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, (const void *)&optval, sizeof(int));
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.fd = fd;
+    if (epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      close(fd);
+      continue;
+    }
+    if ((size_t)fd >= connections_.size())
+    {
+      Connection closed;
+      memset(&closed, 0, sizeof(closed));
+      connections_.resize(fd + 1024, closed);
+    }
+    Connection &connection = connections_[fd];
+    connection.state = Detecting;
+    connection.pendingLength = 0;
+    connection.handshake = NULL;
+    connectionCount_.store(connectionCount_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+}
+
+void StreamServer::closeConnection(int fd)
+{
+  Connection &connection = connections_[fd];
+  delete connection.handshake;
+  connection.handshake = NULL;
+  connection.state = Closed;
+  connectionCount_.store(connectionCount_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+  close(fd); // also removes it from the epoll set
+}
+
+bool StreamServer::handleHandshake(int fd, Connection &connection, const char *data, int length)
+{
+  if (connection.handshake == NULL)
+  {
+    connection.handshake = new std::string();
+  }
+  std::string &request = *connection.handshake;
+  request.append(data, length);
+  size_t end = request.find("\r\n\r\n");
+  if (end == std::string::npos)
+  {
+    return request.size() <= (size_t)MaxHandshakeSize;
+  }
+
+  std::string response = webSocketHandshakeResponse(request.c_str());
+  if (response.empty())
+  {
+    stats_.notTsp.inc();
+    static const char badRequest[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    send(fd, badRequest, sizeof(badRequest) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return false;
+  }
+  if (send(fd, response.data(), response.size(), MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)response.size())
+  {
+    return false;
+  }
+
+  // a client may send its first frame right after the request
+  size_t leftover = request.size() - (end + 4);
+  if (leftover > sizeof(connection.pending))
+  {
+    return false;
+  }
+  memcpy(connection.pending, request.data() + end + 4, leftover);
+  connection.pendingLength = (uint8_t)leftover;
+  connection.state = WebSocket;
+  delete connection.handshake;
+  connection.handshake = NULL;
+  return true;
+}
+
+void StreamServer::serveConnection(int fd, bool requireAuthentication)
+{
+  Connection &connection = connections_[fd];
+  char buffer[MaxWebSocketFrame + ReadSize];
+  int have = connection.pendingLength;
+  memcpy(buffer, connection.pending, have);
+
+  struct iovec iov;
+  iov.iov_base = buffer + have;
+  iov.iov_len = ReadSize;
+  char control[CMSG_SPACE(sizeof(struct timespec))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT);
+  if (n <= 0)
+  {
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+    {
+      closeConnection(fd);
+    }
+    return;
+  }
+  uint64_t rxTimeNs = 0;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      rxTimeNs = ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+  }
+  if (rxTimeNs == 0)
+  {
+    rxTimeNs = nowNs(CLOCK_REALTIME);
+  }
+  int total = have + (int)n;
+
+  if (connection.state == Detecting)
+  {
+    if (total < 3)
+    {
+      memcpy(connection.pending, buffer, total);
+      connection.pendingLength = (uint8_t)total;
+      return;
+    }
+    connection.pendingLength = 0;
+    if (hasTspHeader(buffer))
+    {
+      connection.state = RawTsp;
+    }
+    else if (memcmp(buffer, "GET", 3) == 0)
+    {
+      connection.state = Handshake;
+    }
+    else
+    {
+      stats_.notTsp.inc();
+      closeConnection(fd);
+      return;
+    }
+  }
+  if (connection.state == Handshake)
+  {
+    if (!handleHandshake(fd, connection, buffer, total))
+    {
+      closeConnection(fd);
+    }
+    return;
+  }
+
+  // build the replies without their timestamps
+  char out[2 * (MaxWebSocketFrame + ReadSize)];
+  int outLength = 0;
+  int stampOffsets[MaxRepliesPerRead];
+  int replyCount = 0;
+  bool closeAfterSend = false;
+  bool synchronized = clock_ == NULL || clock_->isSynchronized();
+  uint64_t buildStartNs = nowNs(CLOCK_MONOTONIC);
+  int pos = 0;
+  if (connection.state == RawTsp)
+  {
+    for (; total - pos >= TimeRequestPacketSize; pos += TimeRequestPacketSize)
+    {
+      stats_.requests.inc();
+      if (!hasTspHeader(buffer + pos))
+      {
+        stats_.notTsp.inc(); // the stream is out of sync, nothing after it can be trusted
+        closeAfterSend = true;
+        break;
+      }
+      if (requireAuthentication)
+      {
+        stats_.notAuthenticated.inc();
+        continue;
+      }
+      if (!synchronized)
+      {
+        stats_.notSynchronized.inc();
+        continue;
+      }
+      encodeTimeReply(buffer + pos, 0, out + outLength);
+      stampOffsets[replyCount++] = outLength;
+      outLength += TimeReplyPacketSize;
+    }
+  }
+  else
+  {
+    char payload[MaxWebSocketPayload];
+    while (pos < total && !closeAfterSend)
+    {
+      uint8_t opcode;
+      int payloadLength;
+      int frameLength = parseWebSocketFrame(buffer + pos, total - pos, opcode, payload, payloadLength);
+      if (frameLength == 0)
+      {
+        break;
+      }
+      if (frameLength < 0)
+      {
+        closeAfterSend = true;
+        break;
+      }
+      pos += frameLength;
+      if (opcode == WebSocketBinary)
+      {
+        stats_.requests.inc();
+        if (payloadLength < TimeRequestPacketSize)
+        {
+          stats_.tooShort.inc();
+          continue;
+        }
+        if (!hasTspHeader(payload))
+        {
+          stats_.notTsp.inc();
+          continue;
+        }
+        if (requireAuthentication)
+        {
+          stats_.notAuthenticated.inc();
+          continue;
+        }
+        if (!synchronized)
+        {
+          stats_.notSynchronized.inc();
+          continue;
+        }
+        char reply[TimeReplyPacketSize];
+        encodeTimeReply(payload, 0, reply);
+        outLength += encodeWebSocketFrame(WebSocketBinary, reply, TimeReplyPacketSize, out + outLength);
+        stampOffsets[replyCount++] = outLength - TimeReplyPacketSize;
+      }
+      else if (opcode == WebSocketPing)
+      {
+        outLength += encodeWebSocketFrame(WebSocketPong, payload, payloadLength, out + outLength);
+      }
+      else if (opcode == WebSocketClose)
+      {
+        outLength += encodeWebSocketFrame(WebSocketClose, payload, payloadLength < 2 ? payloadLength : 2, out + outLength);
+        closeAfterSend = true;
+      }
+      else if (opcode == WebSocketText)
+      {
+        stats_.requests.inc();
+        stats_.notTsp.inc();
+      }
+    }
+  }
+  memcpy(connection.pending, buffer + pos, total - pos);
+  connection.pendingLength = (uint8_t)(total - pos);
+  uint64_t buildTimeNs = nowNs(CLOCK_MONOTONIC) - buildStartNs;
+
+  if (outLength > 0)
+  {
+    // as late as possible: one clock read for all the replies, right before they are sent
+    uint64_t timeMsSinceEpoch = clock_ != NULL ? clock_->nowMsSinceEpoch() : currentTimeMsSinceEpoch();
+    for (int i = 0; i < replyCount; i++)
+    {
+      ((TimeReply *)(out + stampOffsets[i]))->timeSinceEphoc1970Ms = timeMsSinceEpoch;
+    }
+    ssize_t sent = send(fd, out, outLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent != outLength)
+    {
+      // the socket buffer is full - the client doesn't read its replies
+      slowReadersDropped_.inc();
+      closeConnection(fd);
+      return;
+    }
+    uint64_t sentNs = nowNs(CLOCK_REALTIME);
+    for (int i = 0; i < replyCount; i++)
+    {
+      stats_.replies.inc();
+      stats_.buildTime.record(buildTimeNs / replyCount);
+      stats_.serviceTime.record(sentNs > rxTimeNs ? sentNs - rxTimeNs : 0);
+    }
+  }
+  if (closeAfterSend)
+  {
+    closeConnection(fd);
+  }
+}
@@ -0,0 +1,121 @@
+#ifndef TSSD_STREAM_SERVER_H
+#define TSSD_STREAM_SERVER_H
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "disciplined_clock.h"
+#include "self_profiler.h"
+#include "serving_config.h"
+#include "websocket.h"
+#include "worker_stats.h"
+
+/*
+ * TSP over persistent TCP connections, for clients which can't send UDP
+ * (browsers). A connection either speaks raw TSP - a stream of 16 byte
+ * TimeRequests, each answered by a TimeReply - or, if it starts with an
+ * HTTP upgrade request, WebSocket with a TimeRequest in every binary
+ * message.
+ *
+ * A single thread serves all the connections with epoll. A connection is a
+ * small fixed size slot in a table indexed by its fd, so tens of thousands
+ * of idle connections cost little more than their sockets. Replies of a
+ * read are stamped with one clock read right before they are sent, and
+ * the sockets have TCP_NODELAY. A client which doesn't read its replies
+ * (the socket buffer is full) is disconnected, so nothing is ever queued.
+ */
+class StreamServer
+{
+public:
+  explicit StreamServer(WorkerStats &stats);
+  ~StreamServer();
+
+  // relay mode: replies carry the time of 'clock', and requests are dropped until it is synchronized
+  void setClock(const DisciplinedClock *clock);
+  // connections from sources the access list of the snapshots of 'domain' doesn't allow are closed on accept,
+  // and while a snapshot requires authentication the requests are dropped
+  void followConfig(ConfigDomain *domain);
+  // counts the performance counters of the serving thread, opened when it starts
+  void setProfiler(SelfProfiler *profiler);
+
+  // returns false (and logs the reason) if the listening socket cannot be created.
+  // 'listenFd' is a listening socket to serve instead of creating one (live upgrade)
+  bool start(const std::string &address, unsigned short port, int maxConnections, int listenFd = -1);
+  void stop();
+
+  // no connection is accepted once it returns, the open ones are still served - while another
+  // process takes the listening socket over (live upgrade). resumeAccepting() if it doesn't
+  void pauseAccepting();
+  void resumeAccepting();
+
+  int listenFd() const
+  {
+    return listenFd_;
+  }
+
+  uint64_t connections() const
+  {
+    return connectionCount_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t connectionsRejected() const
+  {
+    return connectionsRejected_.load();
+  }
+
+  uint64_t slowReadersDropped() const
+  {
+    return slowReadersDropped_.load();
+  }
+
+private:
+  enum ConnectionState
+  {
+    Closed = 0,
+    Detecting, // nothing received yet
+    RawTsp,
+    Handshake, // HTTP upgrade request being received
+    WebSocket
+  };
+
+  struct Connection
+  {
+    uint8_t state;
+    uint8_t pendingLength; // bytes of an incomplete message in 'pending'
+    char pending[MaxWebSocketFrame];
+    std::string *handshake; // only while receiving the upgrade request
+  };
+
+  // the epoll set and the thread, once there is a listening socket
+  bool startServing(const std::string &address, unsigned short port, int maxConnections);
+  void run();
+  void acceptConnections(const AccessList *access);
+  // the connections carry no MACs, with 'requireAuthentication' every request is dropped
+  void serveConnection(int fd, bool requireAuthentication);
+  // returns false if the connection must be closed
+  bool handleHandshake(int fd, Connection &connection, const char *data, int length);
+  void closeConnection(int fd);
+
+  WorkerStats &stats_;
+  const DisciplinedClock *clock_;
+  ConfigDomain *configDomain_; // NULL when every source is served
+  int configReader_;
+  SelfProfiler *profiler_;
+  int listenFd_;
+  int epollFd_;
+  int maxConnections_;
+  std::vector<Connection> connections_; // indexed by fd
+  std::atomic<uint64_t> connectionCount_;
+  StatCounter connectionsRejected_;
+  StatCounter slowReadersDropped_;
+  std::mutex acceptMutex_; // held while accepting, so a pause waits for an accept in progress
+  bool acceptPaused_;
+  std::atomic<bool> stopRequested_;
+  std::thread thread_;
+};
+
+#endif // TSSD_STREAM_SERVER_H
@@ -0,0 +1,79 @@
+#include "systemd.h"
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static const int ListenFdsStart = 3; // SD_LISTEN_FDS_START
+
+// the variable is for this process, and not for a parent which forked it
+static bool isForThisProcess(const char *pidVariable)
+{
+  const char *pid = getenv(pidVariable);
+  return pid == NULL || strtol(pid, NULL, 10) == (long)getpid();
+}
+
+std::vector<int> systemdListenFds()
+{
+  std::vector<int> fds;
+  const char *count = getenv("LISTEN_FDS");
+  if (count != NULL && getenv("LISTEN_PID") != NULL && isForThisProcess("LISTEN_PID"))
+  {
+    int n = atoi(count);
+    for (int fd = ListenFdsStart; fd < ListenFdsStart + n; fd++)
+    {
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fds.push_back(fd);
+    }
+  }
+  unsetenv("LISTEN_PID");
+  unsetenv("LISTEN_FDS");
+  unsetenv("LISTEN_FDNAMES");
+  return fds;
+}
+
+bool systemdNotify(const char *state)
+{
+  const char *path = getenv("NOTIFY_SOCKET");
+  if (path == NULL || (path[0] != '/' && path[0] != '@'))
+  {
+    return false;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  size_t pathLength = strlen(path);
+  if (pathLength >= sizeof(addr.sun_path))
+  {
+    return false;
+  }
+  memcpy(addr.sun_path, path, pathLength);
+  if (addr.sun_path[0] == '@') // abstract namespace
+  {
+    addr.sun_path[0] = '\0';
+  }
+
+  int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+  {
+    return false;
+  }
+  ssize_t sent = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (const struct sockaddr *)&addr,
+    (socklen_t)(offsetof(struct sockaddr_un, sun_path) + pathLength));
+  close(fd);
+  return sent >= 0;
+}
+
+uint64_t systemdWatchdogUsec()
+{
+  const char *usec = getenv("WATCHDOG_USEC");
+  if (usec == NULL || !isForThisProcess("WATCHDOG_PID"))
+  {
+    return 0;
+  }
+  return strtoull(usec, NULL, 10);
+}
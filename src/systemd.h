@@ -0,0 +1,24 @@
+#ifndef TSSD_SYSTEMD_H
+#define TSSD_SYSTEMD_H
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * The parts of the systemd service protocol tssd uses, without linking
+ * libsystemd: sockets passed by socket activation (LISTEN_FDS), and
+ * notifications to the service manager (NOTIFY_SOCKET) - readiness and
+ * watchdog keep-alives.
+ */
+
+// the sockets systemd passed to this process (fds 3 and up), empty if it was not socket activated.
+// the variables are removed from the environment, so a child doesn't take the sockets as its own
+std::vector<int> systemdListenFds();
+
+// sends 'state' (e.g. "READY=1") to the service manager, false if there is none
+bool systemdNotify(const char *state);
+
+// the interval the service manager expects watchdog keep-alives in, 0 if the watchdog is off
+uint64_t systemdWatchdogUsec();
+
+#endif // TSSD_SYSTEMD_H
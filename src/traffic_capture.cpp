@@ -0,0 +1,85 @@
+#include "traffic_capture.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+TrafficCapture::TrafficCapture()
+  : fd_(-1), mappingSize_(0), header_(NULL)
+{
+}
+
+TrafficCapture::~TrafficCapture()
+{
+  close();
+}
+
+bool TrafficCapture::open(const std::string &path, uint64_t maxBytes)
+{
+  if (maxBytes < sizeof(CaptureFileHeader) + captureRecordSize(MaxCapturedPayload))
+  {
+    syslog(LOG_ERR, "capture: max size of %llu bytes is too small", (unsigned long long)maxBytes);
+    return false;
+  }
+  // a new file renamed over the path, a tssd being upgraded (live) keeps capturing to its own file
+  std::string tempPath = path + ".XXXXXX";
+  int fd = mkostemp(&tempPath[0], O_CLOEXEC);
+  if (fd < 0)
+  {
+    syslog(LOG_ERR, "capture: cannot create '%s': '%m'", tempPath.c_str());
+    return false;
+  }
+  // the file is sparse - disk blocks are only allocated for what is captured
+  if (fchmod(fd, 0640) < 0 || ftruncate(fd, maxBytes) < 0)
+  {
+    syslog(LOG_ERR, "capture: cannot resize '%s': '%m'", tempPath.c_str());
+    ::close(fd);
+    unlink(tempPath.c_str());
+    return false;
+  }
+  void *mapping = mmap(NULL, maxBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED || rename(tempPath.c_str(), path.c_str()) < 0)
+  {
+    syslog(LOG_ERR, "capture: cannot map '%s': '%m'", path.c_str());
+    if (mapping != MAP_FAILED)
+    {
+      munmap(mapping, maxBytes);
+    }
+    ::close(fd);
+    unlink(tempPath.c_str());
+    return false;
+  }
+
+  path_ = path;
+  fd_ = fd;
+  mappingSize_ = maxBytes;
+  header_ = (CaptureFileHeader *)mapping;
+  memset(header_, 0, sizeof(*header_));
+  memcpy(header_->magic, CaptureFileMagic, sizeof(header_->magic));
+  header_->usedBytes = sizeof(CaptureFileHeader);
+  syslog(LOG_INFO, "capture: capturing arriving datagrams to '%s' (up to %llu bytes)", path.c_str(), (unsigned long long)maxBytes);
+  return true;
+}
+
+void TrafficCapture::close()
+{
+  if (header_ == NULL)
+  {
+    return;
+  }
+  uint64_t used = header_->usedBytes;
+  syslog(LOG_INFO, "capture: captured %llu datagrams to '%s' (%llu not captured since the file was full)",
+    (unsigned long long)header_->records, path_.c_str(), (unsigned long long)header_->dropped);
+  munmap(header_, mappingSize_);
+  header_ = NULL;
+  if (ftruncate(fd_, used) < 0)
+  {
+    syslog(LOG_WARNING, "capture: cannot truncate '%s': '%m'", path_.c_str());
+  }
+  ::close(fd_);
+  fd_ = -1;
+}
@@ -0,0 +1,96 @@
+#ifndef TSSD_TRAFFIC_CAPTURE_H
+#define TSSD_TRAFFIC_CAPTURE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#include "transport.h"
+
+/*
+ * Binary format of a traffic capture file (written by tssd --capture, and
+ * replayed by tssd-replay): a CaptureFileHeader followed by 'records'
+ * records, each a CaptureRecordHeader followed by 'capturedLength' bytes of
+ * payload, padded to 8 bytes.
+ */
+
+static const char CaptureFileMagic[8] = { 'T', 'S', 'S', 'D', 'C', 'A', 'P', '1' };
+static const int MaxCapturedPayload = MaxDatagramSize; // every datagram is captured whole
+
+struct __attribute__((__packed__)) CaptureFileHeader
+{
+  char magic[8];
+  uint64_t usedBytes; // including this header
+  uint64_t records;
+  uint64_t dropped; // datagrams not captured since the file was full
+  uint8_t reserved[32];
+};
+
+struct __attribute__((__packed__)) CaptureRecordHeader
+{
+  uint64_t rxTimeNs; // arrival time, ns since epoch
+  uint8_t sourceAddr[16]; // IPv4 address is in the first 4 bytes, an IPv6 one takes all 16
+  uint16_t sourcePort; // network byte order
+  uint16_t sourceFamily;
+  uint16_t length; // length of the datagram as received
+  uint16_t capturedLength; // less than 'length' only in older files, which held at most 128 bytes of a datagram
+};
+
+inline size_t captureRecordSize(uint16_t capturedLength)
+{
+  return sizeof(CaptureRecordHeader) + ((capturedLength + 7) & ~(size_t)7);
+}
+
+/*
+ * Writes every arriving datagram of a worker into a memory mapped capture
+ * file - a memcpy per datagram, no syscall. When the file is full, further
+ * datagrams are only counted. On close the file is truncated to its used size.
+ */
+class TrafficCapture
+{
+public:
+  TrafficCapture();
+  ~TrafficCapture();
+
+  // returns false (and logs the reason) on failure
+  bool open(const std::string &path, uint64_t maxBytes);
+  bool isOpen() const
+  {
+    return header_ != NULL;
+  }
+
+  // called by the worker only
+  void capture(const Datagram &datagram)
+  {
+    uint16_t capturedLength = (uint16_t)(datagram.length < MaxCapturedPayload ? datagram.length : MaxCapturedPayload);
+    size_t recordSize = captureRecordSize(capturedLength);
+    uint64_t used = header_->usedBytes;
+    if (used + recordSize > mappingSize_)
+    {
+      header_->dropped++;
+      return;
+    }
+    char *at = (char *)header_ + used;
+    CaptureRecordHeader *record = (CaptureRecordHeader *)at;
+    record->rxTimeNs = datagram.rxTimeNs;
+    socketAddressBytes(datagram.peer, record->sourceAddr);
+    record->sourcePort = socketAddressPort(datagram.peer);
+    record->sourceFamily = datagram.peer.sa.sa_family;
+    record->length = (uint16_t)datagram.length;
+    record->capturedLength = capturedLength;
+    memcpy(at + sizeof(CaptureRecordHeader), datagram.data, capturedLength);
+    header_->usedBytes = used + recordSize;
+    header_->records++;
+  }
+
+  void close();
+
+private:
+  std::string path_;
+  int fd_; // truncated on close - by the fd, the path may be the file of a tssd which took over
+  size_t mappingSize_;
+  CaptureFileHeader *header_;
+};
+
+#endif // TSSD_TRAFFIC_CAPTURE_H
@@ -0,0 +1,77 @@
+#ifndef TSSD_TRANSPORT_H
+#define TSSD_TRANSPORT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <netinet/in.h>
+
+static const int MaxDatagramSize = 512; // larger datagrams are truncated
+static const int MaxBatchSize = 64;
+
+/*
+ * An IPv4 or IPv6 socket address. Like a sockaddr_storage for the two
+ * families we serve, but 28 bytes instead of 128 - it is copied into every
+ * reply. Its size is a valid address length for both families, so the
+ * datagrams of a socket never need to look at the family.
+ */
+union SocketAddress
+{
+  struct sockaddr sa;
+  struct sockaddr_in v4;
+  struct sockaddr_in6 v6;
+};
+
+// the address as 16 bytes (an IPv4 address in the first 4), for the capture and flight recorder formats
+inline void socketAddressBytes(const SocketAddress &address, uint8_t *out)
+{
+  if (address.sa.sa_family == AF_INET6)
+  {
+    memcpy(out, &address.v6.sin6_addr, 16);
+  }
+  else
+  {
+    memset(out, 0, 16);
+    memcpy(out, &address.v4.sin_addr, 4);
+  }
+}
+
+// the port is at the same offset in both families
+inline uint16_t socketAddressPort(const SocketAddress &address)
+{
+  return address.v4.sin_port;
+}
+
+struct Datagram
+{
+  char data[MaxDatagramSize];
+  int length;
+  SocketAddress peer; // source of a request, destination of a reply
+  uint64_t rxTimeNs; // CLOCK_REALTIME ns the request was received (by the kernel, when available)
+};
+
+/*
+ * Where the request pipeline gets requests from and sends replies to.
+ * Both directions work on batches, so a transport can use one syscall
+ * (or none) for many datagrams.
+ */
+class Transport
+{
+public:
+  virtual ~Transport() {}
+
+  // receives up to 'maxCount' datagrams. blocks for a short time at most,
+  // returns 0 if nothing arrived, and -1 on a fatal error
+  virtual int receive(Datagram *datagrams, int maxCount) = 0;
+
+  // sends the datagrams, returns how many were sent and -1 on a fatal error.
+  // a datagram which can't be sent (e.g. its destination is unreachable) is skipped
+  virtual int send(const Datagram *datagrams, int count) = 0;
+
+  // datagrams the kernel dropped so far since the receive queue was full
+  virtual uint32_t socketQueueDrops() const
+  {
+    return 0;
+  }
+};
+
+#endif // TSSD_TRANSPORT_H
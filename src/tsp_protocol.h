@@ -0,0 +1,226 @@
+#ifndef TSSD_TSP_PROTOCOL_H
+#define TSSD_TSP_PROTOCOL_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+
+/*
+ * Wire format of TSP (time sync protocol) packets
+ */
+
+struct __attribute__((__packed__)) TimeRequest
+{
+    char protocol[3]; // Protocol name (TSP)
+    uint8_t protocolVersion; // 1
+    char unused[4]; // 8 bytes padding, can have future use
+    uint64_t clientCookie; // 8 bytes which user can set to whatever value, and will be returned in reply
+};
+
+const int TimeRequestPacketSize = sizeof(TimeRequest);
+
+
+struct __attribute__((__packed__)) TimeReply
+{
+    char protocol[3]; // Protocol name (TSP)
+    uint8_t protocolVersion; // 1
+    char unused[4]; // 8 bytes padding, can have future use
+    uint64_t clientCookie; // the cookie which was sent in the request, copied to the reply for reference
+    uint64_t timeSinceEphoc1970Ms; // number of ms since ephoc time - 1 Jan 1970 GMT
+};
+
+const int TimeReplyPacketSize = sizeof(TimeReply);
+
+/*
+ * Batch requests: a gateway asks for the time of many devices in one datagram.
+ * The first unused byte of a TimeRequest is the message type, and the first
+ * cookie is where the cookie of a TimeRequest is - so a batch reply starts
+ * exactly like a TimeReply, and a server which does not know batches replies
+ * to the first cookie.
+ */
+enum TspMessageType
+{
+  TspTimeRequest = 0,
+  TspBatchRequest = 1,
+  TspBatchReply = 2,
+  TspBeacon = 3,
+  TspAuthRequest = 4,
+  TspAuthReply = 5
+};
+
+const uint8_t TspBatchEchoCookies = 0x01; // the reply carries all the cookies, not only the first
+const int MaxBatchCookies = 32;
+
+struct __attribute__((__packed__)) TimeBatchRequest
+{
+    char protocol[3]; // Protocol name (TSP)
+    uint8_t protocolVersion; // 1
+    uint8_t messageType; // TspBatchRequest
+    uint8_t cookieCount; // 1 to MaxBatchCookies, the datagram carries exactly that many cookies
+    uint8_t flags; // TspBatchEchoCookies
+    char unused;
+    uint64_t clientCookies[MaxBatchCookies];
+};
+
+struct __attribute__((__packed__)) TimeBatchReply
+{
+    char protocol[3]; // Protocol name (TSP)
+    uint8_t protocolVersion; // 1
+    uint8_t messageType; // TspBatchReply
+    uint8_t cookieCount; // as in the request
+    uint8_t flags; // as in the request
+    char unused;
+    uint64_t clientCookie; // the first cookie of the request
+    uint64_t timeSinceEphoc1970Ms; // one timestamp for all the cookies
+    uint64_t moreClientCookies[MaxBatchCookies - 1]; // the other cookies, only with TspBatchEchoCookies
+};
+
+inline int timeBatchRequestSize(int cookieCount)
+{
+  return 8 + 8 * cookieCount;
+}
+
+// with the echo the reply is 8 bytes longer than the request, without it a TimeReply
+inline int timeBatchReplySize(int cookieCount, bool echoCookies)
+{
+  return TimeReplyPacketSize + (echoCookies ? 8 * (cookieCount - 1) : 0);
+}
+
+// check header of packet - to make sure it is a TSP (time sync protocol) packet
+inline bool hasTspHeader(const char *buffer)
+{
+  return buffer[0] == 'T' && buffer[1] == 'S' && buffer[2] == 'P';
+}
+
+/*
+ * Beacons: the server periodically sends its time to a multicast or
+ * broadcast group, clients which only need coarse sync listen passively.
+ * A beacon can't carry the time the kernel really sent it, so every beacon
+ * carries the TX timestamp of the previous one (like a PTP follow up) -
+ * a listener pairs it with the time it received the previous beacon.
+ * The first 24 bytes are laid out like a TimeReply.
+ */
+struct __attribute__((__packed__)) TimeBeacon
+{
+    char protocol[3]; // Protocol name (TSP)
+    uint8_t protocolVersion; // 1
+    uint8_t messageType; // TspBeacon
+    uint8_t flags; // none yet, 0
+    uint16_t keyId; // key of a trailing MAC, 0 for an unsigned beacon
+    uint64_t sequence; // +1 for every beacon, a gap means lost beacons
+    uint64_t timeSinceEphoc1970Ms; // server time the beacon was built
+    uint64_t timeNs; // the same, in ns since the epoch
+    uint64_t previousTxTimeNs; // server time the kernel sent beacon 'sequence - 1', 0 if unknown
+};
+
+const int TimeBeaconPacketSize = sizeof(TimeBeacon);
+
+inline bool isTimeBeacon(const char *buffer, int length)
+{
+  return length >= TimeBeaconPacketSize && hasTspHeader(buffer) && ((const TimeBeacon *)buffer)->messageType == TspBeacon;
+}
+
+/*
+ * Authenticated requests: the client and the server share a key, and a
+ * request and its reply carry the id of the key and a SipHash-2-4 MAC, so
+ * a client can tell a reply came from a server which has its key. The MAC
+ * of a request covers its first 16 bytes (the header with the key id, and
+ * the cookie), the MAC of a reply its first 24 (the header, the cookie and
+ * the time) - a reply can't be moved to another request or changed. The
+ * reply starts like a TimeReply; a server which doesn't know authenticated
+ * requests answers them with a TimeReply of message type TspAuthRequest,
+ * which a client must not accept.
+ */
+struct __attribute__((__packed__)) TimeAuthRequest
+{
+    char protocol[3]; // Protocol name (TSP)
+    uint8_t protocolVersion; // 1
+    uint8_t messageType; // TspAuthRequest
+    uint8_t flags; // none yet, 0
+    uint16_t keyId; // the key of the MAC, 1 to 65535
+    uint64_t clientCookie;
+    uint64_t mac; // SipHash-2-4 of the first 16 bytes
+};
+
+struct __attribute__((__packed__)) TimeAuthReply
+{
+    char protocol[3]; // Protocol name (TSP)
+    uint8_t protocolVersion; // 1
+    uint8_t messageType; // TspAuthReply
+    uint8_t flags; // as in the request
+    uint16_t keyId; // as in the request
+    uint64_t clientCookie;
+    uint64_t timeSinceEphoc1970Ms;
+    uint64_t mac; // SipHash-2-4 of the first 24 bytes
+};
+
+const int TimeAuthRequestPacketSize = sizeof(TimeAuthRequest);
+const int TimeAuthReplyPacketSize = sizeof(TimeAuthReply);
+const int TimeAuthRequestMacLength = 16; // bytes covered by the MAC
+const int TimeAuthReplyMacLength = 24;
+
+// an authenticated request of a TSP packet (the MAC is not checked)
+inline bool isTimeAuthRequest(const char *buffer, int length)
+{
+  return length == TimeAuthRequestPacketSize && ((const TimeAuthRequest *)buffer)->messageType == TspAuthRequest;
+}
+
+// the time to put in a reply: number of ms since ephoc time
+inline uint64_t currentTimeMsSinceEpoch()
+{
+  struct timeval tvCurrTime;
+  gettimeofday(&tvCurrTime, NULL);
+  // convert sec to ms and usec to ms
+  return ((uint64_t)(tvCurrTime.tv_sec)) * 1000 + ((uint64_t)(tvCurrTime.tv_usec)) / 1000;
+}
+
+// the reply is the request (so the cookie is returned), followed by the time
+inline void encodeTimeReply(const char *requestBuffer, uint64_t timeMsSinceEpoch, char *replyBuffer)
+{
+  memcpy(replyBuffer, requestBuffer, TimeRequestPacketSize);
+  ((TimeReply *)replyBuffer)->timeSinceEphoc1970Ms = timeMsSinceEpoch;
+}
+
+// the reply without its MAC, which is added once the whole batch is built
+inline void encodeTimeAuthReply(const char *requestBuffer, uint64_t timeMsSinceEpoch, char *replyBuffer)
+{
+  memcpy(replyBuffer, requestBuffer, TimeRequestPacketSize);
+  TimeAuthReply *reply = (TimeAuthReply *)replyBuffer;
+  reply->messageType = TspAuthReply;
+  reply->timeSinceEphoc1970Ms = timeMsSinceEpoch;
+  reply->mac = 0;
+}
+
+// number of cookies of a well formed batch request (of a TSP packet), 0 if it is not one
+inline int batchRequestCookieCount(const char *buffer, int length)
+{
+  const TimeBatchRequest *request = (const TimeBatchRequest *)buffer;
+  if (length < TimeRequestPacketSize || request->messageType != TspBatchRequest)
+  {
+    return 0;
+  }
+  int count = request->cookieCount;
+  if (count < 1 || count > MaxBatchCookies || length != timeBatchRequestSize(count))
+  {
+    return 0;
+  }
+  return count;
+}
+
+// returns the length of the reply
+inline int encodeTimeBatchReply(const char *requestBuffer, int cookieCount, uint64_t timeMsSinceEpoch, char *replyBuffer)
+{
+  const TimeBatchRequest *request = (const TimeBatchRequest *)requestBuffer;
+  TimeBatchReply *reply = (TimeBatchReply *)replyBuffer;
+  memcpy(replyBuffer, requestBuffer, TimeRequestPacketSize);
+  reply->messageType = TspBatchReply;
+  reply->timeSinceEphoc1970Ms = timeMsSinceEpoch;
+  bool echoCookies = (request->flags & TspBatchEchoCookies) != 0;
+  if (echoCookies)
+  {
+    memcpy(reply->moreClientCookies, &request->clientCookies[1], 8 * (cookieCount - 1));
+  }
+  return timeBatchReplySize(cookieCount, echoCookies);
+}
+
+#endif // TSSD_TSP_PROTOCOL_H
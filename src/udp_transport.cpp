@@ -0,0 +1,283 @@
+#include "udp_transport.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+
+static inline uint64_t realtimeNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// read the ancillary data the kernel attached to a received message:
+// the time it received the packet, as CLOCK_REALTIME ns (left 0 if missing),
+// and the number of packets dropped so far on the socket queue (left unchanged if missing)
+static void parseAncillaryData(struct msghdr *msg, uint64_t *rxTimeNs, uint32_t *socketQueueDrops)
+{
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET)
+    {
+      continue;
+    }
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      *rxTimeNs = ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    }
+    else if (cmsg->cmsg_type == SO_RXQ_OVFL)
+    {
+      memcpy(socketQueueDrops, CMSG_DATA(cmsg), sizeof(*socketQueueDrops));
+    }
+  }
+}
+
+UdpTransport::UdpTransport()
+  : fd_(-1), socketQueueDrops_(0), lastSendErrno_(0)
+{
+}
+
+UdpTransport::~UdpTransport()
+{
+  close();
+}
+
+bool UdpTransport::open(unsigned short port, int family, bool v6Only)
+{
+  int optval; /* flag value for setsockopt */
+
+  /* 
+   * socket: create the parent socket 
+   */
+  fd_ = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0)
+  {
+    syslog(LOG_ERR, "ERROR opening socket: '%m'");
+    return false;
+  }
+
+  /* setsockopt: Handy debugging trick that lets 
+   * us rerun the server immediately after we kill it; 
+   * otherwise we have to wait about 20 secs. 
+   * Eliminates "ERROR on binding: Address already in use" error. 
+   */
+  optval = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, (const void *)&optval , sizeof(int));
+
+  /*
+   * build the server's Internet address
+   */
+  SocketAddress serveraddr;
+  bzero((char *) &serveraddr, sizeof(serveraddr));
+  if (family == AF_INET6)
+  {
+    // explicitly, the default of IPV6_V6ONLY is a sysctl
+    optval = v6Only ? 1 : 0;
+    if (setsockopt(fd_, IPPROTO_IPV6, IPV6_V6ONLY, (const void *)&optval, sizeof(int)) < 0)
+    {
+      syslog(LOG_ERR, "ERROR setting IPV6_V6ONLY: '%m'");
+      close();
+      return false;
+    }
+    serveraddr.v6.sin6_family = AF_INET6;
+    serveraddr.v6.sin6_addr = in6addr_any;
+    serveraddr.v6.sin6_port = htons(port);
+  }
+  else
+  {
+    serveraddr.v4.sin_family = AF_INET;
+    serveraddr.v4.sin_addr.s_addr = htonl(INADDR_ANY);
+    serveraddr.v4.sin_port = htons(port);
+  }
+
+  /* 
+   * bind: associate the parent socket with a port 
+   */
+  if (bind(fd_, &serveraddr.sa, family == AF_INET6 ? sizeof(serveraddr.v6) : sizeof(serveraddr.v4)) < 0)
+  {
+    syslog(LOG_ERR, "ERROR on binding to port %u (%s): '%m'", port, family == AF_INET6 ? "IPv6" : "IPv4");
+    close();
+    return false;
+  }
+  configureSocket();
+  return true;
+}
+
+bool UdpTransport::adopt(int fd)
+{
+  unsigned short port;
+  int family;
+  bool v6Only;
+  if (!udpSocketEndpoint(fd, port, family, v6Only))
+  {
+    syslog(LOG_ERR, "fd %d is not a bound UDP socket", fd);
+    return false;
+  }
+  fd_ = fd;
+  // the receive timeout only works on a blocking socket
+  fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_NONBLOCK);
+  configureSocket();
+  return true;
+}
+
+void UdpTransport::configureSocket()
+{
+  int optval;
+
+  /*
+  Set timeout on the socket. it is good for 2 reasons:
+  1. if we get a signal to terminate the service, this will give us a chance to 
+    observe the flag change and exit the loop
+  2. the code (which should react fast to time request) will be "hot" in cache,
+    thus, decreasing the response time
+  */
+  struct timeval tvForSockRecv;
+  tvForSockRecv.tv_sec = 0;
+  tvForSockRecv.tv_usec = 1000 * 50; /* value is microseconds, so timeout set to 50 ms */
+  setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, (const char*)&tvForSockRecv, sizeof(tvForSockRecv));
+
+  // ask the kernel to timestamp every arriving packet, so the service time
+  // includes the time the request waited in the socket queue
+  optval = 1;
+  if (setsockopt(fd_, SOL_SOCKET, SO_TIMESTAMPNS, (const void *)&optval, sizeof(int)) < 0)
+  {
+    syslog(LOG_WARNING, "kernel RX timestamps are not available: '%m'");
+  }
+
+  // ask the kernel to report how many packets were dropped on a full socket queue
+  optval = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, (const void *)&optval, sizeof(int));
+}
+
+bool udpSocketEndpoint(int fd, unsigned short &port, int &family, bool &v6Only)
+{
+  int type;
+  socklen_t length = sizeof(type);
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0 || type != SOCK_DGRAM)
+  {
+    return false;
+  }
+  SocketAddress addr;
+  length = sizeof(addr);
+  if (getsockname(fd, &addr.sa, &length) < 0 || (addr.sa.sa_family != AF_INET && addr.sa.sa_family != AF_INET6))
+  {
+    return false;
+  }
+  family = addr.sa.sa_family;
+  port = ntohs(socketAddressPort(addr));
+  int optval = 0;
+  length = sizeof(optval);
+  v6Only = family == AF_INET6 && getsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &optval, &length) == 0 && optval != 0;
+  return true;
+}
+
+void UdpTransport::close()
+{
+  if (fd_ >= 0)
+  {
+    ::close(fd_);
+    fd_ = -1;
+  }
+}
+
+int UdpTransport::receive(Datagram *datagrams, int maxCount)
+{
+  if (maxCount > MaxBatchSize)
+  {
+    maxCount = MaxBatchSize;
+  }
+  for (int i = 0; i < maxCount; i++)
+  {
+    iovs_[i].iov_base = datagrams[i].data;
+    iovs_[i].iov_len = MaxDatagramSize;
+    bzero(&msgs_[i], sizeof(msgs_[i]));
+    msgs_[i].msg_hdr.msg_name = &datagrams[i].peer;
+    msgs_[i].msg_hdr.msg_namelen = sizeof(datagrams[i].peer);
+    msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+    msgs_[i].msg_hdr.msg_control = control_[i];
+    msgs_[i].msg_hdr.msg_controllen = sizeof(control_[i]);
+  }
+
+  // blocks until the first datagram (or the socket timeout), then takes whatever else is queued
+  int n = recvmmsg(fd_, msgs_, maxCount, MSG_WAITFORONE, NULL);
+  if (n < 0)
+  {
+    if (errno == EAGAIN || errno == EINTR) // timeout of the recv operation
+    {
+      return 0;
+    }
+    syslog(LOG_ERR, "recv from socket failed because: '%m'");
+    return -1;
+  }
+
+  uint64_t fallbackRxTimeNs = 0;
+  for (int i = 0; i < n; i++)
+  {
+    datagrams[i].length = (int)msgs_[i].msg_len;
+    datagrams[i].rxTimeNs = 0;
+    parseAncillaryData(&msgs_[i].msg_hdr, &datagrams[i].rxTimeNs, &socketQueueDrops_);
+    if (datagrams[i].rxTimeNs == 0)
+    {
+      if (fallbackRxTimeNs == 0)
+      {
+        fallbackRxTimeNs = realtimeNs();
+      }
+      datagrams[i].rxTimeNs = fallbackRxTimeNs;
+    }
+  }
+  return n;
+}
+
+int UdpTransport::send(const Datagram *datagrams, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    iovs_[i].iov_base = (void *)datagrams[i].data;
+    iovs_[i].iov_len = datagrams[i].length;
+    bzero(&msgs_[i], sizeof(msgs_[i]));
+    msgs_[i].msg_hdr.msg_name = (void *)&datagrams[i].peer;
+    msgs_[i].msg_hdr.msg_namelen = sizeof(datagrams[i].peer);
+    msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+    msgs_[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  // sendmmsg stops at a datagram which can't be sent, and fails with its error when it's the first one
+  int sent = 0;
+  int done = 0;
+  while (done < count)
+  {
+    int n = sendmmsg(fd_, msgs_ + done, count - done, MSG_CONFIRM);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EBADF || errno == ENOTSOCK || errno == EFAULT)
+      {
+        syslog(LOG_ERR, "ERROR in sendto: '%m'");
+        return -1;
+      }
+      // e.g. no route to the client (ENETUNREACH), or a firewall rule (EPERM) - only this reply is lost
+      if (errno != lastSendErrno_)
+      {
+        syslog(LOG_WARNING, "cannot send a reply: '%m'");
+        lastSendErrno_ = errno;
+      }
+      done++;
+      continue;
+    }
+    sent += n;
+    done += n;
+  }
+  return sent;
+}
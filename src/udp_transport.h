@@ -0,0 +1,55 @@
+#ifndef TSSD_UDP_TRANSPORT_H
+#define TSSD_UDP_TRANSPORT_H
+
+#include <sys/socket.h>
+
+#include "transport.h"
+
+/*
+ * Transport over a UDP socket, with recvmmsg/sendmmsg. Every request is
+ * stamped with the kernel RX timestamp (SO_TIMESTAMPNS).
+ */
+class UdpTransport : public Transport
+{
+public:
+  UdpTransport();
+  virtual ~UdpTransport();
+
+  // creates the socket and binds it to the port on all interfaces. 'family' is AF_INET, or
+  // AF_INET6 - which also serves IPv4 clients (as mapped addresses) unless 'v6Only'.
+  // returns false (and logs the reason) on failure
+  bool open(unsigned short port, int family = AF_INET, bool v6Only = false);
+  // serves a UDP socket which is already bound (passed by systemd). returns false (and logs the reason) on failure
+  bool adopt(int fd);
+  void close();
+
+  int fd() const
+  {
+    return fd_;
+  }
+
+  virtual int receive(Datagram *datagrams, int maxCount);
+  virtual int send(const Datagram *datagrams, int count);
+
+  virtual uint32_t socketQueueDrops() const
+  {
+    return socketQueueDrops_;
+  }
+
+private:
+  // the options every served socket needs
+  void configureSocket();
+
+  int fd_;
+  uint32_t socketQueueDrops_;
+  int lastSendErrno_; // logged once until another error comes
+  struct iovec iovs_[MaxBatchSize];
+  struct mmsghdr msgs_[MaxBatchSize];
+  // ancillary data - kernel RX timestamp and socket queue drops
+  char control_[MaxBatchSize][CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+};
+
+// the local port and family of a bound UDP socket, false if 'fd' is not one
+bool udpSocketEndpoint(int fd, unsigned short &port, int &family, bool &v6Only);
+
+#endif // TSSD_UDP_TRANSPORT_H
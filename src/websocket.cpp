@@ -0,0 +1,195 @@
+#include "websocket.h"
+
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+
+static const char WebSocketGuid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+static inline uint32_t rotateLeft(uint32_t value, int bits)
+{
+  return (value << bits) | (value >> (32 - bits));
+}
+
+// SHA-1, only for the handshake - it is not used for anything which needs to be secure
+static void sha1(const std::string &message, uint8_t digest[20])
+{
+  uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  std::string padded = message;
+  padded += (char)0x80;
+  while (padded.size() % 64 != 56)
+  {
+    padded += (char)0;
+  }
+  uint64_t bits = (uint64_t)message.size() * 8;
+  for (int i = 7; i >= 0; i--)
+  {
+    padded += (char)(bits >> (i * 8));
+  }
+
+  for (size_t chunk = 0; chunk < padded.size(); chunk += 64)
+  {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+    {
+      const uint8_t *p = (const uint8_t *)padded.data() + chunk + i * 4;
+      w[i] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    }
+    for (int i = 16; i < 80; i++)
+    {
+      w[i] = rotateLeft(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++)
+    {
+      uint32_t f, k;
+      if (i < 20)
+      {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      }
+      else if (i < 40)
+      {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      }
+      else if (i < 60)
+      {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      }
+      else
+      {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t temp = rotateLeft(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = rotateLeft(b, 30);
+      b = a;
+      a = temp;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+  for (int i = 0; i < 5; i++)
+  {
+    digest[i * 4] = (uint8_t)(h[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)h[i];
+  }
+}
+
+static std::string base64(const uint8_t *data, int length)
+{
+  static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::string out;
+  for (int i = 0; i < length; i += 3)
+  {
+    uint32_t group = (uint32_t)data[i] << 16;
+    if (i + 1 < length)
+    {
+      group |= (uint32_t)data[i + 1] << 8;
+    }
+    if (i + 2 < length)
+    {
+      group |= data[i + 2];
+    }
+    out += alphabet[(group >> 18) & 0x3f];
+    out += alphabet[(group >> 12) & 0x3f];
+    out += i + 1 < length ? alphabet[(group >> 6) & 0x3f] : '=';
+    out += i + 2 < length ? alphabet[group & 0x3f] : '=';
+  }
+  return out;
+}
+
+std::string webSocketAccept(const std::string &key)
+{
+  uint8_t digest[20];
+  sha1(key + WebSocketGuid, digest);
+  return base64(digest, sizeof(digest));
+}
+
+// the value of a header (case insensitive name), empty if missing
+static std::string headerValue(const char *request, const char *name)
+{
+  size_t nameLength = strlen(name);
+  for (const char *line = strchr(request, '\n'); line != NULL; line = strchr(line, '\n'))
+  {
+    line++;
+    if (strncasecmp(line, name, nameLength) == 0 && line[nameLength] == ':')
+    {
+      const char *value = line + nameLength + 1;
+      while (*value == ' ' || *value == '\t')
+      {
+        value++;
+      }
+      const char *end = value;
+      while (*end != '\0' && *end != '\r' && *end != '\n')
+      {
+        end++;
+      }
+      while (end > value && isspace((unsigned char)end[-1]))
+      {
+        end--;
+      }
+      return std::string(value, end - value);
+    }
+  }
+  return std::string();
+}
+
+std::string webSocketHandshakeResponse(const char *request)
+{
+  std::string key = headerValue(request, "Sec-WebSocket-Key");
+  if (strncmp(request, "GET ", 4) != 0 || key.empty())
+  {
+    return std::string();
+  }
+  return "HTTP/1.1 101 Switching Protocols\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "Sec-WebSocket-Accept: " + webSocketAccept(key) + "\r\n\r\n";
+}
+
+int parseWebSocketFrame(const char *buffer, int length, uint8_t &opcode, char *payload, int &payloadLength)
+{
+  if (length < 2)
+  {
+    return 0;
+  }
+  uint8_t first = (uint8_t)buffer[0];
+  uint8_t second = (uint8_t)buffer[1];
+  bool final = (first & 0x80) != 0;
+  bool masked = (second & 0x80) != 0;
+  payloadLength = second & 0x7f;
+  if (!final || !masked || payloadLength > MaxWebSocketPayload)
+  {
+    return -1;
+  }
+  int frameLength = 2 + 4 + payloadLength;
+  if (length < frameLength)
+  {
+    return 0;
+  }
+  opcode = first & 0x0f;
+  const char *mask = buffer + 2;
+  for (int i = 0; i < payloadLength; i++)
+  {
+    payload[i] = buffer[6 + i] ^ mask[i & 3];
+  }
+  return frameLength;
+}
+
+int encodeWebSocketFrame(uint8_t opcode, const char *payload, int payloadLength, char *frame)
+{
+  frame[0] = (char)(0x80 | opcode);
+  frame[1] = (char)payloadLength;
+  memcpy(frame + 2, payload, payloadLength);
+  return 2 + payloadLength;
+}
@@ -0,0 +1,43 @@
+#ifndef TSSD_WEBSOCKET_H
+#define TSSD_WEBSOCKET_H
+
+#include <stdint.h>
+#include <string>
+
+/*
+ * The parts of WebSocket (RFC 6455) the stream endpoint needs: the
+ * handshake, and frames with payloads of up to 125 bytes - which is all
+ * a TSP message takes.
+ */
+
+enum WebSocketOpcode
+{
+  WebSocketText = 0x1,
+  WebSocketBinary = 0x2,
+  WebSocketClose = 0x8,
+  WebSocketPing = 0x9,
+  WebSocketPong = 0xa
+};
+
+const int MaxWebSocketPayload = 125; // fits the 7 bit length
+const int MaxWebSocketFrame = 2 + 4 + MaxWebSocketPayload; // header, mask and payload of a client frame
+
+// the value of Sec-WebSocket-Accept for a Sec-WebSocket-Key
+std::string webSocketAccept(const std::string &key);
+
+// the 101 response to an HTTP upgrade request (the complete headers, NUL terminated),
+// or an empty string if it is not a valid WebSocket upgrade request
+std::string webSocketHandshakeResponse(const char *request);
+
+/*
+ * Parses a client frame from the start of 'buffer'. Returns the length of
+ * the frame once it is complete (with the unmasked payload in 'payload'),
+ * 0 if more bytes are needed, or -1 if it is not a frame we accept
+ * (unmasked, fragmented, or too long).
+ */
+int parseWebSocketFrame(const char *buffer, int length, uint8_t &opcode, char *payload, int &payloadLength);
+
+// a server frame (never masked), returns its length. 'payloadLength' is at most MaxWebSocketPayload
+int encodeWebSocketFrame(uint8_t opcode, const char *payload, int payloadLength, char *frame);
+
+#endif // TSSD_WEBSOCKET_H
@@ -0,0 +1,69 @@
+#ifndef TSSD_WORKER_STATS_H
+#define TSSD_WORKER_STATS_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "latency_histogram.h"
+
+/*
+ * Counter with a single writer. Incrementing is a relaxed load + store,
+ * which is enough since no other thread writes to it, and readers on other
+ * threads always see a consistent (maybe slightly old) value.
+ */
+class StatCounter
+{
+public:
+  StatCounter() : value_(0) {}
+
+  void inc()
+  {
+    value_.store(value_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  }
+
+  void add(uint64_t n)
+  {
+    value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  uint64_t load() const
+  {
+    return value_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> value_;
+};
+
+/*
+ * Statistics of a single worker (a loop which serves requests).
+ * Only the worker writes to it, the stats reporter reads it concurrently.
+ * Aligned to a cache line so workers never share a line with each other.
+ */
+struct alignas(64) WorkerStats
+{
+  WorkerStats() : socketQueueDrops(0), cpu(-1) {}
+
+  StatCounter requests; // datagrams received
+  StatCounter tooShort; // dropped since shorter than a TimeRequest
+  StatCounter notTsp; // dropped since the header is not 'TSP'
+  StatCounter notNtpClient; // dropped by the NTP endpoint since they are not NTP client requests
+  StatCounter notSynchronized; // dropped since the relay is not synchronized to its upstream yet
+  StatCounter authFailed; // authenticated requests dropped since their key is unknown or their MAC is wrong
+  StatCounter notAuthenticated; // dropped since they are not authenticated, and authentication is required
+  StatCounter accessDenied; // dropped (or connections closed) since the source is not allowed by the access list
+  StatCounter batchTooLarge; // batch requests dropped since they carry more cookies than allowed
+  StatCounter batchRateLimited; // batch requests dropped by the batch rate limit
+  StatCounter batchRequests; // batch requests served
+  StatCounter batchCookies; // cookies served in batch requests
+  StatCounter authRequests; // authenticated requests served
+  StatCounter replies; // replies sent
+  StatCounter sendFailed; // replies the kernel didn't send, e.g. since there is no route to the client
+  std::atomic<uint32_t> socketQueueDrops; // packets the kernel dropped since the socket queue was full (SO_RXQ_OVFL)
+  std::atomic<int> cpu; // cpu the worker was last seen running on
+
+  LatencyHistogram serviceTime; // kernel RX timestamp until sendto() returned
+  LatencyHistogram buildTime; // time spent building the reply
+};
+
+#endif // TSSD_WORKER_STATS_H
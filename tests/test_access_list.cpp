@@ -0,0 +1,104 @@
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <string>
+
+#include "access_list.h"
+#include "unittest.h"
+
+static SocketAddress address(const char *text)
+{
+  SocketAddress source;
+  memset(&source, 0, sizeof(source));
+  if (inet_pton(AF_INET, text, &source.v4.sin_addr) == 1)
+  {
+    source.v4.sin_family = AF_INET;
+  }
+  else
+  {
+    source.v6.sin6_family = AF_INET6;
+    CHECK(inet_pton(AF_INET6, text, &source.v6.sin6_addr) == 1);
+  }
+  return source;
+}
+
+static void AccessListEmpty()
+{
+  AccessList access;
+  std::string error;
+  CHECK(access.allow("", error));
+  CHECK(access.deny(" , ", error));
+  CHECK(access.empty());
+  CHECK(access.allows(address("10.0.0.1")));
+  CHECK(access.allows(address("2001:db8::1")));
+}
+TSSD_TEST(AccessListEmpty);
+
+static void AccessListAllowIPv4()
+{
+  AccessList access;
+  std::string error;
+  CHECK(access.allow("10.0.0.0/8, 192.168.1.7,172.16.0.128/25", error));
+  CHECK(!access.empty());
+  CHECK(access.allows(address("10.1.2.3")));
+  CHECK(access.allows(address("192.168.1.7")));
+  CHECK(access.allows(address("172.16.0.200")));
+  CHECK(!access.allows(address("172.16.0.100")));
+  CHECK(!access.allows(address("192.168.1.8")));
+  CHECK(!access.allows(address("11.0.0.1")));
+  // only IPv4 is allowed
+  CHECK(!access.allows(address("2001:db8::1")));
+}
+TSSD_TEST(AccessListAllowIPv4);
+
+static void AccessListDenyOverAllow()
+{
+  AccessList access;
+  std::string error;
+  CHECK(access.allow("10.0.0.0/8", error));
+  CHECK(access.deny("10.0.0.0/24", error));
+  CHECK(!access.allows(address("10.0.0.5")));
+  CHECK(access.allows(address("10.0.1.5")));
+
+  AccessList denyOnly;
+  CHECK(denyOnly.deny("0.0.0.0/0", error));
+  CHECK(!denyOnly.allows(address("10.0.0.1")));
+  CHECK(denyOnly.allows(address("2001:db8::1")));
+}
+TSSD_TEST(AccessListDenyOverAllow);
+
+static void AccessListIPv6()
+{
+  AccessList access;
+  std::string error;
+  CHECK(access.allow("2001:db8::/32,10.0.0.0/8", error));
+  CHECK(access.allows(address("2001:db8:1::1")));
+  CHECK(!access.allows(address("2001:db9::1")));
+  // a mapped IPv4 source of a dual stack socket matches the IPv4 prefixes
+  CHECK(access.allows(address("::ffff:10.0.0.1")));
+  CHECK(!access.allows(address("::ffff:11.0.0.1")));
+}
+TSSD_TEST(AccessListIPv6);
+
+static void AccessListErrors()
+{
+  const char *const invalid[] = { "bogus", "10.0.0.0/33", "10.0.0.0/", "10.0.0.0/x", "10.0.0.0/-1", "2001:db8::/129",
+    "10.0.0.1,10.0.0" };
+  for (size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); i++)
+  {
+    AccessList access;
+    std::string error;
+    if (!CHECK(!access.allow(invalid[i], error)))
+    {
+      continue;
+    }
+    CHECK(!error.empty());
+  }
+  AccessList access;
+  std::string error;
+  CHECK(!access.deny("10.0.0.1, not-an-address", error));
+  CHECK(error == "'not-an-address' is not an address");
+  CHECK(!access.deny("10.0.0.1/40", error));
+  CHECK(error == "'10.0.0.1/40' has an invalid prefix length");
+}
+TSSD_TEST(AccessListErrors);
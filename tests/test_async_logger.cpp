@@ -0,0 +1,115 @@
+/*
+ * Tests of the log rings of the workers: the per category rate limit, the
+ * sampling over it, and a full ring.
+ */
+
+#include <string.h>
+
+#include "async_logger.h"
+#include "unittest.h"
+
+static const uint64_t SecondNs = 1000000000ULL;
+
+static SocketAddress testSource()
+{
+  SocketAddress source;
+  memset(&source, 0, sizeof(source));
+  source.v4.sin_family = AF_INET;
+  return source;
+}
+
+// records in the ring, and how many of them are samples
+static int popAll(LogRing &ring, int &sampled)
+{
+  int count = 0;
+  sampled = 0;
+  LogRecord record;
+  while (ring.pop(record))
+  {
+    count++;
+    sampled += record.sampled;
+  }
+  return count;
+}
+
+static void AsyncLoggerRateLimit()
+{
+  LogRing ring(8, 10, 0);
+  SocketAddress source = testSource();
+  uint64_t now = 100 * SecondNs;
+  for (int i = 0; i < 25; i++)
+  {
+    ring.log(LogNotTsp, now, source, 4, i);
+  }
+  // another category has its own limit
+  ring.log(LogTooShort, now, source, 2, 0);
+  int sampled;
+  CHECK_EQUAL(popAll(ring, sampled), 11);
+  CHECK_EQUAL(ring.suppressed(LogNotTsp), 15);
+  CHECK_EQUAL(ring.suppressed(LogTooShort), 0);
+
+  // a new second, a new window
+  for (int i = 0; i < 25; i++)
+  {
+    ring.log(LogNotTsp, now + SecondNs, source, 4, i);
+  }
+  CHECK_EQUAL(popAll(ring, sampled), 10);
+  CHECK_EQUAL(ring.suppressed(LogNotTsp), 30);
+}
+TSSD_TEST(AsyncLoggerRateLimit);
+
+// over the rate, one of every 'sampleEvery' records is still logged, marked as a sample
+static void AsyncLoggerSampling()
+{
+  LogRing ring(8, 5, 10);
+  SocketAddress source = testSource();
+  uint64_t now = 100 * SecondNs;
+  for (int i = 0; i < 105; i++)
+  {
+    ring.log(LogAccessDenied, now, source, 8, i);
+  }
+  int sampled;
+  CHECK_EQUAL(popAll(ring, sampled), 15);
+  CHECK_EQUAL(sampled, 10);
+  CHECK_EQUAL(ring.suppressed(LogAccessDenied), 90);
+
+  // a reload turns the sampling off
+  ring.setLimits(5, 0);
+  for (int i = 0; i < 100; i++)
+  {
+    ring.log(LogAccessDenied, now, source, 8, i);
+  }
+  CHECK_EQUAL(popAll(ring, sampled), 0);
+  CHECK_EQUAL(ring.suppressed(LogAccessDenied), 190);
+}
+TSSD_TEST(AsyncLoggerSampling);
+
+// a full ring loses the records (counted as suppressed), the worker never waits
+static void AsyncLoggerRingFull()
+{
+  LogRing ring(4, 1000, 0);
+  SocketAddress source = testSource();
+  uint64_t now = 100 * SecondNs;
+  for (int i = 0; i < 20; i++)
+  {
+    ring.log(LogAuthFailed, now, source, 40, i);
+  }
+  CHECK_EQUAL(ring.suppressed(LogAuthFailed), 4);
+  LogRecord record;
+  for (uint64_t i = 0; i < 16; i++)
+  {
+    if (!CHECK(ring.pop(record)))
+    {
+      return;
+    }
+    CHECK_EQUAL(record.arg, i);
+    CHECK_EQUAL(record.category, LogAuthFailed);
+    CHECK_EQUAL(record.length, 40);
+    CHECK_EQUAL(record.timeNs, now);
+  }
+  CHECK(!ring.pop(record));
+  // room again once drained
+  ring.log(LogAuthFailed, now, source, 40, 99);
+  CHECK(ring.pop(record) && record.arg == 99);
+}
+TSSD_TEST(AsyncLoggerRingFull);
@@ -0,0 +1,97 @@
+/*
+ * Tests of the batch request rate limits: the per source and the total
+ * buckets, and a source which evicts another one from its table slot.
+ */
+
+#include "batch_rate_limiter.h"
+#include "unittest.h"
+
+static const uint64_t SecondNs = 1000000000ULL;
+
+static uint32_t slot(uint64_t address)
+{
+  return BatchRateLimiter::hash(address) & (BatchRateLimiter::TableSize - 1);
+}
+
+// another source key, in the same table slot as 'address' or in another one
+static uint64_t otherSource(uint64_t address, bool colliding)
+{
+  uint64_t other = address + 1;
+  while ((slot(other) == slot(address)) != colliding)
+  {
+    other++;
+  }
+  return other;
+}
+
+static void BatchRateLimiterPerSource()
+{
+  BatchRateLimiter limiter;
+  limiter.configure(100, 1000000, 0);
+  uint64_t now = 10 * SecondNs;
+  CHECK(limiter.allow(1, now, 100));
+  CHECK(!limiter.allow(1, now, 1));
+  // another source has its own bucket
+  CHECK(limiter.allow(otherSource(1, false), now, 100));
+  // refilled at the rate, up to the burst
+  CHECK(limiter.allow(1, now + SecondNs / 2, 50));
+  CHECK(!limiter.allow(1, now + SecondNs / 2, 1));
+  CHECK(limiter.allow(1, now + 10 * SecondNs, 100));
+  CHECK(!limiter.allow(1, now + 10 * SecondNs, 1));
+}
+TSSD_TEST(BatchRateLimiterPerSource);
+
+static void BatchRateLimiterTotal()
+{
+  BatchRateLimiter limiter;
+  limiter.configure(100, 150, 0);
+  uint64_t now = 10 * SecondNs;
+  uint64_t other = otherSource(1, false);
+  CHECK(limiter.allow(1, now, 100));
+  CHECK(!limiter.allow(other, now, 100));
+  CHECK(limiter.allow(other, now, 50));
+  CHECK(!limiter.allow(other, now, 1));
+}
+TSSD_TEST(BatchRateLimiterTotal);
+
+// a source taking a slot over gets the tokens left in it, not a fresh burst
+static void BatchRateLimiterEviction()
+{
+  BatchRateLimiter limiter;
+  limiter.configure(100, 1000000, 0);
+  uint64_t now = 10 * SecondNs;
+  uint64_t colliding = otherSource(1, true);
+  CHECK(limiter.allow(1, now, 100));
+  CHECK(!limiter.allow(colliding, now, 1));
+  CHECK(limiter.allow(colliding, now + SecondNs / 4, 25));
+  CHECK(!limiter.allow(1, now + SecondNs / 4, 1));
+
+  // alternating spoofed sources of one slot share its rate
+  uint64_t served = 0;
+  for (int i = 0; i < 1000; i++)
+  {
+    if (limiter.allow((i & 1) != 0 ? 1 : colliding, now + SecondNs, 1))
+    {
+      served++;
+    }
+  }
+  CHECK_EQUAL(served, 75);
+}
+TSSD_TEST(BatchRateLimiterEviction);
+
+// the buckets go over to a new process in a live upgrade
+static void BatchRateLimiterState()
+{
+  BatchRateLimiter limiter;
+  limiter.configure(100, 1000000, 0);
+  uint64_t now = 10 * SecondNs;
+  CHECK(limiter.allow(1, now, 100));
+
+  BatchRateLimiter restored;
+  restored.configure(100, 1000000, 0);
+  CHECK(!restored.restoreState("junk"));
+  CHECK(restored.restoreState(limiter.saveState()));
+  CHECK(!restored.allow(1, now, 1));
+  CHECK(restored.allow(otherSource(1, false), now, 100));
+}
+TSSD_TEST(BatchRateLimiterState);
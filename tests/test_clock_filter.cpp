@@ -0,0 +1,130 @@
+/*
+ * Tests of the clock filter of the client library: the minimum delay
+ * selection, the aging of old samples, the spike gate, and the adaptive
+ * poll interval.
+ */
+
+#include <math.h>
+
+#include "clock_filter.h"
+#include "unittest.h"
+
+static const uint64_t SecondNs = 1000000000ULL;
+
+static ClockSample sample(double offsetMs, double delayMs)
+{
+  ClockSample s;
+  s.offsetNs = offsetMs * 1e6;
+  s.delayNs = delayMs * 1e6;
+  return s;
+}
+
+// only the fastest exchange of a burst is kept, and it bounds the error of the estimate
+static void ClockFilterMinimumDelay()
+{
+  ClockFilter filter(1e6, 50.0);
+  ClockEstimate estimate;
+  CHECK(!filter.estimate(0, estimate));
+  CHECK(!filter.addBurst(NULL, 0, 0));
+
+  ClockSample burst[4] = { sample(7.0, 5.0), sample(2.0, 1.0), sample(4.0, 3.0), sample(9.0, -1.0) };
+  uint64_t now = 100 * SecondNs;
+  CHECK(filter.addBurst(burst, 4, now));
+  CHECK_EQUAL(filter.size(), 1);
+  if (!CHECK(filter.estimate(now + SecondNs, estimate)))
+  {
+    return;
+  }
+  CHECK(estimate.offsetNs == 2e6);
+  CHECK(estimate.delayNs == 1e6);
+  CHECK_EQUAL(estimate.ageNs, SecondNs);
+  // half the round trip, half the resolution, and the drift over a second
+  CHECK(fabs(estimate.uncertaintyNs - (0.5e6 + 0.5e6 + 50e3)) < 1.0);
+}
+TSSD_TEST(ClockFilterMinimumDelay);
+
+// an old sample is penalized by the drift since it was taken, a fresher one wins eventually
+static void ClockFilterAging()
+{
+  ClockFilter filter(1e6, 50.0);
+  uint64_t now = 100 * SecondNs;
+  ClockSample fast = sample(1.0, 1.0);
+  ClockSample slower = sample(1.2, 1.5);
+  CHECK(filter.addBurst(&fast, 1, now));
+  CHECK(filter.addBurst(&slower, 1, now + 2 * SecondNs));
+  // 2 * 50 ppm * 2 s = 0.2 ms older does not make up for 0.5 ms more delay
+  ClockEstimate estimate;
+  CHECK(filter.estimate(now + 2 * SecondNs, estimate) && estimate.offsetNs == 1e6);
+  // but 10 s older does
+  CHECK(filter.addBurst(&slower, 1, now + 10 * SecondNs));
+  CHECK(filter.estimate(now + 10 * SecondNs, estimate) && estimate.offsetNs == 1.2e6 && estimate.ageNs == 0);
+
+  // the window keeps the last WindowSize samples
+  for (int i = 0; i < 2 * ClockFilter::WindowSize; i++)
+  {
+    ClockSample s = sample(1.2, 2.0);
+    filter.addBurst(&s, 1, now + (100 + i) * SecondNs);
+  }
+  CHECK_EQUAL(filter.size(), ClockFilter::WindowSize);
+  CHECK(filter.estimate(now + 200 * SecondNs, estimate) && estimate.delayNs == 2e6);
+}
+TSSD_TEST(ClockFilterAging);
+
+// a single outlier is rejected, a persistent one is a step of the clock and restarts the window
+static void ClockFilterSpikes()
+{
+  ClockFilter filter(1e6, 50.0);
+  uint64_t now = 100 * SecondNs;
+  for (int i = 0; i < 4; i++)
+  {
+    ClockSample s = sample(0.1 * (i % 2), 1.0);
+    CHECK(filter.addBurst(&s, 1, now + i * SecondNs));
+  }
+  ClockSample spike = sample(50.0, 1.0);
+  CHECK(!filter.addBurst(&spike, 1, now + 4 * SecondNs));
+  CHECK_EQUAL(filter.rejectedSpikes(), 1);
+  ClockSample normal = sample(0.05, 1.0);
+  CHECK(filter.addBurst(&normal, 1, now + 5 * SecondNs));
+  CHECK_EQUAL(filter.size(), 5);
+
+  // the clock stepped by 50 ms
+  for (int i = 0; i < ClockFilter::MaxConsecutiveSpikes; i++)
+  {
+    CHECK(!filter.addBurst(&spike, 1, now + (6 + i) * SecondNs));
+  }
+  CHECK(filter.addBurst(&spike, 1, now + 10 * SecondNs));
+  CHECK_EQUAL(filter.size(), 1);
+  CHECK_EQUAL(filter.rejectedSpikes(), 1 + ClockFilter::MaxConsecutiveSpikes);
+  ClockEstimate estimate;
+  CHECK(filter.estimate(now + 10 * SecondNs, estimate) && estimate.offsetNs == 50e6);
+}
+TSSD_TEST(ClockFilterSpikes);
+
+static void ClockFilterPollInterval()
+{
+  PollInterval interval(16.0, 64.0);
+  CHECK(interval.seconds() == 16.0);
+  for (int i = 0; i < PollInterval::Hysteresis - 1; i++)
+  {
+    interval.update(true);
+  }
+  CHECK(interval.seconds() == 16.0);
+  interval.update(true);
+  CHECK(interval.seconds() == 32.0);
+  // never above the max
+  for (int i = 0; i < 4 * PollInterval::Hysteresis; i++)
+  {
+    interval.update(true);
+  }
+  CHECK(interval.seconds() == 64.0);
+  // a jump counts down twice as fast
+  interval.update(false);
+  interval.update(false);
+  CHECK(interval.seconds() == 32.0);
+  for (int i = 0; i < 4 * PollInterval::Hysteresis; i++)
+  {
+    interval.failed();
+  }
+  CHECK(interval.seconds() == 16.0);
+}
+TSSD_TEST(ClockFilterPollInterval);
@@ -0,0 +1,223 @@
+/*
+ * Tests of the options: the config file, the command line over it, the
+ * snapshot the workers serve with, and what a reload does with a changed
+ * config file.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config_loader.h"
+#include "unittest.h"
+
+/*
+ * A config file which is removed once the test is done.
+ */
+class TempConfigFile
+{
+public:
+  TempConfigFile()
+  {
+    char path[] = "/tmp/tssd-test-XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    path_ = path;
+  }
+
+  ~TempConfigFile()
+  {
+    unlink(path_.c_str());
+  }
+
+  void write(const std::string &text)
+  {
+    FILE *file = fopen(path_.c_str(), "w");
+    if (CHECK(file != NULL))
+    {
+      fputs(text.c_str(), file);
+      fclose(file);
+    }
+  }
+
+  const std::string &path() const
+  {
+    return path_;
+  }
+
+private:
+  std::string path_;
+};
+
+static SocketAddress ipv4Address(const char *text)
+{
+  SocketAddress source;
+  memset(&source, 0, sizeof(source));
+  source.v4.sin_family = AF_INET;
+  inet_pton(AF_INET, text, &source.v4.sin_addr);
+  return source;
+}
+
+static void ConfigReadFile()
+{
+  TempConfigFile file;
+  file.write("# tssd\n\n  port = 5000  \nallow=10.0.0.0/8, 2001:db8::/32\ndont_d\n\tdeny =\n");
+  std::vector<std::string> arguments;
+  std::string error;
+  CHECK(readConfigFile(file.path(), arguments, error));
+  CHECK(arguments == std::vector<std::string>({ "--port=5000", "--allow=10.0.0.0/8, 2001:db8::/32", "--dont_d", "--deny=" }));
+
+  file.write("port = 5000\nbatch size = 4\n");
+  arguments.clear();
+  CHECK(!readConfigFile(file.path(), arguments, error));
+  CHECK(error == "'" + file.path() + "' line 2 is not 'name = value'");
+
+  CHECK(!readConfigFile("/nonexistent/tssd.conf", arguments, error));
+  CHECK(!error.empty());
+}
+TSSD_TEST(ConfigReadFile);
+
+static void ConfigCommandLineOverridesFile()
+{
+  TempConfigFile file;
+  file.write("port = 5000\nallow = 10.0.0.0/8\n");
+  cxxopts::Options options("tssd", "");
+  addOptions(options);
+  std::string error;
+  std::unique_ptr<cxxopts::ParseResult> parseResult =
+    loadOptions(options, std::vector<std::string>({ "tssd", "--config", file.path(), "--port=6000" }), error);
+  if (!CHECK(parseResult.get() != NULL))
+  {
+    return;
+  }
+  CHECK_EQUAL((*parseResult)["port"].as<unsigned short>(), 6000);
+  CHECK((*parseResult)["allow"].as<std::string>() == "10.0.0.0/8");
+  CHECK_EQUAL((*parseResult)["batch_size"].as<int>(), 32);
+}
+TSSD_TEST(ConfigCommandLineOverridesFile);
+
+static void ConfigInvalidOptions()
+{
+  TempConfigFile file;
+  file.write("no_such_option = 1\n");
+  cxxopts::Options options("tssd", "");
+  addOptions(options);
+  std::string error;
+  CHECK(loadOptions(options, std::vector<std::string>({ "tssd", "--config", file.path() }), error).get() == NULL);
+  CHECK(!error.empty());
+  error.clear();
+  CHECK(loadOptions(options, std::vector<std::string>({ "tssd", "--port=x" }), error).get() == NULL);
+  CHECK(!error.empty());
+  error.clear();
+  CHECK(loadOptions(options, std::vector<std::string>({ "tssd", "--config", "/nonexistent/tssd.conf" }), error).get() == NULL);
+  CHECK(!error.empty());
+  // --help doesn't need a valid config file
+  std::unique_ptr<cxxopts::ParseResult> help =
+    loadOptions(options, std::vector<std::string>({ "tssd", "--config", file.path(), "--help" }), error);
+  CHECK(help.get() != NULL && help->count("help") > 0);
+}
+TSSD_TEST(ConfigInvalidOptions);
+
+static void ConfigBuildServingConfig()
+{
+  cxxopts::Options options("tssd", "");
+  addOptions(options);
+  std::string error;
+  std::unique_ptr<cxxopts::ParseResult> parseResult = loadOptions(options,
+    std::vector<std::string>({ "tssd", "--batch_size=8", "--batch_request_rate=50", "--deny=10.0.0.1", "--log_sample=0" }),
+    error);
+  if (!CHECK(parseResult.get() != NULL))
+  {
+    return;
+  }
+  std::unique_ptr<ServingConfig> config(buildServingConfig(*parseResult));
+  if (!CHECK(config.get() != NULL))
+  {
+    return;
+  }
+  CHECK_EQUAL(config->batchSize, 8);
+  CHECK_EQUAL(config->maxBatchCookies, 32);
+  CHECK(config->batchRequestRate == 50);
+  CHECK_EQUAL(config->keys.size(), 0);
+  CHECK(!config->access.allows(ipv4Address("10.0.0.1")));
+  CHECK(config->access.allows(ipv4Address("10.0.0.2")));
+  CHECK_EQUAL(config->logSample, 0);
+
+  parseResult = loadOptions(options, std::vector<std::string>({ "tssd", "--require_auth" }), error);
+  CHECK(parseResult.get() != NULL && buildServingConfig(*parseResult) == NULL);
+  parseResult = loadOptions(options, std::vector<std::string>({ "tssd", "--allow=10.0.0.0/40" }), error);
+  CHECK(parseResult.get() != NULL && buildServingConfig(*parseResult) == NULL);
+  CHECK_EQUAL(logPriority("warning"), LOG_WARNING);
+  CHECK_EQUAL(logPriority("verbose"), -1);
+}
+TSSD_TEST(ConfigBuildServingConfig);
+
+static void ConfigChangedOptions()
+{
+  cxxopts::Options options("tssd", "");
+  addOptions(options);
+  std::string error;
+  std::unique_ptr<cxxopts::ParseResult> before =
+    loadOptions(options, std::vector<std::string>({ "tssd", "--port=5000", "--ntp_port=123", "--allow=10.0.0.0/8" }), error);
+  std::unique_ptr<cxxopts::ParseResult> after =
+    loadOptions(options, std::vector<std::string>({ "tssd", "--port=5001", "--relay=10.0.0.9", "--deny=10.0.0.1" }), error);
+  if (!CHECK(before.get() != NULL && after.get() != NULL))
+  {
+    return;
+  }
+  // a reload applies the access lists, they are not restart options
+  std::map<std::string, std::string> beforeOptions = restartOptions(*before);
+  CHECK_EQUAL(beforeOptions.size(), 2);
+  CHECK(beforeOptions["port"] == "5000");
+  CHECK(changedOptions(beforeOptions, restartOptions(*after)) == "--ntp_port, --port, --relay");
+  CHECK(changedOptions(beforeOptions, beforeOptions).empty());
+}
+TSSD_TEST(ConfigChangedOptions);
+
+static void ConfigReload()
+{
+  TempConfigFile file;
+  file.write("port = 5000\nallow = 10.0.0.0/8\n");
+  cxxopts::Options options("tssd", "");
+  addOptions(options);
+  std::vector<std::string> commandLine({ "tssd", "--config", file.path() });
+  std::string error;
+  std::unique_ptr<cxxopts::ParseResult> running = loadOptions(options, commandLine, error);
+  if (!CHECK(running.get() != NULL))
+  {
+    return;
+  }
+  ConfigDomain domain(buildServingConfig(*running));
+  ConfigReloader reloader(options, commandLine, *running, domain, false);
+  CHECK(!domain.current()->access.allows(ipv4Address("192.168.1.1")));
+
+  file.write("port = 5000\ndeny = 10.0.0.1\nbatch_size = 4\n");
+  CHECK_EQUAL(reloader.reload(), ConfigReloader::Applied);
+  CHECK(domain.current()->access.allows(ipv4Address("192.168.1.1")));
+  CHECK(!domain.current()->access.allows(ipv4Address("10.0.0.1")));
+  CHECK_EQUAL(domain.current()->batchSize, 4);
+
+  // an invalid configuration keeps the one served
+  uint64_t version = domain.current()->version;
+  file.write("port = 5000\ndeny = 10.0.0.300\n");
+  CHECK_EQUAL(reloader.reload(), ConfigReloader::Kept);
+  file.write("port = 5000\nlog_level = verbose\n");
+  CHECK_EQUAL(reloader.reload(), ConfigReloader::Kept);
+  file.write("port = 5000\nno_such_option = 1\n");
+  CHECK_EQUAL(reloader.reload(), ConfigReloader::Kept);
+  CHECK_EQUAL(domain.current()->version, version);
+
+  // without an upgrade socket a new port needs a restart, the rest applies
+  file.write("port = 5001\n");
+  CHECK_EQUAL(reloader.reload(), ConfigReloader::RestartNeeded);
+  CHECK(domain.current()->access.empty());
+}
+TSSD_TEST(ConfigReload);
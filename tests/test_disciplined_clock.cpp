@@ -0,0 +1,153 @@
+/*
+ * Tests of the disciplined clock of a relay: the fit of the offset and the
+ * frequency, the hand over of its model, and lock free readers while it is
+ * updated.
+ */
+
+#include <math.h>
+
+#include <atomic>
+#include <thread>
+
+#include "disciplined_clock.h"
+#include "unittest.h"
+
+static const uint64_t SecondNs = 1000000000ULL;
+
+// upstream runs 20 ppm fast and 5 ms ahead of the raw clock at 'start'
+static double upstreamOffsetNs(uint64_t start, uint64_t raw)
+{
+  return 5e6 + 20e-6 * ((double)raw - (double)start);
+}
+
+static void DisciplinedClockFrequency()
+{
+  DisciplinedClock clock;
+  DisciplinedClock::Model model;
+  CHECK(!clock.isSynchronized());
+  CHECK(!clock.saveModel(model));
+
+  uint64_t start = 1000 * SecondNs;
+  clock.update(start, upstreamOffsetNs(start, start), 1000.0);
+  CHECK(clock.isSynchronized());
+  // a single sample: the offset only
+  CHECK(clock.frequencyPpm() == 0.0);
+  CHECK_EQUAL(clock.timeNsAt(start), start + 5000000);
+
+  for (int i = 1; i < 8; i++)
+  {
+    uint64_t sample = start + i * 16 * SecondNs;
+    clock.update(sample, upstreamOffsetNs(start, sample), 1000.0);
+  }
+  CHECK(fabs(clock.frequencyPpm() - 20.0) < 0.01);
+  CHECK(clock.uncertaintyNs() == 1000.0);
+  // and it extrapolates between the polls
+  uint64_t later = start + 200 * SecondNs;
+  CHECK(fabs((double)clock.timeNsAt(later) - ((double)later + upstreamOffsetNs(start, later))) < 100.0);
+}
+TSSD_TEST(DisciplinedClockFrequency);
+
+static void DisciplinedClockUpdates()
+{
+  DisciplinedClock clock;
+  uint64_t start = 1000 * SecondNs;
+  // samples too close to tell a frequency: the weighted mean offset
+  clock.update(start, 1000.0, 100.0);
+  clock.update(start + SecondNs, 3000.0, 100.0);
+  CHECK(clock.frequencyPpm() == 0.0);
+  CHECK_EQUAL(clock.timeNsAt(start + SecondNs), start + SecondNs + 2000);
+
+  // the same best sample reported again only updates the uncertainty
+  clock.update(start + SecondNs, 3000.0, 500.0);
+  CHECK_EQUAL(clock.timeNsAt(start + SecondNs), start + SecondNs + 2000);
+  CHECK(clock.uncertaintyNs() == 500.0);
+
+  // a frequency beyond a crystal's is clamped
+  clock.reset();
+  clock.update(start, 0.0, 100.0);
+  clock.update(start + 10 * SecondNs, 1e7, 100.0);
+  CHECK(fabs(clock.frequencyPpm() - 500.0) < 1e-6);
+}
+TSSD_TEST(DisciplinedClockUpdates);
+
+// the model handed to the next process serves the same time, and is the first point of its fit
+static void DisciplinedClockModel()
+{
+  DisciplinedClock clock;
+  uint64_t start = 1000 * SecondNs;
+  for (int i = 0; i < 4; i++)
+  {
+    uint64_t sample = start + i * 16 * SecondNs;
+    clock.update(sample, upstreamOffsetNs(start, sample), 1000.0);
+  }
+  DisciplinedClock::Model model;
+  if (!CHECK(clock.saveModel(model)))
+  {
+    return;
+  }
+  DisciplinedClock next;
+  next.restoreModel(model);
+  CHECK(next.isSynchronized());
+  CHECK(next.uncertaintyNs() == clock.uncertaintyNs());
+  uint64_t later = start + 100 * SecondNs;
+  CHECK_EQUAL(next.timeNsAt(later), clock.timeNsAt(later));
+
+  uint64_t sample = start + 112 * SecondNs;
+  next.update(sample, upstreamOffsetNs(start, sample), 1000.0);
+  CHECK(fabs(next.frequencyPpm() - 20.0) < 0.01);
+}
+TSSD_TEST(DisciplinedClockModel);
+
+// reads the time at a raw time until stopped, counting results that are none of the models'
+struct ClockReader
+{
+  const DisciplinedClock *clock;
+  uint64_t raw;
+  uint64_t expected[2];
+  std::atomic<bool> stop;
+  std::atomic<uint64_t> reads;
+  uint64_t torn;
+
+  void run()
+  {
+    while (!stop.load())
+    {
+      uint64_t time = clock->timeNsAt(raw);
+      if (time != expected[0] && time != expected[1])
+      {
+        torn++;
+      }
+      reads++;
+    }
+  }
+};
+
+// a reader never sees half of one model and half of another
+static void DisciplinedClockConcurrentReaders()
+{
+  DisciplinedClock clock;
+  uint64_t reference = 1000 * SecondNs;
+  DisciplinedClock::Model models[2] = {
+    { 0.0, 0.0, reference, 1000.0 },
+    { 1e6, 100e-6, reference + SecondNs, 1000.0 }
+  };
+  clock.restoreModel(models[0]);
+
+  ClockReader reader;
+  reader.clock = &clock;
+  reader.raw = reference + 10 * SecondNs;
+  reader.expected[0] = reader.raw;
+  reader.expected[1] = reader.raw + 1000000 + 900000;
+  reader.stop = false;
+  reader.reads = 0;
+  reader.torn = 0;
+  std::thread thread(&ClockReader::run, &reader);
+  for (int i = 0; i < 200000 || reader.reads.load() < 1000; i++)
+  {
+    clock.restoreModel(models[i % 2]);
+  }
+  reader.stop = true;
+  thread.join();
+  CHECK_EQUAL(reader.torn, 0);
+}
+TSSD_TEST(DisciplinedClockConcurrentReaders);
@@ -0,0 +1,154 @@
+/*
+ * Tests of the flight recorder file format (as tssd-flight-decode reads
+ * it): the header, the ring of records, and a dump.
+ */
+
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <vector>
+
+#include "flight_recorder.h"
+#include "unittest.h"
+
+static SocketAddress ipv6Source(const char *text, uint16_t port)
+{
+  SocketAddress source;
+  memset(&source, 0, sizeof(source));
+  source.v6.sin6_family = AF_INET6;
+  inet_pton(AF_INET6, text, &source.v6.sin6_addr);
+  source.v6.sin6_port = htons(port);
+  return source;
+}
+
+// the records of a file (or a dump) in the order they were written, false if its header is not valid
+static bool decode(const std::string &content, FlightRecorderHeader &header, std::vector<FlightRecord> &records)
+{
+  if (!CHECK(content.size() >= sizeof(header)))
+  {
+    return false;
+  }
+  memcpy(&header, content.data(), sizeof(header));
+  if (!CHECK(memcmp(header.magic, FlightRecorderMagic, sizeof(header.magic)) == 0) ||
+    !CHECK_EQUAL(header.recordSize, sizeof(FlightRecord)) ||
+    !CHECK_EQUAL(content.size(), sizeof(header) + header.capacity * sizeof(FlightRecord)))
+  {
+    return false;
+  }
+  records.clear();
+  uint64_t first = header.writeIndex > header.capacity ? header.writeIndex - header.capacity : 0;
+  for (uint64_t i = first; i < header.writeIndex; i++)
+  {
+    FlightRecord record;
+    memcpy(&record, content.data() + sizeof(header) + (i % header.capacity) * sizeof(FlightRecord), sizeof(record));
+    records.push_back(record);
+  }
+  return true;
+}
+
+static void FlightRecorderFormat()
+{
+  TempDirectory directory;
+  std::string path = directory.path() + "/flight";
+  SocketAddress source = ipv6Source("2001:db8::1:2", 40000);
+  {
+    FlightRecorder recorder;
+    // rounded up to 8 records
+    if (!CHECK(recorder.open(path, 3, 5)))
+    {
+      return;
+    }
+    for (uint64_t i = 0; i < 11; i++)
+    {
+      recorder.record(1000 + i, 2000 + i, 3000 + i, 0xc0c0 + i, source, 8);
+    }
+  }
+
+  FlightRecorderHeader header;
+  std::vector<FlightRecord> records;
+  if (!decode(directory.read("flight"), header, records))
+  {
+    return;
+  }
+  CHECK_EQUAL(header.worker, 3);
+  CHECK_EQUAL(header.capacity, 8);
+  CHECK_EQUAL(header.writeIndex, 11);
+  // the ring keeps the last 8
+  if (!CHECK_EQUAL(records.size(), 8))
+  {
+    return;
+  }
+  for (size_t i = 0; i < records.size(); i++)
+  {
+    CHECK_EQUAL(records[i].rxTimeNs, 1003 + i);
+    CHECK_EQUAL(records[i].txTimeNs, 2003 + i);
+    CHECK_EQUAL(records[i].replyTimeMs, 3003 + i);
+    CHECK_EQUAL(records[i].clientCookie, 0xc0c3 + i);
+    CHECK_EQUAL(records[i].requestLength, 8);
+  }
+  // the full IPv6 address
+  CHECK_EQUAL(records[0].sourceFamily, AF_INET6);
+  CHECK_EQUAL(ntohs(records[0].sourcePort), 40000);
+  CHECK(memcmp(records[0].sourceAddr, &source.v6.sin6_addr, 16) == 0);
+}
+TSSD_TEST(FlightRecorderFormat);
+
+// a dump is a copy of the ring as it was frozen, then recording goes on
+static void FlightRecorderDump()
+{
+  TempDirectory directory;
+  std::string path = directory.path() + "/flight";
+  FlightRecorder recorder;
+  if (!CHECK(recorder.open(path, 0, 4)))
+  {
+    return;
+  }
+  SocketAddress source = ipv6Source("::ffff:10.0.0.1", 1);
+  recorder.record(1, 1, 1, 1, source, 8);
+  recorder.record(2, 2, 2, 2, source, 8);
+  recorder.requestDump();
+  recorder.dumpIfRequested();
+
+  std::string dumpName;
+  for (int i = 0; i < 100 && dumpName.empty(); i++)
+  {
+    struct timespec pause = { 0, 10000000 };
+    nanosleep(&pause, NULL);
+    std::vector<std::string> names = directory.files();
+    for (size_t n = 0; n < names.size(); n++)
+    {
+      if (names[n].compare(0, 11, "flight.dump") == 0 &&
+        directory.read(names[n]).size() == sizeof(FlightRecorderHeader) + 4 * sizeof(FlightRecord))
+      {
+        dumpName = names[n];
+      }
+    }
+  }
+  if (!CHECK(!dumpName.empty()))
+  {
+    return;
+  }
+  FlightRecorderHeader header;
+  std::vector<FlightRecord> records;
+  if (decode(directory.read(dumpName), header, records) && CHECK_EQUAL(records.size(), 2))
+  {
+    CHECK_EQUAL(records[0].clientCookie, 1);
+    CHECK_EQUAL(records[1].clientCookie, 2);
+  }
+
+  // recording goes on once the dump is written
+  for (int i = 0; i < 100; i++)
+  {
+    recorder.record(3, 3, 3, 3, source, 8);
+    if (decode(directory.read("flight"), header, records) && header.writeIndex == 3)
+    {
+      break;
+    }
+    struct timespec pause = { 0, 10000000 };
+    nanosleep(&pause, NULL);
+  }
+  CHECK_EQUAL(header.writeIndex, 3);
+}
+TSSD_TEST(FlightRecorderDump);
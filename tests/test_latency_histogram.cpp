@@ -0,0 +1,91 @@
+/*
+ * Tests of the latency histograms: the bucket resolution, the percentiles
+ * and the windows the statistics report.
+ */
+
+#include "latency_histogram.h"
+#include "unittest.h"
+
+// every value is counted in a bucket whose highest value is at most ~3% above it
+static void LatencyHistogramBuckets()
+{
+  int previousIndex = -1;
+  for (uint64_t value = 0; value < ((uint64_t)1 << 40); value = value < 100 ? value + 1 : value + value / 7)
+  {
+    int index = LatencyHistogram::bucketIndex(value);
+    uint64_t highest = LatencyHistogram::bucketHighestValue(index);
+    if (!CHECK(index >= previousIndex && index < LatencyHistogram::BucketCount) ||
+      !CHECK(highest >= value && highest - value <= value / LatencyHistogram::SubBucketCount))
+    {
+      return;
+    }
+    previousIndex = index;
+  }
+  // exact below SubBucketCount, and clamped at the top
+  CHECK_EQUAL(LatencyHistogram::bucketHighestValue(LatencyHistogram::bucketIndex(31)), 31);
+  CHECK_EQUAL(LatencyHistogram::bucketIndex((uint64_t)1 << 40), LatencyHistogram::BucketCount - 1);
+  CHECK_EQUAL(LatencyHistogram::bucketIndex(~(uint64_t)0), LatencyHistogram::BucketCount - 1);
+  CHECK_EQUAL(LatencyHistogram::bucketIndex(LatencyHistogram::bucketHighestValue(100) + 1), 101);
+}
+TSSD_TEST(LatencyHistogramBuckets);
+
+static void LatencyHistogramPercentiles()
+{
+  LatencyHistogram histogram;
+  HistogramSnapshot snapshot;
+  histogram.snapshot(snapshot);
+  CHECK_EQUAL(snapshot.valueAtPercentile(99.0), 0);
+
+  // 1 to 1000 us
+  for (uint64_t us = 1; us <= 1000; us++)
+  {
+    histogram.record(us * 1000);
+  }
+  histogram.snapshot(snapshot);
+  CHECK_EQUAL(snapshot.total, 1000);
+  CHECK_EQUAL(snapshot.sum, 500500000ULL);
+  CHECK_EQUAL(snapshot.max, 1000000);
+  uint64_t p50 = snapshot.valueAtPercentile(50.0);
+  uint64_t p99 = snapshot.valueAtPercentile(99.0);
+  CHECK(p50 >= 500000 && p50 <= 500000 + 500000 / LatencyHistogram::SubBucketCount);
+  CHECK(p99 >= 990000 && p99 <= 990000 + 990000 / LatencyHistogram::SubBucketCount);
+  // never above the max
+  CHECK_EQUAL(snapshot.valueAtPercentile(100.0), 1000000);
+  CHECK(snapshot.valueAtPercentile(0.0) >= 1000 && snapshot.valueAtPercentile(0.0) < 1100);
+  CHECK_EQUAL(snapshot.countAtOrBelow(LatencyHistogram::bucketHighestValue(LatencyHistogram::bucketIndex(100000))), 100);
+}
+TSSD_TEST(LatencyHistogramPercentiles);
+
+// a window holds only the values recorded between two snapshots
+static void LatencyHistogramWindow()
+{
+  LatencyHistogram histogram;
+  for (int i = 0; i < 100; i++)
+  {
+    histogram.record(5000000);
+  }
+  HistogramSnapshot older;
+  histogram.snapshot(older);
+  for (int i = 0; i < 10; i++)
+  {
+    histogram.record(2000);
+  }
+  HistogramSnapshot newer;
+  histogram.snapshot(newer);
+
+  HistogramSnapshot window;
+  newer.windowSince(older, window);
+  CHECK_EQUAL(window.total, 10);
+  CHECK_EQUAL(window.sum, 20000);
+  CHECK(window.max >= 2000 && window.max < 2100);
+  CHECK(window.valueAtPercentile(99.9) >= 2000 && window.valueAtPercentile(99.9) < 2100);
+
+  // the merge of the workers' histograms
+  HistogramSnapshot merged;
+  merged.merge(window);
+  merged.merge(older);
+  CHECK_EQUAL(merged.total, 110);
+  CHECK_EQUAL(merged.max, 5000000);
+  CHECK_EQUAL(merged.countAtOrBelow(2100), 10);
+}
+TSSD_TEST(LatencyHistogramWindow);
@@ -0,0 +1,181 @@
+/*
+ * Tests of the live upgrade handover over its control socket, within one
+ * process: the new tssd's side runs on a thread.
+ */
+
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <string>
+#include <thread>
+
+#include "live_upgrade.h"
+#include "unittest.h"
+
+// a UDP socket bound to an ephemeral loopback port
+static int boundSocket(unsigned short &port)
+{
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+    getsockname(fd, (struct sockaddr *)&address, &length) < 0)
+  {
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+  port = ntohs(address.sin_port);
+  return fd;
+}
+
+static bool waitRequested(const UpgradeListener &listener)
+{
+  for (int i = 0; i < 500 && !listener.requested(); i++)
+  {
+    poll(NULL, 0, 10);
+  }
+  return listener.requested();
+}
+
+// the new tssd's side
+struct Takeover
+{
+  std::string path;
+  bool confirm;
+  bool received;
+  UpgradeHandover handover;
+
+  void run()
+  {
+    UpgradeTakeover takeover;
+    received = takeover.receive(path, handover);
+    if (received && confirm)
+    {
+      takeover.confirm();
+    }
+  }
+};
+
+static void LiveUpgradeHandover()
+{
+  TempDirectory directory;
+  std::string path = directory.path() + "/control";
+  UpgradeListener listener;
+  if (!CHECK(listener.start(path, false)))
+  {
+    return;
+  }
+  // a second tssd does not steal the control socket of a running one
+  UpgradeListener other;
+  CHECK(!other.start(path, false));
+
+  unsigned short ports[3];
+  UpgradeHandover handover;
+  handover.addSocket(UpgradeUdpSocket, boundSocket(ports[0]));
+  handover.addSocket(UpgradeUdpSocket, boundSocket(ports[1]));
+  handover.addSocket(UpgradeMetricsSocket, boundSocket(ports[2]));
+  handover.addState("empty", "");
+  handover.addState("binary", std::string("a\0b", 3));
+  handover.addState("large", std::string(1 << 20, 'x'));
+
+  Takeover takeover;
+  takeover.path = path;
+  takeover.confirm = true;
+  takeover.received = false;
+  std::thread thread(&Takeover::run, &takeover);
+  if (CHECK(waitRequested(listener)))
+  {
+    CHECK(listener.handOver(handover));
+  }
+  thread.join();
+  CHECK(!listener.requested());
+  if (!CHECK(takeover.received) || !CHECK_EQUAL(takeover.handover.fds.size(), 3))
+  {
+    return;
+  }
+
+  // the same sockets: found by their kind and port, and a datagram sent to them arrives
+  UpgradeHandover &received = takeover.handover;
+  CHECK_EQUAL(received.takeSocket(UpgradeStreamSocket, 0), -1);
+  int second = received.takeSocket(UpgradeUdpSocket, ports[1]);
+  int first = received.takeSocket(UpgradeUdpSocket, 0);
+  int metrics = received.takeSocket(UpgradeMetricsSocket, 0);
+  CHECK(received.fds.empty());
+  if (CHECK(second >= 0 && first >= 0 && metrics >= 0))
+  {
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(ports[1]);
+    CHECK_EQUAL(sendto(handover.fds[0], "z", 1, 0, (struct sockaddr *)&address, sizeof(address)), 1);
+    char byte = 0;
+    CHECK(recv(second, &byte, 1, MSG_DONTWAIT) == 1 && byte == 'z');
+    close(first);
+    close(second);
+    close(metrics);
+  }
+
+  CHECK_EQUAL(received.state.size(), 3);
+  CHECK(received.findState("missing") == NULL);
+  CHECK(received.findState("empty") != NULL && received.findState("empty")->empty());
+  CHECK(received.findState("binary") != NULL && *received.findState("binary") == std::string("a\0b", 3));
+  CHECK(received.findState("large") != NULL && *received.findState("large") == std::string(1 << 20, 'x'));
+  for (size_t i = 0; i < handover.fds.size(); i++)
+  {
+    close(handover.fds[i]);
+  }
+}
+TSSD_TEST(LiveUpgradeHandover);
+
+// a new tssd which fails before it confirms leaves the running one serving, and the next one may take over
+static void LiveUpgradeNotConfirmed()
+{
+  TempDirectory directory;
+  std::string path = directory.path() + "/control";
+  UpgradeListener listener;
+  if (!CHECK(listener.start(path, false)))
+  {
+    return;
+  }
+  unsigned short port;
+  UpgradeHandover handover;
+  handover.addSocket(UpgradeUdpSocket, boundSocket(port));
+
+  for (int attempt = 0; attempt < 2; attempt++)
+  {
+    Takeover takeover;
+    takeover.path = path;
+    takeover.confirm = attempt == 1;
+    takeover.received = false;
+    std::thread thread(&Takeover::run, &takeover);
+    if (CHECK(waitRequested(listener)))
+    {
+      CHECK_EQUAL(listener.handOver(handover), attempt == 1);
+    }
+    thread.join();
+    CHECK(takeover.received);
+    for (size_t i = 0; i < takeover.handover.fds.size(); i++)
+    {
+      close(takeover.handover.fds[i]);
+    }
+  }
+  close(handover.fds[0]);
+
+  // without a running tssd there is nothing to take over
+  listener.stop();
+  unlink(path.c_str());
+  UpgradeHandover none;
+  UpgradeTakeover takeover;
+  CHECK(!takeover.receive(path, none));
+}
+TSSD_TEST(LiveUpgradeNotConfirmed);
@@ -0,0 +1,112 @@
+/*
+ * Tests of the metrics endpoint over a loopback connection.
+ */
+
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <string>
+
+#include "metrics_server.h"
+#include "unittest.h"
+
+// a connection to 'server', -1 if it fails
+static int connectTo(const MetricsServer &server)
+{
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (getsockname(server.listenFd(), (struct sockaddr *)&address, &length) != 0)
+  {
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&address, length) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// what the server sends until it closes the connection, or 'timeoutMs' passes
+static std::string readResponse(int fd, int timeoutMs)
+{
+  std::string response;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  char buffer[4096];
+  while (poll(&pfd, 1, timeoutMs) == 1)
+  {
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0)
+    {
+      break;
+    }
+    response.append(buffer, n);
+  }
+  return response;
+}
+
+static uint64_t monotonicMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000ULL + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static void MetricsServerScrape()
+{
+  WorkerStats stats;
+  stats.replies.add(3);
+  MetricsServer server(std::vector<const WorkerStats *>(1, &stats));
+  if (!CHECK(server.start("127.0.0.1", 0)))
+  {
+    return;
+  }
+  int fd = connectTo(server);
+  if (!CHECK(fd >= 0))
+  {
+    return;
+  }
+  const char request[] = "GET /metrics HTTP/1.0\r\n\r\n";
+  CHECK_EQUAL(send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL), sizeof(request) - 1);
+  std::string response = readResponse(fd, 1000);
+  CHECK(response.compare(0, 15, "HTTP/1.0 200 OK") == 0);
+  CHECK(response.find("\ntssd_replies_total{worker=\"0\"} 3\n") != std::string::npos);
+  close(fd);
+}
+TSSD_TEST(MetricsServerScrape);
+
+// a client trickling its request is cut off at the deadline of the connection, not served forever
+static void MetricsServerConnectionDeadline()
+{
+  WorkerStats stats;
+  MetricsServer server(std::vector<const WorkerStats *>(1, &stats));
+  if (!CHECK(server.start("127.0.0.1", 0)))
+  {
+    return;
+  }
+  int fd = connectTo(server);
+  if (!CHECK(fd >= 0))
+  {
+    return;
+  }
+  uint64_t startMs = monotonicMs();
+  bool closed = false;
+  while (!closed && monotonicMs() - startMs < 5000)
+  {
+    // a byte every 200 ms, well within a per recv timeout
+    send(fd, "G", 1, MSG_NOSIGNAL);
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    char byte;
+    closed = poll(&pfd, 1, 200) == 1 && recv(fd, &byte, 1, 0) <= 0;
+  }
+  uint64_t elapsedMs = monotonicMs() - startMs;
+  CHECK(closed);
+  CHECK(elapsedMs >= 1500 && elapsedMs < 3000);
+  close(fd);
+}
+TSSD_TEST(MetricsServerConnectionDeadline);
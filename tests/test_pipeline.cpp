@@ -0,0 +1,369 @@
+/*
+ * Functional tests of the request pipeline over the in-memory transport:
+ * the replies it builds and the requests it drops, for every kind of
+ * request it serves.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/timex.h>
+
+#include <vector>
+
+#include "memory_transport.h"
+#include "ntp_protocol.h"
+#include "request_pipeline.h"
+#include "serving_config.h"
+#include "tsp_protocol.h"
+#include "unittest.h"
+
+static Datagram makeDatagram(const char *source, uint16_t port)
+{
+  Datagram d;
+  memset(&d, 0, sizeof(d));
+  d.peer.v4.sin_family = AF_INET;
+  inet_pton(AF_INET, source, &d.peer.v4.sin_addr);
+  d.peer.v4.sin_port = htons(port);
+  return d;
+}
+
+static Datagram makeTimeRequest(const char *source, uint64_t cookie)
+{
+  Datagram d = makeDatagram(source, 40000);
+  TimeRequest *request = (TimeRequest *)d.data;
+  memcpy(request->protocol, "TSP", 3);
+  request->protocolVersion = 1;
+  request->clientCookie = cookie;
+  d.length = TimeRequestPacketSize;
+  return d;
+}
+
+static Datagram makeBatchRequest(const char *source, int cookieCount, bool echoCookies)
+{
+  Datagram d = makeTimeRequest(source, 0);
+  TimeBatchRequest *request = (TimeBatchRequest *)d.data;
+  request->messageType = TspBatchRequest;
+  request->cookieCount = (uint8_t)cookieCount;
+  request->flags = echoCookies ? TspBatchEchoCookies : 0;
+  for (int c = 0; c < cookieCount; c++)
+  {
+    request->clientCookies[c] = 100 + c;
+  }
+  d.length = timeBatchRequestSize(cookieCount);
+  return d;
+}
+
+static Datagram makeAuthRequest(const char *source, uint64_t cookie, uint16_t keyId, const SipHashKey &key)
+{
+  Datagram d = makeTimeRequest(source, cookie);
+  TimeAuthRequest *request = (TimeAuthRequest *)d.data;
+  request->messageType = TspAuthRequest;
+  request->keyId = keyId;
+  request->mac = sipHash24(key, d.data, TimeAuthRequestMacLength);
+  d.length = TimeAuthRequestPacketSize;
+  return d;
+}
+
+static Datagram makeNtpRequest(const char *source, uint8_t version, uint8_t mode, uint64_t transmitTimestamp)
+{
+  Datagram d = makeDatagram(source, 123);
+  NtpPacket *request = (NtpPacket *)d.data;
+  request->liVnMode = (uint8_t)((version << 3) | mode);
+  request->poll = 6;
+  request->transmitTimestamp = transmitTimestamp;
+  d.length = NtpPacketSize;
+  return d;
+}
+
+// seconds since the unix epoch of an NTP timestamp (network byte order)
+static uint64_t ntpSeconds(uint64_t timestamp)
+{
+  return ntohl((uint32_t)timestamp) - NtpEpochOffsetSec;
+}
+
+// whether the kernel considers the system clock synchronized, as the pipeline checks it for NTP replies
+static bool systemClockSynchronized()
+{
+  struct timex tx;
+  memset(&tx, 0, sizeof(tx));
+  int state = adjtimex(&tx);
+  return state >= 0 && state != TIME_ERROR && (tx.status & STA_UNSYNC) == 0;
+}
+
+static const SipHashKey TestKey = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+
+/*
+ * A pipeline which serves 'requests' once, in one batch.
+ */
+struct PipelineRun
+{
+  explicit PipelineRun(const std::vector<Datagram> &requests)
+    : transport(requests, MaxBatchSize), pipeline(transport, stats, NULL, NULL, NULL)
+  {
+    transport.setRounds(1);
+  }
+
+  // the replies
+  const std::vector<Datagram> &serve()
+  {
+    int received = pipeline.processBatch();
+    CHECK_EQUAL(received, transport.received());
+    return transport.captured();
+  }
+
+  WorkerStats stats;
+  MemoryTransport transport;
+  RequestPipeline pipeline;
+};
+
+static void PipelineTimeReply()
+{
+  std::vector<Datagram> requests(1, makeTimeRequest("10.0.0.1", 0x1122334455667788ULL));
+  PipelineRun run(requests);
+  uint64_t beforeMs = currentTimeMsSinceEpoch();
+  const std::vector<Datagram> &replies = run.serve();
+  uint64_t afterMs = currentTimeMsSinceEpoch();
+
+  if (!CHECK_EQUAL(replies.size(), 1))
+  {
+    return;
+  }
+  const TimeReply *reply = (const TimeReply *)replies[0].data;
+  CHECK_EQUAL(replies[0].length, TimeReplyPacketSize);
+  CHECK(hasTspHeader(replies[0].data));
+  CHECK_EQUAL(reply->protocolVersion, 1);
+  CHECK_EQUAL(reply->clientCookie, 0x1122334455667788ULL);
+  CHECK(reply->timeSinceEphoc1970Ms >= beforeMs && reply->timeSinceEphoc1970Ms <= afterMs);
+  CHECK(memcmp(&replies[0].peer, &requests[0].peer, sizeof(SocketAddress)) == 0);
+  CHECK_EQUAL(run.stats.requests.load(), 1);
+  CHECK_EQUAL(run.stats.replies.load(), 1);
+}
+TSSD_TEST(PipelineTimeReply);
+
+static void PipelineDropsMalformedRequests()
+{
+  std::vector<Datagram> requests;
+  requests.push_back(makeTimeRequest("10.0.0.1", 1));
+  requests.back().length = 10;
+  requests.push_back(makeTimeRequest("10.0.0.1", 2));
+  requests.back().data[0] = 'X';
+  requests.push_back(makeTimeRequest("10.0.0.1", 3));
+  PipelineRun run(requests);
+  const std::vector<Datagram> &replies = run.serve();
+
+  if (!CHECK_EQUAL(replies.size(), 1))
+  {
+    return;
+  }
+  CHECK_EQUAL(((const TimeReply *)replies[0].data)->clientCookie, 3);
+  CHECK_EQUAL(run.stats.requests.load(), 3);
+  CHECK_EQUAL(run.stats.tooShort.load(), 1);
+  CHECK_EQUAL(run.stats.notTsp.load(), 1);
+  CHECK_EQUAL(run.stats.replies.load(), 1);
+}
+TSSD_TEST(PipelineDropsMalformedRequests);
+
+static void PipelineNtpReply()
+{
+  uint32_t referenceId;
+  memcpy(&referenceId, "LOCL", 4);
+  std::vector<Datagram> requests;
+  requests.push_back(makeNtpRequest("10.0.0.1", 4, NtpModeClient, 0x0807060504030201ULL));
+  requests.push_back(makeNtpRequest("10.0.0.2", 3, NtpModeClient, 0x1817161514131211ULL));
+  requests.push_back(makeNtpRequest("10.0.0.3", 4, NtpModeServer, 0));
+  requests.push_back(makeNtpRequest("10.0.0.4", 4, NtpModeClient, 0));
+  requests.back().length = NtpPacketSize - 1;
+  PipelineRun run(requests);
+  run.pipeline.serveNtp(2, referenceId);
+  uint64_t beforeSec = currentTimeMsSinceEpoch() / 1000;
+  const std::vector<Datagram> &replies = run.serve();
+  uint64_t afterSec = currentTimeMsSinceEpoch() / 1000;
+  // the system clock of the host running the tests may be unsynchronized, the replies say so (RFC 5905)
+  bool synchronized = systemClockSynchronized();
+
+  if (!CHECK_EQUAL(replies.size(), 2))
+  {
+    return;
+  }
+  for (size_t i = 0; i < replies.size(); i++)
+  {
+    const NtpPacket *request = (const NtpPacket *)requests[i].data;
+    const NtpPacket *reply = (const NtpPacket *)replies[i].data;
+    CHECK_EQUAL(replies[i].length, NtpPacketSize);
+    CHECK_EQUAL(ntpMode(reply->liVnMode), NtpModeServer);
+    CHECK_EQUAL(ntpVersion(reply->liVnMode), ntpVersion(request->liVnMode));
+    CHECK_EQUAL(ntpLeap(reply->liVnMode), synchronized ? NtpLeapNone : NtpLeapUnsynchronized);
+    CHECK_EQUAL(reply->stratum, synchronized ? 2 : NtpStratumUnsynchronized);
+    CHECK_EQUAL(reply->poll, request->poll);
+    CHECK_EQUAL(reply->referenceId, referenceId);
+    CHECK_EQUAL(reply->originTimestamp, request->transmitTimestamp);
+    CHECK(ntpSeconds(reply->transmitTimestamp) >= beforeSec && ntpSeconds(reply->transmitTimestamp) <= afterSec);
+    CHECK(ntpSeconds(reply->receiveTimestamp) <= ntpSeconds(reply->transmitTimestamp));
+  }
+  CHECK_EQUAL(run.stats.notNtpClient.load(), 1);
+  CHECK_EQUAL(run.stats.tooShort.load(), 1);
+}
+TSSD_TEST(PipelineNtpReply);
+
+// an unsynchronized server reports stratum 16, not its configured one
+static void PipelineNtpUnsynchronized()
+{
+  NtpServerInfo info;
+  memset(&info, 0, sizeof(info));
+  info.stratum = 2;
+  Datagram request = makeNtpRequest("10.0.0.1", 4, NtpModeClient, 1);
+  char reply[NtpPacketSize];
+  info.leap = NtpLeapUnsynchronized;
+  encodeNtpReply(request.data, info, 0, 0, reply);
+  CHECK_EQUAL(ntpLeap(((const NtpPacket *)reply)->liVnMode), NtpLeapUnsynchronized);
+  CHECK_EQUAL(((const NtpPacket *)reply)->stratum, NtpStratumUnsynchronized);
+  info.leap = NtpLeapNone;
+  encodeNtpReply(request.data, info, 0, 0, reply);
+  CHECK_EQUAL(ntpLeap(((const NtpPacket *)reply)->liVnMode), NtpLeapNone);
+  CHECK_EQUAL(((const NtpPacket *)reply)->stratum, 2);
+}
+TSSD_TEST(PipelineNtpUnsynchronized);
+
+static void PipelineAuthenticatedReply()
+{
+  KeyStore keys;
+  keys.add(1, TestKey);
+  std::vector<Datagram> requests;
+  requests.push_back(makeAuthRequest("10.0.0.1", 7, 1, TestKey));
+  requests.push_back(makeAuthRequest("10.0.0.1", 8, 1, TestKey));
+  ((TimeAuthRequest *)requests.back().data)->mac ^= 1;
+  requests.push_back(makeAuthRequest("10.0.0.1", 9, 2, TestKey)); // an unknown key
+  requests.push_back(makeTimeRequest("10.0.0.1", 10));
+  PipelineRun run(requests);
+  run.pipeline.enableAuthentication(&keys, false);
+  const std::vector<Datagram> &replies = run.serve();
+
+  if (!CHECK_EQUAL(replies.size(), 2))
+  {
+    return;
+  }
+  const TimeAuthReply *reply = (const TimeAuthReply *)replies[0].data;
+  CHECK_EQUAL(replies[0].length, TimeAuthReplyPacketSize);
+  CHECK_EQUAL(reply->messageType, TspAuthReply);
+  CHECK_EQUAL(reply->keyId, 1);
+  CHECK_EQUAL(reply->clientCookie, 7);
+  CHECK_EQUAL(reply->mac, sipHash24(TestKey, replies[0].data, TimeAuthReplyMacLength));
+  // an unauthenticated request is still served
+  CHECK_EQUAL(replies[1].length, TimeReplyPacketSize);
+  CHECK_EQUAL(((const TimeReply *)replies[1].data)->clientCookie, 10);
+  CHECK_EQUAL(run.stats.authFailed.load(), 2);
+  CHECK_EQUAL(run.stats.authRequests.load(), 1);
+}
+TSSD_TEST(PipelineAuthenticatedReply);
+
+static void PipelineRequiredAuthentication()
+{
+  KeyStore keys;
+  keys.add(1, TestKey);
+  std::vector<Datagram> requests;
+  requests.push_back(makeTimeRequest("10.0.0.1", 1));
+  requests.push_back(makeAuthRequest("10.0.0.1", 2, 1, TestKey));
+  PipelineRun run(requests);
+  run.pipeline.enableAuthentication(&keys, true);
+  const std::vector<Datagram> &replies = run.serve();
+
+  if (!CHECK_EQUAL(replies.size(), 1))
+  {
+    return;
+  }
+  CHECK_EQUAL(((const TimeAuthReply *)replies[0].data)->clientCookie, 2);
+  CHECK_EQUAL(run.stats.notAuthenticated.load(), 1);
+}
+TSSD_TEST(PipelineRequiredAuthentication);
+
+static void PipelineBatchRequests()
+{
+  std::vector<Datagram> requests;
+  // a source may take 10 cookies at once: two requests of 4, not a third
+  requests.push_back(makeBatchRequest("10.0.0.1", 4, true));
+  requests.push_back(makeBatchRequest("10.0.0.1", 4, true));
+  requests.push_back(makeBatchRequest("10.0.0.1", 4, true));
+  requests.push_back(makeBatchRequest("10.0.0.2", 4, false));
+  requests.push_back(makeBatchRequest("10.0.0.3", 5, false));
+  PipelineRun run(requests);
+  run.pipeline.enableBatchRequests(4, 10, 1000);
+  const std::vector<Datagram> &replies = run.serve();
+
+  if (!CHECK_EQUAL(replies.size(), 3))
+  {
+    return;
+  }
+  const TimeBatchReply *reply = (const TimeBatchReply *)replies[0].data;
+  CHECK_EQUAL(replies[0].length, timeBatchReplySize(4, true));
+  CHECK_EQUAL(reply->messageType, TspBatchReply);
+  CHECK_EQUAL(reply->cookieCount, 4);
+  CHECK_EQUAL(reply->clientCookie, 100);
+  CHECK_EQUAL(reply->moreClientCookies[0], 101);
+  CHECK_EQUAL(reply->moreClientCookies[2], 103);
+  CHECK_EQUAL(replies[2].length, timeBatchReplySize(4, false));
+  CHECK_EQUAL(((const TimeBatchReply *)replies[2].data)->clientCookie, 100);
+  CHECK_EQUAL(run.stats.batchRateLimited.load(), 1);
+  CHECK_EQUAL(run.stats.batchTooLarge.load(), 1);
+  CHECK_EQUAL(run.stats.batchRequests.load(), 3);
+  CHECK_EQUAL(run.stats.batchCookies.load(), 12);
+}
+TSSD_TEST(PipelineBatchRequests);
+
+// until batch requests are enabled, a batch request is served as a TimeRequest of its first cookie
+static void PipelineBatchRequestsDisabled()
+{
+  std::vector<Datagram> requests(1, makeBatchRequest("10.0.0.1", 4, true));
+  PipelineRun run(requests);
+  const std::vector<Datagram> &replies = run.serve();
+
+  if (!CHECK_EQUAL(replies.size(), 1))
+  {
+    return;
+  }
+  CHECK_EQUAL(replies[0].length, TimeReplyPacketSize);
+  CHECK_EQUAL(((const TimeReply *)replies[0].data)->clientCookie, 100);
+  CHECK_EQUAL(run.stats.batchRequests.load(), 0);
+}
+TSSD_TEST(PipelineBatchRequestsDisabled);
+
+static ServingConfig *makeConfig(const std::string &allow, const std::string &deny)
+{
+  ServingConfig *config = new ServingConfig();
+  config->batchSize = 2;
+  std::string error;
+  CHECK(config->access.allow(allow, error));
+  CHECK(config->access.deny(deny, error));
+  return config;
+}
+
+// a published snapshot applies from the next batch
+static void PipelineAccessListReload()
+{
+  std::vector<Datagram> requests;
+  requests.push_back(makeTimeRequest("10.0.0.1", 1));
+  requests.push_back(makeTimeRequest("192.168.1.1", 2));
+  WorkerStats stats;
+  MemoryTransport transport(requests, MaxBatchSize);
+  RequestPipeline pipeline(transport, stats, NULL, NULL, NULL);
+  ConfigDomain domain(makeConfig("10.0.0.0/8", ""));
+  pipeline.followConfig(&domain);
+
+  CHECK_EQUAL(pipeline.processBatch(), 2);
+  CHECK_EQUAL(transport.sent(), 1);
+  CHECK_EQUAL(stats.accessDenied.load(), 1);
+
+  // publish() waits for the readers which are serving, this one is between batches
+  pipeline.leaveConfig();
+  domain.publish(makeConfig("10.0.0.0/8", "10.0.0.1"));
+  CHECK_EQUAL(pipeline.processBatch(), 2);
+  CHECK_EQUAL(transport.sent(), 1);
+  CHECK_EQUAL(stats.accessDenied.load(), 3);
+
+  pipeline.leaveConfig();
+  domain.publish(makeConfig("", ""));
+  CHECK_EQUAL(pipeline.processBatch(), 2);
+  CHECK_EQUAL(transport.sent(), 3);
+  CHECK_EQUAL(stats.accessDenied.load(), 3);
+  pipeline.leaveConfig();
+}
+TSSD_TEST(PipelineAccessListReload);
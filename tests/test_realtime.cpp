@@ -0,0 +1,50 @@
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "realtime.h"
+#include "unittest.h"
+
+static void CpuListParse()
+{
+  std::vector<int> cpus;
+  CHECK(parseCpuList("2-5,8", cpus));
+  CHECK(cpus == std::vector<int>({ 2, 3, 4, 5, 8 }));
+  // as in /sys/devices/system/cpu/isolated
+  CHECK(parseCpuList(" 0 , 3-3\n", cpus));
+  CHECK(cpus == std::vector<int>({ 0, 3 }));
+  CHECK(parseCpuList("1,,2", cpus));
+  CHECK(cpus == std::vector<int>({ 1, 2 }));
+  CHECK(parseCpuList("", cpus));
+  CHECK(cpus.empty());
+  CHECK(parseCpuList("\n", cpus));
+  CHECK(cpus.empty());
+}
+TSSD_TEST(CpuListParse);
+
+static void CpuListMalformed()
+{
+  const char *const malformed[] = { "a", "5-2", "1-", "-1", "1-2-3", "2x", "0-99999", "1,b" };
+  for (size_t i = 0; i < sizeof(malformed) / sizeof(malformed[0]); i++)
+  {
+    std::vector<int> cpus;
+    if (!CHECK(!parseCpuList(malformed[i], cpus)))
+    {
+      printf("  '%s' was parsed\n", malformed[i]);
+    }
+  }
+}
+TSSD_TEST(CpuListMalformed);
+
+static void CpuListFormat()
+{
+  CHECK(formatCpuList(std::vector<int>()) == "");
+  CHECK(formatCpuList(std::vector<int>({ 3 })) == "3");
+  CHECK(formatCpuList(std::vector<int>({ 0, 1, 2, 5, 7, 8 })) == "0-2,5,7-8");
+
+  std::vector<int> cpus;
+  CHECK(parseCpuList(formatCpuList(std::vector<int>({ 1, 2, 3, 6 })), cpus));
+  CHECK(cpus == std::vector<int>({ 1, 2, 3, 6 }));
+}
+TSSD_TEST(CpuListFormat);
@@ -0,0 +1,152 @@
+/*
+ * Tests of the reclamation of the serving configuration snapshots: a
+ * snapshot is freed only once no reader can still use it, while readers
+ * on other threads go on serving.
+ */
+
+#include <poll.h>
+
+#include <atomic>
+#include <thread>
+
+#include "serving_config.h"
+#include "unittest.h"
+
+// a snapshot whose fields all tell the same number, to see one that was freed and reused
+static ServingConfig *numberedConfig(int number)
+{
+  ServingConfig *config = new ServingConfig();
+  config->batchSize = number;
+  config->maxBatchCookies = number;
+  config->logRate = number;
+  return config;
+}
+
+static void ServingConfigReaders()
+{
+  ConfigDomain domain(numberedConfig(0));
+  CHECK_EQUAL(domain.current()->version, 1);
+  for (int i = 0; i < ConfigDomain::MaxReaders; i++)
+  {
+    CHECK_EQUAL(domain.registerReader(), i);
+  }
+  CHECK_EQUAL(domain.registerReader(), -1);
+  // readers start offline, so nothing to wait for
+  domain.publish(numberedConfig(1));
+  CHECK_EQUAL(domain.current()->version, 2);
+  const ServingConfig *config = domain.read(3);
+  CHECK(config == domain.current() && config->batchSize == 1);
+  domain.leave(3);
+}
+TSSD_TEST(ServingConfigReaders);
+
+struct Publisher
+{
+  ConfigDomain *domain;
+  std::atomic<bool> done;
+
+  void run()
+  {
+    domain->publish(numberedConfig(2));
+    done = true;
+  }
+};
+
+// publish() waits for a reader which is in the middle of a batch
+static void ServingConfigWaitsForReader()
+{
+  ConfigDomain domain(numberedConfig(1));
+  int reader = domain.registerReader();
+  const ServingConfig *config = domain.read(reader);
+
+  Publisher publisher;
+  publisher.domain = &domain;
+  publisher.done = false;
+  std::thread thread(&Publisher::run, &publisher);
+  poll(NULL, 0, 50);
+  CHECK(!publisher.done.load());
+  // still the snapshot of the batch
+  CHECK_EQUAL(config->batchSize, 1);
+  // the next batch starts with the new snapshot
+  config = domain.read(reader);
+  thread.join();
+  CHECK(publisher.done.load());
+  CHECK_EQUAL(config->batchSize, 2);
+  domain.leave(reader);
+}
+TSSD_TEST(ServingConfigWaitsForReader);
+
+// a worker: batch after batch, uses a snapshot all along the batch
+struct Reader
+{
+  ConfigDomain *domain;
+  int slot;
+  std::atomic<bool> stop;
+  std::atomic<uint64_t> batches;
+  uint64_t errors;
+
+  void run()
+  {
+    uint64_t lastVersion = 0;
+    while (!stop.load())
+    {
+      const ServingConfig *config = domain->read(slot);
+      int number = config->batchSize;
+      if (config->version < lastVersion)
+      {
+        errors++;
+      }
+      lastVersion = config->version;
+      for (int i = 0; i < 100; i++)
+      {
+        if (config->batchSize != number || config->maxBatchCookies != number || (int)config->logRate != number)
+        {
+          errors++;
+          break;
+        }
+      }
+      batches++;
+    }
+    domain->leave(slot);
+  }
+};
+
+static void ServingConfigConcurrentPublish()
+{
+  static const int ReaderCount = 3;
+  ConfigDomain domain(numberedConfig(0));
+  Reader readers[ReaderCount];
+  std::thread threads[ReaderCount];
+  for (int i = 0; i < ReaderCount; i++)
+  {
+    readers[i].domain = &domain;
+    readers[i].slot = domain.registerReader();
+    readers[i].stop = false;
+    readers[i].batches = 0;
+    readers[i].errors = 0;
+    threads[i] = std::thread(&Reader::run, &readers[i]);
+  }
+  // every reader is serving, so every publish waits for all of them
+  for (int i = 0; i < ReaderCount; i++)
+  {
+    while (readers[i].batches.load() == 0)
+    {
+      poll(NULL, 0, 1);
+    }
+  }
+  for (int number = 1; number <= 100; number++)
+  {
+    domain.publish(numberedConfig(number));
+  }
+  CHECK_EQUAL(domain.current()->version, 101);
+  for (int i = 0; i < ReaderCount; i++)
+  {
+    readers[i].stop = true;
+    threads[i].join();
+    CHECK(readers[i].batches.load() > 100);
+    CHECK_EQUAL(readers[i].errors, 0);
+  }
+  // every reader went offline
+  domain.publish(numberedConfig(101));
+}
+TSSD_TEST(ServingConfigConcurrentPublish);
@@ -0,0 +1,147 @@
+/*
+ * Tests of the TCP endpoint over a loopback connection.
+ */
+
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "serving_config.h"
+#include "stream_server.h"
+#include "tsp_protocol.h"
+#include "unittest.h"
+
+// a connection to 'server', -1 if it fails
+static int connectTo(const StreamServer &server)
+{
+  struct sockaddr_in address;
+  socklen_t length = sizeof(address);
+  if (getsockname(server.listenFd(), (struct sockaddr *)&address, &length) != 0)
+  {
+    return -1;
+  }
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&address, length) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void sendTimeRequest(int fd, uint64_t cookie)
+{
+  TimeRequest request;
+  memset(&request, 0, sizeof(request));
+  memcpy(request.protocol, "TSP", 3);
+  request.protocolVersion = 1;
+  request.clientCookie = cookie;
+  CHECK_EQUAL(send(fd, &request, sizeof(request), MSG_NOSIGNAL), sizeof(request));
+}
+
+// true if a counter reaches 'value' within a second
+static bool waitFor(const StatCounter &counter, uint64_t value)
+{
+  for (int i = 0; i < 100 && counter.load() < value; i++)
+  {
+    struct timespec pause = { 0, 10000000 };
+    nanosleep(&pause, NULL);
+  }
+  return counter.load() >= value;
+}
+
+static void StreamServerRawTsp()
+{
+  WorkerStats stats;
+  StreamServer server(stats);
+  if (!CHECK(server.start("127.0.0.1", 0, 16)))
+  {
+    return;
+  }
+  int fd = connectTo(server);
+  if (!CHECK(fd >= 0))
+  {
+    return;
+  }
+  sendTimeRequest(fd, 42);
+  TimeReply reply;
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  if (CHECK(poll(&pfd, 1, 1000) == 1))
+  {
+    CHECK_EQUAL(recv(fd, &reply, sizeof(reply), MSG_WAITALL), sizeof(reply));
+    CHECK_EQUAL(reply.clientCookie, 42);
+  }
+  close(fd);
+}
+TSSD_TEST(StreamServerRawTsp);
+
+// the connections carry no MACs, so with --require_auth nothing is answered
+static void StreamServerRequiresAuthentication()
+{
+  ServingConfig *config = new ServingConfig();
+  config->requireAuthentication = true;
+  ConfigDomain domain(config);
+  WorkerStats stats;
+  StreamServer server(stats);
+  server.followConfig(&domain);
+  if (!CHECK(server.start("127.0.0.1", 0, 16)))
+  {
+    return;
+  }
+  int fd = connectTo(server);
+  if (!CHECK(fd >= 0))
+  {
+    return;
+  }
+  sendTimeRequest(fd, 42);
+  CHECK(waitFor(stats.notAuthenticated, 1));
+  struct pollfd pfd = { fd, POLLIN, 0 };
+  CHECK_EQUAL(poll(&pfd, 1, 100), 0);
+  CHECK_EQUAL(stats.replies.load(), 0);
+  close(fd);
+  server.stop();
+}
+TSSD_TEST(StreamServerRequiresAuthentication);
+
+// while paused a new connection waits in the backlog (for another process), open ones are still served
+static void StreamServerPauseAccepting()
+{
+  WorkerStats stats;
+  StreamServer server(stats);
+  if (!CHECK(server.start("127.0.0.1", 0, 16)))
+  {
+    return;
+  }
+  int open = connectTo(server);
+  if (!CHECK(open >= 0))
+  {
+    return;
+  }
+  sendTimeRequest(open, 1);
+  CHECK(waitFor(stats.replies, 1));
+
+  server.pauseAccepting();
+  int waiting = connectTo(server);
+  if (!CHECK(waiting >= 0))
+  {
+    close(open);
+    return;
+  }
+  sendTimeRequest(waiting, 2);
+  sendTimeRequest(open, 3);
+  CHECK(waitFor(stats.replies, 2));
+  struct timespec pause = { 0, 100000000 };
+  nanosleep(&pause, NULL);
+  CHECK_EQUAL(server.connections(), 1);
+  CHECK_EQUAL(stats.replies.load(), 2);
+
+  server.resumeAccepting();
+  CHECK(waitFor(stats.replies, 3));
+  CHECK_EQUAL(server.connections(), 2);
+  close(waiting);
+  close(open);
+}
+TSSD_TEST(StreamServerPauseAccepting);
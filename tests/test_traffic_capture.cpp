@@ -0,0 +1,114 @@
+/*
+ * Tests of the traffic capture file format (as tssd-replay reads it): the
+ * header, the records and their padding, and a full file.
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <string>
+
+#include "traffic_capture.h"
+#include "unittest.h"
+
+static Datagram makeDatagram(const char *source, uint16_t port, int length, uint64_t rxTimeNs)
+{
+  Datagram d;
+  memset(&d, 0, sizeof(d));
+  d.peer.v4.sin_family = AF_INET;
+  inet_pton(AF_INET, source, &d.peer.v4.sin_addr);
+  d.peer.v4.sin_port = htons(port);
+  for (int i = 0; i < length; i++)
+  {
+    d.data[i] = (char)i;
+  }
+  d.length = length;
+  d.rxTimeNs = rxTimeNs;
+  return d;
+}
+
+static void TrafficCaptureFormat()
+{
+  TempDirectory directory;
+  std::string path = directory.path() + "/capture";
+  Datagram datagrams[3] = {
+    makeDatagram("10.0.0.1", 40000, 16, 1000),
+    makeDatagram("10.0.0.2", 40001, 3, 2000), // junk is captured too
+    makeDatagram("10.0.0.3", 40002, MaxDatagramSize, 3000) // e.g. a batch request, whole
+  };
+  {
+    TrafficCapture capture;
+    if (!CHECK(capture.open(path, 1 << 20)))
+    {
+      return;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+      capture.capture(datagrams[i]);
+    }
+  }
+
+  // truncated to the used size on close
+  std::string content = directory.read("capture");
+  size_t expectedSize = sizeof(CaptureFileHeader) + captureRecordSize(16) + captureRecordSize(3) + captureRecordSize(MaxDatagramSize);
+  if (!CHECK_EQUAL(content.size(), expectedSize))
+  {
+    return;
+  }
+  CaptureFileHeader header;
+  memcpy(&header, content.data(), sizeof(header));
+  CHECK(memcmp(header.magic, CaptureFileMagic, sizeof(header.magic)) == 0);
+  CHECK_EQUAL(header.usedBytes, expectedSize);
+  CHECK_EQUAL(header.records, 3);
+  CHECK_EQUAL(header.dropped, 0);
+
+  size_t offset = sizeof(CaptureFileHeader);
+  for (int i = 0; i < 3; i++)
+  {
+    CaptureRecordHeader record;
+    memcpy(&record, content.data() + offset, sizeof(record));
+    CHECK_EQUAL(record.rxTimeNs, datagrams[i].rxTimeNs);
+    CHECK_EQUAL(record.sourceFamily, AF_INET);
+    CHECK_EQUAL(record.sourcePort, datagrams[i].peer.v4.sin_port);
+    CHECK(memcmp(record.sourceAddr, &datagrams[i].peer.v4.sin_addr, 4) == 0);
+    CHECK_EQUAL(record.length, datagrams[i].length);
+    CHECK_EQUAL(record.capturedLength, datagrams[i].length);
+    CHECK(memcmp(content.data() + offset + sizeof(record), datagrams[i].data, datagrams[i].length) == 0);
+    // records start 8 byte aligned
+    CHECK_EQUAL(captureRecordSize(record.capturedLength) % 8, 0);
+    offset += captureRecordSize(record.capturedLength);
+  }
+}
+TSSD_TEST(TrafficCaptureFormat);
+
+// once the file is full, datagrams are only counted
+static void TrafficCaptureFull()
+{
+  TempDirectory directory;
+  std::string path = directory.path() + "/capture";
+  uint64_t maxBytes = sizeof(CaptureFileHeader) + captureRecordSize(MaxCapturedPayload) + captureRecordSize(16);
+  {
+    TrafficCapture capture;
+    CHECK(!capture.open(path, sizeof(CaptureFileHeader) + 100));
+    if (!CHECK(capture.open(path, maxBytes)))
+    {
+      return;
+    }
+    Datagram datagram = makeDatagram("10.0.0.1", 40000, 16, 1000);
+    for (int i = 0; i < 20; i++)
+    {
+      capture.capture(datagram);
+    }
+  }
+  std::string content = directory.read("capture");
+  CaptureFileHeader header;
+  if (CHECK(content.size() >= sizeof(header)))
+  {
+    memcpy(&header, content.data(), sizeof(header));
+    uint64_t fitting = (maxBytes - sizeof(CaptureFileHeader)) / captureRecordSize(16);
+    CHECK_EQUAL(header.records, fitting);
+    CHECK_EQUAL(header.dropped, 20 - fitting);
+    CHECK_EQUAL(content.size(), header.usedBytes);
+  }
+}
+TSSD_TEST(TrafficCaptureFull);
@@ -0,0 +1,64 @@
+/*
+ * Tests of the UDP transport over loopback sockets.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "udp_transport.h"
+#include "unittest.h"
+
+static Datagram makeDatagram(const char *destination, uint16_t port, char payload)
+{
+  Datagram d;
+  memset(&d, 0, sizeof(d));
+  d.peer.v4.sin_family = AF_INET;
+  inet_pton(AF_INET, destination, &d.peer.v4.sin_addr);
+  d.peer.v4.sin_port = port;
+  d.data[0] = payload;
+  d.length = 1;
+  return d;
+}
+
+// a datagram the kernel refuses to send is skipped, the ones after it are still sent
+static void UdpTransportSkipsFailedDatagram()
+{
+  UdpTransport transport;
+  if (!CHECK(transport.open(0)))
+  {
+    return;
+  }
+  int receiver = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  if (!CHECK(bind(receiver, (struct sockaddr *)&address, sizeof(address)) == 0 &&
+      getsockname(receiver, (struct sockaddr *)&address, &length) == 0))
+  {
+    close(receiver);
+    return;
+  }
+
+  // a broadcast destination fails with EACCES without SO_BROADCAST
+  Datagram datagrams[4] = {
+    makeDatagram("255.255.255.255", address.sin_port, 'x'),
+    makeDatagram("127.0.0.1", address.sin_port, 'a'),
+    makeDatagram("255.255.255.255", address.sin_port, 'y'),
+    makeDatagram("127.0.0.1", address.sin_port, 'b')
+  };
+  int sent = transport.send(datagrams, 4);
+  CHECK_EQUAL(sent, 2);
+
+  char received[2] = { 0, 0 };
+  for (int i = 0; i < 2; i++)
+  {
+    CHECK_EQUAL(recv(receiver, &received[i], 1, MSG_DONTWAIT), 1);
+  }
+  CHECK(received[0] == 'a' && received[1] == 'b');
+  close(receiver);
+}
+TSSD_TEST(UdpTransportSkipsFailedDatagram);
@@ -0,0 +1,101 @@
+#include <string.h>
+
+#include <string>
+
+#include "unittest.h"
+#include "websocket.h"
+
+// the example of RFC 6455 section 1.3
+static void WebSocketAcceptKey()
+{
+  CHECK(webSocketAccept("dGhlIHNhbXBsZSBub25jZQ==") == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+TSSD_TEST(WebSocketAcceptKey);
+
+static void WebSocketHandshake()
+{
+  std::string response = webSocketHandshakeResponse("GET /tsp HTTP/1.1\r\n"
+    "Host: server.example.com\r\n"
+    "Upgrade: websocket\r\n"
+    "Connection: Upgrade\r\n"
+    "sec-websocket-key:   dGhlIHNhbXBsZSBub25jZQ==  \r\n"
+    "Sec-WebSocket-Version: 13\r\n\r\n");
+  CHECK(response.compare(0, 34, "HTTP/1.1 101 Switching Protocols\r\n") == 0);
+  CHECK(response.find("\r\nSec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n\r\n") != std::string::npos);
+
+  CHECK(webSocketHandshakeResponse("GET /tsp HTTP/1.1\r\nUpgrade: websocket\r\n\r\n").empty());
+  CHECK(webSocketHandshakeResponse("POST /tsp HTTP/1.1\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n").empty());
+}
+TSSD_TEST(WebSocketHandshake);
+
+// the masked "Hello" of RFC 6455 section 5.7
+static const char MaskedHello[] = "\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58";
+
+static void WebSocketParseFrame()
+{
+  uint8_t opcode = 0;
+  char payload[MaxWebSocketPayload];
+  int payloadLength = 0;
+  CHECK_EQUAL(parseWebSocketFrame(MaskedHello, 11, opcode, payload, payloadLength), 11);
+  CHECK_EQUAL(opcode, WebSocketText);
+  CHECK_EQUAL(payloadLength, 5);
+  CHECK(memcmp(payload, "Hello", 5) == 0);
+
+  // a frame followed by the start of the next one
+  char frames[16];
+  memcpy(frames, MaskedHello, 11);
+  memcpy(frames + 11, MaskedHello, 5);
+  CHECK_EQUAL(parseWebSocketFrame(frames, 16, opcode, payload, payloadLength), 11);
+}
+TSSD_TEST(WebSocketParseFrame);
+
+static void WebSocketParseIncompleteFrame()
+{
+  uint8_t opcode;
+  char payload[MaxWebSocketPayload];
+  int payloadLength;
+  CHECK_EQUAL(parseWebSocketFrame(MaskedHello, 0, opcode, payload, payloadLength), 0);
+  CHECK_EQUAL(parseWebSocketFrame(MaskedHello, 1, opcode, payload, payloadLength), 0);
+  CHECK_EQUAL(parseWebSocketFrame(MaskedHello, 5, opcode, payload, payloadLength), 0);
+  CHECK_EQUAL(parseWebSocketFrame(MaskedHello, 10, opcode, payload, payloadLength), 0);
+}
+TSSD_TEST(WebSocketParseIncompleteFrame);
+
+static void WebSocketRejectFrames()
+{
+  uint8_t opcode;
+  char payload[MaxWebSocketPayload];
+  int payloadLength;
+  // unmasked, a client must mask
+  CHECK_EQUAL(parseWebSocketFrame("\x81\x05Hello", 7, opcode, payload, payloadLength), -1);
+  // fragmented, FIN is not set
+  char frame[11];
+  memcpy(frame, MaskedHello, sizeof(frame));
+  frame[0] = '\x01';
+  CHECK_EQUAL(parseWebSocketFrame(frame, sizeof(frame), opcode, payload, payloadLength), -1);
+  // a 16 bit length, longer than any TSP message
+  CHECK_EQUAL(parseWebSocketFrame("\x82\xfe\x00\x80", 4, opcode, payload, payloadLength), -1);
+}
+TSSD_TEST(WebSocketRejectFrames);
+
+// the unmasked "Hello" of RFC 6455 section 5.7
+static void WebSocketEncodeFrame()
+{
+  char frame[2 + MaxWebSocketPayload];
+  CHECK_EQUAL(encodeWebSocketFrame(WebSocketText, "Hello", 5, frame), 7);
+  CHECK(memcmp(frame, "\x81\x05Hello", 7) == 0);
+
+  uint8_t opcode;
+  char payload[MaxWebSocketPayload];
+  int payloadLength;
+  char masked[2 + 4 + MaxWebSocketPayload];
+  int length = encodeWebSocketFrame(WebSocketBinary, "\x01\x02\x03", 3, masked);
+  // a client frame of the same payload, with a zero mask
+  memmove(masked + 6, masked + 2, 3);
+  masked[1] |= (char)0x80;
+  memset(masked + 2, 0, 4);
+  CHECK_EQUAL(parseWebSocketFrame(masked, length + 4, opcode, payload, payloadLength), length + 4);
+  CHECK_EQUAL(opcode, WebSocketBinary);
+  CHECK(payloadLength == 3 && memcmp(payload, "\x01\x02\x03", 3) == 0);
+}
+TSSD_TEST(WebSocketEncodeFrame);
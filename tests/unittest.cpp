@@ -0,0 +1,126 @@
+#include "unittest.h"
+
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct RegisteredTest
+{
+  const char *name;
+  TestFunction function;
+};
+
+static std::vector<RegisteredTest> &registeredTests()
+{
+  static std::vector<RegisteredTest> tests;
+  return tests;
+}
+
+static int failedChecks = 0;
+
+TestRegistration::TestRegistration(const char *name, TestFunction function)
+{
+  RegisteredTest test = { name, function };
+  registeredTests().push_back(test);
+}
+
+bool checkPassed(bool passed, const char *expression, const char *file, int line)
+{
+  if (!passed)
+  {
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+    failedChecks++;
+  }
+  return passed;
+}
+
+bool checkEqual(uint64_t actual, uint64_t expected, const char *expression, const char *file, int line)
+{
+  if (actual != expected)
+  {
+    fprintf(stderr, "%s:%d: check failed: %s (%" PRIu64 " != %" PRIu64 ")\n", file, line, expression, actual, expected);
+    failedChecks++;
+  }
+  return actual == expected;
+}
+
+TempDirectory::TempDirectory()
+{
+  char path[] = "/tmp/tssd-test-XXXXXX";
+  CHECK(mkdtemp(path) != NULL);
+  path_ = path;
+}
+
+TempDirectory::~TempDirectory()
+{
+  std::vector<std::string> names = files();
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    unlink((path_ + "/" + names[i]).c_str());
+  }
+  rmdir(path_.c_str());
+}
+
+std::vector<std::string> TempDirectory::files() const
+{
+  std::vector<std::string> names;
+  DIR *dir = opendir(path_.c_str());
+  if (dir == NULL)
+  {
+    return names;
+  }
+  while (struct dirent *entry = readdir(dir))
+  {
+    if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+    {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  return names;
+}
+
+std::string TempDirectory::read(const std::string &name) const
+{
+  std::string content;
+  FILE *file = fopen((path_ + "/" + name).c_str(), "re");
+  if (file == NULL)
+  {
+    return content;
+  }
+  char buffer[65536];
+  size_t n;
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+  {
+    content.append(buffer, n);
+  }
+  fclose(file);
+  return content;
+}
+
+int main(int argc, char **argv)
+{
+  const char *prefix = argc > 1 ? argv[1] : "";
+  int run = 0;
+  for (size_t i = 0; i < registeredTests().size(); i++)
+  {
+    const RegisteredTest &test = registeredTests()[i];
+    if (strncmp(test.name, prefix, strlen(prefix)) != 0)
+    {
+      continue;
+    }
+    int failedBefore = failedChecks;
+    test.function();
+    printf("%-48s %s\n", test.name, failedChecks == failedBefore ? "ok" : "FAILED");
+    run++;
+  }
+  if (run == 0)
+  {
+    fprintf(stderr, "no test starts with '%s'\n", prefix);
+    return 1;
+  }
+  return failedChecks == 0 ? 0 : 1;
+}
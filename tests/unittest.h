@@ -0,0 +1,67 @@
+#ifndef TSSD_UNITTEST_H
+#define TSSD_UNITTEST_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/*
+ * Minimal self contained test harness, like the microbenchmark one. A test
+ * is a function which checks its results; a failed check is reported with
+ * its file and line, and the test goes on:
+ *
+ *   static void PipelineSomething()
+ *   {
+ *     CHECK(something());
+ *     CHECK_EQUAL(answer(), 42);
+ *   }
+ *   TSSD_TEST(PipelineSomething);
+ *
+ * tssd-tests runs the tests whose name starts with its argument (all
+ * without one), and fails if a check failed. The checks stay in a release
+ * build, unlike assert().
+ */
+
+typedef void (*TestFunction)();
+
+struct TestRegistration
+{
+  TestRegistration(const char *name, TestFunction function);
+};
+
+#define TSSD_TEST(function) \
+  static TestRegistration testRegistration_##function(#function, function)
+
+// reports a failed check, returns 'passed'
+bool checkPassed(bool passed, const char *expression, const char *file, int line);
+bool checkEqual(uint64_t actual, uint64_t expected, const char *expression, const char *file, int line);
+
+/*
+ * A directory for the files a test writes, removed with them once the test
+ * is done.
+ */
+class TempDirectory
+{
+public:
+  TempDirectory();
+  ~TempDirectory();
+
+  const std::string &path() const
+  {
+    return path_;
+  }
+
+  // names of the files in the directory
+  std::vector<std::string> files() const;
+  // the whole content of a file in the directory, empty if it can't be read
+  std::string read(const std::string &name) const;
+
+private:
+  std::string path_;
+};
+
+#define CHECK(condition) checkPassed((condition), #condition, __FILE__, __LINE__)
+#define CHECK_EQUAL(actual, expected) checkEqual((uint64_t)(actual), (uint64_t)(expected), #actual " == " #expected, __FILE__, __LINE__)
+
+#endif // TSSD_UNITTEST_H
@@ -0,0 +1,139 @@
+/*
+ * tssd-client: command line client of the reference client library.
+ * Polls a tssd server with the adaptive interval of the library and
+ * prints the estimated offset of the local clock and its uncertainty.
+ * With --beacon it only listens to the server's beacons instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cxxopts/cxxopts.hpp>
+
+#include "beacon_listener.h"
+#include "tsp_client.h"
+
+static cxxopts::ParseResult parseOptions(int argc, char **argv, cxxopts::Options &options)
+{
+  try
+  {
+    cxxopts::ParseResult optsResult = options.parse(argc, argv);
+    if (optsResult.count("help") > 0)
+    {
+      std::cout << options.help() << std::endl;
+      exit(EXIT_SUCCESS);
+    }
+    return optsResult;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+static int listenToBeacons(const std::string &group, unsigned short port, int count)
+{
+  BeaconListener listener;
+  if (!listener.open(group.c_str(), port))
+  {
+    perror(group.c_str());
+    return EXIT_FAILURE;
+  }
+  BeaconSample sample;
+  for (int i = 0; count == 0 || i < count; )
+  {
+    int rc = listener.receive(5000, sample);
+    if (rc < 0)
+    {
+      perror("receive");
+      return EXIT_FAILURE;
+    }
+    if (rc == 0)
+    {
+      printf("no beacon\n");
+      fflush(stdout);
+      continue;
+    }
+    printf("beacon %llu offset %+.3f ms (%s), lost %llu\n", (unsigned long long)sample.sequence,
+      sample.offsetNs / 1e6, sample.precise ? "TX timestamp" : "build time", (unsigned long long)sample.lost);
+    fflush(stdout);
+    i++;
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+  const char *appName = argv[0];
+  cxxopts::Options options(appName, "Time sync client, prints the offset of the local clock to the server");
+  options.add_options()
+    ("h, help", "print help")
+    ("s, server", "server host name or address", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+    ("p, port", "server port", cxxopts::value<unsigned short>()->default_value("12321"))
+    ("burst", "requests per poll", cxxopts::value<int>()->default_value("4"))
+    ("min_poll", "shortest poll interval in seconds", cxxopts::value<double>()->default_value("16"))
+    ("max_poll", "longest poll interval in seconds", cxxopts::value<double>()->default_value("1024"))
+    ("c, count", "number of polls (0 for no limit)", cxxopts::value<int>()->default_value("0"))
+    ("beacon", "listen passively to the beacons sent to this multicast group (or broadcast address) instead of polling", cxxopts::value<std::string>()->default_value(""))
+    ("beacon_port", "UDP port of the beacons", cxxopts::value<unsigned short>()->default_value("12323"))
+    ("key_id", "send authenticated requests with the key of this id on the server (0 for unauthenticated requests)", cxxopts::value<int>()->default_value("0"))
+    ("key", "the key of --key_id, 32 hex digits", cxxopts::value<std::string>()->default_value(""))
+    ;
+
+  cxxopts::ParseResult parseResult = parseOptions(argc, argv, options);
+  int count = parseResult["count"].as<int>();
+
+  std::string beaconGroup = parseResult["beacon"].as<std::string>();
+  if (!beaconGroup.empty())
+  {
+    return listenToBeacons(beaconGroup, parseResult["beacon_port"].as<unsigned short>(), count);
+  }
+
+  TspClient::Config config;
+  config.burstSize = parseResult["burst"].as<int>();
+  config.minPollSec = parseResult["min_poll"].as<double>();
+  config.maxPollSec = parseResult["max_poll"].as<double>();
+  int keyId = parseResult["key_id"].as<int>();
+  if (keyId < 0 || keyId > 65535 || (keyId != 0 && !parseSipHashKey(parseResult["key"].as<std::string>().c_str(), config.key)))
+  {
+    std::cerr << appName << ": --key_id must be 0 to 65535, and --key 32 hex digits" << std::endl;
+    return EXIT_FAILURE;
+  }
+  config.keyId = (uint16_t)keyId;
+  TspClient client(config);
+  std::string server = parseResult["server"].as<std::string>();
+  if (!client.open(server.c_str(), parseResult["port"].as<unsigned short>()))
+  {
+    perror(server.c_str());
+    return EXIT_FAILURE;
+  }
+
+  for (int i = 0; count == 0 || i < count; i++)
+  {
+    if (i > 0)
+    {
+      usleep((useconds_t)(client.pollIntervalSec() * 1e6));
+    }
+    int replies = client.poll();
+    if (replies < 0)
+    {
+      perror("poll");
+      return EXIT_FAILURE;
+    }
+    ClockEstimate estimate;
+    if (!client.estimate(estimate))
+    {
+      printf(client.authFailures() > 0 ? "no authenticated reply\n" : "no reply\n");
+      fflush(stdout);
+      continue;
+    }
+    printf("offset %+.3f ms +- %.3f ms, delay %.3f ms, jitter %.3f ms, replies %d, next poll in %.0f s\n",
+      estimate.offsetNs / 1e6, estimate.uncertaintyNs / 1e6, estimate.delayNs / 1e6,
+      estimate.jitterNs / 1e6, replies, client.pollIntervalSec());
+    fflush(stdout);
+  }
+  return EXIT_SUCCESS;
+}
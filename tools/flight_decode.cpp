@@ -0,0 +1,89 @@
+/*
+ * tssd-flight-decode: prints the records of a tssd flight recorder file
+ * (or a dump of it), oldest first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "flight_recorder.h"
+
+static void formatTime(uint64_t timeNs, char *out, size_t size)
+{
+  time_t sec = (time_t)(timeNs / 1000000000ULL);
+  struct tm tmUtc;
+  gmtime_r(&sec, &tmUtc);
+  size_t len = strftime(out, size, "%Y-%m-%dT%H:%M:%S", &tmUtc);
+  snprintf(out + len, size - len, ".%09lluZ", (unsigned long long)(timeNs % 1000000000ULL));
+}
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: %s <flight recorder file>\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (f == NULL)
+  {
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+
+  FlightRecorderHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, FlightRecorderMagic, sizeof(header.magic)) != 0)
+  {
+    fprintf(stderr, "%s: not a tssd flight recorder file\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  if (header.recordSize != sizeof(FlightRecord) || header.capacity == 0 || (header.capacity & (header.capacity - 1)) != 0)
+  {
+    fprintf(stderr, "%s: unsupported record size %u or capacity %llu\n", argv[1], header.recordSize, (unsigned long long)header.capacity);
+    return EXIT_FAILURE;
+  }
+
+  // the records are allocated by the capacity, which must fit the file (a corrupt one could ask for any size)
+  struct stat st;
+  if (fstat(fileno(f), &st) != 0 ||
+    header.capacity > ((uint64_t)st.st_size - sizeof(FlightRecorderHeader)) / sizeof(FlightRecord))
+  {
+    fprintf(stderr, "%s: file is truncated\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  std::vector<FlightRecord> records(header.capacity);
+  if (fread(records.data(), sizeof(FlightRecord), records.size(), f) != records.size())
+  {
+    fprintf(stderr, "%s: file is truncated\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  fclose(f);
+
+  uint64_t first = header.writeIndex > header.capacity ? header.writeIndex - header.capacity : 0;
+  printf("# worker %u, %llu records (%llu written in total)\n", header.worker,
+    (unsigned long long)(header.writeIndex - first), (unsigned long long)header.writeIndex);
+  printf("# index rx_time source cookie reply_time_ms reply_minus_rx_ms service_us request_length\n");
+  for (uint64_t i = first; i < header.writeIndex; i++)
+  {
+    const FlightRecord &r = records[i & (header.capacity - 1)];
+    char rxTime[64];
+    formatTime(r.rxTimeNs, rxTime, sizeof(rxTime));
+    char addr[INET6_ADDRSTRLEN] = "?";
+    inet_ntop(r.sourceFamily, r.sourceAddr, addr, sizeof(addr));
+    bool v6 = r.sourceFamily == AF_INET6;
+    printf("%llu %s %s%s%s:%u 0x%016llx %llu %+.3f %.3f %u\n",
+      (unsigned long long)i, rxTime, v6 ? "[" : "", addr, v6 ? "]" : "", ntohs(r.sourcePort),
+      (unsigned long long)r.clientCookie, (unsigned long long)r.replyTimeMs,
+      (double)r.replyTimeMs - r.rxTimeNs / 1e6,
+      ((double)r.txTimeNs - (double)r.rxTimeNs) / 1e3,
+      r.requestLength);
+  }
+  return EXIT_SUCCESS;
+}
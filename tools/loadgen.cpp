@@ -0,0 +1,452 @@
+/*
+ * tssd-loadgen: load generator for tssd.
+ * Simulates a population of clients sending TimeRequests from several
+ * threads with sendmmsg/recvmmsg, following a rate profile (ramp up and an
+ * optional burst - e.g. a reboot storm of the whole fleet), matches the
+ * replies by their client cookie and reports throughput, loss and RTT.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <cxxopts/cxxopts.hpp>
+
+#include "latency_histogram.h"
+#include "tsp_protocol.h"
+
+static const int MaxBatch = 64;
+static const uint64_t InFlightSlots = 1 << 16; // per thread, power of 2
+
+// cookie layout: thread (8 bits) | client (24 bits) | sequence (32 bits)
+static uint64_t makeCookie(uint64_t thread, uint64_t client, uint64_t seq)
+{
+  return (thread << 56) | ((client & 0xffffff) << 32) | (seq & 0xffffffff);
+}
+
+static uint64_t nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+struct LoadProfile
+{
+  double ratePerSec; // steady request rate of all threads together
+  double rampSec; // linear ramp from 0 to the steady rate
+  double durationSec;
+  double stormAtSec; // a burst of 'stormClients' requests, spread over 'stormWindowSec'
+  double stormWindowSec;
+  uint64_t stormClients;
+
+  // number of requests which should have been sent by all threads until 'elapsedSec'
+  double requestsUntil(double elapsedSec) const
+  {
+    double t = elapsedSec < durationSec ? elapsedSec : durationSec;
+    double steady;
+    if (rampSec <= 0.0)
+    {
+      steady = ratePerSec * t;
+    }
+    else if (t < rampSec)
+    {
+      steady = ratePerSec * t * t / (2.0 * rampSec);
+    }
+    else
+    {
+      steady = ratePerSec * (t - rampSec / 2.0);
+    }
+
+    double storm = 0.0;
+    if (stormClients > 0 && t >= stormAtSec)
+    {
+      double stormElapsed = t - stormAtSec;
+      storm = stormWindowSec <= 0.0 || stormElapsed >= stormWindowSec ?
+        (double)stormClients : (double)stormClients * stormElapsed / stormWindowSec;
+    }
+    return steady + storm;
+  }
+};
+
+struct InFlight
+{
+  uint64_t cookie; // 0 when the slot is free
+  uint64_t sentNs;
+};
+
+struct ThreadResult
+{
+  ThreadResult() : sent(0), junk(0), received(0), unmatched(0), sendErrors(0) {}
+  uint64_t sent;
+  uint64_t junk; // part of 'sent' which is not a valid request, so no reply is expected
+  uint64_t received;
+  uint64_t unmatched; // replies with an unknown cookie (late, or not ours)
+  uint64_t sendErrors;
+  LatencyHistogram rtt;
+};
+
+struct ThreadConfig
+{
+  int index;
+  int threadCount;
+  struct sockaddr_in server;
+  int sockets;
+  uint64_t clients; // clients simulated by this thread
+  int batch;
+  double drainSec;
+  LoadProfile profile;
+  double junkPercent; // of the datagrams, alternating too short and not TSP
+  std::vector<uint8_t> versions; // protocol versions the requests cycle through
+};
+
+// datagrams the server must drop
+static const char JunkTooShort[8] = { 'T', 'S', 'P', 1, 0, 0, 0, 0 };
+static const char JunkNotTsp[16] = { 'G', 'E', 'T', ' ', '/', ' ', 'H', 'T', 'T', 'P', '/', '1', '.', '0', '\r', '\n' };
+
+static std::atomic<bool> stopping(false);
+
+static void receiveReplies(int fd, std::vector<InFlight> &inFlight, ThreadResult &result)
+{
+  TimeReply replies[MaxBatch];
+  struct iovec iovs[MaxBatch];
+  struct mmsghdr msgs[MaxBatch];
+  while (true)
+  {
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < MaxBatch; i++)
+    {
+      iovs[i].iov_base = &replies[i];
+      iovs[i].iov_len = sizeof(TimeReply);
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg(fd, msgs, MaxBatch, MSG_DONTWAIT, NULL);
+    if (n <= 0)
+    {
+      return;
+    }
+    uint64_t receivedNs = nowNs();
+    for (int i = 0; i < n; i++)
+    {
+      if (msgs[i].msg_len < (unsigned int)TimeReplyPacketSize)
+      {
+        result.unmatched++;
+        continue;
+      }
+      uint64_t cookie = replies[i].clientCookie;
+      InFlight &slot = inFlight[cookie & (InFlightSlots - 1)];
+      if (slot.cookie != cookie)
+      {
+        result.unmatched++;
+        continue;
+      }
+      result.rtt.record(receivedNs - slot.sentNs);
+      result.received++;
+      slot.cookie = 0;
+    }
+  }
+}
+
+static void runThread(ThreadConfig config, ThreadResult *result)
+{
+  std::vector<int> fds;
+  for (int i = 0; i < config.sockets; i++)
+  {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&config.server, sizeof(config.server)) < 0)
+    {
+      perror("socket");
+      exit(EXIT_FAILURE);
+    }
+    fds.push_back(fd);
+  }
+
+  std::vector<InFlight> inFlight(InFlightSlots);
+  std::vector<struct pollfd> pfds(fds.size());
+  for (size_t i = 0; i < fds.size(); i++)
+  {
+    pfds[i].fd = fds[i];
+    pfds[i].events = POLLIN;
+  }
+
+  TimeRequest requests[MaxBatch];
+  struct iovec iovs[MaxBatch];
+  struct mmsghdr msgs[MaxBatch];
+  memset(requests, 0, sizeof(requests));
+  for (int i = 0; i < MaxBatch; i++)
+  {
+    memcpy(requests[i].protocol, "TSP", 3);
+    requests[i].protocolVersion = 1;
+  }
+
+  uint64_t seq = 0;
+  uint64_t nextClient = 0;
+  double junkCredit = 0.0;
+  const uint64_t startNs = nowNs();
+  const uint64_t endNs = startNs + (uint64_t)(config.profile.durationSec * 1e9);
+  while (!stopping.load(std::memory_order_relaxed))
+  {
+    uint64_t now = nowNs();
+    if (now >= endNs)
+    {
+      break;
+    }
+    double due = config.profile.requestsUntil((now - startNs) / 1e9) / config.threadCount;
+    uint64_t pending = due > (double)result->sent ? (uint64_t)(due - result->sent) : 0;
+
+    // each client sends from one of the thread's sockets, so the server sees 'sockets' sources per thread
+    while (pending > 0)
+    {
+      int fdIndex = (int)(nextClient % fds.size());
+      int batch = 0;
+      uint64_t sendNs = nowNs();
+      while (batch < config.batch && (uint64_t)batch < pending)
+      {
+        uint64_t client = nextClient;
+        uint64_t cookie = makeCookie(config.index, client, seq++);
+        junkCredit += config.junkPercent / 100.0;
+        if (junkCredit >= 1.0)
+        {
+          junkCredit -= 1.0;
+          bool tooShort = (seq & 1) != 0;
+          iovs[batch].iov_base = (void *)(tooShort ? JunkTooShort : JunkNotTsp);
+          iovs[batch].iov_len = tooShort ? sizeof(JunkTooShort) : sizeof(JunkNotTsp);
+          result->junk++;
+        }
+        else
+        {
+          requests[batch].clientCookie = cookie;
+          requests[batch].protocolVersion = config.versions[seq % config.versions.size()];
+          InFlight &slot = inFlight[cookie & (InFlightSlots - 1)];
+          slot.cookie = cookie;
+          slot.sentNs = sendNs;
+          iovs[batch].iov_base = &requests[batch];
+          iovs[batch].iov_len = sizeof(TimeRequest);
+        }
+        memset(&msgs[batch], 0, sizeof(msgs[batch]));
+        msgs[batch].msg_hdr.msg_iov = &iovs[batch];
+        msgs[batch].msg_hdr.msg_iovlen = 1;
+        batch++;
+        nextClient = (nextClient + 1) % config.clients;
+        if ((int)(nextClient % fds.size()) != fdIndex)
+        {
+          break;
+        }
+      }
+      int sent = sendmmsg(fds[fdIndex], msgs, batch, 0);
+      if (sent < 0)
+      {
+        result->sendErrors += batch;
+        sent = batch; // count them as sent (and lost), so the profile is kept
+      }
+      else if (sent < batch)
+      {
+        result->sendErrors += batch - sent;
+        sent = batch;
+      }
+      result->sent += sent;
+      pending -= sent;
+      receiveReplies(fds[fdIndex], inFlight, *result);
+    }
+
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+      receiveReplies(fds[i], inFlight, *result);
+    }
+    if (pending == 0)
+    {
+      // wait for replies, or until it is time to send the next request
+      double rate = config.profile.ratePerSec / config.threadCount;
+      int waitMs = rate >= 1000.0 ? 0 : 1;
+      poll(pfds.data(), pfds.size(), waitMs);
+    }
+  }
+
+  // wait for the last replies
+  uint64_t drainEndNs = nowNs() + (uint64_t)(config.drainSec * 1e9);
+  while (result->received + result->junk < result->sent && nowNs() < drainEndNs)
+  {
+    poll(pfds.data(), pfds.size(), 10);
+    for (size_t i = 0; i < fds.size(); i++)
+    {
+      receiveReplies(fds[i], inFlight, *result);
+    }
+  }
+
+  for (size_t i = 0; i < fds.size(); i++)
+  {
+    close(fds[i]);
+  }
+}
+
+static cxxopts::ParseResult parseOptions(int argc, char **argv, cxxopts::Options &options)
+{
+  try
+  {
+    cxxopts::ParseResult optsResult = options.parse(argc, argv);
+    if (optsResult.count("help") > 0)
+    {
+      std::cout << options.help() << std::endl;
+      exit(EXIT_SUCCESS);
+    }
+    return optsResult;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *appName = argv[0];
+  cxxopts::Options options(appName, "Load generator for the time sync server");
+  options.add_options()
+    ("h, help", "print help")
+    ("s, server", "server address", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+    ("p, port", "server port", cxxopts::value<unsigned short>()->default_value("12321"))
+    ("t, threads", "sending threads", cxxopts::value<int>()->default_value("4"))
+    ("clients", "number of simulated clients", cxxopts::value<uint64_t>()->default_value("1000000"))
+    ("sockets", "sockets (source ports) per thread", cxxopts::value<int>()->default_value("16"))
+    ("r, rate", "steady request rate per second (all threads together)", cxxopts::value<double>()->default_value("100000"))
+    ("d, duration", "test duration in seconds", cxxopts::value<double>()->default_value("10"))
+    ("ramp", "seconds to ramp up linearly to the steady rate", cxxopts::value<double>()->default_value("0"))
+    ("batch", "max requests per sendmmsg call", cxxopts::value<int>()->default_value("32"))
+    ("storm_at", "seconds from start of a burst in which every client sends one request (reboot storm)", cxxopts::value<double>()->default_value("0"))
+    ("storm_clients", "clients in the burst (0 for no burst)", cxxopts::value<uint64_t>()->default_value("0"))
+    ("storm_window", "seconds over which the burst is spread", cxxopts::value<double>()->default_value("1"))
+    ("drain", "seconds to wait for replies at the end", cxxopts::value<double>()->default_value("1"))
+    ("junk", "percent of the datagrams which are junk (too short or not TSP)", cxxopts::value<double>()->default_value("0"))
+    ("versions", "comma separated protocol versions the requests cycle through", cxxopts::value<std::string>()->default_value("1"))
+    ("json", "print the results as JSON", cxxopts::value<bool>())
+    ;
+
+  cxxopts::ParseResult parseResult = parseOptions(argc, argv, options);
+
+  ThreadConfig config;
+  memset(&config.server, 0, sizeof(config.server));
+  config.server.sin_family = AF_INET;
+  config.server.sin_port = htons(parseResult["port"].as<unsigned short>());
+  if (inet_pton(AF_INET, parseResult["server"].as<std::string>().c_str(), &config.server.sin_addr) != 1)
+  {
+    std::cerr << appName << ": invalid server address" << std::endl;
+    return EXIT_FAILURE;
+  }
+  config.threadCount = parseResult["threads"].as<int>();
+  config.sockets = parseResult["sockets"].as<int>();
+  config.batch = parseResult["batch"].as<int>();
+  config.drainSec = parseResult["drain"].as<double>();
+  config.junkPercent = parseResult["junk"].as<double>();
+  std::stringstream versions(parseResult["versions"].as<std::string>());
+  std::string version;
+  while (std::getline(versions, version, ','))
+  {
+    config.versions.push_back((uint8_t)atoi(version.c_str()));
+  }
+  if (config.versions.empty())
+  {
+    std::cerr << appName << ": no protocol versions" << std::endl;
+    return EXIT_FAILURE;
+  }
+  config.profile.ratePerSec = parseResult["rate"].as<double>();
+  config.profile.durationSec = parseResult["duration"].as<double>();
+  config.profile.rampSec = parseResult["ramp"].as<double>();
+  config.profile.stormAtSec = parseResult["storm_at"].as<double>();
+  config.profile.stormClients = parseResult["storm_clients"].as<uint64_t>();
+  config.profile.stormWindowSec = parseResult["storm_window"].as<double>();
+  uint64_t clients = parseResult["clients"].as<uint64_t>();
+  if (config.threadCount < 1 || config.threadCount > 255 || config.sockets < 1 ||
+    config.batch < 1 || config.batch > MaxBatch || clients < (uint64_t)config.threadCount)
+  {
+    std::cerr << appName << ": threads must be 1-255, batch 1-" << MaxBatch << ", and clients at least threads" << std::endl;
+    return EXIT_FAILURE;
+  }
+  config.clients = clients / config.threadCount;
+
+  std::vector<ThreadResult> results(config.threadCount);
+  std::vector<std::thread> threads;
+  uint64_t startNs = nowNs();
+  for (int i = 0; i < config.threadCount; i++)
+  {
+    ThreadConfig threadConfig = config;
+    threadConfig.index = i;
+    threads.push_back(std::thread(runThread, threadConfig, &results[i]));
+  }
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    threads[i].join();
+  }
+  double elapsedSec = (nowNs() - startNs) / 1e9;
+
+  uint64_t sent = 0, junk = 0, received = 0, unmatched = 0, sendErrors = 0;
+  HistogramSnapshot rtt;
+  HistogramSnapshot threadRtt;
+  for (size_t i = 0; i < results.size(); i++)
+  {
+    sent += results[i].sent;
+    junk += results[i].junk;
+    received += results[i].received;
+    unmatched += results[i].unmatched;
+    sendErrors += results[i].sendErrors;
+    results[i].rtt.snapshot(threadRtt);
+    rtt.merge(threadRtt);
+  }
+
+  uint64_t lost = sent - junk - received;
+  if (parseResult["json"].as<bool>())
+  {
+    printf("{\n");
+    printf("  \"sent\": %llu,\n", (unsigned long long)sent);
+    printf("  \"received\": %llu,\n", (unsigned long long)received);
+    printf("  \"junk\": %llu,\n", (unsigned long long)junk);
+    printf("  \"send_errors\": %llu,\n", (unsigned long long)sendErrors);
+    printf("  \"unmatched\": %llu,\n", (unsigned long long)unmatched);
+    printf("  \"loss_percent\": %.4f,\n", sent > junk ? 100.0 * lost / (sent - junk) : 0.0);
+    printf("  \"throughput\": %.1f,\n", received / elapsedSec);
+    printf("  \"rtt_us\": { \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p99.9\": %.2f, \"max\": %.2f }\n",
+      rtt.valueAtPercentile(50.0) / 1e3, rtt.valueAtPercentile(90.0) / 1e3,
+      rtt.valueAtPercentile(99.0) / 1e3, rtt.valueAtPercentile(99.9) / 1e3, rtt.max / 1e3);
+    printf("}\n");
+    return lost == 0 ? EXIT_SUCCESS : 2;
+  }
+
+  printf("sent:        %llu (%.0f/s, %llu send errors)\n", (unsigned long long)sent,
+    sent / config.profile.durationSec, (unsigned long long)sendErrors);
+  printf("received:    %llu (%.0f/s over %.1f s)\n", (unsigned long long)received,
+    received / elapsedSec, elapsedSec);
+  if (junk > 0)
+  {
+    printf("junk:        %llu (no reply expected)\n", (unsigned long long)junk);
+  }
+  printf("lost:        %llu (%.3f%%), unmatched replies: %llu\n", (unsigned long long)lost,
+    sent > junk ? 100.0 * lost / (sent - junk) : 0.0, (unsigned long long)unmatched);
+  printf("rtt [us]:    p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+    rtt.valueAtPercentile(50.0) / 1e3, rtt.valueAtPercentile(90.0) / 1e3,
+    rtt.valueAtPercentile(99.0) / 1e3, rtt.valueAtPercentile(99.9) / 1e3, rtt.max / 1e3);
+  printf("rtt histogram [us]:\n");
+  static const double boundsUs[] = { 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 100000 };
+  uint64_t below = 0;
+  for (size_t i = 0; i < sizeof(boundsUs) / sizeof(boundsUs[0]); i++)
+  {
+    uint64_t atOrBelow = rtt.countAtOrBelow((uint64_t)(boundsUs[i] * 1000));
+    printf("  <= %8.0f: %llu\n", boundsUs[i], (unsigned long long)(atOrBelow - below));
+    below = atOrBelow;
+  }
+  printf("   > %8.0f: %llu\n", boundsUs[sizeof(boundsUs) / sizeof(boundsUs[0]) - 1], (unsigned long long)(rtt.total - below));
+
+  return lost == 0 ? EXIT_SUCCESS : 2;
+}
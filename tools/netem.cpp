@@ -0,0 +1,473 @@
+/*
+ * tssd-netem: userspace network impairment proxy.
+ * Sits between clients and a server and forwards UDP datagrams in both
+ * directions, after a configurable delay (base delay per direction for
+ * asymmetry, plus jitter from a distribution), with random loss and
+ * reordering. Needs no root and no tc, so the end to end accuracy of
+ * clients can be measured under realistic network conditions.
+ *
+ * Every client (source address) gets its own upstream socket, so the
+ * server sees one source per client and the replies find their way back.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include <map>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include <cxxopts/cxxopts.hpp>
+
+#include "transport.h"
+
+enum JitterDistribution
+{
+  JitterUniform, // uniform in [-jitter, +jitter]
+  JitterNormal, // normal with a standard deviation of 'jitter'
+  JitterExponential, // one sided with a mean of 'jitter' (queueing)
+  JitterPareto // one sided heavy tail with a mean of 'jitter' (bursts of cross traffic)
+};
+
+enum Direction
+{
+  Upstream, // client to server
+  Downstream, // server to client
+  DirectionCount
+};
+
+struct Impairment
+{
+  double delayMs;
+  double jitterMs;
+  double lossPercent;
+  double reorderPercent; // sent without the delay, so they overtake earlier datagrams
+};
+
+struct DirectionStats
+{
+  DirectionStats() : received(0), forwarded(0), lost(0), reordered(0), sendErrors(0), delaySumNs(0) {}
+  uint64_t received;
+  uint64_t forwarded;
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t sendErrors;
+  double delaySumNs;
+};
+
+struct Session
+{
+  int upstreamFd; // connected to the server
+  struct sockaddr_in client;
+  uint64_t lastActiveNs;
+};
+
+struct PendingDatagram
+{
+  uint64_t dueNs;
+  uint64_t seq; // keeps the order of datagrams which are due at the same time
+  Direction direction;
+  uint64_t sessionKey;
+  int length;
+  char data[MaxDatagramSize];
+};
+
+struct PendingLater
+{
+  bool operator()(const PendingDatagram *a, const PendingDatagram *b) const
+  {
+    return a->dueNs != b->dueNs ? a->dueNs > b->dueNs : a->seq > b->seq;
+  }
+};
+
+static const uint64_t ListenKey = ~(uint64_t)0;
+static const uint64_t TimerKey = ~(uint64_t)0 - 1;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void handleSignal(int)
+{
+  stopping = 1;
+}
+
+static uint64_t nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t sessionKey(const struct sockaddr_in &addr)
+{
+  return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+class Impairer
+{
+public:
+  Impairer(JitterDistribution distribution, uint64_t seed) : distribution_(distribution), random_(seed) {}
+
+  // returns false if the datagram is lost, else the delay to apply
+  bool decide(const Impairment &impairment, uint64_t &delayNs, bool &reordered)
+  {
+    std::uniform_real_distribution<double> percent(0.0, 100.0);
+    if (impairment.lossPercent > 0.0 && percent(random_) < impairment.lossPercent)
+    {
+      return false;
+    }
+    reordered = impairment.reorderPercent > 0.0 && percent(random_) < impairment.reorderPercent;
+    if (reordered)
+    {
+      delayNs = 0;
+      return true;
+    }
+    double delayMs = impairment.delayMs + jitterMs(impairment.jitterMs);
+    delayNs = delayMs > 0.0 ? (uint64_t)(delayMs * 1e6) : 0;
+    return true;
+  }
+
+private:
+  double jitterMs(double jitter)
+  {
+    if (jitter <= 0.0)
+    {
+      return 0.0;
+    }
+    switch (distribution_)
+    {
+      case JitterUniform:
+        return std::uniform_real_distribution<double>(-jitter, jitter)(random_);
+      case JitterNormal:
+        return std::normal_distribution<double>(0.0, jitter)(random_);
+      case JitterExponential:
+        return std::exponential_distribution<double>(1.0 / jitter)(random_);
+      case JitterPareto:
+      {
+        // pareto with shape 'a' and scale 'xm' has a mean of xm * a / (a - 1),
+        // the excess over xm has a mean of xm / (a - 1)
+        const double shape = 2.5;
+        double xm = jitter * (shape - 1.0);
+        double u = std::uniform_real_distribution<double>(0.0, 1.0)(random_);
+        return xm / pow(1.0 - u, 1.0 / shape) - xm;
+      }
+    }
+    return 0.0;
+  }
+
+  JitterDistribution distribution_;
+  std::mt19937_64 random_;
+};
+
+static cxxopts::ParseResult parseOptions(int argc, char **argv, cxxopts::Options &options)
+{
+  try
+  {
+    cxxopts::ParseResult optsResult = options.parse(argc, argv);
+    if (optsResult.count("help") > 0)
+    {
+      std::cout << options.help() << std::endl;
+      exit(EXIT_SUCCESS);
+    }
+    return optsResult;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void printStats(const char *name, const DirectionStats &stats)
+{
+  printf("%-11s received %llu, forwarded %llu, lost %llu, reordered %llu, send errors %llu, mean delay %.3f ms\n",
+    name, (unsigned long long)stats.received, (unsigned long long)stats.forwarded,
+    (unsigned long long)stats.lost, (unsigned long long)stats.reordered, (unsigned long long)stats.sendErrors,
+    stats.received > stats.lost ? stats.delaySumNs / (stats.received - stats.lost) / 1e6 : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+  const char *appName = argv[0];
+  cxxopts::Options options(appName, "UDP proxy which delays, reorders and drops datagrams");
+  options.add_options()
+    ("h, help", "print help")
+    ("l, listen_port", "port the clients send to", cxxopts::value<unsigned short>()->default_value("12322"))
+    ("s, server", "server address", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+    ("p, port", "server port", cxxopts::value<unsigned short>()->default_value("12321"))
+    ("delay", "base one way delay in ms, both directions", cxxopts::value<double>()->default_value("0"))
+    ("delay_up", "base delay in ms from client to server (overrides --delay)", cxxopts::value<double>())
+    ("delay_down", "base delay in ms from server to client (overrides --delay)", cxxopts::value<double>())
+    ("jitter", "jitter in ms added to the base delay", cxxopts::value<double>()->default_value("0"))
+    ("distribution", "jitter distribution: uniform, normal, exponential or pareto", cxxopts::value<std::string>()->default_value("uniform"))
+    ("loss", "percent of datagrams dropped, per direction", cxxopts::value<double>()->default_value("0"))
+    ("reorder", "percent of datagrams sent without the delay, per direction", cxxopts::value<double>()->default_value("0"))
+    ("seed", "random seed (0 for a random one)", cxxopts::value<uint64_t>()->default_value("0"))
+    ("idle_timeout", "seconds after which an idle client's upstream socket is closed", cxxopts::value<double>()->default_value("60"))
+    ;
+
+  cxxopts::ParseResult parseResult = parseOptions(argc, argv, options);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(parseResult["port"].as<unsigned short>());
+  if (inet_pton(AF_INET, parseResult["server"].as<std::string>().c_str(), &server.sin_addr) != 1)
+  {
+    std::cerr << appName << ": invalid server address" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  Impairment impairments[DirectionCount];
+  double delay = parseResult["delay"].as<double>();
+  impairments[Upstream].delayMs = parseResult.count("delay_up") > 0 ? parseResult["delay_up"].as<double>() : delay;
+  impairments[Downstream].delayMs = parseResult.count("delay_down") > 0 ? parseResult["delay_down"].as<double>() : delay;
+  for (int d = 0; d < DirectionCount; d++)
+  {
+    impairments[d].jitterMs = parseResult["jitter"].as<double>();
+    impairments[d].lossPercent = parseResult["loss"].as<double>();
+    impairments[d].reorderPercent = parseResult["reorder"].as<double>();
+  }
+
+  JitterDistribution distribution;
+  std::string distributionName = parseResult["distribution"].as<std::string>();
+  if (distributionName == "uniform")
+  {
+    distribution = JitterUniform;
+  }
+  else if (distributionName == "normal")
+  {
+    distribution = JitterNormal;
+  }
+  else if (distributionName == "exponential")
+  {
+    distribution = JitterExponential;
+  }
+  else if (distributionName == "pareto")
+  {
+    distribution = JitterPareto;
+  }
+  else
+  {
+    std::cerr << appName << ": unknown distribution '" << distributionName << "'" << std::endl;
+    return EXIT_FAILURE;
+  }
+  uint64_t seed = parseResult["seed"].as<uint64_t>();
+  if (seed == 0)
+  {
+    seed = std::random_device()();
+  }
+  Impairer impairer(distribution, seed);
+  uint64_t idleTimeoutNs = (uint64_t)(parseResult["idle_timeout"].as<double>() * 1e9);
+
+  int listenFd = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in listenAddr;
+  memset(&listenAddr, 0, sizeof(listenAddr));
+  listenAddr.sin_family = AF_INET;
+  listenAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+  listenAddr.sin_port = htons(parseResult["listen_port"].as<unsigned short>());
+  if (listenFd < 0 || bind(listenFd, (struct sockaddr *)&listenAddr, sizeof(listenAddr)) < 0)
+  {
+    perror("bind");
+    return EXIT_FAILURE;
+  }
+
+  // the timer fires when the earliest delayed datagram is due
+  int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  int epollFd = epoll_create1(0);
+  if (timerFd < 0 || epollFd < 0)
+  {
+    perror("epoll");
+    return EXIT_FAILURE;
+  }
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.u64 = ListenKey;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+  event.data.u64 = TimerKey;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &event);
+
+  signal(SIGINT, handleSignal);
+  signal(SIGTERM, handleSignal);
+
+  printf("forwarding port %u to %s:%u, delay up %.3f ms, down %.3f ms, jitter %.3f ms (%s), loss %.2f%%, reorder %.2f%%\n",
+    ntohs(listenAddr.sin_port), parseResult["server"].as<std::string>().c_str(), ntohs(server.sin_port),
+    impairments[Upstream].delayMs, impairments[Downstream].delayMs, impairments[Upstream].jitterMs,
+    distributionName.c_str(), impairments[Upstream].lossPercent, impairments[Upstream].reorderPercent);
+  fflush(stdout);
+
+  std::map<uint64_t, Session> sessions;
+  std::priority_queue<PendingDatagram *, std::vector<PendingDatagram *>, PendingLater> pending;
+  std::vector<PendingDatagram *> freeList;
+  DirectionStats stats[DirectionCount];
+  uint64_t seq = 0;
+  uint64_t armedNs = 0; // due time the timer is set to, 0 when disarmed
+  uint64_t nextExpiryNs = nowNs() + 1000000000ULL;
+
+  while (stopping == 0)
+  {
+    struct epoll_event events[64];
+    int n = epoll_wait(epollFd, events, 64, 1000);
+    if (n < 0 && errno != EINTR)
+    {
+      perror("epoll_wait");
+      return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+      uint64_t key = events[i].data.u64;
+      if (key == TimerKey)
+      {
+        uint64_t expirations;
+        ssize_t ignored = read(timerFd, &expirations, sizeof(expirations));
+        (void)ignored;
+        armedNs = 0;
+        continue;
+      }
+
+      // read everything which is waiting on this socket
+      while (true)
+      {
+        PendingDatagram *datagram;
+        if (freeList.empty())
+        {
+          datagram = new PendingDatagram;
+        }
+        else
+        {
+          datagram = freeList.back();
+          freeList.pop_back();
+        }
+
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        int fd = key == ListenKey ? listenFd : sessions[key].upstreamFd;
+        ssize_t length = recvfrom(fd, datagram->data, sizeof(datagram->data), MSG_DONTWAIT, (struct sockaddr *)&from, &fromLen);
+        if (length < 0)
+        {
+          freeList.push_back(datagram);
+          break;
+        }
+        uint64_t receivedNs = nowNs();
+
+        if (key == ListenKey)
+        {
+          datagram->direction = Upstream;
+          datagram->sessionKey = sessionKey(from);
+          std::map<uint64_t, Session>::iterator it = sessions.find(datagram->sessionKey);
+          if (it == sessions.end())
+          {
+            Session session;
+            session.client = from;
+            session.upstreamFd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (session.upstreamFd < 0 || connect(session.upstreamFd, (struct sockaddr *)&server, sizeof(server)) < 0)
+            {
+              perror("upstream socket");
+              return EXIT_FAILURE;
+            }
+            event.data.u64 = datagram->sessionKey;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, session.upstreamFd, &event);
+            it = sessions.insert(std::make_pair(datagram->sessionKey, session)).first;
+          }
+          it->second.lastActiveNs = receivedNs;
+        }
+        else
+        {
+          datagram->direction = Downstream;
+          datagram->sessionKey = key;
+        }
+
+        DirectionStats &directionStats = stats[datagram->direction];
+        directionStats.received++;
+        uint64_t delayNs;
+        bool reordered;
+        if (!impairer.decide(impairments[datagram->direction], delayNs, reordered))
+        {
+          directionStats.lost++;
+          freeList.push_back(datagram);
+          continue;
+        }
+        if (reordered)
+        {
+          directionStats.reordered++;
+        }
+        directionStats.delaySumNs += delayNs;
+        datagram->length = (int)length;
+        datagram->dueNs = receivedNs + delayNs;
+        datagram->seq = seq++;
+        pending.push(datagram);
+      }
+    }
+
+    // send everything which is due
+    uint64_t now = nowNs();
+    while (!pending.empty() && pending.top()->dueNs <= now)
+    {
+      PendingDatagram *datagram = pending.top();
+      pending.pop();
+      std::map<uint64_t, Session>::iterator it = sessions.find(datagram->sessionKey);
+      DirectionStats &directionStats = stats[datagram->direction];
+      ssize_t sent = -1;
+      if (it != sessions.end())
+      {
+        sent = datagram->direction == Upstream ?
+          send(it->second.upstreamFd, datagram->data, datagram->length, 0) :
+          sendto(listenFd, datagram->data, datagram->length, 0, (struct sockaddr *)&it->second.client, sizeof(it->second.client));
+      }
+      if (sent < 0)
+      {
+        directionStats.sendErrors++;
+      }
+      else
+      {
+        directionStats.forwarded++;
+      }
+      freeList.push_back(datagram);
+    }
+
+    if (!pending.empty() && pending.top()->dueNs != armedNs)
+    {
+      armedNs = pending.top()->dueNs;
+      struct itimerspec timer;
+      memset(&timer, 0, sizeof(timer));
+      timer.it_value.tv_sec = armedNs / 1000000000ULL;
+      timer.it_value.tv_nsec = armedNs % 1000000000ULL;
+      timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &timer, NULL);
+    }
+
+    if (now >= nextExpiryNs)
+    {
+      nextExpiryNs = now + 1000000000ULL;
+      for (std::map<uint64_t, Session>::iterator it = sessions.begin(); it != sessions.end();)
+      {
+        if (now - it->second.lastActiveNs > idleTimeoutNs)
+        {
+          close(it->second.upstreamFd);
+          sessions.erase(it++);
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+  }
+
+  printf("clients:    %zu active\n", sessions.size());
+  printStats("upstream", stats[Upstream]);
+  printStats("downstream", stats[Downstream]);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,423 @@
+/*
+ * tssd-replay: replays captured traffic against a tssd.
+ * Reads a capture file written by 'tssd --capture', or a pcap file (e.g.
+ * a production capture taken with tcpdump), and sends the datagrams at
+ * their original pace (or scaled) with sendmmsg. Datagrams of the same
+ * original source are sent from the same socket, so the server sees a
+ * similar distribution of sources.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include <cxxopts/cxxopts.hpp>
+
+#include "traffic_capture.h"
+
+static const int MaxBatch = 64;
+
+struct Packet
+{
+  uint64_t timeNs; // original arrival time
+  uint32_t sourceHash; // picks the socket the packet is sent from
+  uint16_t length;
+  const uint8_t *payload; // points into the mapped input file
+};
+
+static uint64_t nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t hashSource(const uint8_t *addr, size_t addrLen, uint16_t port)
+{
+  uint32_t h = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < addrLen; i++)
+  {
+    h = (h ^ addr[i]) * 16777619u;
+  }
+  h = (h ^ (port & 0xff)) * 16777619u;
+  h = (h ^ (port >> 8)) * 16777619u;
+  return h;
+}
+
+// a truncated request would only be replayed as junk, so it is left out and counted in 'truncated'
+static bool loadCapture(const uint8_t *data, size_t size, std::vector<Packet> &packets, uint64_t &truncated)
+{
+  const CaptureFileHeader *header = (const CaptureFileHeader *)data;
+  size_t offset = sizeof(CaptureFileHeader);
+  size_t end = header->usedBytes < size ? header->usedBytes : size;
+  for (uint64_t i = 0; i < header->records && offset + sizeof(CaptureRecordHeader) <= end; i++)
+  {
+    const CaptureRecordHeader *record = (const CaptureRecordHeader *)(data + offset);
+    size_t recordSize = captureRecordSize(record->capturedLength);
+    if (offset + recordSize > end)
+    {
+      break;
+    }
+    if (record->capturedLength < record->length)
+    {
+      truncated++;
+      offset += recordSize;
+      continue;
+    }
+    Packet packet;
+    packet.timeNs = record->rxTimeNs;
+    packet.sourceHash = hashSource(record->sourceAddr, sizeof(record->sourceAddr), record->sourcePort);
+    packet.length = record->capturedLength;
+    packet.payload = data + offset + sizeof(CaptureRecordHeader);
+    packets.push_back(packet);
+    offset += recordSize;
+  }
+  return true;
+}
+
+static uint16_t readBe16(const uint8_t *p)
+{
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+// extracts the UDP payload to 'port' from a link layer frame, returns false if it is not one
+static bool parseFrame(uint32_t linkType, const uint8_t *frame, size_t len, unsigned short port, Packet &packet)
+{
+  size_t ipOffset;
+  uint16_t etherType = 0;
+  switch (linkType)
+  {
+    case 1: // ethernet
+      if (len < 14)
+      {
+        return false;
+      }
+      ipOffset = 14;
+      etherType = readBe16(frame + 12);
+      while ((etherType == 0x8100 || etherType == 0x88a8) && len >= ipOffset + 4) // vlan tags
+      {
+        etherType = readBe16(frame + ipOffset + 2);
+        ipOffset += 4;
+      }
+      break;
+    case 113: // linux cooked capture (tcpdump -i any)
+      if (len < 16)
+      {
+        return false;
+      }
+      ipOffset = 16;
+      etherType = readBe16(frame + 14);
+      break;
+    case 101: // raw ip
+      ipOffset = 0;
+      break;
+    default:
+      return false;
+  }
+  if (len <= ipOffset)
+  {
+    return false;
+  }
+
+  const uint8_t *ip = frame + ipOffset;
+  size_t ipLen = len - ipOffset;
+  int version = ip[0] >> 4;
+  if (etherType != 0 && !((etherType == 0x0800 && version == 4) || (etherType == 0x86dd && version == 6)))
+  {
+    return false;
+  }
+
+  const uint8_t *udp;
+  const uint8_t *srcAddr;
+  size_t srcAddrLen;
+  if (version == 4)
+  {
+    size_t headerLen = (ip[0] & 0x0f) * 4;
+    if (ipLen < 20 || ipLen < headerLen + 8 || ip[9] != 17 /* udp */ || (readBe16(ip + 6) & 0x3fff) != 0 /* fragment */)
+    {
+      return false;
+    }
+    udp = ip + headerLen;
+    srcAddr = ip + 12;
+    srcAddrLen = 4;
+  }
+  else if (version == 6)
+  {
+    if (ipLen < 48 || ip[6] != 17) // udp without extension headers
+    {
+      return false;
+    }
+    udp = ip + 40;
+    srcAddr = ip + 8;
+    srcAddrLen = 16;
+  }
+  else
+  {
+    return false;
+  }
+
+  if (readBe16(udp + 2) != port)
+  {
+    return false;
+  }
+  size_t udpLen = readBe16(udp + 4);
+  size_t available = len - (size_t)(udp - frame);
+  if (udpLen < 8 || udpLen > available)
+  {
+    return false;
+  }
+  packet.sourceHash = hashSource(srcAddr, srcAddrLen, readBe16(udp));
+  packet.length = (uint16_t)(udpLen - 8);
+  packet.payload = udp + 8;
+  return true;
+}
+
+static bool loadPcap(const uint8_t *data, size_t size, unsigned short port, std::vector<Packet> &packets)
+{
+  if (size < 24)
+  {
+    return false;
+  }
+  uint32_t magic;
+  memcpy(&magic, data, 4);
+  bool swapped = (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1);
+  bool nanos = (magic == 0xa1b23c4d || magic == 0x4d3cb2a1);
+  if (!swapped && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+  {
+    return false;
+  }
+  #define PCAP_U32(v) (swapped ? __builtin_bswap32(v) : (v))
+  uint32_t linkType;
+  memcpy(&linkType, data + 20, 4);
+  linkType = PCAP_U32(linkType);
+
+  size_t offset = 24;
+  while (offset + 16 <= size)
+  {
+    uint32_t recordHeader[4]; // seconds, sub seconds, captured length, original length
+    memcpy(recordHeader, data + offset, sizeof(recordHeader));
+    uint64_t sec = PCAP_U32(recordHeader[0]);
+    uint64_t subSec = PCAP_U32(recordHeader[1]);
+    uint32_t capturedLen = PCAP_U32(recordHeader[2]);
+    offset += 16;
+    if (offset + capturedLen > size)
+    {
+      break;
+    }
+    Packet packet;
+    packet.timeNs = sec * 1000000000ULL + (nanos ? subSec : subSec * 1000);
+    if (parseFrame(linkType, data + offset, capturedLen, port, packet))
+    {
+      packets.push_back(packet);
+    }
+    offset += capturedLen;
+  }
+  #undef PCAP_U32
+  return true;
+}
+
+static cxxopts::ParseResult parseOptions(int argc, char **argv, cxxopts::Options &options)
+{
+  try
+  {
+    cxxopts::ParseResult optsResult = options.parse(argc, argv);
+    if (optsResult.count("help") > 0 || optsResult.count("input") == 0)
+    {
+      std::cout << options.help() << std::endl;
+      exit(optsResult.count("help") > 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    return optsResult;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *appName = argv[0];
+  cxxopts::Options options(appName, "Replays a tssd capture file or a pcap file against a time sync server");
+  options.add_options()
+    ("h, help", "print help")
+    ("i, input", "capture file (tssd --capture) or pcap file", cxxopts::value<std::string>())
+    ("s, server", "server address", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+    ("p, port", "server port", cxxopts::value<unsigned short>()->default_value("12321"))
+    ("pcap_port", "UDP destination port of the requests in a pcap file", cxxopts::value<unsigned short>()->default_value("12321"))
+    ("speed", "replay speed relative to the original (2 is twice as fast, 0 as fast as possible)", cxxopts::value<double>()->default_value("1"))
+    ("loops", "times to replay the input", cxxopts::value<int>()->default_value("1"))
+    ("sockets", "sockets to send from, original sources are spread over them", cxxopts::value<int>()->default_value("64"))
+    ("batch", "max datagrams per sendmmsg call", cxxopts::value<int>()->default_value("32"))
+    ;
+  cxxopts::ParseResult parseResult = parseOptions(argc, argv, options);
+
+  std::string input = parseResult["input"].as<std::string>();
+  double speed = parseResult["speed"].as<double>();
+  int loops = parseResult["loops"].as<int>();
+  int socketCount = parseResult["sockets"].as<int>();
+  int batch = parseResult["batch"].as<int>();
+  if (speed < 0 || loops < 1 || socketCount < 1 || batch < 1 || batch > MaxBatch)
+  {
+    std::cerr << appName << ": invalid speed, loops, sockets or batch (1-" << MaxBatch << ")" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(parseResult["port"].as<unsigned short>());
+  if (inet_pton(AF_INET, parseResult["server"].as<std::string>().c_str(), &server.sin_addr) != 1)
+  {
+    std::cerr << appName << ": invalid server address" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  int fd = open(input.c_str(), O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+  {
+    std::cerr << appName << ": cannot read '" << input << "'" << std::endl;
+    return EXIT_FAILURE;
+  }
+  const uint8_t *data = (const uint8_t *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    std::cerr << appName << ": cannot map '" << input << "'" << std::endl;
+    return EXIT_FAILURE;
+  }
+  madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+  std::vector<Packet> packets;
+  uint64_t truncated = 0;
+  bool loaded;
+  if ((size_t)st.st_size >= sizeof(CaptureFileHeader) && memcmp(data, CaptureFileMagic, sizeof(CaptureFileMagic)) == 0)
+  {
+    loaded = loadCapture(data, st.st_size, packets, truncated);
+  }
+  else
+  {
+    loaded = loadPcap(data, st.st_size, parseResult["pcap_port"].as<unsigned short>(), packets);
+  }
+  if (!loaded || packets.empty())
+  {
+    std::cerr << appName << ": '" << input << "' is not a capture or pcap file, or has no requests" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::vector<int> fds(socketCount);
+  for (int i = 0; i < socketCount; i++)
+  {
+    fds[i] = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fds[i] < 0)
+    {
+      perror("socket");
+      return EXIT_FAILURE;
+    }
+  }
+
+  // datagrams which are due are collected per socket, and each socket's batch is sent with one syscall
+  std::vector<std::vector<struct mmsghdr> > msgs(socketCount, std::vector<struct mmsghdr>(MaxBatch));
+  std::vector<std::vector<struct iovec> > iovs(socketCount, std::vector<struct iovec>(MaxBatch));
+  std::vector<int> pending(socketCount, 0);
+  uint64_t sent = 0;
+  uint64_t sendErrors = 0;
+
+  uint64_t firstNs = packets.front().timeNs;
+  uint64_t startNs = nowNs();
+  uint64_t loopOffsetNs = 0;
+  uint64_t spanNs = packets.back().timeNs - firstNs;
+  for (int loop = 0; loop < loops; loop++)
+  {
+    size_t i = 0;
+    while (i < packets.size())
+    {
+      uint64_t now = nowNs();
+      int collected = 0;
+      while (i < packets.size() && collected < batch)
+      {
+        const Packet &packet = packets[i];
+        uint64_t offsetNs = packet.timeNs >= firstNs ? packet.timeNs - firstNs : 0;
+        uint64_t dueNs = speed > 0 ? startNs + (uint64_t)((loopOffsetNs + offsetNs) / speed) : 0;
+        if (dueNs > now)
+        {
+          break;
+        }
+        int s = (int)(packet.sourceHash % socketCount);
+        struct mmsghdr &msg = msgs[s][pending[s]];
+        struct iovec &iov = iovs[s][pending[s]];
+        iov.iov_base = (void *)packet.payload;
+        iov.iov_len = packet.length;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_hdr.msg_name = &server;
+        msg.msg_hdr.msg_namelen = sizeof(server);
+        msg.msg_hdr.msg_iov = &iov;
+        msg.msg_hdr.msg_iovlen = 1;
+        pending[s]++;
+        collected++;
+        i++;
+      }
+
+      for (int s = 0; s < socketCount; s++)
+      {
+        int done = 0;
+        while (done < pending[s])
+        {
+          int n = sendmmsg(fds[s], msgs[s].data() + done, pending[s] - done, 0);
+          if (n < 0)
+          {
+            if (errno != EINTR)
+            {
+              sendErrors += pending[s] - done;
+              break;
+            }
+            continue;
+          }
+          done += n;
+          sent += n;
+        }
+        pending[s] = 0;
+      }
+
+      if (collected == 0 && i < packets.size())
+      {
+        // sleep until the next datagram is due, in short steps so the pace stays accurate
+        uint64_t offsetNs = packets[i].timeNs - firstNs;
+        uint64_t dueNs = startNs + (uint64_t)((loopOffsetNs + offsetNs) / speed);
+        uint64_t waitNs = dueNs - now;
+        if (waitNs > 50000)
+        {
+          struct timespec ts;
+          ts.tv_sec = 0;
+          ts.tv_nsec = (long)(waitNs > 1000000 ? 1000000 : waitNs - 20000);
+          nanosleep(&ts, NULL);
+        }
+      }
+    }
+    loopOffsetNs += spanNs + 1;
+  }
+
+  double elapsedSec = (nowNs() - startNs) / 1e9;
+  printf("replayed:    %llu datagrams in %.3f s (%.0f/s), %llu send errors\n",
+    (unsigned long long)sent, elapsedSec, elapsedSec > 0 ? sent / elapsedSec : 0.0, (unsigned long long)sendErrors);
+  printf("original:    %llu datagrams over %.3f s, %llu truncated ones left out\n",
+    (unsigned long long)packets.size(), spanNs / 1e9, (unsigned long long)truncated);
+
+  for (int i = 0; i < socketCount; i++)
+  {
+    close(fds[i]);
+  }
+  return sendErrors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,379 @@
+/*
+ * tssd-syncsim: simulates clients synchronizing to tssd and reports the
+ * accuracy they achieve. Meant to run on the server host (usually through
+ * tssd-netem), so the host clock is the truth: the true offset between
+ * the client and the server is 0 and every estimated offset is an error.
+ *
+ * Every poll a client sends a burst of requests and estimates its offset
+ * from one exchange as
+ *   offset = server time - (send time + receive time) / 2
+ * using the middle of the server's millisecond (replies are truncated to ms).
+ * Three estimators are reported: the first sample of the burst, the
+ * sample with the minimum round trip delay of the burst, and the clock
+ * filter of the reference client library over the recent bursts.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <vector>
+
+#include <cxxopts/cxxopts.hpp>
+
+#include "clock_filter.h"
+#include "latency_histogram.h"
+#include "tsp_protocol.h"
+
+static uint64_t clockNs(clockid_t clockId)
+{
+  struct timespec ts;
+  clock_gettime(clockId, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+struct Sample
+{
+  uint64_t cookie; // 0 while no reply arrived
+  uint64_t sentNs; // CLOCK_REALTIME
+  double offsetNs;
+  uint64_t delayNs;
+};
+
+struct Client
+{
+  uint64_t nextPollNs; // CLOCK_MONOTONIC
+  int sent; // requests of the current burst sent so far
+  uint64_t burstDeadlineNs; // replies of the burst are not waited for after it, 0 when idle
+  std::vector<Sample> burst;
+  ClockFilter filter;
+};
+
+// signed offset errors, the histograms only hold absolute values
+struct ErrorStats
+{
+  ErrorStats() : count(0), sum(0.0), sumSquares(0.0) {}
+
+  void record(double errorNs)
+  {
+    count++;
+    sum += errorNs;
+    sumSquares += errorNs * errorNs;
+    absError.record((uint64_t)fabs(errorNs));
+  }
+
+  uint64_t count;
+  double sum;
+  double sumSquares;
+  LatencyHistogram absError;
+};
+
+static void printErrorStats(const char *name, const ErrorStats &stats, bool json, bool last)
+{
+  HistogramSnapshot snapshot;
+  stats.absError.snapshot(snapshot);
+  double mean = stats.count > 0 ? stats.sum / stats.count : 0.0;
+  double variance = stats.count > 1 ? (stats.sumSquares - stats.sum * mean) / (stats.count - 1) : 0.0;
+  double stddev = variance > 0.0 ? sqrt(variance) : 0.0;
+  if (json)
+  {
+    printf("  \"%s\": { \"estimates\": %llu, \"mean_us\": %.2f, \"stddev_us\": %.2f, "
+      "\"abs_p50_us\": %.2f, \"abs_p95_us\": %.2f, \"abs_p99_us\": %.2f, \"abs_max_us\": %.2f }%s\n",
+      name, (unsigned long long)stats.count, mean / 1e3, stddev / 1e3,
+      snapshot.valueAtPercentile(50.0) / 1e3, snapshot.valueAtPercentile(95.0) / 1e3,
+      snapshot.valueAtPercentile(99.0) / 1e3, snapshot.max / 1e3, last ? "" : ",");
+    return;
+  }
+  printf("%-10s estimates=%llu mean=%.1f stddev=%.1f |error| p50=%.1f p95=%.1f p99=%.1f max=%.1f [us]\n",
+    name, (unsigned long long)stats.count, mean / 1e3, stddev / 1e3,
+    snapshot.valueAtPercentile(50.0) / 1e3, snapshot.valueAtPercentile(95.0) / 1e3,
+    snapshot.valueAtPercentile(99.0) / 1e3, snapshot.max / 1e3);
+}
+
+static cxxopts::ParseResult parseOptions(int argc, char **argv, cxxopts::Options &options)
+{
+  try
+  {
+    cxxopts::ParseResult optsResult = options.parse(argc, argv);
+    if (optsResult.count("help") > 0)
+    {
+      std::cout << options.help() << std::endl;
+      exit(EXIT_SUCCESS);
+    }
+    return optsResult;
+  }
+  catch (const std::exception &e)
+  {
+    std::cerr << argv[0] << ": " << e.what() << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *appName = argv[0];
+  cxxopts::Options options(appName, "Simulates syncing clients and reports their offset error against the host clock");
+  options.add_options()
+    ("h, help", "print help")
+    ("s, server", "server (or tssd-netem) address", cxxopts::value<std::string>()->default_value("127.0.0.1"))
+    ("p, port", "server (or tssd-netem) port", cxxopts::value<unsigned short>()->default_value("12322"))
+    ("clients", "number of simulated clients", cxxopts::value<int>()->default_value("10"))
+    ("interval", "seconds between the polls of a client", cxxopts::value<double>()->default_value("1"))
+    ("burst", "requests per poll", cxxopts::value<int>()->default_value("4"))
+    ("spacing", "ms between the requests of a burst", cxxopts::value<double>()->default_value("2"))
+    ("timeout", "ms to wait for the replies of a burst", cxxopts::value<double>()->default_value("1000"))
+    ("d, duration", "test duration in seconds", cxxopts::value<double>()->default_value("10"))
+    ("json", "print the results as JSON", cxxopts::value<bool>())
+    ;
+
+  cxxopts::ParseResult parseResult = parseOptions(argc, argv, options);
+
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(parseResult["port"].as<unsigned short>());
+  if (inet_pton(AF_INET, parseResult["server"].as<std::string>().c_str(), &server.sin_addr) != 1)
+  {
+    std::cerr << appName << ": invalid server address" << std::endl;
+    return EXIT_FAILURE;
+  }
+  int clientCount = parseResult["clients"].as<int>();
+  int burstSize = parseResult["burst"].as<int>();
+  uint64_t intervalNs = (uint64_t)(parseResult["interval"].as<double>() * 1e9);
+  uint64_t spacingNs = (uint64_t)(parseResult["spacing"].as<double>() * 1e6);
+  uint64_t timeoutNs = (uint64_t)(parseResult["timeout"].as<double>() * 1e6);
+  double durationSec = parseResult["duration"].as<double>();
+  bool json = parseResult["json"].as<bool>();
+  if (clientCount <= 0 || burstSize <= 0)
+  {
+    std::cerr << appName << ": clients and burst must be positive" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  // all clients share one socket, the cookie tells them apart: client (32 bits) | sequence (32 bits)
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&server, sizeof(server)) < 0)
+  {
+    perror("socket");
+    return EXIT_FAILURE;
+  }
+
+  // the polls of the clients are spread evenly over the interval
+  const uint64_t startNs = clockNs(CLOCK_MONOTONIC);
+  const uint64_t endNs = startNs + (uint64_t)(durationSec * 1e9);
+  std::vector<Client> clients(clientCount);
+  for (int i = 0; i < clientCount; i++)
+  {
+    clients[i].nextPollNs = startNs + intervalNs * i / clientCount;
+    clients[i].sent = 0;
+    clients[i].burstDeadlineNs = 0;
+    clients[i].burst.resize(burstSize);
+  }
+
+  TimeRequest request;
+  memset(&request, 0, sizeof(request));
+  memcpy(request.protocol, "TSP", 3);
+  request.protocolVersion = 1;
+
+  uint64_t seq = 1;
+  uint64_t sent = 0, received = 0, unmatched = 0;
+  uint64_t withinUncertainty = 0; // filter estimates whose error is within their uncertainty
+  double uncertaintySumNs = 0.0;
+  ErrorStats firstSample, minDelay, filtered;
+  std::vector<ClockSample> filterSamples;
+  LatencyHistogram delays;
+  bool sending = true;
+  while (true)
+  {
+    uint64_t now = clockNs(CLOCK_MONOTONIC);
+    if (now >= endNs)
+    {
+      sending = false;
+    }
+
+    // send the due requests and close the bursts which are complete or timed out
+    uint64_t nextWakeNs = now + 100000000ULL;
+    bool idle = true;
+    for (int i = 0; i < clientCount; i++)
+    {
+      Client &client = clients[i];
+      if (client.burstDeadlineNs == 0 && sending && now >= client.nextPollNs)
+      {
+        client.sent = 0;
+        client.burstDeadlineNs = now + spacingNs * (burstSize - 1) + timeoutNs;
+        client.nextPollNs += intervalNs;
+      }
+      if (client.burstDeadlineNs == 0)
+      {
+        if (sending && client.nextPollNs < nextWakeNs)
+        {
+          nextWakeNs = client.nextPollNs;
+        }
+        continue;
+      }
+      idle = false;
+
+      uint64_t sendAtNs = client.burstDeadlineNs - timeoutNs - spacingNs * (burstSize - 1 - client.sent);
+      if (client.sent < burstSize && now >= sendAtNs)
+      {
+        Sample &sample = client.burst[client.sent];
+        sample.cookie = ((uint64_t)i << 32) | (seq++ & 0xffffffff);
+        request.clientCookie = sample.cookie;
+        sample.sentNs = clockNs(CLOCK_REALTIME);
+        if (send(fd, &request, sizeof(request), 0) == (ssize_t)sizeof(request))
+        {
+          sent++;
+        }
+        client.sent++;
+        sendAtNs += spacingNs;
+      }
+
+      bool complete = client.sent == burstSize;
+      for (int s = 0; s < client.sent && complete; s++)
+      {
+        complete = client.burst[s].cookie == 0;
+      }
+      if (complete || now >= client.burstDeadlineNs)
+      {
+        const Sample *first = NULL;
+        const Sample *best = NULL;
+        filterSamples.clear();
+        for (int s = 0; s < client.sent; s++)
+        {
+          const Sample &sample = client.burst[s];
+          if (sample.cookie != 0)
+          {
+            continue; // lost
+          }
+          ClockSample clockSample;
+          clockSample.offsetNs = sample.offsetNs;
+          clockSample.delayNs = (double)sample.delayNs;
+          filterSamples.push_back(clockSample);
+          if (first == NULL)
+          {
+            first = &sample;
+          }
+          if (best == NULL || sample.delayNs < best->delayNs)
+          {
+            best = &sample;
+          }
+        }
+        if (first != NULL)
+        {
+          firstSample.record(first->offsetNs);
+          minDelay.record(best->offsetNs);
+          client.filter.addBurst(filterSamples.data(), (int)filterSamples.size(), now);
+          ClockEstimate estimate;
+          client.filter.estimate(now, estimate);
+          filtered.record(estimate.offsetNs);
+          uncertaintySumNs += estimate.uncertaintyNs;
+          if (fabs(estimate.offsetNs) <= estimate.uncertaintyNs)
+          {
+            withinUncertainty++;
+          }
+        }
+        for (int s = 0; s < burstSize; s++)
+        {
+          client.burst[s].cookie = 0;
+        }
+        client.burstDeadlineNs = 0;
+        continue;
+      }
+      uint64_t wakeNs = client.sent < burstSize ? sendAtNs : client.burstDeadlineNs;
+      if (wakeNs < nextWakeNs)
+      {
+        nextWakeNs = wakeNs;
+      }
+    }
+    if (!sending && idle)
+    {
+      break;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    now = clockNs(CLOCK_MONOTONIC);
+    int waitMs = nextWakeNs > now ? (int)((nextWakeNs - now + 999999) / 1000000) : 0;
+    if (poll(&pfd, 1, waitMs) <= 0)
+    {
+      continue;
+    }
+
+    TimeReply reply;
+    ssize_t length;
+    while ((length = recv(fd, &reply, sizeof(reply), MSG_DONTWAIT)) >= 0)
+    {
+      uint64_t receivedNs = clockNs(CLOCK_REALTIME);
+      uint64_t clientIndex = reply.clientCookie >> 32;
+      if (length < (ssize_t)TimeReplyPacketSize || clientIndex >= (uint64_t)clientCount)
+      {
+        unmatched++;
+        continue;
+      }
+      Client &client = clients[clientIndex];
+      Sample *sample = NULL;
+      for (int s = 0; s < client.sent; s++)
+      {
+        if (client.burst[s].cookie == reply.clientCookie && reply.clientCookie != 0)
+        {
+          sample = &client.burst[s];
+        }
+      }
+      if (sample == NULL)
+      {
+        unmatched++; // late reply of a closed burst, or a duplicate
+        continue;
+      }
+      received++;
+      double serverNs = (double)reply.timeSinceEphoc1970Ms * 1e6 + 500000.0;
+      sample->delayNs = receivedNs - sample->sentNs;
+      sample->offsetNs = serverNs - ((double)sample->sentNs + (double)receivedNs) / 2.0;
+      sample->cookie = 0;
+      delays.record(sample->delayNs);
+    }
+  }
+  close(fd);
+
+  HistogramSnapshot delaySnapshot;
+  delays.snapshot(delaySnapshot);
+  uint64_t lost = sent - received;
+  if (json)
+  {
+    printf("{\n");
+    printf("  \"sent\": %llu,\n", (unsigned long long)sent);
+    printf("  \"received\": %llu,\n", (unsigned long long)received);
+    printf("  \"unmatched\": %llu,\n", (unsigned long long)unmatched);
+    printf("  \"loss_percent\": %.4f,\n", sent > 0 ? 100.0 * lost / sent : 0.0);
+    printf("  \"delay_us\": { \"p50\": %.2f, \"p99\": %.2f, \"max\": %.2f },\n",
+      delaySnapshot.valueAtPercentile(50.0) / 1e3, delaySnapshot.valueAtPercentile(99.0) / 1e3, delaySnapshot.max / 1e3);
+    printErrorStats("first_sample", firstSample, true, false);
+    printErrorStats("min_delay", minDelay, true, false);
+    printErrorStats("filter", filtered, true, false);
+    printf("  \"filter_mean_uncertainty_us\": %.2f,\n", filtered.count > 0 ? uncertaintySumNs / filtered.count / 1e3 : 0.0);
+    printf("  \"filter_within_uncertainty_percent\": %.2f\n", filtered.count > 0 ? 100.0 * withinUncertainty / filtered.count : 0.0);
+    printf("}\n");
+    return EXIT_SUCCESS;
+  }
+  printf("requests:  sent %llu, received %llu, lost %llu (%.3f%%), unmatched %llu\n",
+    (unsigned long long)sent, (unsigned long long)received, (unsigned long long)lost,
+    sent > 0 ? 100.0 * lost / sent : 0.0, (unsigned long long)unmatched);
+  printf("delay:     p50=%.1f p99=%.1f max=%.1f [us]\n",
+    delaySnapshot.valueAtPercentile(50.0) / 1e3, delaySnapshot.valueAtPercentile(99.0) / 1e3, delaySnapshot.max / 1e3);
+  printf("offset error against the host clock (replies have a 1 ms resolution):\n");
+  printErrorStats("first", firstSample, false, false);
+  printErrorStats("min delay", minDelay, false, false);
+  printErrorStats("filter", filtered, false, false);
+  printf("filter uncertainty: mean %.1f us, error within it in %.2f%% of the estimates\n",
+    filtered.count > 0 ? uncertaintySumNs / filtered.count / 1e3 : 0.0,
+    filtered.count > 0 ? 100.0 * withinUncertainty / filtered.count : 0.0);
+  return EXIT_SUCCESS;
+}